@@ -0,0 +1,526 @@
+#include "approximate.h"
+#include "exact.h"
+#include "integral.h"
+#include "parallel.h"
+#include "pbm.h"
+#include "sauvola.h"
+#include "sauvola_simd.h"
+#include "synthetic.h"
+#include "tiled.h"
+#include "tools.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+/* -------------------------------------------------------------------------- */
+/*                              Benchmark Harness                             */
+/* -------------------------------------------------------------------------- */
+
+/*
+ * Times every engine over a matrix of image sizes, radii and thread counts:
+ *
+ *   bench [--sizes 1024x1024,3000x2000] [--radii 7,15,50] [--threads 1,4]
+ *         [--engines naive,integral,...] [--warmup 2] [--repetitions 10]
+ *         [--seed 1] [--format table|csv|json] [--output file]
+ *
+ * Every configuration runs in a child process of its own, so the peak
+ * resident memory of the child, minus what it inherited, is the peak working
+ * memory of the engine, outputs included. The input images are synthetic
+ * documents generated in memory, the same for every run with the same seed.
+ */
+
+#define BENCH_MAX_ITEMS 32
+
+// Naive runs above this many window pixel visits are skipped
+#define BENCH_NAIVE_BUDGET 5e8
+
+#define BENCH_K 0.5f
+#define BENCH_R 255.0f
+
+struct bench_case {
+  unsigned char **grayscale;
+  unsigned char **output;
+  struct integral_image *integral_image;
+  int num_rows;
+  int num_cols;
+  int r;
+  int num_threads;
+};
+
+struct bench_engine {
+  const char *name;
+  int parallel; // 0 if the engine always runs on the calling thread
+  int needs_integral_image;
+  int packed_output;
+  void (*run)(struct bench_case *c);
+};
+
+struct bench_result {
+  double median_ms;
+  double p95_ms;
+  double peak_bytes;
+  int skipped;
+};
+
+struct bench_options {
+  int sizes[BENCH_MAX_ITEMS][2]; // columns and rows
+  int num_sizes;
+  int radii[BENCH_MAX_ITEMS];
+  int num_radii;
+  int threads[BENCH_MAX_ITEMS];
+  int num_threads;
+  const char *engines[BENCH_MAX_ITEMS];
+  int num_engines;
+  int warmup;
+  int repetitions;
+  unsigned int seed;
+  const char *format;
+  const char *output;
+};
+
+/* --- Engines -------------------------------------------------------------- */
+
+static void run_naive(struct bench_case *c) {
+  sauvola_threshold_parallel(c->grayscale, c->output, c->num_cols, c->num_rows,
+                             BENCH_K, c->r, BENCH_R, c->num_threads);
+}
+
+static void run_integral(struct bench_case *c) {
+  compute_integral_image_parallel(c->grayscale, c->integral_image, c->num_cols,
+                                  c->num_rows, c->num_threads);
+  sauvola_threshold_with_integral_image_parallel(
+      c->grayscale, c->integral_image, c->output, c->num_cols, c->num_rows,
+      BENCH_K, c->r, BENCH_R, c->num_threads);
+}
+
+static void run_tiled(struct bench_case *c) {
+  sauvola_threshold_tiled(c->grayscale, c->output, c->num_cols, c->num_rows,
+                          BENCH_K, c->r, BENCH_R, 0, 0, c->num_threads);
+}
+
+static void run_running_sums(struct bench_case *c) {
+  sauvola_threshold_running_sums(c->grayscale, c->output, c->num_cols,
+                                 c->num_rows, BENCH_K, c->r, BENCH_R);
+}
+
+static void run_packed(struct bench_case *c) {
+  compute_integral_image_parallel(c->grayscale, c->integral_image, c->num_cols,
+                                  c->num_rows, c->num_threads);
+  sauvola_threshold_with_integral_image_packed(
+      c->grayscale, c->integral_image, c->output, c->num_cols, c->num_rows,
+      BENCH_K, c->r, BENCH_R, c->num_threads);
+}
+
+static void run_exact(struct bench_case *c) {
+  const struct sauvola_rational k = {1, 2}, R = {255, 1};
+
+  compute_integral_image_parallel(c->grayscale, c->integral_image, c->num_cols,
+                                  c->num_rows, c->num_threads);
+  sauvola_threshold_exact(c->grayscale, c->integral_image, c->output,
+                          c->num_cols, c->num_rows, k, c->r, R,
+                          c->num_threads);
+}
+
+static void run_approximate(struct bench_case *c) {
+  struct approximate_scratch scratch = {0};
+  int step = choose_decimation(c->grayscale, c->num_cols, c->num_rows, BENCH_K,
+                               c->r, BENCH_R, 0.01, &scratch);
+
+  sauvola_threshold_approximate_with_scratch(
+      c->grayscale, c->output, c->num_cols, c->num_rows, BENCH_K, c->r,
+      BENCH_R, step, detect_simd_level(), &scratch);
+  free_approximate_scratch(&scratch);
+}
+
+static const struct bench_engine engines[] = {
+    {"naive", 1, 0, 0, run_naive},
+    {"integral", 1, 1, 0, run_integral},
+    {"tiled", 1, 0, 0, run_tiled},
+    {"running_sums", 0, 0, 0, run_running_sums},
+    {"packed", 1, 1, 1, run_packed},
+    {"exact", 1, 1, 0, run_exact},
+    {"approximate", 0, 0, 0, run_approximate},
+};
+
+#define NUM_ENGINES ((int)(sizeof(engines) / sizeof(engines[0])))
+
+/* --- Measurement ---------------------------------------------------------- */
+
+/*
+ * Resident memory of the calling process in bytes.
+ */
+static double resident_bytes(void) {
+  long size, resident = 0;
+  FILE *file = fopen("/proc/self/statm", "r");
+
+  if (file != NULL) {
+    if (fscanf(file, "%ld %ld", &size, &resident) != 2)
+      resident = 0;
+    fclose(file);
+  }
+
+  return (double)resident * sysconf(_SC_PAGESIZE);
+}
+
+static int compare_doubles(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+
+  return (x > y) - (x < y);
+}
+
+/*
+ * Runs an engine in the calling process: allocates what it needs, runs the
+ * warm-up iterations and times the repetitions with the monotonic clock.
+ * Returns 0 if the buffers cannot be allocated.
+ */
+static int measure(const struct bench_engine *engine, struct bench_case *c,
+                   int warmup, int repetitions, double *times) {
+  int output_cols =
+      engine->packed_output ? packed_row_bytes(c->num_cols) : c->num_cols;
+  double start;
+
+  c->output = alloc_2D_unsigned_char(c->num_rows, output_cols);
+  if (c->output == NULL || c->output[0] == NULL)
+    return 0;
+  if (engine->needs_integral_image) {
+    c->integral_image = alloc_narrow_integral_image(c->num_rows, c->num_cols,
+                                                    255, c->r);
+    if (c->integral_image == NULL)
+      return 0;
+  }
+
+  for (int n = 0; n < warmup; n++) {
+    engine->run(c);
+  }
+  for (int n = 0; n < repetitions; n++) {
+    start = wall_time_ms();
+    engine->run(c);
+    times[n] = wall_time_ms() - start;
+  }
+
+  return 1;
+}
+
+/*
+ * Measures one configuration in a child process, which sends the times and
+ * its peak memory growth back through a pipe. Returns 0 if the child fails.
+ */
+static int measure_in_child(const struct bench_engine *engine,
+                            struct bench_case *c, int warmup, int repetitions,
+                            struct bench_result *result) {
+  double *times = (double *)malloc((repetitions + 1) * sizeof(double));
+  size_t size = (repetitions + 1) * sizeof(double);
+  int fds[2], status, ok = 0;
+  size_t received = 0;
+  ssize_t count;
+  pid_t pid;
+
+  if (times == NULL || pipe(fds) != 0) {
+    free(times);
+    return 0;
+  }
+
+  fflush(stdout);
+  pid = fork();
+  if (pid == 0) {
+    struct rusage usage;
+    double baseline = resident_bytes();
+
+    // The process exits right away, so nothing is freed
+    close(fds[0]);
+    if (!measure(engine, c, warmup, repetitions, times))
+      _exit(1);
+    getrusage(RUSAGE_SELF, &usage);
+    times[repetitions] = usage.ru_maxrss * 1024.0 - baseline;
+    _exit(write(fds[1], times, size) == (ssize_t)size ? 0 : 1);
+  }
+
+  close(fds[1]);
+  while (pid > 0 && received < size &&
+         (count = read(fds[0], (char *)times + received, size - received)) >
+             0) {
+    received += count;
+  }
+  close(fds[0]);
+
+  if (pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) &&
+      WEXITSTATUS(status) == 0 && received == size) {
+    result->peak_bytes = fmax(times[repetitions], 0);
+    qsort(times, repetitions, sizeof(double), compare_doubles);
+    result->median_ms = repetitions % 2 ? times[repetitions / 2]
+                                        : (times[repetitions / 2 - 1] +
+                                           times[repetitions / 2]) /
+                                              2;
+    // Nearest rank
+    result->p95_ms = times[(int)ceil(0.95 * repetitions) - 1];
+    ok = 1;
+  }
+
+  free(times);
+  return ok;
+}
+
+/* --- Reporting ------------------------------------------------------------ */
+
+static void print_header(FILE *file, const char *format) {
+  if (strcmp(format, "csv") == 0) {
+    fprintf(file, "engine,cols,rows,r,threads,repetitions,median_ms,p95_ms,"
+                  "mpix_per_s,peak_bytes_per_pixel\n");
+  } else if (strcmp(format, "json") == 0) {
+    fprintf(file, "[");
+  } else {
+    fprintf(file, "%-13s %11s %4s %7s %10s %10s %9s %10s\n", "engine", "size",
+            "r", "threads", "median_ms", "p95_ms", "MPix/s", "bytes/px");
+  }
+}
+
+static void print_result(FILE *file, const char *format,
+                         const struct bench_engine *engine,
+                         const struct bench_case *c, int repetitions,
+                         const struct bench_result *result, int first) {
+  double pixels = (double)c->num_rows * c->num_cols;
+  double mpix = pixels / (result->median_ms * 1000.0);
+  double bytes = result->peak_bytes / pixels;
+  char size[32];
+
+  if (strcmp(format, "csv") == 0) {
+    if (result->skipped) {
+      fprintf(file, "%s,%d,%d,%d,%d,0,,,,\n", engine->name, c->num_cols,
+              c->num_rows, c->r, c->num_threads);
+    } else {
+      fprintf(file, "%s,%d,%d,%d,%d,%d,%.3f,%.3f,%.2f,%.2f\n", engine->name,
+              c->num_cols, c->num_rows, c->r, c->num_threads, repetitions,
+              result->median_ms, result->p95_ms, mpix, bytes);
+    }
+  } else if (strcmp(format, "json") == 0) {
+    fprintf(file,
+            "%s\n  {\"engine\": \"%s\", \"cols\": %d, \"rows\": %d, "
+            "\"r\": %d, \"threads\": %d, ",
+            first ? "" : ",", engine->name, c->num_cols, c->num_rows, c->r,
+            c->num_threads);
+    if (result->skipped) {
+      fprintf(file, "\"skipped\": true}");
+    } else {
+      fprintf(file,
+              "\"repetitions\": %d, \"median_ms\": %.3f, \"p95_ms\": %.3f, "
+              "\"mpix_per_s\": %.2f, \"peak_bytes_per_pixel\": %.2f}",
+              repetitions, result->median_ms, result->p95_ms, mpix, bytes);
+    }
+  } else {
+    snprintf(size, sizeof(size), "%dx%d", c->num_cols, c->num_rows);
+    if (result->skipped) {
+      fprintf(file, "%-13s %11s %4d %7d %10s\n", engine->name, size, c->r,
+              c->num_threads, "skipped");
+    } else {
+      fprintf(file, "%-13s %11s %4d %7d %10.3f %10.3f %9.2f %10.2f\n",
+              engine->name, size, c->r, c->num_threads, result->median_ms,
+              result->p95_ms, mpix, bytes);
+    }
+  }
+  fflush(file);
+}
+
+static void print_footer(FILE *file, const char *format) {
+  if (strcmp(format, "json") == 0)
+    fprintf(file, "\n]\n");
+}
+
+/* --- Command Line --------------------------------------------------------- */
+
+/*
+ * Splits a comma separated list into items. Returns the number of items, or
+ * -1 if there are more than BENCH_MAX_ITEMS.
+ */
+static int split_list(char *list, char **items) {
+  int num_items = 0;
+
+  for (char *item = strtok(list, ","); item != NULL;
+       item = strtok(NULL, ",")) {
+    if (num_items == BENCH_MAX_ITEMS)
+      return -1;
+    items[num_items++] = item;
+  }
+
+  return num_items;
+}
+
+static int parse_ints(char *list, int *values, int *num_values) {
+  char *items[BENCH_MAX_ITEMS];
+  int num_items = split_list(list, items);
+
+  for (int n = 0; n < num_items; n++) {
+    values[n] = atoi(items[n]);
+    if (values[n] < 1)
+      return 0;
+  }
+  *num_values = num_items;
+
+  return num_items > 0;
+}
+
+static int parse_sizes(char *list, struct bench_options *options) {
+  char *items[BENCH_MAX_ITEMS];
+  int num_items = split_list(list, items);
+
+  for (int n = 0; n < num_items; n++) {
+    if (sscanf(items[n], "%dx%d", &options->sizes[n][0],
+               &options->sizes[n][1]) != 2 ||
+        options->sizes[n][0] < 1 || options->sizes[n][1] < 1)
+      return 0;
+  }
+  options->num_sizes = num_items;
+
+  return num_items > 0;
+}
+
+static int parse_engines(char *list, struct bench_options *options) {
+  int num_items = split_list(list, (char **)options->engines);
+
+  for (int n = 0; n < num_items; n++) {
+    int e = 0;
+
+    while (e < NUM_ENGINES && strcmp(engines[e].name, options->engines[n]))
+      e++;
+    if (e == NUM_ENGINES)
+      return 0;
+  }
+  options->num_engines = num_items;
+
+  return num_items > 0;
+}
+
+static int parse_options(int argc, char **argv, struct bench_options *options) {
+  int ok = 1;
+
+  for (int n = 1; n < argc && ok; n += 2) {
+    char *value = n + 1 < argc ? argv[n + 1] : NULL;
+
+    if (value == NULL) {
+      ok = 0;
+    } else if (strcmp(argv[n], "--sizes") == 0) {
+      ok = parse_sizes(value, options);
+    } else if (strcmp(argv[n], "--radii") == 0) {
+      ok = parse_ints(value, options->radii, &options->num_radii);
+    } else if (strcmp(argv[n], "--threads") == 0) {
+      ok = parse_ints(value, options->threads, &options->num_threads);
+    } else if (strcmp(argv[n], "--engines") == 0) {
+      ok = parse_engines(value, options);
+    } else if (strcmp(argv[n], "--warmup") == 0) {
+      options->warmup = atoi(value);
+      ok = options->warmup >= 0;
+    } else if (strcmp(argv[n], "--repetitions") == 0) {
+      options->repetitions = atoi(value);
+      ok = options->repetitions >= 1;
+    } else if (strcmp(argv[n], "--seed") == 0) {
+      options->seed = strtoul(value, NULL, 10);
+    } else if (strcmp(argv[n], "--format") == 0) {
+      options->format = value;
+      ok = strcmp(value, "table") == 0 || strcmp(value, "csv") == 0 ||
+           strcmp(value, "json") == 0;
+    } else if (strcmp(argv[n], "--output") == 0) {
+      options->output = value;
+    } else {
+      ok = 0;
+    }
+  }
+
+  return ok;
+}
+
+static int engine_selected(const struct bench_options *options,
+                           const char *name) {
+  for (int n = 0; n < options->num_engines; n++) {
+    if (strcmp(options->engines[n], name) == 0)
+      return 1;
+  }
+
+  return options->num_engines == 0;
+}
+
+/* --- Main Program --------------------------------------------------------- */
+
+int main(int argc, char **argv) {
+  struct bench_options options = {{{1024, 1024}, {3000, 2000}}, 2, {7, 15, 50},
+                                  3, {1}, 1};
+  FILE *file = stdout;
+  int first = 1;
+
+  options.warmup = 2;
+  options.repetitions = 10;
+  options.seed = 1;
+  options.format = "table";
+  if (default_thread_count() > 1)
+    options.threads[options.num_threads++] = default_thread_count();
+
+  if (!parse_options(argc, argv, &options)) {
+    fprintf(stderr,
+            "usage: %s [--sizes WxH,...] [--radii r,...] [--threads n,...] "
+            "[--engines name,...] [--warmup n] [--repetitions n] "
+            "[--seed n] [--format table|csv|json] [--output file]\n",
+            argv[0]);
+    return 1;
+  }
+  if (options.output != NULL && (file = fopen(options.output, "w")) == NULL) {
+    fprintf(stderr, "bench: cannot write %s\n", options.output);
+    return 1;
+  }
+
+  print_header(file, options.format);
+  for (int s = 0; s < options.num_sizes; s++) {
+    struct bench_case c = {NULL};
+
+    c.num_cols = options.sizes[s][0];
+    c.num_rows = options.sizes[s][1];
+    c.grayscale = alloc_2D_unsigned_char(c.num_rows, c.num_cols);
+    if (c.grayscale == NULL || c.grayscale[0] == NULL) {
+      fprintf(stderr, "bench: cannot allocate a %dx%d image\n", c.num_cols,
+              c.num_rows);
+      return 1;
+    }
+    generate_synthetic_document(c.grayscale, c.num_rows, c.num_cols,
+                                options.seed, 0);
+
+    for (int e = 0; e < NUM_ENGINES; e++) {
+      if (!engine_selected(&options, engines[e].name))
+        continue;
+
+      for (int i = 0; i < options.num_radii; i++) {
+        double window = 2.0 * options.radii[i] + 1;
+
+        c.r = options.radii[i];
+        for (int t = 0; t < options.num_threads; t++) {
+          struct bench_result result = {0};
+
+          // Serial engines are measured once, with one thread
+          c.num_threads = engines[e].parallel ? options.threads[t] : 1;
+          if (!engines[e].parallel && t > 0)
+            continue;
+
+          result.skipped = strcmp(engines[e].name, "naive") == 0 &&
+                           (double)c.num_rows * c.num_cols * window * window >
+                               BENCH_NAIVE_BUDGET;
+          if (!result.skipped &&
+              !measure_in_child(&engines[e], &c, options.warmup,
+                                options.repetitions, &result)) {
+            fprintf(stderr, "bench: %s failed\n", engines[e].name);
+            continue;
+          }
+          print_result(file, options.format, &engines[e], &c,
+                       options.repetitions, &result, first);
+          first = 0;
+        }
+      }
+    }
+
+    free(c.grayscale[0]);
+    free(c.grayscale);
+  }
+  print_footer(file, options.format);
+
+  if (file != stdout)
+    fclose(file);
+  return 0;
+}
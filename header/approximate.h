@@ -0,0 +1,44 @@
+#ifndef APPROXIMATE_H
+#define APPROXIMATE_H
+
+#include "sauvola_simd.h"
+#include <stddef.h>
+
+/*
+ * Buffers of the approximate engine kept across calls of
+ * sauvola_threshold_approximate_with_scratch: the integral images and the
+ * thresholds of the block grid and the interpolation tables and rows of one
+ * image width. Zero it before the first use and release it with
+ * free_approximate_scratch.
+ */
+struct approximate_scratch {
+  unsigned long long *sums;    // integral image of the block sums
+  unsigned long long *squares; // integral image of the block sums of squares
+  double *thresholds;          // threshold at every block centre
+  size_t block_capacity;       // entries in sums, squares and thresholds
+  double *columns; // column weights followed by two interpolated rows
+  int *blocks;     // block of every column followed by the next one
+  int column_capacity; // columns the tables and rows have room for
+};
+
+void free_approximate_scratch(struct approximate_scratch *scratch);
+
+int choose_decimation(unsigned char **grayscale, int num_cols, int num_rows,
+                      float k, int r, float R, double max_disagreement,
+                      struct approximate_scratch *scratch);
+
+int sauvola_threshold_approximate(unsigned char **grayscale,
+                                  unsigned char **output, int num_cols,
+                                  int num_rows, float k, int r, float R,
+                                  int step);
+
+int sauvola_threshold_approximate_with_scratch(
+    unsigned char **grayscale, unsigned char **output, int num_cols,
+    int num_rows, float k, int r, float R, int step, enum simd_level level,
+    struct approximate_scratch *scratch);
+
+double sauvola_disagreement_rate(unsigned char **grayscale,
+                                 unsigned char **output, int num_cols,
+                                 int num_rows, float k, int r, float R);
+
+#endif
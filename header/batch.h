@@ -0,0 +1,33 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+/*
+ * Worker counts of the three pipeline stages and the capacity of the queues
+ * between them. Zero or negative values select the defaults. With pbm_output
+ * set the results are written as 1-bit PBM images instead of PGM images.
+ */
+struct batch_options {
+  int num_readers;
+  int num_workers;
+  int num_writers;
+  int queue_capacity;
+  int r;
+  int pbm_output;
+};
+
+struct batch_report {
+  int num_pages;
+  int num_failed;
+  double elapsed_ms;
+  double pages_per_second;
+};
+
+int list_batch_inputs(const char *source, char ***file_names, int *num_files);
+
+void free_batch_inputs(char **file_names, int num_files);
+
+int sauvola_batch(const char *source, const char *output_directory,
+                  const struct batch_options *options,
+                  struct batch_report *report);
+
+#endif
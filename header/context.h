@@ -0,0 +1,73 @@
+#ifndef CONTEXT_H
+#define CONTEXT_H
+
+#include "approximate.h"
+#include "parallel.h"
+#include "sauvola.h"
+#include "sweep.h"
+#include "tiled.h"
+#include "tools.h"
+
+/*
+ * A grow-only 2D image: one 64-byte aligned buffer and its row pointers. The
+ * rows of 16-bit images point at unsigned short samples.
+ */
+struct image_buffer {
+  unsigned char *data;
+  unsigned char **rows;
+  size_t capacity; // bytes in data
+  int row_capacity; // entries in rows
+};
+
+/*
+ * Buffers and threads reused across the images of a run. Every buffer only
+ * grows, and is pre-faulted when it does, and the worker pool is kept until
+ * the thread count changes, so once the context has seen the largest image
+ * processing further images of at most that size does not allocate.
+ */
+struct sauvola_context {
+  struct image_buffer grayscale;
+  struct image_buffer grayscale16; // 16-bit images, see pgm16.h
+  struct image_buffer output;
+  unsigned char ***output_images; // images in output, see context_output_images
+  int output_image_capacity;
+  struct integral_image integral_image;
+  unsigned char **mapped_rows; // rows of a mapped image, see mapped.h
+  int mapped_row_capacity;
+  struct worker_pool pool; // see context_worker_pool
+  int pool_threads;        // threads the pool was started for, 0 if none
+  struct packed_scratch packed_scratch;
+  struct tiled_scratch tiled_scratch;
+  struct sweep_scratch sweep_scratch;
+  struct approximate_scratch approximate_scratch;
+  int num_allocations; // number of times a buffer or the pool was set up
+};
+
+void init_sauvola_context(struct sauvola_context *context);
+
+void free_sauvola_context(struct sauvola_context *context);
+
+unsigned char **context_grayscale(struct sauvola_context *context,
+                                  int num_rows, int num_cols);
+
+unsigned short **context_grayscale16(struct sauvola_context *context,
+                                     int num_rows, int num_cols);
+
+unsigned char **context_output(struct sauvola_context *context, int num_rows,
+                               int num_cols);
+
+unsigned char ***context_output_images(struct sauvola_context *context,
+                                      int num_images, int num_rows,
+                                      int num_cols);
+
+unsigned char **context_row_pointers(struct sauvola_context *context,
+                                     int num_rows);
+
+struct worker_pool *context_worker_pool(struct sauvola_context *context,
+                                        int num_threads);
+
+struct integral_image *context_integral_image(struct sauvola_context *context,
+                                              int num_rows, int num_cols,
+                                              int max_color, int r);
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef EXACT_H
+#define EXACT_H
+
+#include "tools.h"
+
+/*
+ * A parameter given as num / den, with den > 0.
+ */
+struct sauvola_rational {
+  int num;
+  int den;
+};
+
+int sauvola_exact_supported(struct sauvola_rational k, int r,
+                            struct sauvola_rational R, int num_rows,
+                            int num_cols);
+
+int sauvola_threshold_exact_rows(unsigned char **grayscale,
+                                 struct integral_image *integral_image,
+                                 unsigned char **output, int num_cols,
+                                 int num_rows, struct sauvola_rational k, int r,
+                                 struct sauvola_rational R, int row_begin,
+                                 int row_end);
+
+int sauvola_threshold_exact(unsigned char **grayscale,
+                            struct integral_image *integral_image,
+                            unsigned char **output, int num_cols, int num_rows,
+                            struct sauvola_rational k, int r,
+                            struct sauvola_rational R, int num_threads);
+
+#endif
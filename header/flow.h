@@ -1,6 +1,38 @@
+#include "context.h"
+#include "sweep.h"
+
 double pgm_sauvola_flow(const char *input_file_name,
-                        const char *output_file_name, int r);
+                        const char *output_file_name, float k, int r, float R,
+                        int num_threads, struct sauvola_context *context);
 
 double pgm_sauvola_flow_with_integral_image(const char *input_file_name,
                                             const char *output_file_name,
-                                            int r);
+                                            float k, int r, float R,
+                                            int num_threads,
+                                            struct sauvola_context *context);
+
+double pgm_sauvola_flow_tiled(const char *input_file_name,
+                              const char *output_file_name, float k, int r,
+                              float R, int num_threads,
+                              struct sauvola_context *context);
+
+double pgm_sauvola_flow_streaming(const char *input_file_name,
+                                  const char *output_file_name, float k, int r,
+                                  float R);
+
+double pgm_sauvola_flow_pbm(const char *input_file_name,
+                            const char *output_file_name, float k, int r,
+                            float R, int num_threads,
+                            struct sauvola_context *context);
+
+double pgm_sauvola_flow_sweep(const char *input_file_name,
+                              const char *const *output_file_names,
+                              const struct sauvola_params *params,
+                              int num_params, int num_threads,
+                              struct sauvola_context *context);
+
+double pgm_sauvola_flow_approximate(const char *input_file_name,
+                                    const char *output_file_name, float k,
+                                    int r, float R, double max_disagreement,
+                                    double *disagreement,
+                                    struct sauvola_context *context);
@@ -0,0 +1,76 @@
+#ifndef INSTRUMENT_H
+#define INSTRUMENT_H
+
+#include <stdio.h>
+
+/*
+ * Per-stage instrumentation of the hot path. Every stage records the calls,
+ * the wall time, the bytes moved and the pixels processed, and, where
+ * perf_event_open is available, the CPU cycles, instructions and last level
+ * cache misses of the calling thread and of the threads it starts and joins
+ * during the stage. Stages run by several threads at once, like in the batch
+ * pipeline, add up their times.
+ *
+ * Build with -DSAUVOLA_INSTRUMENT=1 to enable it. Otherwise the probes
+ * expand to nothing, their arguments are not evaluated and no counters are
+ * compiled in.
+ */
+
+#ifndef SAUVOLA_INSTRUMENT
+#define SAUVOLA_INSTRUMENT 0
+#endif
+
+enum instrument_stage {
+  STAGE_HEADER,
+  STAGE_READ,
+  STAGE_GRAY,
+  STAGE_INTEGRAL,
+  STAGE_THRESHOLD,
+  STAGE_WRITE,
+  NUM_STAGES
+};
+
+#if SAUVOLA_INSTRUMENT
+
+/*
+ * Start of a stage on the calling thread, see INSTRUMENT_BEGIN.
+ */
+struct stage_probe {
+  double start_ms;
+  unsigned long long start_counters[3];
+  int has_counters;
+};
+
+void stage_begin(struct stage_probe *probe);
+
+void stage_end(struct stage_probe *probe, enum instrument_stage stage,
+               unsigned long long bytes, unsigned long long pixels);
+
+void instrument_report(FILE *file);
+
+void instrument_reset(void);
+
+// Declares probe and starts a stage
+#define INSTRUMENT_BEGIN(probe)                                                \
+  struct stage_probe probe;                                                    \
+  stage_begin(&probe)
+
+// Ends the stage started with probe
+#define INSTRUMENT_END(probe, stage, bytes, pixels)                            \
+  stage_end(&probe, stage, bytes, pixels)
+
+// Prints the stages recorded so far
+#define INSTRUMENT_REPORT(file) instrument_report(file)
+
+#define INSTRUMENT_RESET() instrument_reset()
+
+#else
+
+#define INSTRUMENT_BEGIN(probe) ((void)0)
+#define INSTRUMENT_END(probe, stage, bytes, pixels) ((void)0)
+#define INSTRUMENT_REPORT(file) ((void)0)
+#define INSTRUMENT_RESET() ((void)0)
+
+#endif
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef INTEGRAL_H
+#define INTEGRAL_H
+
+#include "parallel.h"
+#include "tools.h"
+
+void compute_integral_image_parallel(unsigned char **input,
+                                     struct integral_image *output,
+                                     int num_cols, int num_rows,
+                                     int num_threads);
+
+void compute_integral_image_pooled(unsigned char **input,
+                                   struct integral_image *output, int num_cols,
+                                   int num_rows, struct worker_pool *pool);
+
+void compute_integral_image_16_parallel(unsigned short **input,
+                                        struct integral_image *output,
+                                        int num_cols, int num_rows,
+                                        int num_threads);
+
+void compute_integral_image_16_pooled(unsigned short **input,
+                                      struct integral_image *output,
+                                      int num_cols, int num_rows,
+                                      struct worker_pool *pool);
+
+void update_integral_image(unsigned char **input,
+                           struct integral_image *output, int num_cols,
+                           int num_rows, int row_begin, int row_end,
+                           int col_begin, int col_end,
+                           unsigned long long *deltas,
+                           struct worker_pool *pool);
+
+#endif
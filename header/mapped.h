@@ -0,0 +1,36 @@
+#ifndef MAPPED_H
+#define MAPPED_H
+
+#include <stddef.h>
+
+struct sauvola_context;
+
+/*
+ * A PGM (P5) or PPM (P6) image whose pixel payload is used in place. The file
+ * is memory mapped when possible, otherwise it is read into one buffer. rows
+ * points at the start of every image row inside the payload, num_cols *
+ * channels bytes apart, and must not be written through. The row pointers
+ * are allocated for the image or taken from a context, see map_pnm_image.
+ */
+struct mapped_image {
+  int num_rows;
+  int num_cols;
+  int max_color;
+  int channels;
+  unsigned char *pixels;
+  unsigned char **rows;
+  void *base;
+  size_t length;
+  int is_mapped;
+  int owns_rows; // rows was allocated for this image
+};
+
+int parse_pnm_header(const unsigned char *data, size_t length, char format,
+                     int *num_rows, int *num_cols, int *max_color);
+
+int map_pnm_image(const char *file_name, struct mapped_image *image,
+                  struct sauvola_context *context);
+
+void unmap_pnm_image(struct mapped_image *image);
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+typedef void (*parallel_task_fn)(void *context, int task_index,
+                                 int worker_index);
+
+/*
+ * Threads kept waiting between jobs, for callers that run many small jobs and
+ * should not start and join threads for every one of them. The calling thread
+ * takes part in every job, so num_workers counts it too.
+ */
+struct worker_pool {
+  struct pool_state *state; // NULL with a single worker
+  int num_workers;
+  unsigned long num_runs; // jobs run so far
+};
+
+int default_thread_count(void);
+
+int parallel_for(int num_tasks, int num_threads, parallel_task_fn task,
+                 void *context);
+
+int worker_pool_init(struct worker_pool *pool, int num_threads);
+
+void worker_pool_run(struct worker_pool *pool, int num_tasks,
+                     parallel_task_fn task, void *context);
+
+void worker_pool_free(struct worker_pool *pool);
+
+int run_parallel(struct worker_pool *pool, int num_tasks, int num_threads,
+                 parallel_task_fn task, void *context);
+
+int parallel_worker_count(const struct worker_pool *pool, int num_threads);
+
+#endif
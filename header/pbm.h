@@ -0,0 +1,19 @@
+#ifndef PBM_H
+#define PBM_H
+
+#include <stdio.h>
+
+int packed_row_bytes(int num_cols);
+
+void pack_binary_row(const unsigned char *row, unsigned char *packed,
+                     int num_cols);
+
+void unpack_binary_row(const unsigned char *packed, unsigned char *row,
+                       int num_cols);
+
+void write_pbm_header(FILE *file, int num_rows, int num_cols);
+
+int write_pbm_image(const char *file_name, unsigned char *packed_data,
+                    int num_rows, int num_cols);
+
+#endif
@@ -1,3 +1,8 @@
+#include <stdio.h>
+
+int read_pgm_header_stream(FILE *file, int *num_rows, int *num_cols,
+                           int *max_color);
+
 int read_pgm_header(const char *file_name, int *num_rows, int *num_cols,
                     int *max_color);
 
@@ -6,3 +11,5 @@ int read_pgm_data(unsigned char *image, const char *file_name,
 
 int write_pgm_image(const char *file_name, unsigned char *image_data,
                     int num_rows, int num_cols, int max_val);
+
+void write_pgm_header(FILE *file, int num_rows, int num_cols, int max_val);
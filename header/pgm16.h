@@ -0,0 +1,48 @@
+#ifndef PGM16_H
+#define PGM16_H
+
+#include "parallel.h"
+#include "tools.h"
+
+/*
+ * 16-bit grayscale images, as found in PGM files whose max color value is
+ * above 255, with two big-endian bytes per sample. The samples are byte
+ * swapped once, on load, and then kept as unsigned short all the way through
+ * the integral image and the threshold; only the binary output is 8-bit.
+ */
+
+// Largest max color value of a PGM image
+#define PGM16_MAX_COLOR 65535
+
+void load_big_endian_samples(const unsigned char *data,
+                             unsigned short *samples, long num_samples);
+
+void load_pgm16_with_integral_image(unsigned char **data,
+                                    unsigned short **grayscale,
+                                    struct integral_image *integral_image,
+                                    int num_cols, int num_rows,
+                                    struct worker_pool *pool);
+
+float sauvola_R_for_max_color(float R, int max_color);
+
+void sauvola_threshold_16_with_integral_image_span(
+    unsigned short **grayscale, struct integral_image *integral_image,
+    unsigned char **output, int num_cols, int num_rows, float k, int r, float R,
+    int i, int col_begin, int col_end);
+
+void sauvola_threshold_16_with_integral_image_rows(
+    unsigned short **grayscale, struct integral_image *integral_image,
+    unsigned char **output, int num_cols, int num_rows, float k, int r, float R,
+    int row_begin, int row_end);
+
+void sauvola_threshold_16_with_integral_image_parallel(
+    unsigned short **grayscale, struct integral_image *integral_image,
+    unsigned char **output, int num_cols, int num_rows, float k, int r, float R,
+    int num_threads);
+
+void sauvola_threshold_16_with_integral_image_pooled(
+    unsigned short **grayscale, struct integral_image *integral_image,
+    unsigned char **output, int num_cols, int num_rows, float k, int r, float R,
+    struct worker_pool *pool);
+
+#endif
@@ -1,3 +1,5 @@
+#include "context.h"
+
 int read_ppm_header(const char *filename, int *num_rows, int *num_cols,
                     int *max_color);
 
@@ -14,8 +16,13 @@ int write_ppm_image(const char *file_name, unsigned char *red_channel,
                     unsigned char *green_channel, unsigned char *blue_channel,
                     int num_rows, int num_cols, int max_color);
 
+void write_ppm_header(FILE *file, int num_rows, int num_cols, int max_color);
+
 void ppm_sauvola_flow(const char *input_file_name,
-                      const char *output_file_name);
+                      const char *output_file_name,
+                      struct sauvola_context *context);
 
 double ppm_sauvola_flow_with_integral_image(const char *input_file_name,
-                                            const char *output_file_name);
+                                            const char *output_file_name,
+                                            int num_threads,
+                                            struct sauvola_context *context);
@@ -0,0 +1,33 @@
+#ifndef RGB_H
+#define RGB_H
+
+#include "parallel.h"
+#include "tools.h"
+
+void deinterleave_rgb(const unsigned char *rgb, unsigned char *red_channel,
+                      unsigned char *green_channel,
+                      unsigned char *blue_channel, long num_pixels);
+
+void interleave_rgb(const unsigned char *red_channel,
+                    const unsigned char *green_channel,
+                    const unsigned char *blue_channel, unsigned char *rgb,
+                    long num_pixels);
+
+void rgb_to_gray(const unsigned char *rgb, unsigned char *gray,
+                 long num_pixels);
+
+void rgb_to_gray_with_integral_image(unsigned char **rgb,
+                                     unsigned char **grayscale,
+                                     struct integral_image *integral_image,
+                                     int num_cols, int num_rows);
+
+void rgb16_to_gray16(const unsigned char *rgb, unsigned short *gray,
+                     long num_pixels);
+
+void rgb16_to_gray16_with_integral_image(unsigned char **rgb,
+                                         unsigned short **grayscale,
+                                         struct integral_image *integral_image,
+                                         int num_cols, int num_rows,
+                                         struct worker_pool *pool);
+
+#endif
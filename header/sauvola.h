@@ -1,3 +1,8 @@
+#ifndef SAUVOLA_H
+#define SAUVOLA_H
+
+#include "parallel.h"
+#include "sauvola_simd.h"
 #include "tools.h"
 #include <ctype.h>
 #include <math.h>
@@ -8,8 +13,79 @@
 void sauvola_threshold(unsigned char **grayscale, unsigned char **output,
                        int num_cols, int num_rows, float k, int r, float R);
 
-void sauvola_threshold_with_integral_image(unsigned char **grayscale,
-                                           unsigned long long ***integral_image,
-                                           unsigned char **output, int num_cols,
-                                           int num_rows, float k, int r,
-                                           float R);
+void sauvola_threshold_with_integral_image(
+    unsigned char **grayscale, struct integral_image *integral_image,
+    unsigned char **output, int num_cols, int num_rows, float k, int r,
+    float R);
+
+void sauvola_threshold_rows(unsigned char **grayscale, unsigned char **output,
+                            int num_cols, int num_rows, float k, int r,
+                            float R, int row_begin, int row_end);
+
+void sauvola_threshold_with_integral_image_rows(
+    unsigned char **grayscale, struct integral_image *integral_image,
+    unsigned char **output, int num_cols, int num_rows, float k, int r, float R,
+    int row_begin, int row_end);
+
+void sauvola_threshold_with_integral_image_span(
+    unsigned char **grayscale, struct integral_image *integral_image,
+    unsigned char **output, int num_cols, int num_rows, float k, int r, float R,
+    int i, int col_begin, int col_end);
+
+void sauvola_threshold_parallel(unsigned char **grayscale,
+                                unsigned char **output, int num_cols,
+                                int num_rows, float k, int r, float R,
+                                int num_threads);
+
+void sauvola_threshold_pooled(unsigned char **grayscale,
+                              unsigned char **output, int num_cols,
+                              int num_rows, float k, int r, float R,
+                              struct worker_pool *pool);
+
+void sauvola_threshold_with_integral_image_parallel(
+    unsigned char **grayscale, struct integral_image *integral_image,
+    unsigned char **output, int num_cols, int num_rows, float k, int r, float R,
+    int num_threads);
+
+void sauvola_threshold_with_integral_image_pooled(
+    unsigned char **grayscale, struct integral_image *integral_image,
+    unsigned char **output, int num_cols, int num_rows, float k, int r, float R,
+    struct worker_pool *pool);
+
+void sauvola_threshold_running_sums(unsigned char **grayscale,
+                                    unsigned char **output, int num_cols,
+                                    int num_rows, float k, int r, float R);
+
+void sauvola_threshold_running_sums_rows(unsigned char **grayscale,
+                                         unsigned char **output, int num_cols,
+                                         int num_rows, float k, int r, float R,
+                                         int row_begin, int row_end);
+
+/*
+ * Band buffers of the packed engine, one band of rows per worker, kept across
+ * calls of sauvola_threshold_with_integral_image_packed_pooled. Zero it before
+ * the first use and release it with free_packed_scratch.
+ */
+struct packed_scratch {
+  unsigned char *data;
+  size_t capacity; // bytes in data
+};
+
+void free_packed_scratch(struct packed_scratch *scratch);
+
+int sauvola_threshold_with_integral_image_packed_rows(
+    unsigned char **grayscale, struct integral_image *integral_image,
+    unsigned char **packed, int num_cols, int num_rows, float k, int r, float R,
+    enum simd_level level, int row_begin, int row_end);
+
+int sauvola_threshold_with_integral_image_packed(
+    unsigned char **grayscale, struct integral_image *integral_image,
+    unsigned char **packed, int num_cols, int num_rows, float k, int r, float R,
+    int num_threads);
+
+int sauvola_threshold_with_integral_image_packed_pooled(
+    unsigned char **grayscale, struct integral_image *integral_image,
+    unsigned char **packed, int num_cols, int num_rows, float k, int r, float R,
+    struct worker_pool *pool, struct packed_scratch *scratch);
+
+#endif
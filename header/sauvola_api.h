@@ -0,0 +1,96 @@
+#ifndef SAUVOLA_API_H
+#define SAUVOLA_API_H
+
+#include "context.h"
+#include "parallel.h"
+#include "sauvola_simd.h"
+
+/*
+ * In-memory library interface. A processor is set up once with the Sauvola
+ * parameters and keeps every buffer it needs across calls; sauvola_process
+ * binarizes pixels the caller already holds into memory the caller owns,
+ * without any I/O, and reports errors as status codes instead of exiting.
+ *
+ * Regions of interest of a page are binarized without copying them out: the
+ * page is set once with sauvola_set_page, which builds its integral image,
+ * and every later call of sauvola_process_rois only costs the area of the
+ * regions it is given. After the caller retouches a patch of the page,
+ * sauvola_update_page updates the integral image from the patch on and
+ * binarizes again only the pixels whose window reaches the patch.
+ */
+
+enum sauvola_status {
+  SAUVOLA_OK = 0,
+  SAUVOLA_ERROR_ARGUMENT = -1, // invalid parameter, size, stride or pointer
+  SAUVOLA_ERROR_MEMORY = -2    // a buffer could not be allocated
+};
+
+/*
+ * Parameters of a processor, with the meaning of the k, r and R arguments of
+ * sauvola_threshold. num_threads below 1 selects one thread per online
+ * processor.
+ */
+struct sauvola_options {
+  float k;
+  int r;
+  float R;
+  int num_threads;
+};
+
+/*
+ * A rectangle of a page: num_rows rows from row and num_cols columns from
+ * col.
+ */
+struct sauvola_roi {
+  int row;
+  int col;
+  int num_rows;
+  int num_cols;
+};
+
+struct sauvola_processor {
+  struct sauvola_options options;
+  struct sauvola_context context; // integral image
+  unsigned char **input_rows;
+  unsigned char **output_rows;
+  int row_capacity; // entries in input_rows and output_rows
+  unsigned long long *deltas; // column deltas of sauvola_update_page
+  int delta_capacity;
+  int page_cols;    // size of the page set with sauvola_set_page, 0 if none
+  int page_rows;
+  enum simd_level level;
+  struct worker_pool pool; // options.num_threads workers
+};
+
+const char *sauvola_status_string(enum sauvola_status status);
+
+enum sauvola_status
+sauvola_processor_init(struct sauvola_processor *processor,
+                       const struct sauvola_options *options);
+
+enum sauvola_status
+sauvola_processor_reserve(struct sauvola_processor *processor, int num_rows,
+                          int num_cols);
+
+enum sauvola_status sauvola_process(struct sauvola_processor *processor,
+                                    const unsigned char *pixels, long stride,
+                                    int num_cols, int num_rows,
+                                    unsigned char *output, long output_stride);
+
+enum sauvola_status sauvola_set_page(struct sauvola_processor *processor,
+                                     const unsigned char *pixels, long stride,
+                                     int num_cols, int num_rows);
+
+enum sauvola_status
+sauvola_process_rois(struct sauvola_processor *processor,
+                     const struct sauvola_roi *rois, int num_rois,
+                     unsigned char *output, long output_stride);
+
+enum sauvola_status
+sauvola_update_page(struct sauvola_processor *processor,
+                    const struct sauvola_roi *patch, unsigned char *output,
+                    long output_stride);
+
+void sauvola_processor_free(struct sauvola_processor *processor);
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef SAUVOLA_SIMD_H
+#define SAUVOLA_SIMD_H
+
+#include "tools.h"
+
+enum simd_level { SIMD_SCALAR, SIMD_AVX2, SIMD_AVX512 };
+
+enum simd_level detect_simd_level(void);
+
+void sauvola_threshold_with_integral_image_simd(
+    unsigned char **grayscale, struct integral_image *integral_image,
+    unsigned char **output, int num_cols, int num_rows, float k, int r,
+    float R);
+
+void sauvola_threshold_with_integral_image_simd_rows(
+    unsigned char **grayscale, struct integral_image *integral_image,
+    unsigned char **output, int num_cols, int num_rows, float k, int r, float R,
+    enum simd_level level, int row_begin, int row_end);
+
+void sauvola_threshold_with_integral_image_simd_rect(
+    unsigned char **grayscale, struct integral_image *integral_image,
+    unsigned char **output, int num_cols, int num_rows, float k, int r, float R,
+    enum simd_level level, int row_begin, int row_end, int col_begin,
+    int col_end);
+
+void sauvola_threshold_16_with_integral_image_simd_rows(
+    unsigned short **grayscale, struct integral_image *integral_image,
+    unsigned char **output, int num_cols, int num_rows, float k, int r, float R,
+    enum simd_level level, int row_begin, int row_end);
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <stdio.h>
+
+/*
+ * Running column sums over the rows of a vertical window. sum[j] and
+ * sum_squares[j] hold the sum and the sum of squares of column j over the rows
+ * added so far and not yet removed. row_sum and row_sum_squares are scratch
+ * space for the horizontal prefix sums of one row.
+ */
+struct column_sums {
+  int num_cols;
+  unsigned long long *sum;
+  unsigned long long *sum_squares;
+  unsigned long long *row_sum;
+  unsigned long long *row_sum_squares;
+};
+
+int init_column_sums(struct column_sums *sums, int num_cols);
+
+void free_column_sums(struct column_sums *sums);
+
+void column_sums_add_row(struct column_sums *sums, const unsigned char *row);
+
+void column_sums_remove_row(struct column_sums *sums, const unsigned char *row);
+
+void column_sums_threshold_row(struct column_sums *sums,
+                               const unsigned char *grayscale,
+                               unsigned char *output, int window_rows, float k,
+                               int r, float R);
+
+int sauvola_threshold_stream(FILE *input, FILE *output, int num_rows,
+                             int num_cols, float k, int r, float R);
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef SWEEP_H
+#define SWEEP_H
+
+#include "parallel.h"
+#include "tools.h"
+
+/*
+ * One parameter set of a sweep, with the meaning of the k, r and R arguments
+ * of sauvola_threshold.
+ */
+struct sauvola_params {
+  float k;
+  int r;
+  float R;
+};
+
+/*
+ * Buffers of a sweep kept across calls of sauvola_threshold_sweep_pooled: the
+ * slot tables of the parameter sets and the row buffers of every worker. Zero
+ * it before the first use and release it with free_sweep_scratch.
+ */
+struct sweep_scratch {
+  int *slots;
+  int *radii;
+  int param_capacity; // entries in slots and radii
+  double *rows;
+  size_t row_capacity; // doubles in rows
+};
+
+void free_sweep_scratch(struct sweep_scratch *scratch);
+
+int sweep_max_radius(const struct sauvola_params *params, int num_params);
+
+int sauvola_threshold_sweep_rows(unsigned char **grayscale,
+                                 struct integral_image *integral_image,
+                                 unsigned char ***outputs, int num_cols,
+                                 int num_rows,
+                                 const struct sauvola_params *params,
+                                 int num_params, int row_begin, int row_end);
+
+int sauvola_threshold_sweep(unsigned char **grayscale,
+                            struct integral_image *integral_image,
+                            unsigned char ***outputs, int num_cols,
+                            int num_rows, const struct sauvola_params *params,
+                            int num_params, int num_threads);
+
+int sauvola_threshold_sweep_pooled(unsigned char **grayscale,
+                                   struct integral_image *integral_image,
+                                   unsigned char ***outputs, int num_cols,
+                                   int num_rows,
+                                   const struct sauvola_params *params,
+                                   int num_params, struct worker_pool *pool,
+                                   struct sweep_scratch *scratch);
+
+#endif
@@ -0,0 +1,18 @@
+#ifndef SYNTHETIC_H
+#define SYNTHETIC_H
+
+void synthetic_document_row(unsigned char *gray, int i, int num_rows,
+                            int num_cols, unsigned int seed);
+
+void synthetic_document_row_rgb(unsigned char *red, unsigned char *green,
+                                unsigned char *blue, int i, int num_rows,
+                                int num_cols, unsigned int seed);
+
+void generate_synthetic_document(unsigned char **grayscale, int num_rows,
+                                 int num_cols, unsigned int seed,
+                                 int num_threads);
+
+int write_synthetic_document(const char *file_name, int num_rows,
+                             int num_cols, int channels, unsigned int seed);
+
+#endif
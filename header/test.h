@@ -2,6 +2,56 @@
 #include "tools.h"
 #include <stdbool.h>
 
-bool test_integral_image(const char *source_image);
+// Seed of the synthetic test page
+#define TEST_PAGE_SEED 1
+
+bool test_integral_image(int num_rows, int num_cols);
 
 bool test_image_unity(const char *image_one, const char *image_two);
+
+bool test_parallel_unity(int num_rows, int num_cols, int r, int num_threads);
+
+bool test_simd_unity(int num_rows, int num_cols, int r);
+
+bool test_stream_unity(const char *source_image, int r);
+
+bool test_mapped_unity(const char *source_image);
+
+bool test_ppm_unity(const char *source_image, const char *temporary_image);
+
+bool test_gray_unity(int num_rows, int num_cols, int r);
+
+bool test_batch_unity(const char *source_image, const char *output_directory,
+                      int r);
+
+bool test_context_reuse(const char *source_image, const char *temporary_image,
+                        int r);
+
+bool test_tiled_unity(int num_rows, int num_cols, int r);
+
+bool test_running_sums_unity(int num_rows, int num_cols, int r);
+
+bool test_pbm_unity(const char *source_image, const char *temporary_image,
+                    int r);
+
+
+bool test_exact_unity(int num_rows, int num_cols, int r);
+
+bool test_integral_image_unity(int num_rows, int num_cols);
+
+bool test_sweep_unity(int num_rows, int num_cols);
+
+bool test_approximate_unity(int num_rows, int num_cols, int r);
+
+bool test_synthetic_unity(const char *temporary_image, int num_rows,
+                          int num_cols, int r);
+
+bool test_api_unity(int num_rows, int num_cols, int r);
+
+bool test_roi_unity(int num_rows, int num_cols, int r);
+
+bool test_update_unity(int num_rows, int num_cols, int r);
+
+bool test_pgm16_unity(const char *source_image, const char *temporary_image,
+                      const char *temporary_color_image,
+                      const char *temporary_output, int r);
@@ -0,0 +1,38 @@
+#ifndef TILED_H
+#define TILED_H
+
+#include "parallel.h"
+#include <stddef.h>
+
+/*
+ * Per-worker scratch of the tiled engine, the row pointers and the integral
+ * image of a halo for every worker, kept across calls of
+ * sauvola_threshold_tiled_pooled. Zero it before the first use and release it
+ * with free_tiled_scratch.
+ */
+struct tiled_scratch {
+  struct tile_scratch *workers;
+  int num_workers;
+  int row_capacity; // entries in the row pointers of every worker
+};
+
+size_t default_l2_cache_size(void);
+
+void choose_tile_size(int num_rows, int num_cols, int r, size_t cache_size,
+                      int *tile_rows, int *tile_cols);
+
+void sauvola_threshold_tiled(unsigned char **grayscale, unsigned char **output,
+                             int num_cols, int num_rows, float k, int r,
+                             float R, int tile_rows, int tile_cols,
+                             int num_threads);
+
+void sauvola_threshold_tiled_pooled(unsigned char **grayscale,
+                                    unsigned char **output, int num_cols,
+                                    int num_rows, float k, int r, float R,
+                                    int tile_rows, int tile_cols,
+                                    struct worker_pool *pool,
+                                    struct tiled_scratch *scratch);
+
+void free_tiled_scratch(struct tiled_scratch *scratch);
+
+#endif
@@ -1,17 +1,178 @@
+#ifndef TOOLS_H
+#define TOOLS_H
+
 #include <ctype.h>
 #include <math.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
 
+// Largest pixel value of an 8-bit image
+#define SAUVOLA_MAX_PIXEL 255.0
+
+/*
+ * Memory layout of the two integral image planes. Planar keeps the sums and
+ * the sums of squares in separate planes, interleaved stores them as
+ * (sum, sum of squares) pairs.
+ */
+enum integral_layout { INTEGRAL_PLANAR, INTEGRAL_INTERLEAVED };
+
+/*
+ * Integral image stored in one contiguous, 64-byte aligned buffer. Every row
+ * is padded to a multiple of 64 bytes and preceded by 64 bytes of zeros, and
+ * a row of zeros precedes the first row, so the element at row -1 or column -1
+ * reads as 0 and column 0 of every row is aligned.
+ *
+ * Each plane holds 32-bit or 64-bit elements. A 32-bit plane either fits the
+ * whole-image total or is kept modulo 2^32, which is still exact for window
+ * sums as long as a single window cannot exceed 2^32; so plane values are only
+ * meaningful through integral_window_sum and integral_window_sum_squares,
+ * which reduce the four-corner difference modulo the plane width.
+ */
+struct integral_image {
+  int num_rows;
+  int num_cols;
+  enum integral_layout layout;
+  int sum_bits;         // width of a sum element, 32 or 64
+  int sum_squares_bits; // width of a sum of squares element, 32 or 64
+  long row_stride;      // elements between two rows of a plane
+  long step;            // elements between two columns of a plane
+  void *sum;
+  void *sum_squares;
+  void *buffer;
+  size_t buffer_size;
+};
+
+// Element index of row i and column j within a plane
+#define INTEGRAL_INDEX(ii, i, j)                                               \
+  ((long)(i) * (ii)->row_stride + (long)(j) * (ii)->step)
+
+/*
+ * Returns the address of the element at the given index of a plane with
+ * elements of the given width.
+ */
+static inline void *integral_plane_at(void *plane, int bits, long index) {
+  return (char *)plane + index * (bits / 8);
+}
+
+/*
+ * Reads the element at the given index of a plane with elements of the given
+ * width.
+ */
+static inline unsigned long long integral_plane_load(const void *plane,
+                                                     int bits, long index) {
+  return bits == 32 ? ((const unsigned int *)plane)[index]
+                    : ((const unsigned long long *)plane)[index];
+}
+
+/*
+ * Stores a value in a plane with elements of the given width, truncating it
+ * modulo 2^32 for 32-bit planes.
+ */
+static inline void integral_plane_store(void *plane, int bits, long index,
+                                        unsigned long long value) {
+  if (bits == 32) {
+    ((unsigned int *)plane)[index] = (unsigned int)value;
+  } else {
+    ((unsigned long long *)plane)[index] = value;
+  }
+}
+
+/*
+ * Returns the mask that reduces a four-corner difference modulo the width of
+ * a plane.
+ */
+static inline unsigned long long integral_plane_mask(int bits) {
+  return bits == 32 ? 0xFFFFFFFFULL : ~0ULL;
+}
+
+/*
+ * Returns the sum of the pixels in rows [top, bottom] and columns
+ * [left, right].
+ */
+static inline unsigned long long
+integral_window_sum(const struct integral_image *ii, int top, int left,
+                    int bottom, int right) {
+  const void *plane = ii->sum;
+  int bits = ii->sum_bits;
+
+  return (integral_plane_load(plane, bits, INTEGRAL_INDEX(ii, bottom, right)) -
+          integral_plane_load(plane, bits, INTEGRAL_INDEX(ii, top - 1, right)) -
+          integral_plane_load(plane, bits,
+                              INTEGRAL_INDEX(ii, bottom, left - 1)) +
+          integral_plane_load(plane, bits,
+                              INTEGRAL_INDEX(ii, top - 1, left - 1))) &
+         integral_plane_mask(bits);
+}
+
+/*
+ * Returns the sum of the squared pixels in rows [top, bottom] and columns
+ * [left, right].
+ */
+static inline unsigned long long
+integral_window_sum_squares(const struct integral_image *ii, int top, int left,
+                            int bottom, int right) {
+  const void *plane = ii->sum_squares;
+  int bits = ii->sum_squares_bits;
+
+  return (integral_plane_load(plane, bits, INTEGRAL_INDEX(ii, bottom, right)) -
+          integral_plane_load(plane, bits, INTEGRAL_INDEX(ii, top - 1, right)) -
+          integral_plane_load(plane, bits,
+                              INTEGRAL_INDEX(ii, bottom, left - 1)) +
+          integral_plane_load(plane, bits,
+                              INTEGRAL_INDEX(ii, top - 1, left - 1))) &
+         integral_plane_mask(bits);
+}
+
+/*
+ * Returns a / count rounded exactly like the division, given the reciprocal
+ * 1.0 / count, for a whole number a below 2^53 and a window count. The product
+ * with the reciprocal is off by an ulp at most, and one fused multiply-add
+ * corrects it from the exact remainder, so a window mean costs two
+ * multiply-adds and a multiplication instead of a division.
+ */
+static inline double window_quotient(double a, double count,
+                                     double reciprocal) {
+  double quotient = a * reciprocal;
+
+  return fma(fma(-quotient, count, a), reciprocal, quotient);
+}
+
 void skip_comments(FILE *file);
 
 unsigned char **alloc_2D_unsigned_char(int num_rows, int num_cols);
 
-unsigned long long ***alloc_integral_image(int num_rows, int num_cols);
+struct integral_image *alloc_integral_image(int num_rows, int num_cols,
+                                            enum integral_layout layout);
+
+int reserve_integral_image(struct integral_image *integral_image, int num_rows,
+                           int num_cols, enum integral_layout layout,
+                           int sum_bits, int sum_squares_bits);
+
+void choose_integral_widths(int num_rows, int num_cols, int max_color, int r,
+                            int *sum_bits, int *sum_squares_bits);
+
+struct integral_image *alloc_narrow_integral_image(int num_rows, int num_cols,
+                                                   int max_color, int r);
 
-void compute_integral_image(unsigned char **input, unsigned long long ***output,
-                            int num_cols, int num_rows);
+void free_integral_image(struct integral_image *integral_image);
+
+void compute_integral_image(unsigned char **input,
+                            struct integral_image *output, int num_cols,
+                            int num_rows);
+
+void compute_integral_image_rows(unsigned char **input,
+                                 struct integral_image *output, int num_cols,
+                                 int row_begin, int row_end);
 
 bool test_integral_imgage(const char *source_image);
+
+double wall_time_ms(void);
+
+size_t write_image_file(const char *file_name, const char *header,
+                        size_t header_length, const unsigned char *payload,
+                        size_t payload_length);
+
+#endif
@@ -1,50 +1,405 @@
+#include "batch.h"
 #include "flow.h"
+#include "instrument.h"
+#include "parallel.h"
+#include "synthetic.h"
 #include "test.h"
 #include "tools.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 /* -------------------------------------------------------------------------- */
 /*                                Main Program                                */
 /* -------------------------------------------------------------------------- */
 
-enum FLOW { PURE, INTEGRAL_IMAGE, TEST_INTEGRAL_IMAGE, TEST_IMAGE_UNITY };
+// Page the tests run on, written with write_synthetic_document
+#define TEST_PAGE "./media/test_page.pgm"
+#define TEST_PAGE_ROWS 1024
+#define TEST_PAGE_COLS 768
+
+enum FLOW {
+  PURE,
+  INTEGRAL_IMAGE,
+  TEST_INTEGRAL_IMAGE,
+  TEST_IMAGE_UNITY,
+  TEST_PARALLEL_UNITY,
+  TEST_SIMD_UNITY,
+  TEST_STREAM_UNITY,
+  TEST_MAPPED_UNITY,
+  TEST_PPM_UNITY,
+  TEST_GRAY_UNITY,
+  TEST_BATCH_UNITY,
+  TEST_CONTEXT_REUSE,
+  TEST_TILED_UNITY,
+  TEST_RUNNING_SUMS_UNITY,
+  TEST_PBM_UNITY,
+  TEST_EXACT_UNITY,
+  TEST_INTEGRAL_IMAGE_UNITY,
+  TEST_SWEEP_UNITY,
+  TEST_APPROXIMATE_UNITY,
+  TEST_SYNTHETIC_UNITY,
+  TEST_API_UNITY,
+  TEST_ROI_UNITY,
+  TEST_UPDATE_UNITY,
+  TEST_PGM16_UNITY,
+  TILED,
+  STREAMING,
+  PBM,
+  SWEEP,
+  APPROXIMATE
+};
+
+/*
+ * Returns whether a test reads the test page from TEST_PAGE. These tests
+ * cover the PGM, PPM and PBM files, the mapped and streaming readers and the
+ * file flows, so they keep a real file. The other tests generate the same
+ * page in memory.
+ */
+static int flow_reads_test_page(enum FLOW flow) {
+  switch (flow) {
+  case TEST_IMAGE_UNITY:
+  case TEST_STREAM_UNITY:
+  case TEST_MAPPED_UNITY:
+  case TEST_PPM_UNITY:
+  case TEST_BATCH_UNITY:
+  case TEST_CONTEXT_REUSE:
+  case TEST_PBM_UNITY:
+  case TEST_PGM16_UNITY:
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+/*
+ * Runs the batch pipeline from the command line:
+ *
+ *   run batch [--pbm] <directory|manifest> <output directory> [r] [readers]
+ *             [workers] [writers]
+ *
+ * and prints the aggregate throughput. --pbm writes 1-bit PBM images.
+ */
+static int batch_command(int argc, char **argv) {
+  struct batch_options options = {0};
+  struct batch_report report;
+
+  // Drop the option, the positional arguments keep their indices
+  if (argc > 2 && strcmp(argv[2], "--pbm") == 0) {
+    options.pbm_output = 1;
+    argv[2] = argv[1];
+    argv[1] = argv[0];
+    argv++;
+    argc--;
+  }
+
+  if (argc < 4 || argc > 8) {
+    fprintf(stderr,
+            "usage: %s batch [--pbm] <directory|manifest> <output directory> "
+            "[r] [readers] [workers] [writers]\n",
+            argv[0]);
+    return 1;
+  }
+  if (argc > 4)
+    options.r = atoi(argv[4]);
+  if (argc > 5)
+    options.num_readers = atoi(argv[5]);
+  if (argc > 6)
+    options.num_workers = atoi(argv[6]);
+  if (argc > 7)
+    options.num_writers = atoi(argv[7]);
+
+  if (!sauvola_batch(argv[2], argv[3], &options, &report)) {
+    fprintf(stderr, "batch: cannot process %s\n", argv[2]);
+    return 1;
+  }
+
+  printf("Sauvola Batch\n");
+  printf("Pages: %d (%d failed)\n", report.num_pages, report.num_failed);
+  printf("Time: %f\n", report.elapsed_ms);
+  printf("Pages/s: %f\n", report.pages_per_second);
+
+  return report.num_failed > 0;
+}
+
+/*
+ * Writes a synthetic document from the command line:
+ *
+ *   run synthetic <output.pgm|output.ppm> <columns>x<rows> [seed]
+ *
+ * Images with a .ppm extension are written in color, others in grayscale.
+ */
+static int synthetic_command(int argc, char **argv) {
+  const char *extension;
+  int num_rows, num_cols, channels;
+  unsigned int seed = 1;
+
+  if (argc < 4 || argc > 5 ||
+      sscanf(argv[3], "%dx%d", &num_cols, &num_rows) != 2 || num_cols < 1 ||
+      num_rows < 1) {
+    fprintf(stderr, "usage: %s synthetic <output.pgm|output.ppm> "
+                    "<columns>x<rows> [seed]\n",
+            argv[0]);
+    return 1;
+  }
+  if (argc > 4)
+    seed = strtoul(argv[4], NULL, 10);
+  extension = strrchr(argv[2], '.');
+  channels = extension != NULL && strcmp(extension, ".ppm") == 0 ? 3 : 1;
+
+  if (!write_synthetic_document(argv[2], num_rows, num_cols, channels, seed)) {
+    fprintf(stderr, "synthetic: cannot write %s\n", argv[2]);
+    return 1;
+  }
+
+  return 0;
+}
 
 int main(int argc, char **argv) {
-  double time;
+  double time, disagreement;
+  int num_threads = default_thread_count();
+  const struct sauvola_params sweep_params[] = {
+      {0.2, 13, 255}, {0.34, 13, 255}, {0.5, 13, 255}};
+  const char *sweep_outputs[] = {"./media/016_lanczos_sweep_0.pgm",
+                                 "./media/016_lanczos_sweep_1.pgm",
+                                 "./media/016_lanczos_sweep_2.pgm"};
+
+  if (argc > 1 && strcmp(argv[1], "batch") == 0) {
+    int status = batch_command(argc, argv);
+
+    INSTRUMENT_REPORT(stderr);
+    return status;
+  }
+  if (argc > 1 && strcmp(argv[1], "synthetic") == 0)
+    return synthetic_command(argc, argv);
 
   enum FLOW flow = TEST_INTEGRAL_IMAGE;
 
+  // The tests run on a generated page, so they need no media files. Only the
+  // ones that go through the files write it out first.
+  if (flow_reads_test_page(flow) &&
+      !write_synthetic_document(TEST_PAGE, TEST_PAGE_ROWS, TEST_PAGE_COLS, 1,
+                                TEST_PAGE_SEED)) {
+    fprintf(stderr, "cannot write %s\n", TEST_PAGE);
+    return 1;
+  }
+
   switch (flow) {
   case INTEGRAL_IMAGE:
     time = pgm_sauvola_flow_with_integral_image(
-        "./media/016_lanczos.pgm", "./media/016_lanczos_converted_ii.pgm", 13);
+        "./media/016_lanczos.pgm", "./media/016_lanczos_converted_ii.pgm", 0.5,
+        13, 255, num_threads, NULL);
     printf("Sauvola with Integral Image\n");
     printf("Time: %f\n", time);
     break;
   case PURE:
     time = pgm_sauvola_flow("./media/016_lanczos.pgm",
-                            "./media/016_lanczos_converted.pgm", 13);
+                            "./media/016_lanczos_converted.pgm", 0.5, 13, 255,
+                            num_threads, NULL);
     printf("Sauvola\n");
     printf("Time: %f\n", time);
     break;
   case TEST_INTEGRAL_IMAGE:
-    if (test_integral_image("./media/016_lanczos.pgm")) {
+    if (test_integral_image(TEST_PAGE_ROWS, TEST_PAGE_COLS)) {
       printf("TEST INTEGRAL IMAGE: pass\n");
     } else {
       printf("TEST INTEGRAL IMAGE: fail\n");
     }
     break;
   case TEST_IMAGE_UNITY:
-    if (test_image_unity("./media/016_lanczos_converted_ii.pgm",
-                         "./media/016_lanczos_converted.pgm")) {
+    pgm_sauvola_flow_with_integral_image(
+        TEST_PAGE, "./media/test_page_converted_ii.pgm", 0.5, 13, 255,
+        num_threads, NULL);
+    pgm_sauvola_flow(TEST_PAGE, "./media/test_page_converted.pgm", 0.5, 13,
+                     255, num_threads, NULL);
+    if (test_image_unity("./media/test_page_converted_ii.pgm",
+                         "./media/test_page_converted.pgm")) {
       printf("TEST IMAGE UNITY: pass\n");
     } else {
       printf("TEST IMAGE UNITY: fail\n");
     }
     break;
+  case TEST_PARALLEL_UNITY:
+    if (test_parallel_unity(TEST_PAGE_ROWS, TEST_PAGE_COLS, 13, num_threads)) {
+      printf("TEST PARALLEL UNITY: pass\n");
+    } else {
+      printf("TEST PARALLEL UNITY: fail\n");
+    }
+    break;
+  case TEST_SIMD_UNITY:
+    if (test_simd_unity(TEST_PAGE_ROWS, TEST_PAGE_COLS, 13)) {
+      printf("TEST SIMD UNITY: pass\n");
+    } else {
+      printf("TEST SIMD UNITY: fail\n");
+    }
+    break;
+  case TEST_STREAM_UNITY:
+    if (test_stream_unity(TEST_PAGE, 13)) {
+      printf("TEST STREAM UNITY: pass\n");
+    } else {
+      printf("TEST STREAM UNITY: fail\n");
+    }
+    break;
+  case TEST_MAPPED_UNITY:
+    if (test_mapped_unity(TEST_PAGE)) {
+      printf("TEST MAPPED UNITY: pass\n");
+    } else {
+      printf("TEST MAPPED UNITY: fail\n");
+    }
+    break;
+  case TEST_PPM_UNITY:
+    if (test_ppm_unity(TEST_PAGE, "./media/test_page_rgb.ppm")) {
+      printf("TEST PPM UNITY: pass\n");
+    } else {
+      printf("TEST PPM UNITY: fail\n");
+    }
+    break;
+  case TEST_GRAY_UNITY:
+    if (test_gray_unity(TEST_PAGE_ROWS, TEST_PAGE_COLS, 13)) {
+      printf("TEST GRAY UNITY: pass\n");
+    } else {
+      printf("TEST GRAY UNITY: fail\n");
+    }
+    break;
+  case TEST_BATCH_UNITY:
+    if (test_batch_unity(TEST_PAGE, "./media/batch", 13)) {
+      printf("TEST BATCH UNITY: pass\n");
+    } else {
+      printf("TEST BATCH UNITY: fail\n");
+    }
+    break;
+  case TEST_CONTEXT_REUSE:
+    if (test_context_reuse(TEST_PAGE, "./media/test_page_context.pgm", 13)) {
+      printf("TEST CONTEXT REUSE: pass\n");
+    } else {
+      printf("TEST CONTEXT REUSE: fail\n");
+    }
+    break;
+  case TEST_TILED_UNITY:
+    if (test_tiled_unity(TEST_PAGE_ROWS, TEST_PAGE_COLS, 13)) {
+      printf("TEST TILED UNITY: pass\n");
+    } else {
+      printf("TEST TILED UNITY: fail\n");
+    }
+    break;
+  case TEST_RUNNING_SUMS_UNITY:
+    if (test_running_sums_unity(TEST_PAGE_ROWS, TEST_PAGE_COLS, 13)) {
+      printf("TEST RUNNING SUMS UNITY: pass\n");
+    } else {
+      printf("TEST RUNNING SUMS UNITY: fail\n");
+    }
+    break;
+  case TEST_PBM_UNITY:
+    if (test_pbm_unity(TEST_PAGE, "./media/test_page_packed.pbm", 13)) {
+      printf("TEST PBM UNITY: pass\n");
+    } else {
+      printf("TEST PBM UNITY: fail\n");
+    }
+    break;
+  case TEST_EXACT_UNITY:
+    if (test_exact_unity(TEST_PAGE_ROWS, TEST_PAGE_COLS, 13)) {
+      printf("TEST EXACT UNITY: pass\n");
+    } else {
+      printf("TEST EXACT UNITY: fail\n");
+    }
+    break;
+  case TEST_INTEGRAL_IMAGE_UNITY:
+    if (test_integral_image_unity(TEST_PAGE_ROWS, TEST_PAGE_COLS)) {
+      printf("TEST INTEGRAL IMAGE UNITY: pass\n");
+    } else {
+      printf("TEST INTEGRAL IMAGE UNITY: fail\n");
+    }
+    break;
+  case TEST_SWEEP_UNITY:
+    if (test_sweep_unity(TEST_PAGE_ROWS, TEST_PAGE_COLS)) {
+      printf("TEST SWEEP UNITY: pass\n");
+    } else {
+      printf("TEST SWEEP UNITY: fail\n");
+    }
+    break;
+  case TEST_APPROXIMATE_UNITY:
+    if (test_approximate_unity(TEST_PAGE_ROWS, TEST_PAGE_COLS, 50)) {
+      printf("TEST APPROXIMATE UNITY: pass\n");
+    } else {
+      printf("TEST APPROXIMATE UNITY: fail\n");
+    }
+    break;
+  case TEST_SYNTHETIC_UNITY:
+    if (test_synthetic_unity("./media/synthetic.pgm", 1536, 2048, 13)) {
+      printf("TEST SYNTHETIC UNITY: pass\n");
+    } else {
+      printf("TEST SYNTHETIC UNITY: fail\n");
+    }
+    break;
+  case TEST_API_UNITY:
+    if (test_api_unity(TEST_PAGE_ROWS, TEST_PAGE_COLS, 13)) {
+      printf("TEST API UNITY: pass\n");
+    } else {
+      printf("TEST API UNITY: fail\n");
+    }
+    break;
+  case TEST_ROI_UNITY:
+    if (test_roi_unity(TEST_PAGE_ROWS, TEST_PAGE_COLS, 13)) {
+      printf("TEST ROI UNITY: pass\n");
+    } else {
+      printf("TEST ROI UNITY: fail\n");
+    }
+    break;
+  case TEST_UPDATE_UNITY:
+    if (test_update_unity(TEST_PAGE_ROWS, TEST_PAGE_COLS, 13)) {
+      printf("TEST UPDATE UNITY: pass\n");
+    } else {
+      printf("TEST UPDATE UNITY: fail\n");
+    }
+    break;
+  case TEST_PGM16_UNITY:
+    if (test_pgm16_unity(TEST_PAGE, "./media/test_page_16.pgm",
+                         "./media/test_page_16.ppm",
+                         "./media/test_page_16_converted.pgm", 13)) {
+      printf("TEST PGM16 UNITY: pass\n");
+    } else {
+      printf("TEST PGM16 UNITY: fail\n");
+    }
+    break;
+  case TILED:
+    time = pgm_sauvola_flow_tiled("./media/016_lanczos.pgm",
+                                  "./media/016_lanczos_converted_tiled.pgm",
+                                  0.5, 13, 255, num_threads, NULL);
+    printf("Sauvola Tiled\n");
+    printf("Time: %f\n", time);
+    break;
+  case STREAMING:
+    time = pgm_sauvola_flow_streaming(
+        "./media/016_lanczos.pgm", "./media/016_lanczos_converted_st.pgm", 0.5,
+        13, 255);
+    printf("Sauvola Streaming\n");
+    printf("Time: %f\n", time);
+    break;
+  case PBM:
+    time = pgm_sauvola_flow_pbm("./media/016_lanczos.pgm",
+                                "./media/016_lanczos_converted.pbm", 0.5, 13,
+                                255, num_threads, NULL);
+    printf("Sauvola PBM\n");
+    printf("Time: %f\n", time);
+    break;
+  case SWEEP:
+    time = pgm_sauvola_flow_sweep("./media/016_lanczos.pgm", sweep_outputs,
+                                  sweep_params, 3, num_threads, NULL);
+    printf("Sauvola Sweep\n");
+    printf("Time: %f\n", time);
+    break;
+  case APPROXIMATE:
+    time = pgm_sauvola_flow_approximate(
+        "./media/016_lanczos.pgm", "./media/016_lanczos_converted_approx.pgm",
+        0.5, 100, 255, 0.01, &disagreement, NULL);
+    printf("Sauvola Approximate\n");
+    printf("Time: %f\n", time);
+    printf("Disagreement: %f%%\n", 100 * disagreement);
+    break;
   default:
     return 0;
   }
 
+  INSTRUMENT_REPORT(stderr);
   return 0;
 }
@@ -0,0 +1,598 @@
+#include "approximate.h"
+#include "sauvola.h"
+#include "tools.h"
+#include <immintrin.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* -------------------------------------------------------------------------- */
+/*                  Approximate Sauvola (Decimated Statistics)                */
+/* -------------------------------------------------------------------------- */
+
+/*
+ * For large radii the window statistics change slowly across the image, so
+ * they are only computed on a grid of step x step pixel blocks. The image is
+ * summed into blocks in one pass, the windows are assembled from the
+ * 2 round(r / step) + 1 blocks around each block, and the threshold at the
+ * block centres is bilinearly interpolated back to every pixel. Only the
+ * block sums, their integral image and the block thresholds are stored,
+ * about 24 bytes per block instead of 16 bytes per pixel, and the window
+ * work drops by step^2. With a step of 1 the blocks are the pixels and the
+ * output is the same as sauvola_threshold_with_integral_image.
+ */
+
+/*
+ * The grid of blocks of one call, in the buffers of an approximate_scratch.
+ */
+struct block_grid {
+  int step;
+  int block_rows;
+  int block_cols;
+  unsigned long long *sums;    // integral image of the block sums
+  unsigned long long *squares; // integral image of the block sums of squares
+  double *thresholds;          // threshold at every block centre
+};
+
+// Side of the square of pixels choose_decimation measures the steps on
+#define DECIMATION_SAMPLE_SIDE 1024
+
+#define TARGET_AVX2 __attribute__((target("avx2,fma")))
+#define TARGET_AVX512 __attribute__((target("avx512f,avx512bw,avx512vl")))
+
+/**
+ * Releases the buffers of the approximate engine.
+ */
+void free_approximate_scratch(struct approximate_scratch *scratch) {
+  free(scratch->sums);
+  free(scratch->squares);
+  free(scratch->thresholds);
+  free(scratch->columns);
+  free(scratch->blocks);
+  memset(scratch, 0, sizeof(*scratch));
+}
+
+/*
+ * Grows the scratch to at least num_blocks grid entries and num_cols columns.
+ * Returns 0 if the memory cannot be allocated, in which case the old buffers
+ * are released.
+ */
+static int reserve_approximate_scratch(struct approximate_scratch *scratch,
+                                       size_t num_blocks, int num_cols) {
+  if (scratch->block_capacity < num_blocks) {
+    free(scratch->sums);
+    free(scratch->squares);
+    free(scratch->thresholds);
+    scratch->sums = (unsigned long long *)malloc(
+        num_blocks * sizeof(unsigned long long));
+    scratch->squares = (unsigned long long *)malloc(
+        num_blocks * sizeof(unsigned long long));
+    scratch->thresholds = (double *)malloc(num_blocks * sizeof(double));
+    scratch->block_capacity = num_blocks;
+  }
+  if (scratch->column_capacity < num_cols) {
+    free(scratch->columns);
+    free(scratch->blocks);
+    scratch->columns = (double *)malloc(3 * (size_t)num_cols * sizeof(double));
+    scratch->blocks = (int *)malloc(2 * (size_t)num_cols * sizeof(int));
+    scratch->column_capacity = num_cols;
+  }
+
+  if (scratch->sums == NULL || scratch->squares == NULL ||
+      scratch->thresholds == NULL || scratch->columns == NULL ||
+      scratch->blocks == NULL) {
+    free_approximate_scratch(scratch);
+    return 0;
+  }
+
+  return 1;
+}
+
+/*
+ * Number of pixels that differ between two images.
+ */
+static long count_differing(unsigned char **first, unsigned char **second,
+                            int num_cols, int num_rows) {
+  long differing = 0;
+
+  for (int i = 0; i < num_rows; i++) {
+    for (int j = 0; j < num_cols; j++) {
+      differing += first[i][j] != second[i][j];
+    }
+  }
+
+  return differing;
+}
+
+/**
+ * Returns the largest block step for which the approximate output of a sample
+ * of the image differs from the exact Sauvola output in at most a fraction
+ * max_disagreement of its pixels, and at least 1. The sample is the centred
+ * square of DECIMATION_SAMPLE_SIDE pixels, or of four window sides if that is
+ * larger, clipped to the image. Its exact output is computed once and the
+ * steps from 1 to r are bisected, taking the disagreement to grow with the
+ * step. The rest of a larger image can disagree more or less often, see
+ * sauvola_disagreement_rate.
+ *
+ * @param scratch The buffers of the trial runs, see
+ * sauvola_threshold_approximate_with_scratch.
+ * @return The step, or 0 if the memory cannot be allocated.
+ */
+int choose_decimation(unsigned char **grayscale, int num_cols, int num_rows,
+                      float k, int r, float R, double max_disagreement,
+                      struct approximate_scratch *scratch) {
+  int side = 4 * (2 * r + 1) > DECIMATION_SAMPLE_SIDE ? 4 * (2 * r + 1)
+                                                      : DECIMATION_SAMPLE_SIDE;
+  int sample_rows = side < num_rows ? side : num_rows;
+  int sample_cols = side < num_cols ? side : num_cols;
+  int top = (num_rows - sample_rows) / 2, left = (num_cols - sample_cols) / 2;
+  double max_differing = max_disagreement * sample_rows * sample_cols;
+  enum simd_level level = detect_simd_level();
+  int low = 1, high = r > 1 ? r : 1, step;
+  unsigned char **sample =
+      (unsigned char **)malloc(sample_rows * sizeof(unsigned char *));
+  unsigned char **exact = alloc_2D_unsigned_char(sample_rows, sample_cols);
+  unsigned char **approximate =
+      alloc_2D_unsigned_char(sample_rows, sample_cols);
+  int ok = sample != NULL && exact != NULL && exact[0] != NULL &&
+           approximate != NULL && approximate[0] != NULL;
+
+  if (ok) {
+    for (int i = 0; i < sample_rows; i++) {
+      sample[i] = grayscale[top + i] + left;
+    }
+    sauvola_threshold_running_sums(sample, exact, sample_cols, sample_rows, k,
+                                   r, R);
+  }
+
+  // A step of low always meets the target, one of high + 1 never does
+  while (ok && low < high) {
+    step = low + (high - low + 1) / 2;
+    ok = sauvola_threshold_approximate_with_scratch(
+        sample, approximate, sample_cols, sample_rows, k, r, R, step, level,
+        scratch);
+    if (ok && count_differing(exact, approximate, sample_cols, sample_rows) <=
+                  max_differing) {
+      low = step;
+    } else {
+      high = step - 1;
+    }
+  }
+
+  free(sample);
+  if (exact != NULL)
+    free(exact[0]);
+  free(exact);
+  if (approximate != NULL)
+    free(approximate[0]);
+  free(approximate);
+
+  return ok ? low : 0;
+}
+
+/*
+ * Sums the image into blocks and turns the block sums into an integral image
+ * with a zero row and column in front, in the buffers of scratch. Returns 0 if
+ * the buffers cannot be allocated.
+ */
+static int compute_block_grid(unsigned char **grayscale, int num_cols,
+                              int num_rows, int step,
+                              struct approximate_scratch *scratch,
+                              struct block_grid *grid) {
+  int block_rows = (num_rows + step - 1) / step;
+  int block_cols = (num_cols + step - 1) / step;
+  long stride = block_cols + 1;
+  size_t size = (size_t)(block_rows + 1) * stride;
+  unsigned long long *sums, *squares, row_sum, row_sum_squares;
+  int i, j, b;
+
+  if (!reserve_approximate_scratch(scratch, size, num_cols))
+    return 0;
+  grid->step = step;
+  grid->block_rows = block_rows;
+  grid->block_cols = block_cols;
+  grid->sums = scratch->sums;
+  grid->squares = scratch->squares;
+  grid->thresholds = scratch->thresholds;
+  memset(grid->sums, 0, size * sizeof(unsigned long long));
+  memset(grid->squares, 0, size * sizeof(unsigned long long));
+
+  // Block sums go to row b + 1 and column c + 1
+  for (i = 0; i < num_rows; i++) {
+    sums = grid->sums + (i / step + 1) * stride + 1;
+    squares = grid->squares + (i / step + 1) * stride + 1;
+    for (j = 0, b = 0; j < num_cols; j += step, b++) {
+      int end = j + step < num_cols ? j + step : num_cols;
+      unsigned int block_sum = 0, block_sum_squares = 0;
+
+      for (int x = j; x < end; x++) {
+        block_sum += grayscale[i][x];
+        block_sum_squares += (unsigned int)grayscale[i][x] * grayscale[i][x];
+      }
+      sums[b] += block_sum;
+      squares[b] += block_sum_squares;
+    }
+  }
+
+  // Integral image of the blocks, the zero row and column stay zero
+  for (i = 1; i <= block_rows; i++) {
+    row_sum = 0;
+    row_sum_squares = 0;
+    for (j = 1; j <= block_cols; j++) {
+      row_sum += grid->sums[i * stride + j];
+      row_sum_squares += grid->squares[i * stride + j];
+      grid->sums[i * stride + j] = row_sum + grid->sums[(i - 1) * stride + j];
+      grid->squares[i * stride + j] =
+          row_sum_squares + grid->squares[(i - 1) * stride + j];
+    }
+  }
+
+  return 1;
+}
+
+/*
+ * Computes the threshold of every block from the blocks within
+ * round(r / step) blocks of it, with the same formula as the exact engines.
+ * The pixel count of a window follows from its extent, clipped to the image.
+ */
+static void compute_block_thresholds(struct block_grid *grid, int num_cols,
+                                     int num_rows, float k, int r, float R) {
+  int step = grid->step;
+  int radius = (int)floor((double)r / step + 0.5);
+  long stride = grid->block_cols + 1;
+  unsigned long long sum, sum_squares;
+  long count;
+  double mean, stdev;
+
+  for (int bi = 0; bi < grid->block_rows; bi++) {
+    int top = bi - radius > 0 ? bi - radius : 0;
+    int bottom =
+        bi + radius < grid->block_rows - 1 ? bi + radius : grid->block_rows - 1;
+    int height = (bottom + 1) * step < num_rows
+                     ? (bottom + 1) * step - top * step
+                     : num_rows - top * step;
+
+    for (int bj = 0; bj < grid->block_cols; bj++) {
+      int left = bj - radius > 0 ? bj - radius : 0;
+      int right = bj + radius < grid->block_cols - 1 ? bj + radius
+                                                     : grid->block_cols - 1;
+      int width = (right + 1) * step < num_cols
+                      ? (right + 1) * step - left * step
+                      : num_cols - left * step;
+
+      sum = grid->sums[(bottom + 1) * stride + right + 1] -
+            grid->sums[top * stride + right + 1] -
+            grid->sums[(bottom + 1) * stride + left] +
+            grid->sums[top * stride + left];
+      sum_squares = grid->squares[(bottom + 1) * stride + right + 1] -
+                    grid->squares[top * stride + right + 1] -
+                    grid->squares[(bottom + 1) * stride + left] +
+                    grid->squares[top * stride + left];
+      count = (long)width * height;
+
+      mean = sum / (double)count;
+      stdev = sqrt((sum_squares / (double)count) - (mean * mean));
+      grid->thresholds[(long)bi * grid->block_cols + bj] =
+          mean * (1.0 + k * ((stdev / R) - 1.0));
+    }
+  }
+}
+
+/*
+ * Position of pixel coordinate x between the block centres, as the index of
+ * the block centre at or before it and the weight of the next one. Centres
+ * are at (b + 0.5) step - 0.5; beyond the first and last centre the
+ * threshold is held constant.
+ */
+static void interpolation_weight(int x, int step, int num_blocks, int *block,
+                                 double *weight) {
+  double position = (x + 0.5) / step - 0.5;
+
+  if (position <= 0) {
+    *block = 0;
+    *weight = 0;
+  } else if (position >= num_blocks - 1) {
+    *block = num_blocks - 1;
+    *weight = 0;
+  } else {
+    *block = (int)position;
+    *weight = position - *block;
+  }
+}
+
+/* ------------------------------ Interpolation ----------------------------- */
+
+/*
+ * Both interpolations take the lower value plus the weight times the
+ * difference to the upper one with a single rounding, so the scalar loops and
+ * the vector kernels give the same thresholds. A weight of 0 gives the lower
+ * value exactly.
+ */
+
+/*
+ * Interpolates the thresholds of one block row to the columns
+ * [col_begin, num_cols).
+ */
+static void interpolate_row(const double *thresholds, const int *blocks,
+                            const int *nexts, const double *weights,
+                            double *row, int col_begin, int num_cols) {
+  for (int j = col_begin; j < num_cols; j++) {
+    row[j] = fma(thresholds[nexts[j]] - thresholds[blocks[j]], weights[j],
+                 thresholds[blocks[j]]);
+  }
+}
+
+/*
+ * Binarizes the pixels [col_begin, num_cols) of one row against the
+ * thresholds between the interpolated rows above and below.
+ */
+static void threshold_row(const unsigned char *grayscale, const double *above,
+                          const double *below, double weight,
+                          unsigned char *output, int col_begin,
+                          int num_cols) {
+  for (int j = col_begin; j < num_cols; j++) {
+    output[j] =
+        grayscale[j] > fma(below[j] - above[j], weight, above[j]) ? 255 : 0;
+  }
+}
+
+/*
+ * Byte patterns for every 4-bit compare mask, lowest pixel first
+ */
+static const unsigned int mask_bytes_avx2[16] = {
+    0x00000000, 0x000000FF, 0x0000FF00, 0x0000FFFF, 0x00FF0000, 0x00FF00FF,
+    0x00FFFF00, 0x00FFFFFF, 0xFF000000, 0xFF0000FF, 0xFF00FF00, 0xFF00FFFF,
+    0xFFFF0000, 0xFFFF00FF, 0xFFFFFF00, 0xFFFFFFFF};
+
+/*
+ * interpolate_row on four columns at a time, gathering the block thresholds.
+ * Returns the first column left over.
+ */
+static TARGET_AVX2 int interpolate_row_avx2(const double *thresholds,
+                                            const int *blocks,
+                                            const int *nexts,
+                                            const double *weights,
+                                            double *row, int num_cols) {
+  __m256d lower, upper;
+  int j;
+
+  for (j = 0; j + 4 <= num_cols; j += 4) {
+    lower = _mm256_i32gather_pd(
+        thresholds, _mm_loadu_si128((const __m128i *)(blocks + j)), 8);
+    upper = _mm256_i32gather_pd(
+        thresholds, _mm_loadu_si128((const __m128i *)(nexts + j)), 8);
+    _mm256_storeu_pd(row + j,
+                     _mm256_fmadd_pd(_mm256_sub_pd(upper, lower),
+                                     _mm256_loadu_pd(weights + j), lower));
+  }
+
+  return j;
+}
+
+/*
+ * threshold_row on four pixels at a time. Returns the first column left over.
+ */
+static TARGET_AVX2 int threshold_row_avx2(const unsigned char *grayscale,
+                                          const double *above,
+                                          const double *below, double weight,
+                                          unsigned char *output,
+                                          int num_cols) {
+  const __m256d weight_v = _mm256_set1_pd(weight);
+  __m256d lower, threshold, gray;
+  unsigned int pixels;
+  int j;
+
+  for (j = 0; j + 4 <= num_cols; j += 4) {
+    lower = _mm256_loadu_pd(above + j);
+    threshold = _mm256_fmadd_pd(
+        _mm256_sub_pd(_mm256_loadu_pd(below + j), lower), weight_v, lower);
+
+    memcpy(&pixels, grayscale + j, sizeof(pixels));
+    gray = _mm256_cvtepi32_pd(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(pixels)));
+    pixels = mask_bytes_avx2[_mm256_movemask_pd(
+        _mm256_cmp_pd(gray, threshold, _CMP_GT_OQ))];
+    memcpy(output + j, &pixels, sizeof(pixels));
+  }
+
+  return j;
+}
+
+/*
+ * interpolate_row on eight columns at a time. Returns the first column left
+ * over.
+ */
+static TARGET_AVX512 int interpolate_row_avx512(const double *thresholds,
+                                                const int *blocks,
+                                                const int *nexts,
+                                                const double *weights,
+                                                double *row, int num_cols) {
+  __m512d lower, upper;
+  int j;
+
+  for (j = 0; j + 8 <= num_cols; j += 8) {
+    lower = _mm512_i32gather_pd(
+        _mm256_loadu_si256((const __m256i *)(blocks + j)), thresholds, 8);
+    upper = _mm512_i32gather_pd(
+        _mm256_loadu_si256((const __m256i *)(nexts + j)), thresholds, 8);
+    _mm512_storeu_pd(row + j,
+                     _mm512_fmadd_pd(_mm512_sub_pd(upper, lower),
+                                     _mm512_loadu_pd(weights + j), lower));
+  }
+
+  return j;
+}
+
+/*
+ * threshold_row on eight pixels at a time. Returns the first column left
+ * over.
+ */
+static TARGET_AVX512 int threshold_row_avx512(const unsigned char *grayscale,
+                                              const double *above,
+                                              const double *below,
+                                              double weight,
+                                              unsigned char *output,
+                                              int num_cols) {
+  const __m512d weight_v = _mm512_set1_pd(weight);
+  __m512d lower, threshold, gray;
+  __mmask8 brighter;
+  int j;
+
+  for (j = 0; j + 8 <= num_cols; j += 8) {
+    lower = _mm512_loadu_pd(above + j);
+    threshold = _mm512_fmadd_pd(
+        _mm512_sub_pd(_mm512_loadu_pd(below + j), lower), weight_v, lower);
+
+    gray = _mm512_cvtepi32_pd(_mm256_cvtepu8_epi32(
+        _mm_loadl_epi64((const __m128i *)(grayscale + j))));
+    brighter = _mm512_cmp_pd_mask(gray, threshold, _CMP_GT_OQ);
+    _mm_storel_epi64((__m128i *)(output + j), _mm_movm_epi8(brighter));
+  }
+
+  return j;
+}
+
+/*
+ * Interpolates the thresholds of block row b horizontally to every column.
+ */
+static void interpolate_block_row(const struct block_grid *grid, int b,
+                                  const int *blocks, const int *nexts,
+                                  const double *weights, double *row,
+                                  int num_cols, enum simd_level level) {
+  const double *thresholds = grid->thresholds + (long)b * grid->block_cols;
+  int j = 0;
+
+  if (level == SIMD_AVX512) {
+    j = interpolate_row_avx512(thresholds, blocks, nexts, weights, row,
+                               num_cols);
+  } else if (level == SIMD_AVX2) {
+    j = interpolate_row_avx2(thresholds, blocks, nexts, weights, row,
+                             num_cols);
+  }
+  interpolate_row(thresholds, blocks, nexts, weights, row, j, num_cols);
+}
+
+/**
+ * Binarizes an image with the Sauvola algorithm from window statistics
+ * computed on step x step blocks, see choose_decimation. The thresholds of
+ * the block centres are bilinearly interpolated to every pixel, a row of
+ * block thresholds at a time horizontally and then every row vertically
+ * while it is compared to the pixels. With a step of 1 the output is the same
+ * as sauvola_threshold_with_integral_image. Use sauvola_disagreement_rate to
+ * measure how far the output is from the exact one.
+ *
+ * @return 1 on success, 0 if the block grid or the row buffers cannot be
+ * allocated.
+ */
+int sauvola_threshold_approximate(unsigned char **grayscale,
+                                  unsigned char **output, int num_cols,
+                                  int num_rows, float k, int r, float R,
+                                  int step) {
+  struct approximate_scratch scratch = {0};
+  int ok = sauvola_threshold_approximate_with_scratch(
+      grayscale, output, num_cols, num_rows, k, r, R, step,
+      detect_simd_level(), &scratch);
+
+  free_approximate_scratch(&scratch);
+  return ok;
+}
+
+/**
+ * Same as sauvola_threshold_approximate with the block grid and the row
+ * buffers kept in scratch. Once scratch has grown for the largest grid and
+ * the widest image, further calls do not allocate.
+ *
+ * @param level The instruction set of the interpolation, normally
+ * detect_simd_level(). The output does not depend on it.
+ * @return 1 on success, 0 if the step is below 1 or the buffers cannot be
+ * allocated.
+ */
+int sauvola_threshold_approximate_with_scratch(
+    unsigned char **grayscale, unsigned char **output, int num_cols,
+    int num_rows, float k, int r, float R, int step, enum simd_level level,
+    struct approximate_scratch *scratch) {
+  struct block_grid grid;
+  double *weights, *above, *below, *swap;
+  int *blocks, *nexts;
+  int above_block = -1, below_block = -1;
+
+  if (step < 1 ||
+      !compute_block_grid(grayscale, num_cols, num_rows, step, scratch, &grid))
+    return 0;
+  compute_block_thresholds(&grid, num_cols, num_rows, k, r, R);
+
+  weights = scratch->columns;
+  above = weights + num_cols;
+  below = above + num_cols;
+  blocks = scratch->blocks;
+  nexts = blocks + num_cols;
+
+  // The blocks around every column and the weight of the next one, once
+  for (int j = 0; j < num_cols; j++) {
+    interpolation_weight(j, step, grid.block_cols, &blocks[j], &weights[j]);
+    nexts[j] = weights[j] > 0 ? blocks[j] + 1 : blocks[j];
+  }
+
+  for (int i = 0; i < num_rows; i++) {
+    int block, next, j = 0;
+    double weight;
+
+    interpolation_weight(i, step, grid.block_rows, &block, &weight);
+    next = weight > 0 ? block + 1 : block;
+
+    // The block rows around row i, spread to full width when they change
+    if (block != above_block) {
+      if (block == below_block) {
+        swap = above;
+        above = below;
+        below = swap;
+        below_block = -1;
+      } else {
+        interpolate_block_row(&grid, block, blocks, nexts, weights, above,
+                              num_cols, level);
+      }
+      above_block = block;
+    }
+    if (next != below_block) {
+      interpolate_block_row(&grid, next, blocks, nexts, weights, below,
+                            num_cols, level);
+      below_block = next;
+    }
+
+    // Vertical interpolation and comparison
+    if (level == SIMD_AVX512) {
+      j = threshold_row_avx512(grayscale[i], above, below, weight, output[i],
+                               num_cols);
+    } else if (level == SIMD_AVX2) {
+      j = threshold_row_avx2(grayscale[i], above, below, weight, output[i],
+                             num_cols);
+    }
+    threshold_row(grayscale[i], above, below, weight, output[i], j, num_cols);
+  }
+
+  return 1;
+}
+
+/**
+ * Returns the fraction of pixels of output that differ from the exact Sauvola
+ * output for the same parameters, or -1 if the memory cannot be allocated.
+ * The exact output is computed with sauvola_threshold_running_sums, which
+ * needs no full-resolution integral image.
+ */
+double sauvola_disagreement_rate(unsigned char **grayscale,
+                                 unsigned char **output, int num_cols,
+                                 int num_rows, float k, int r, float R) {
+  unsigned char **exact = alloc_2D_unsigned_char(num_rows, num_cols);
+  long differing;
+
+  if (exact == NULL || exact[0] == NULL)
+    return -1;
+
+  sauvola_threshold_running_sums(grayscale, exact, num_cols, num_rows, k, r,
+                                 R);
+  differing = count_differing(exact, output, num_cols, num_rows);
+
+  free(exact[0]);
+  free(exact);
+
+  return (double)differing / ((double)num_rows * num_cols);
+}
@@ -0,0 +1,692 @@
+#include "batch.h"
+#include "context.h"
+#include "instrument.h"
+#include "mapped.h"
+#include "parallel.h"
+#include "pbm.h"
+#include "pgm.h"
+#include "rgb.h"
+#include "sauvola.h"
+#include "sauvola_simd.h"
+#include "tools.h"
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+/* -------------------------------------------------------------------------- */
+/*                          Batch Processing Pipeline                         */
+/* -------------------------------------------------------------------------- */
+
+/*
+ * Pages flow through three stages: readers map and decode the input files,
+ * workers compute the integral image and threshold, writers encode the
+ * results. The stages are connected by bounded queues, so reading page N+1
+ * and writing page N-1 overlap with thresholding page N, while the number of
+ * pages held in memory stays bounded by the queue capacities and the worker
+ * counts. Every worker thresholds a whole page on one thread; the parallelism
+ * comes from processing several pages at once.
+ *
+ * Pages are drawn from a fixed pool and returned to it by the writers. Each
+ * page keeps its grayscale and output buffers in a context and each worker
+ * keeps its integral image in one, so once the buffers have grown to the
+ * largest page the pipeline runs without allocating.
+ */
+
+struct page {
+  int index;
+  int num_rows;
+  int num_cols;
+  struct mapped_image image;
+  unsigned char **grayscale; // image.rows for PGM input, the context for PPM
+  unsigned char **output; // packed rows with pbm_output
+  struct sauvola_context context;
+};
+
+struct page_queue {
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+  struct page **pages;
+  int capacity;
+  int head;
+  int count;
+  int closed;
+};
+
+struct batch_pipeline {
+  char **file_names;
+  int num_files;
+  int *name_owners; // the first input with the same output name, see below
+  const char *output_directory;
+  int r;
+  int pbm_output;
+  enum simd_level level;
+  struct page_queue free_pages;
+  struct page_queue decoded;
+  struct page_queue thresholded;
+  struct page *pages;
+  int num_pages;
+  pthread_mutex_t lock; // guards next_file and num_failed
+  int next_file;
+  int num_failed;
+};
+
+#define BATCH_DEFAULT_RADIUS 13
+
+/* ------------------------------ Bounded Queue ----------------------------- */
+
+static int queue_init(struct page_queue *queue, int capacity) {
+  queue->pages = (struct page **)malloc(capacity * sizeof(struct page *));
+  if (queue->pages == NULL)
+    return 0;
+
+  pthread_mutex_init(&queue->lock, NULL);
+  pthread_cond_init(&queue->not_empty, NULL);
+  pthread_cond_init(&queue->not_full, NULL);
+  queue->capacity = capacity;
+  queue->head = 0;
+  queue->count = 0;
+  queue->closed = 0;
+
+  return 1;
+}
+
+static void queue_destroy(struct page_queue *queue) {
+  if (queue->pages == NULL)
+    return;
+  pthread_mutex_destroy(&queue->lock);
+  pthread_cond_destroy(&queue->not_empty);
+  pthread_cond_destroy(&queue->not_full);
+  free(queue->pages);
+}
+
+/*
+ * Appends a page, waiting while the queue is full.
+ */
+static void queue_push(struct page_queue *queue, struct page *page) {
+  pthread_mutex_lock(&queue->lock);
+  while (queue->count == queue->capacity)
+    pthread_cond_wait(&queue->not_full, &queue->lock);
+  queue->pages[(queue->head + queue->count) % queue->capacity] = page;
+  queue->count++;
+  pthread_cond_signal(&queue->not_empty);
+  pthread_mutex_unlock(&queue->lock);
+}
+
+/*
+ * Removes the oldest page, waiting while the queue is empty. Returns NULL once
+ * the queue is closed and drained.
+ */
+static struct page *queue_pop(struct page_queue *queue) {
+  struct page *page = NULL;
+
+  pthread_mutex_lock(&queue->lock);
+  while (queue->count == 0 && !queue->closed)
+    pthread_cond_wait(&queue->not_empty, &queue->lock);
+  if (queue->count > 0) {
+    page = queue->pages[queue->head];
+    queue->head = (queue->head + 1) % queue->capacity;
+    queue->count--;
+    pthread_cond_signal(&queue->not_full);
+  }
+  pthread_mutex_unlock(&queue->lock);
+
+  return page;
+}
+
+/*
+ * Marks the end of the input of a queue and wakes every waiting consumer.
+ */
+static void queue_close(struct page_queue *queue) {
+  pthread_mutex_lock(&queue->lock);
+  queue->closed = 1;
+  pthread_cond_broadcast(&queue->not_empty);
+  pthread_mutex_unlock(&queue->lock);
+}
+
+/* ------------------------------- Input List ------------------------------- */
+
+static int compare_file_names(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/*
+ * Appends a copy of name to a growing array of file names.
+ */
+static int append_file_name(char ***file_names, int *num_files, int *capacity,
+                            const char *directory, const char *name) {
+  size_t length = strlen(name) + 1;
+  char **grown, *copy;
+
+  if (*num_files == *capacity) {
+    *capacity = *capacity ? 2 * *capacity : 64;
+    grown = (char **)realloc(*file_names, *capacity * sizeof(char *));
+    if (grown == NULL)
+      return 0;
+    *file_names = grown;
+  }
+
+  if (directory != NULL)
+    length += strlen(directory) + 1;
+  if ((copy = (char *)malloc(length)) == NULL)
+    return 0;
+  if (directory != NULL) {
+    snprintf(copy, length, "%s/%s", directory, name);
+  } else {
+    snprintf(copy, length, "%s", name);
+  }
+  (*file_names)[(*num_files)++] = copy;
+
+  return 1;
+}
+
+/*
+ * Returns 1 if the file name ends with the PGM or PPM extension.
+ */
+static int has_image_extension(const char *name) {
+  size_t length = strlen(name);
+
+  return length > 4 && (strcmp(name + length - 4, ".pgm") == 0 ||
+                        strcmp(name + length - 4, ".ppm") == 0);
+}
+
+/**
+ * Lists the images of a batch. If source is a directory, every .pgm and .ppm
+ * file in it is taken, sorted by name. Otherwise source is read as a manifest
+ * with one file name per line; empty lines and lines starting with # are
+ * skipped.
+ *
+ * @return 1 on success, 0 if the source cannot be read or the memory cannot
+ * be allocated. On success the list must be released with free_batch_inputs.
+ */
+int list_batch_inputs(const char *source, char ***file_names, int *num_files) {
+  struct stat status;
+  int capacity = 0, result = 1;
+
+  *file_names = NULL;
+  *num_files = 0;
+
+  if (stat(source, &status) != 0)
+    return 0;
+
+  if (S_ISDIR(status.st_mode)) {
+    DIR *directory;
+    struct dirent *entry;
+
+    if ((directory = opendir(source)) == NULL)
+      return 0;
+    while (result && (entry = readdir(directory)) != NULL) {
+      if (has_image_extension(entry->d_name))
+        result = append_file_name(file_names, num_files, &capacity, source,
+                                  entry->d_name);
+    }
+    closedir(directory);
+
+    if (result)
+      qsort(*file_names, *num_files, sizeof(char *), compare_file_names);
+  } else {
+    FILE *manifest;
+    char *line = NULL;
+    size_t line_capacity = 0;
+    ssize_t length;
+
+    if ((manifest = fopen(source, "r")) == NULL)
+      return 0;
+    while (result && (length = getline(&line, &line_capacity, manifest)) > 0) {
+      // Strip the line ending and any trailing whitespace
+      while (length > 0 && isspace((unsigned char)line[length - 1]))
+        line[--length] = '\0';
+      if (length > 0 && line[0] != '#')
+        result = append_file_name(file_names, num_files, &capacity, NULL, line);
+    }
+    free(line);
+    fclose(manifest);
+  }
+
+  if (!result) {
+    free_batch_inputs(*file_names, *num_files);
+    *file_names = NULL;
+    *num_files = 0;
+  }
+
+  return result;
+}
+
+/**
+ * Frees a list of file names returned by list_batch_inputs.
+ */
+void free_batch_inputs(char **file_names, int num_files) {
+  for (int i = 0; i < num_files; i++)
+    free(file_names[i]);
+  free(file_names);
+}
+
+/* ------------------------------ Output Names ------------------------------ */
+
+/*
+ * Outputs are named after the base name of their input, so inputs of a
+ * manifest with the same base name in different directories would write the
+ * same output file. Every input but the first of such a group is skipped and
+ * counted as failed instead of silently overwriting the output of another.
+ */
+
+struct output_name {
+  const char *base; // base name without the directory and the extension
+  int length;
+  int index;
+};
+
+static void split_output_name(const char *file_name, struct output_name *name,
+                              int index) {
+  const char *base = strrchr(file_name, '/');
+  const char *extension;
+
+  base = base != NULL ? base + 1 : file_name;
+  extension = strrchr(base, '.');
+  name->base = base;
+  name->length = extension != NULL ? (int)(extension - base) : strlen(base);
+  name->index = index;
+}
+
+static int compare_output_names(const void *a, const void *b) {
+  const struct output_name *x = (const struct output_name *)a;
+  const struct output_name *y = (const struct output_name *)b;
+  int order = strncmp(x->base, y->base,
+                      x->length < y->length ? x->length : y->length);
+
+  if (order == 0)
+    order = x->length - y->length;
+
+  return order != 0 ? order : x->index - y->index;
+}
+
+/*
+ * Sets name_owners[i] to the index of the first input whose output name is
+ * the one of input i, which is i itself unless the names collide. Returns 0
+ * if the memory cannot be allocated.
+ */
+static int find_output_name_owners(char **file_names, int num_files,
+                                   int *name_owners) {
+  struct output_name *names = (struct output_name *)malloc(
+      (num_files + 1) * sizeof(struct output_name));
+  int i, owner = 0;
+
+  if (names == NULL)
+    return 0;
+
+  for (i = 0; i < num_files; i++)
+    split_output_name(file_names[i], &names[i], i);
+  qsort(names, num_files, sizeof(struct output_name), compare_output_names);
+
+  // Sorted by index within a group, so its owner comes first
+  for (i = 0; i < num_files; i++) {
+    if (i == 0 || names[i].length != names[i - 1].length ||
+        strncmp(names[i].base, names[i - 1].base, names[i].length) != 0)
+      owner = names[i].index;
+    name_owners[names[i].index] = owner;
+  }
+
+  free(names);
+  return 1;
+}
+
+/* --------------------------------- Stages --------------------------------- */
+
+static void count_failure(struct batch_pipeline *pipeline) {
+  pthread_mutex_lock(&pipeline->lock);
+  pipeline->num_failed++;
+  pthread_mutex_unlock(&pipeline->lock);
+}
+
+/*
+ * Releases the input mapping of a page.
+ */
+static void release_page_input(struct page *page) {
+  if (page->image.base != NULL)
+    unmap_pnm_image(&page->image);
+  page->grayscale = NULL;
+}
+
+/*
+ * Maps an input file into a page. PGM rows are used in place, PPM images are
+ * converted to grayscale. Returns 0 if the file cannot be read.
+ */
+static int decode_page(struct page *page, const char *file_name, int index) {
+  if (!map_pnm_image(file_name, &page->image, &page->context))
+    return 0;
+
+  page->index = index;
+  page->num_rows = page->image.num_rows;
+  page->num_cols = page->image.num_cols;
+
+  if (page->image.max_color > 255) {
+    release_page_input(page);
+    return 0;
+  }
+
+  if (page->image.channels == 1) {
+    page->grayscale = page->image.rows;
+  } else {
+    page->grayscale =
+        context_grayscale(&page->context, page->num_rows, page->num_cols);
+    if (page->grayscale == NULL) {
+      release_page_input(page);
+      return 0;
+    }
+    rgb_to_gray_with_integral_image(page->image.rows, page->grayscale, NULL,
+                                    page->num_cols, page->num_rows);
+  }
+
+  return 1;
+}
+
+static void *reader_main(void *arg) {
+  struct batch_pipeline *pipeline = (struct batch_pipeline *)arg;
+  struct page *page;
+  int index;
+
+  for (;;) {
+    pthread_mutex_lock(&pipeline->lock);
+    index = pipeline->next_file++;
+    pthread_mutex_unlock(&pipeline->lock);
+    if (index >= pipeline->num_files)
+      break;
+
+    if (pipeline->name_owners[index] != index) {
+      fprintf(stderr, "batch: %s has the output name of %s, skipped\n",
+              pipeline->file_names[index],
+              pipeline->file_names[pipeline->name_owners[index]]);
+      count_failure(pipeline);
+      continue;
+    }
+
+    page = queue_pop(&pipeline->free_pages);
+    if (!decode_page(page, pipeline->file_names[index], index)) {
+      count_failure(pipeline);
+      queue_push(&pipeline->free_pages, page);
+      continue;
+    }
+    queue_push(&pipeline->decoded, page);
+  }
+
+  return NULL;
+}
+
+static void *worker_main(void *arg) {
+  struct batch_pipeline *pipeline = (struct batch_pipeline *)arg;
+  struct sauvola_context context;
+  struct integral_image *integral_image;
+  struct worker_pool *pool;
+  struct page *page;
+  int output_cols, ok;
+
+  // Every worker is one thread of the pipeline, so its pool runs the bands of
+  // the packed engine on that thread
+  init_sauvola_context(&context);
+  pool = context_worker_pool(&context, 1);
+
+  while ((page = queue_pop(&pipeline->decoded)) != NULL) {
+    output_cols = pipeline->pbm_output ? packed_row_bytes(page->num_cols)
+                                       : page->num_cols;
+    integral_image = context_integral_image(&context, page->num_rows,
+                                            page->num_cols, 255, pipeline->r);
+    page->output = context_output(&page->context, page->num_rows, output_cols);
+    ok = pool != NULL && integral_image != NULL && page->output != NULL;
+
+    if (ok) {
+      INSTRUMENT_BEGIN(integral_probe);
+      compute_integral_image(page->grayscale, integral_image, page->num_cols,
+                             page->num_rows);
+      INSTRUMENT_END(integral_probe, STAGE_INTEGRAL,
+                     (long)page->num_rows * page->num_cols +
+                         integral_image->buffer_size,
+                     (long)page->num_rows * page->num_cols);
+
+      INSTRUMENT_BEGIN(threshold_probe);
+      if (pipeline->pbm_output) {
+        ok = sauvola_threshold_with_integral_image_packed_pooled(
+            page->grayscale, integral_image, page->output, page->num_cols,
+            page->num_rows, 0.5, pipeline->r, 255, pool,
+            &context.packed_scratch);
+      } else {
+        sauvola_threshold_with_integral_image_simd_rows(
+            page->grayscale, integral_image, page->output, page->num_cols,
+            page->num_rows, 0.5, pipeline->r, 255, pipeline->level, 0,
+            page->num_rows);
+      }
+      INSTRUMENT_END(threshold_probe, STAGE_THRESHOLD,
+                     (long)page->num_rows * (page->num_cols + output_cols),
+                     (long)page->num_rows * page->num_cols);
+    }
+
+    release_page_input(page);
+    if (!ok) {
+      count_failure(pipeline);
+      queue_push(&pipeline->free_pages, page);
+      continue;
+    }
+    queue_push(&pipeline->thresholded, page);
+  }
+
+  free_sauvola_context(&context);
+  return NULL;
+}
+
+/*
+ * Builds the output file name, the input base name with the given extension in
+ * the output directory, in a buffer that grows as needed. Returns 0 if the
+ * buffer cannot be grown.
+ */
+static int output_file_name(const char *output_directory,
+                            const char *input_file_name,
+                            const char *output_extension, char **name,
+                            size_t *capacity) {
+  const char *base = strrchr(input_file_name, '/');
+  const char *extension;
+  size_t base_length, length;
+  char *grown;
+
+  base = base != NULL ? base + 1 : input_file_name;
+  extension = strrchr(base, '.');
+  base_length = extension != NULL ? (size_t)(extension - base) : strlen(base);
+
+  length = strlen(output_directory) + base_length + strlen(output_extension) +
+           sizeof("/");
+  if (*capacity < length) {
+    if ((grown = (char *)realloc(*name, length)) == NULL)
+      return 0;
+    *name = grown;
+    *capacity = length;
+  }
+  snprintf(*name, length, "%s/%.*s%s", output_directory, (int)base_length,
+           base, output_extension);
+
+  return 1;
+}
+
+static void *writer_main(void *arg) {
+  struct batch_pipeline *pipeline = (struct batch_pipeline *)arg;
+  struct page *page;
+  const char *extension = pipeline->pbm_output ? ".pbm" : ".pgm";
+  char *name = NULL;
+  size_t capacity = 0;
+  int written;
+
+  while ((page = queue_pop(&pipeline->thresholded)) != NULL) {
+    written = output_file_name(pipeline->output_directory,
+                               pipeline->file_names[page->index], extension,
+                               &name, &capacity);
+    if (written && pipeline->pbm_output) {
+      written = write_pbm_image(name, page->output[0], page->num_rows,
+                                page->num_cols);
+    } else if (written) {
+      written = write_pgm_image(name, page->output[0], page->num_rows,
+                                page->num_cols, 255);
+    }
+    if (!written)
+      count_failure(pipeline);
+    queue_push(&pipeline->free_pages, page);
+  }
+
+  free(name);
+  return NULL;
+}
+
+/* -------------------------------- Pipeline -------------------------------- */
+
+/*
+ * Frees the queues and the page pool of a pipeline, including a partially
+ * set up one.
+ */
+static void release_pipeline(struct batch_pipeline *pipeline) {
+  if (pipeline->pages != NULL) {
+    for (int i = 0; i < pipeline->num_pages; i++)
+      free_sauvola_context(&pipeline->pages[i].context);
+  }
+  free(pipeline->pages);
+  free(pipeline->name_owners);
+  queue_destroy(&pipeline->free_pages);
+  queue_destroy(&pipeline->decoded);
+  queue_destroy(&pipeline->thresholded);
+  pthread_mutex_destroy(&pipeline->lock);
+  free_batch_inputs(pipeline->file_names, pipeline->num_files);
+}
+
+/*
+ * Starts count threads running start. Returns the number actually started.
+ */
+static int start_stage(pthread_t *threads, int count, void *(*start)(void *),
+                       struct batch_pipeline *pipeline) {
+  int i;
+
+  for (i = 0; i < count; i++) {
+    if (pthread_create(&threads[i], NULL, start, pipeline) != 0)
+      break;
+  }
+
+  return i;
+}
+
+static void join_stage(pthread_t *threads, int count) {
+  for (int i = 0; i < count; i++)
+    pthread_join(threads[i], NULL);
+}
+
+/**
+ * Binarizes every image of a directory or manifest, see list_batch_inputs,
+ * with the integral image Sauvola algorithm and writes the results as PGM
+ * images, or PBM images with options->pbm_output, with the same base names to
+ * output_directory, which is created if it does not exist. Images that cannot
+ * be read or written are counted as failed and skipped, and so are images
+ * whose base name was already taken by an earlier input of the list.
+ *
+ * @param options The worker counts and queue capacity, or NULL for the
+ * defaults: one reader, one worker per processor, one writer and two queued
+ * pages per worker.
+ * @param report Receives the page counts and the throughput.
+ * @return 1 if the batch ran, 0 if the inputs cannot be listed, the output
+ * directory cannot be created or the pipeline cannot be started.
+ */
+int sauvola_batch(const char *source, const char *output_directory,
+                  const struct batch_options *options,
+                  struct batch_report *report) {
+  struct batch_pipeline pipeline;
+  pthread_t *threads;
+  int num_readers = 1, num_workers = default_thread_count();
+  int num_writers = 1, queue_capacity = 0;
+  int started_readers, started_workers, started_writers;
+  int result = 1;
+  double start_time;
+
+  memset(&pipeline, 0, sizeof(pipeline));
+  pipeline.r = BATCH_DEFAULT_RADIUS;
+  if (options != NULL) {
+    if (options->num_readers > 0)
+      num_readers = options->num_readers;
+    if (options->num_workers > 0)
+      num_workers = options->num_workers;
+    if (options->num_writers > 0)
+      num_writers = options->num_writers;
+    if (options->queue_capacity > 0)
+      queue_capacity = options->queue_capacity;
+    if (options->r > 0)
+      pipeline.r = options->r;
+    pipeline.pbm_output = options->pbm_output;
+  }
+  if (queue_capacity == 0)
+    queue_capacity = 2 * num_workers;
+
+  if (mkdir(output_directory, 0755) != 0 && errno != EEXIST)
+    return 0;
+  if (!list_batch_inputs(source, &pipeline.file_names, &pipeline.num_files))
+    return 0;
+
+  pipeline.output_directory = output_directory;
+  pipeline.level = detect_simd_level();
+  pthread_mutex_init(&pipeline.lock, NULL);
+
+  // Enough pages to fill both queues and keep every thread busy
+  pipeline.num_pages =
+      2 * queue_capacity + num_readers + num_workers + num_writers;
+  pipeline.pages =
+      (struct page *)calloc(pipeline.num_pages, sizeof(struct page));
+  pipeline.name_owners =
+      (int *)malloc((pipeline.num_files + 1) * sizeof(int));
+  threads = (pthread_t *)malloc((num_readers + num_workers + num_writers) *
+                                sizeof(pthread_t));
+  if (threads == NULL || pipeline.pages == NULL ||
+      pipeline.name_owners == NULL ||
+      !find_output_name_owners(pipeline.file_names, pipeline.num_files,
+                               pipeline.name_owners) ||
+      !queue_init(&pipeline.free_pages, pipeline.num_pages) ||
+      !queue_init(&pipeline.decoded, queue_capacity) ||
+      !queue_init(&pipeline.thresholded, queue_capacity)) {
+    free(threads);
+    release_pipeline(&pipeline);
+    return 0;
+  }
+  for (int i = 0; i < pipeline.num_pages; i++) {
+    init_sauvola_context(&pipeline.pages[i].context);
+    queue_push(&pipeline.free_pages, &pipeline.pages[i]);
+  }
+
+  start_time = wall_time_ms();
+
+  // Consumers are started before their producers, so a producer never waits
+  // on a queue nobody drains
+  started_writers = start_stage(threads + num_readers + num_workers,
+                                num_writers, writer_main, &pipeline);
+  started_workers = started_writers > 0
+                        ? start_stage(threads + num_readers, num_workers,
+                                      worker_main, &pipeline)
+                        : 0;
+  started_readers =
+      started_workers > 0
+          ? start_stage(threads, num_readers, reader_main, &pipeline)
+          : 0;
+  result = started_readers > 0;
+
+  // Each queue is closed once every thread feeding it has finished
+  join_stage(threads, started_readers);
+  queue_close(&pipeline.decoded);
+  join_stage(threads + num_readers, started_workers);
+  queue_close(&pipeline.thresholded);
+  join_stage(threads + num_readers + num_workers, started_writers);
+
+  report->num_pages = pipeline.num_files;
+  report->num_failed = pipeline.num_failed;
+  report->elapsed_ms = wall_time_ms() - start_time;
+  report->pages_per_second =
+      report->elapsed_ms > 0
+          ? (report->num_pages - report->num_failed) * 1000.0 /
+                report->elapsed_ms
+          : 0;
+
+  free(threads);
+  release_pipeline(&pipeline);
+
+  return result;
+}
@@ -0,0 +1,221 @@
+#include "context.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* -------------------------------------------------------------------------- */
+/*                           Reusable Buffer Context                          */
+/* -------------------------------------------------------------------------- */
+
+/**
+ * Initializes an empty context. No memory is allocated until a buffer is
+ * requested.
+ */
+void init_sauvola_context(struct sauvola_context *context) {
+  memset(context, 0, sizeof(*context));
+}
+
+/**
+ * Frees every buffer held by a context.
+ */
+void free_sauvola_context(struct sauvola_context *context) {
+  free(context->grayscale.data);
+  free(context->grayscale.rows);
+  free(context->grayscale16.data);
+  free(context->grayscale16.rows);
+  free(context->output.data);
+  free(context->output.rows);
+  free(context->output_images);
+  free(context->integral_image.buffer);
+  free(context->mapped_rows);
+  if (context->pool_threads > 0)
+    worker_pool_free(&context->pool);
+  free_packed_scratch(&context->packed_scratch);
+  free_tiled_scratch(&context->tiled_scratch);
+  free_sweep_scratch(&context->sweep_scratch);
+  free_approximate_scratch(&context->approximate_scratch);
+  init_sauvola_context(context);
+}
+
+/*
+ * Grows an array of row pointers to at least num_rows entries. Returns 0 if
+ * the memory cannot be allocated.
+ */
+static int reserve_rows(struct sauvola_context *context, unsigned char ***rows,
+                        int *row_capacity, int num_rows) {
+  unsigned char **grown;
+
+  if (*row_capacity >= num_rows)
+    return 1;
+
+  grown = (unsigned char **)malloc(num_rows * sizeof(unsigned char *));
+  if (grown == NULL)
+    return 0;
+  free(*rows);
+  *rows = grown;
+  *row_capacity = num_rows;
+  context->num_allocations++;
+
+  return 1;
+}
+
+/*
+ * Returns the rows of an image buffer sized for num_rows x num_cols pixels of
+ * pixel_size bytes, growing it if needed. A grown buffer is written once, so
+ * its pages are faulted in here rather than in the middle of a kernel.
+ * Returns NULL if the memory cannot be allocated.
+ */
+static unsigned char **reserve_image(struct sauvola_context *context,
+                                     struct image_buffer *image, int num_rows,
+                                     int num_cols, size_t pixel_size) {
+  size_t row_size = (size_t)num_cols * pixel_size;
+  size_t size = num_rows * row_size;
+  void *data;
+
+  if (image->capacity < size) {
+    if (posix_memalign(&data, 64, size))
+      return NULL;
+    memset(data, 0, size);
+    free(image->data);
+    image->data = (unsigned char *)data;
+    image->capacity = size;
+    context->num_allocations++;
+  }
+
+  if (!reserve_rows(context, &image->rows, &image->row_capacity, num_rows))
+    return NULL;
+
+  for (int i = 0; i < num_rows; i++) {
+    image->rows[i] = image->data + i * row_size;
+  }
+
+  return image->rows;
+}
+
+/**
+ * Returns a num_rows x num_cols grayscale array owned by the context. Its
+ * contents are undefined. Returns NULL if the memory cannot be allocated.
+ */
+unsigned char **context_grayscale(struct sauvola_context *context,
+                                  int num_rows, int num_cols) {
+  return reserve_image(context, &context->grayscale, num_rows, num_cols, 1);
+}
+
+/**
+ * Returns a num_rows x num_cols array of 16-bit samples owned by the context.
+ * Its contents are undefined. Returns NULL if the memory cannot be allocated.
+ */
+unsigned short **context_grayscale16(struct sauvola_context *context,
+                                     int num_rows, int num_cols) {
+  return (unsigned short **)reserve_image(context, &context->grayscale16,
+                                          num_rows, num_cols,
+                                          sizeof(unsigned short));
+}
+
+/**
+ * Returns a num_rows x num_cols output array owned by the context. Its
+ * contents are undefined. Returns NULL if the memory cannot be allocated.
+ */
+unsigned char **context_output(struct sauvola_context *context, int num_rows,
+                               int num_cols) {
+  return reserve_image(context, &context->output, num_rows, num_cols, 1);
+}
+
+/**
+ * Returns num_images num_rows x num_cols output arrays owned by the context,
+ * as consecutive images of its output buffer, for the outputs of a sweep.
+ * Their contents are undefined. Returns NULL if the memory cannot be
+ * allocated.
+ */
+unsigned char ***context_output_images(struct sauvola_context *context,
+                                       int num_images, int num_rows,
+                                       int num_cols) {
+  unsigned char **rows =
+      context_output(context, num_images * num_rows, num_cols);
+  unsigned char ***images;
+
+  if (rows == NULL)
+    return NULL;
+
+  if (context->output_image_capacity < num_images) {
+    images = (unsigned char ***)malloc(num_images * sizeof(unsigned char **));
+    if (images == NULL)
+      return NULL;
+    free(context->output_images);
+    context->output_images = images;
+    context->output_image_capacity = num_images;
+    context->num_allocations++;
+  }
+
+  for (int n = 0; n < num_images; n++) {
+    context->output_images[n] = rows + (size_t)n * num_rows;
+  }
+
+  return context->output_images;
+}
+
+/**
+ * Returns an array of num_rows row pointers owned by the context, for the
+ * rows of a mapped image, see map_pnm_image. Its contents are undefined.
+ * Returns NULL if the memory cannot be allocated.
+ */
+unsigned char **context_row_pointers(struct sauvola_context *context,
+                                     int num_rows) {
+  if (!reserve_rows(context, &context->mapped_rows,
+                    &context->mapped_row_capacity, num_rows))
+    return NULL;
+
+  return context->mapped_rows;
+}
+
+/**
+ * Returns a pool of num_threads workers owned by the context. It is started
+ * on first use and only restarted when num_threads changes, so the flows do
+ * not start and join threads for every image. Returns NULL if the pool cannot
+ * be started.
+ *
+ * @param num_threads Values below 1 select one thread per online processor.
+ */
+struct worker_pool *context_worker_pool(struct sauvola_context *context,
+                                        int num_threads) {
+  if (num_threads < 1)
+    num_threads = default_thread_count();
+  if (context->pool_threads == num_threads)
+    return &context->pool;
+
+  if (context->pool_threads > 0)
+    worker_pool_free(&context->pool);
+  context->pool_threads = 0;
+  if (!worker_pool_init(&context->pool, num_threads))
+    return NULL;
+  context->pool_threads = num_threads;
+  context->num_allocations++;
+
+  return &context->pool;
+}
+
+/**
+ * Returns a planar integral image owned by the context with the narrowest
+ * safe element widths, see choose_integral_widths. Returns NULL if the memory
+ * cannot be allocated.
+ */
+struct integral_image *context_integral_image(struct sauvola_context *context,
+                                              int num_rows, int num_cols,
+                                              int max_color, int r) {
+  struct integral_image *integral_image = &context->integral_image;
+  size_t old_size = integral_image->buffer_size;
+  int sum_bits, sum_squares_bits;
+
+  choose_integral_widths(num_rows, num_cols, max_color, r, &sum_bits,
+                         &sum_squares_bits);
+  if (!reserve_integral_image(integral_image, num_rows, num_cols,
+                              INTEGRAL_PLANAR, sum_bits, sum_squares_bits))
+    return NULL;
+
+  // Fault in a grown buffer up front
+  if (integral_image->buffer_size != old_size) {
+    memset(integral_image->buffer, 0, integral_image->buffer_size);
+    context->num_allocations++;
+  }
+
+  return integral_image;
+}
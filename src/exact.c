@@ -0,0 +1,187 @@
+#include "exact.h"
+#include "parallel.h"
+#include "tools.h"
+#include <math.h>
+#include <stdlib.h>
+
+/* -------------------------------------------------------------------------- */
+/*                      Exact Integer Sauvola Decision                        */
+/* -------------------------------------------------------------------------- */
+
+/*
+ * With k = kn / kd and R = Rn / Rd, a window of n pixels with sum S and sum
+ * of squares Q has mean S / n and standard deviation sqrt(D) / n, where
+ * D = n Q - S^2. Multiplying the test g > m (1 - k) + (m k / R) s by the
+ * positive n^2 kd Rn turns it into
+ *
+ *   A > B sqrt(D), with A = n Rn (n g kd - S (kd - kn)) and B = S kn Rd,
+ *
+ * in integers only. For B >= 0 this holds if A > 0 and A^2 > B^2 D, for B < 0
+ * if A > 0 or A^2 < B^2 D. The squares are compared in 128 bits, so the
+ * decision is exact: it does not depend on the rounding of the machine or on
+ * -ffast-math, and gives the same output everywhere.
+ */
+
+// Rows per band handed to the thread pool
+#define EXACT_BAND_ROWS 16
+
+// Largest magnitude allowed for A and for B^2 D
+#define EXACT_A_LIMIT 0x1p63L
+#define EXACT_PRODUCT_LIMIT 0x1p127L
+
+struct sauvola_exact_job {
+  unsigned char **grayscale;
+  struct integral_image *integral_image;
+  unsigned char **output;
+  int num_cols;
+  int num_rows;
+  struct sauvola_rational k;
+  int r;
+  struct sauvola_rational R;
+};
+
+/**
+ * Returns 1 if the exact decision can be used for the given parameters and
+ * image size, 0 if a denominator or R is not positive or a window is so large
+ * that A^2 or B^2 D could overflow 128 bits. A has to stay below 2^63 and
+ * B^2 D below 2^127, so the largest radius shrinks as the numerators and
+ * denominators of k and R grow: with k = 1/2 and R = 255 windows of up to
+ * 2621 x 2621 pixels (r up to 1310) are supported, with k = 1/10 and R = 255
+ * r up to 825. Images smaller than the window only count with their own size.
+ */
+int sauvola_exact_supported(struct sauvola_rational k, int r,
+                            struct sauvola_rational R, int num_rows,
+                            int num_cols) {
+  long double max_rows = 2 * r + 1 < num_rows ? 2 * r + 1 : num_rows;
+  long double max_cols = 2 * r + 1 < num_cols ? 2 * r + 1 : num_cols;
+  long double n = max_rows * max_cols;
+  long double max_pixel = SAUVOLA_MAX_PIXEL;
+  long double a_bound, b_bound, d_bound;
+
+  if (k.den <= 0 || R.den <= 0 || R.num <= 0)
+    return 0;
+
+  a_bound = n * n * R.num * max_pixel *
+            ((long double)k.den + fabsl((long double)k.den - k.num));
+  b_bound = n * max_pixel * fabsl((long double)k.num) * R.den;
+  d_bound = n * n * max_pixel * max_pixel / 4;
+
+  return a_bound < EXACT_A_LIMIT && b_bound * b_bound * d_bound <
+                                        EXACT_PRODUCT_LIMIT;
+}
+
+/*
+ * Thresholds the pixels of row i with the exact decision.
+ */
+static void sauvola_exact_span(unsigned char **grayscale,
+                               struct integral_image *integral_image,
+                               unsigned char **output, int num_cols,
+                               int num_rows, struct sauvola_rational k, int r,
+                               struct sauvola_rational R, int i) {
+  int top = i - r > 0 ? i - r : 0;
+  int bottom = i + r < num_rows - 1 ? i + r : num_rows - 1;
+  long long rows = bottom - top + 1;
+  long long kd_minus_kn = (long long)k.den - k.num;
+  long long kn_times_Rd = (long long)k.num * R.den;
+  __int128 sum, deviation, a, b;
+  unsigned __int128 a_squared, b_squared_deviation;
+  int white;
+
+  for (int j = 0; j < num_cols; j++) {
+    int left = j - r > 0 ? j - r : 0;
+    int right = j + r < num_cols - 1 ? j + r : num_cols - 1;
+    long long count = rows * (right - left + 1);
+
+    sum = integral_window_sum(integral_image, top, left, bottom, right);
+    deviation = (__int128)count * integral_window_sum_squares(
+                                      integral_image, top, left, bottom,
+                                      right) -
+                sum * sum;
+    a = (__int128)count * R.num *
+        ((__int128)count * grayscale[i][j] * k.den - sum * kd_minus_kn);
+    b = sum * kn_times_Rd;
+
+    a_squared = (unsigned __int128)(a < 0 ? -a : a) * (a < 0 ? -a : a);
+    b_squared_deviation = (unsigned __int128)(b * b) * deviation;
+
+    if (b >= 0)
+      white = a > 0 && a_squared > b_squared_deviation;
+    else
+      white = a > 0 || a_squared < b_squared_deviation;
+
+    output[i][j] = white ? 255 : 0;
+  }
+}
+
+/**
+ * Binarizes the rows in [row_begin, row_end) with the Sauvola algorithm, k and
+ * R given as rationals, deciding every pixel in integer arithmetic only. The
+ * result is the exact Sauvola output; it matches
+ * sauvola_threshold_with_integral_image except for pixels that lie within
+ * rounding error of the threshold, where the floating point result depends on
+ * the machine. The integral image has to cover the whole image.
+ *
+ * @return 1 on success, 0 if the parameters are not supported, which happens
+ * for radii beyond about 1300 with k = 1/2 and R = 255 and for smaller ones
+ * with larger numerators or denominators, see sauvola_exact_supported.
+ */
+int sauvola_threshold_exact_rows(unsigned char **grayscale,
+                                 struct integral_image *integral_image,
+                                 unsigned char **output, int num_cols,
+                                 int num_rows, struct sauvola_rational k, int r,
+                                 struct sauvola_rational R, int row_begin,
+                                 int row_end) {
+  if (!sauvola_exact_supported(k, r, R, num_rows, num_cols))
+    return 0;
+
+  for (int i = row_begin; i < row_end; i++) {
+    sauvola_exact_span(grayscale, integral_image, output, num_cols, num_rows, k,
+                       r, R, i);
+  }
+
+  return 1;
+}
+
+static void sauvola_exact_band_task(void *context, int task_index,
+                                    int worker_index) {
+  struct sauvola_exact_job *job = (struct sauvola_exact_job *)context;
+  int row_begin = task_index * EXACT_BAND_ROWS;
+  int row_end = fmin(row_begin + EXACT_BAND_ROWS, job->num_rows);
+
+  for (int i = row_begin; i < row_end; i++) {
+    sauvola_exact_span(job->grayscale, job->integral_image, job->output,
+                       job->num_cols, job->num_rows, job->k, job->r, job->R,
+                       i);
+  }
+}
+
+/**
+ * Multithreaded version of sauvola_threshold_exact_rows over the whole image.
+ * Every pixel is decided independently of the others, so the output does not
+ * depend on the number of threads.
+ *
+ * @param num_threads The number of threads to use. Values below 1 select one
+ * thread per online processor.
+ * @return 1 on success, 0 if the parameters are not supported, see
+ * sauvola_exact_supported.
+ */
+int sauvola_threshold_exact(unsigned char **grayscale,
+                            struct integral_image *integral_image,
+                            unsigned char **output, int num_cols, int num_rows,
+                            struct sauvola_rational k, int r,
+                            struct sauvola_rational R, int num_threads) {
+  struct sauvola_exact_job job = {grayscale, integral_image, output, num_cols,
+                                  num_rows,  k,              r,      R};
+  int num_bands = (num_rows + EXACT_BAND_ROWS - 1) / EXACT_BAND_ROWS;
+
+  if (!sauvola_exact_supported(k, r, R, num_rows, num_cols))
+    return 0;
+
+  if (!parallel_for(num_bands, num_threads, sauvola_exact_band_task, &job)) {
+    for (int i = 0; i < num_bands; i++) {
+      sauvola_exact_band_task(&job, i, 0);
+    }
+  }
+
+  return 1;
+}
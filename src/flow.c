@@ -1,122 +1,556 @@
+#include "approximate.h"
+#include "context.h"
+#include "instrument.h"
+#include "integral.h"
+#include "mapped.h"
+#include "pbm.h"
 #include "pgm.h"
+#include "pgm16.h"
 #include "sauvola.h"
+#include "stream.h"
+#include "sweep.h"
+#include "tiled.h"
 #include "tools.h"
 #include <ctype.h>
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 
 /* -------------------------------------------------------------------------- */
 /*                                Program Flows                               */
 /* -------------------------------------------------------------------------- */
 
+/**
+ * Reads a PGM image, binarizes it with the direct Sauvola algorithm on
+ * num_threads threads and writes the result. Returns the wall time of the
+ * thresholding in milliseconds.
+ *
+ * @param context The context whose buffers are reused, or NULL to allocate
+ * them for this call only.
+ */
 double pgm_sauvola_flow(const char *input_file_name,
-                        const char *output_file_name, int r) {
+                        const char *output_file_name, float k, int r, float R,
+                        int num_threads, struct sauvola_context *context) {
   int num_rows, num_cols;
-  int max_color;
-  int header_length, i, j;
-  clock_t start_time, end_time;
+  struct mapped_image image;
+  struct sauvola_context local_context;
+  double start_time, end_time;
   double elapsed_time;
 
-  // Read header to get dimensions and max color value
-  if ((header_length = read_pgm_header(input_file_name, &num_rows, &num_cols,
-                                       &max_color)) <= 0)
-    exit(1);
-
-  // Allocate memory for grayscale array
-  unsigned char **grayscale = alloc_2D_unsigned_char(num_rows, num_cols);
+  // Use a context of our own if the caller does not reuse one
+  if (context == NULL) {
+    init_sauvola_context(&local_context);
+    context = &local_context;
+  }
 
-  // read PGM image data
-  if (read_pgm_data(grayscale[0], input_file_name, header_length, num_rows,
-                    num_cols, max_color) == 0)
-    ;
+  // Map the image, its rows are used in place as the grayscale array
+  if (!map_pnm_image(input_file_name, &image, context) ||
+      image.channels != 1 || image.max_color > 255)
+    exit(1);
+  num_rows = image.num_rows;
+  num_cols = image.num_cols;
+  unsigned char **grayscale = image.rows;
 
-  // Allocate memory for output array
-  unsigned char **output = alloc_2D_unsigned_char(num_rows, num_cols);
+  // Take the output array and the workers from the context
+  unsigned char **output = context_output(context, num_rows, num_cols);
+  struct worker_pool *pool = context_worker_pool(context, num_threads);
+  if (output == NULL || pool == NULL)
+    exit(1);
 
   // start timing
-  start_time = clock();
+  start_time = wall_time_ms();
 
   // Sauvola threshold
-  sauvola_threshold(grayscale, output, num_cols, num_rows, 0.5, r, 255);
+  INSTRUMENT_BEGIN(probe);
+  sauvola_threshold_pooled(grayscale, output, num_cols, num_rows, k, r, R,
+                           pool);
+  INSTRUMENT_END(probe, STAGE_THRESHOLD, 2L * num_rows * num_cols,
+                 (long)num_rows * num_cols);
 
   // end timing
-  end_time = clock();
+  end_time = wall_time_ms();
 
   // calculate elapsed time in milliseconds
-  elapsed_time = ((double)(end_time - start_time) / CLOCKS_PER_SEC) * 1000.0;
+  elapsed_time = end_time - start_time;
 
   // write pgm file
   if (write_pgm_image(output_file_name, output[0], num_rows, num_cols, 255) ==
       0)
     exit(1);
 
-  free(grayscale[0]);
-  free(grayscale);
-  free(output[0]);
-  free(output);
+  unmap_pnm_image(&image);
+  if (context == &local_context)
+    free_sauvola_context(&local_context);
 
   return elapsed_time;
 }
 
+/*
+ * Binarizes a mapped 16-bit PGM image: the samples are swapped into native
+ * order in a buffer of the context, their integral image, which has to be
+ * laid out for the max color value of the image, is built and the image is
+ * thresholded with R scaled to it. Returns 0 if the samples cannot be
+ * allocated, otherwise 1.
+ */
+static int threshold_pgm16(struct mapped_image *image,
+                           struct sauvola_context *context,
+                           struct integral_image *integral_image,
+                           unsigned char **output, float k, int r, float R,
+                           struct worker_pool *pool) {
+  int num_rows = image->num_rows, num_cols = image->num_cols;
+  unsigned short **grayscale = context_grayscale16(context, num_rows, num_cols);
+
+  if (grayscale == NULL)
+    return 0;
+
+  load_pgm16_with_integral_image(image->rows, grayscale, integral_image,
+                                 num_cols, num_rows, pool);
+
+  INSTRUMENT_BEGIN(probe);
+  sauvola_threshold_16_with_integral_image_pooled(
+      grayscale, integral_image, output, num_cols, num_rows, k, r,
+      sauvola_R_for_max_color(R, image->max_color), pool);
+  INSTRUMENT_END(probe, STAGE_THRESHOLD, 3L * num_rows * num_cols,
+                 (long)num_rows * num_cols);
+
+  return 1;
+}
+
+/**
+ * Reads a PGM image, binarizes it with the integral image Sauvola algorithm on
+ * num_threads threads and writes the result. Returns the wall time of the
+ * integral image computation and the thresholding in milliseconds.
+ *
+ * 16-bit images, with a max color value above 255, are read natively, see
+ * pgm16.h. R is given for 8-bit images and scaled to their max color value.
+ *
+ * @param context The context whose buffers are reused, or NULL to allocate
+ * them for this call only.
+ */
 double pgm_sauvola_flow_with_integral_image(const char *input_file_name,
                                             const char *output_file_name,
-                                            int r) {
+                                            float k, int r, float R,
+                                            int num_threads,
+                                            struct sauvola_context *context) {
   int num_rows, num_cols;
   int max_color;
-  int header_length, i, j;
-  clock_t start_time, end_time;
+  struct mapped_image image;
+  struct sauvola_context local_context;
+  double start_time, end_time;
   double elapsed_time;
 
-  // Read header to get dimensions and max color value
-  if ((header_length = read_pgm_header(input_file_name, &num_rows, &num_cols,
-                                       &max_color)) <= 0)
+  // Use a context of our own if the caller does not reuse one
+  if (context == NULL) {
+    init_sauvola_context(&local_context);
+    context = &local_context;
+  }
+
+  // Map the image, the rows of 8-bit images are used in place as the
+  // grayscale array
+  if (!map_pnm_image(input_file_name, &image, context) ||
+      image.channels != 1 || image.max_color > PGM16_MAX_COLOR)
+    exit(1);
+  num_rows = image.num_rows;
+  num_cols = image.num_cols;
+  max_color = image.max_color;
+  unsigned char **grayscale = image.rows;
+
+  // Take the output array from the context
+  unsigned char **output = context_output(context, num_rows, num_cols);
+  if (output == NULL)
     exit(1);
 
-  // Allocate memory for grayscale array
-  unsigned char **grayscale = alloc_2D_unsigned_char(num_rows, num_cols);
+  // Take the integral image and the workers from the context
+  struct integral_image *integral_image =
+      context_integral_image(context, num_rows, num_cols, max_color, r);
+  struct worker_pool *pool = context_worker_pool(context, num_threads);
+  if (integral_image == NULL || pool == NULL)
+    exit(1);
 
-  // read PGM image data
-  if (read_pgm_data(grayscale[0], input_file_name, header_length, num_rows,
-                    num_cols, max_color) == 0)
-    ;
+  // start timing
+  start_time = wall_time_ms();
 
-  // Allocate memory for output array
-  unsigned char **output = alloc_2D_unsigned_char(num_rows, num_cols);
+  if (max_color > 255) {
+    if (!threshold_pgm16(&image, context, integral_image, output, k, r, R,
+                         pool))
+      exit(1);
+  } else {
+    // Calculate integral image
+    compute_integral_image_pooled(grayscale, integral_image, num_cols,
+                                  num_rows, pool);
 
-  // Allocate memory for integral image 3D array
-  unsigned long long ***integral_image =
-      alloc_integral_image(num_rows, num_cols);
+    // Sauvola threshold
+    INSTRUMENT_BEGIN(probe);
+    sauvola_threshold_with_integral_image_pooled(grayscale, integral_image,
+                                                 output, num_cols, num_rows, k,
+                                                 r, R, pool);
+    INSTRUMENT_END(probe, STAGE_THRESHOLD, 2L * num_rows * num_cols,
+                   (long)num_rows * num_cols);
+  }
 
-  // start timing
-  start_time = clock();
+  // end timing
+  end_time = wall_time_ms();
 
-  // Calculate integral image
-  compute_integral_image(grayscale, integral_image, num_cols, num_rows);
+  // calculate elapsed time in milliseconds
+  elapsed_time = end_time - start_time;
 
-  // Sauvola threshold
-  sauvola_threshold_with_integral_image(grayscale, integral_image, output,
-                                        num_cols, num_rows, 0.5, r, 255);
+  // write pgm file
+  if (write_pgm_image(output_file_name, output[0], num_rows, num_cols, 255) ==
+      0)
+    exit(1);
+
+  unmap_pnm_image(&image);
+  if (context == &local_context)
+    free_sauvola_context(&local_context);
+
+  return elapsed_time;
+}
+
+/**
+ * Reads a PGM image, binarizes it tile by tile with the integral image Sauvola
+ * algorithm on num_threads threads and writes the result. The tile size is
+ * chosen from the L2 cache size. Returns the wall time of the thresholding,
+ * integral images included, in milliseconds.
+ *
+ * @param context The context whose buffers are reused, or NULL to allocate
+ * them for this call only.
+ */
+double pgm_sauvola_flow_tiled(const char *input_file_name,
+                              const char *output_file_name, float k, int r,
+                              float R, int num_threads,
+                              struct sauvola_context *context) {
+  int num_rows, num_cols;
+  struct mapped_image image;
+  struct sauvola_context local_context;
+  double start_time, end_time;
+  double elapsed_time;
+
+  // Use a context of our own if the caller does not reuse one
+  if (context == NULL) {
+    init_sauvola_context(&local_context);
+    context = &local_context;
+  }
+
+  // Map the image, its rows are used in place as the grayscale array
+  if (!map_pnm_image(input_file_name, &image, context) ||
+      image.channels != 1 || image.max_color > 255)
+    exit(1);
+  num_rows = image.num_rows;
+  num_cols = image.num_cols;
+  unsigned char **grayscale = image.rows;
+
+  // Take the output array and the workers from the context
+  unsigned char **output = context_output(context, num_rows, num_cols);
+  struct worker_pool *pool = context_worker_pool(context, num_threads);
+  if (output == NULL || pool == NULL)
+    exit(1);
+
+  // start timing
+  start_time = wall_time_ms();
+
+  // Sauvola threshold, integral images of the tiles included
+  INSTRUMENT_BEGIN(probe);
+  sauvola_threshold_tiled_pooled(grayscale, output, num_cols, num_rows, k, r,
+                                 R, 0, 0, pool, &context->tiled_scratch);
+  INSTRUMENT_END(probe, STAGE_THRESHOLD, 2L * num_rows * num_cols,
+                 (long)num_rows * num_cols);
 
   // end timing
-  end_time = clock();
+  end_time = wall_time_ms();
 
   // calculate elapsed time in milliseconds
-  elapsed_time = ((double)(end_time - start_time) / CLOCKS_PER_SEC) * 1000.0;
+  elapsed_time = end_time - start_time;
 
   // write pgm file
   if (write_pgm_image(output_file_name, output[0], num_rows, num_cols, 255) ==
       0)
     exit(1);
 
-  free(grayscale[0]);
-  free(grayscale);
-  free(output[0]);
-  free(output);
-  free(integral_image[0][0]);
-  free(integral_image[0]);
-  free(integral_image);
+  unmap_pnm_image(&image);
+  if (context == &local_context)
+    free_sauvola_context(&local_context);
+
+  return elapsed_time;
+}
+
+/*
+ * Size of the stdio buffers used by the streaming flow. Large buffers let the
+ * kernel issue few, big reads and writes while the rows are processed.
+ */
+#define STREAM_BUFFER_SIZE (1 << 20)
+
+/**
+ * Reads a PGM image row by row, binarizes it with the streaming sliding-window
+ * Sauvola algorithm and writes every output row as soon as it is final. Memory
+ * use depends on the width and the radius only, so images of any height can
+ * be processed. A file name of "-" selects standard input or standard output.
+ * Only 8-bit images are supported. Returns the wall time of the whole flow in
+ * milliseconds.
+ */
+double pgm_sauvola_flow_streaming(const char *input_file_name,
+                                  const char *output_file_name, float k, int r,
+                                  float R) {
+  int num_rows, num_cols;
+  int max_color;
+  double start_time, end_time;
+  FILE *input, *output;
+
+  // start timing, reading and writing overlap with the thresholding
+  start_time = wall_time_ms();
+
+  // Open the input and read the header
+  input = strcmp(input_file_name, "-") == 0 ? stdin
+                                             : fopen(input_file_name, "rb");
+  if (input == NULL)
+    exit(1);
+  setvbuf(input, NULL, _IOFBF, STREAM_BUFFER_SIZE);
+  // The stream is read one byte per pixel, so 16-bit images are rejected
+  if (!read_pgm_header_stream(input, &num_rows, &num_cols, &max_color) ||
+      max_color > 255)
+    exit(1);
+
+  // Open the output and write the header
+  output = strcmp(output_file_name, "-") == 0 ? stdout
+                                               : fopen(output_file_name, "wb");
+  if (output == NULL)
+    exit(1);
+  setvbuf(output, NULL, _IOFBF, STREAM_BUFFER_SIZE);
+  write_pgm_header(output, num_rows, num_cols, 255);
+
+  // Sauvola threshold, reading and writing included
+  INSTRUMENT_BEGIN(probe);
+  if (!sauvola_threshold_stream(input, output, num_rows, num_cols, k, r, R))
+    exit(1);
+  INSTRUMENT_END(probe, STAGE_THRESHOLD, 2L * num_rows * num_cols,
+                 (long)num_rows * num_cols);
+
+  if (input != stdin)
+    fclose(input);
+  if (output != stdout)
+    fclose(output);
+  else
+    fflush(output);
+
+  // end timing
+  end_time = wall_time_ms();
+
+  return end_time - start_time;
+}
+
+/**
+ * Reads a PGM image, binarizes it with the integral image Sauvola algorithm on
+ * num_threads threads straight into packed rows and writes them as a PBM
+ * image. Returns the wall time of the integral image computation and the
+ * thresholding in milliseconds.
+ *
+ * @param context The context whose buffers are reused, or NULL to allocate
+ * them for this call only. The packed rows are kept in its output buffer.
+ */
+double pgm_sauvola_flow_pbm(const char *input_file_name,
+                            const char *output_file_name, float k, int r,
+                            float R, int num_threads,
+                            struct sauvola_context *context) {
+  int num_rows, num_cols;
+  struct mapped_image image;
+  struct sauvola_context local_context;
+  double start_time, elapsed_time;
+
+  // Use a context of our own if the caller does not reuse one
+  if (context == NULL) {
+    init_sauvola_context(&local_context);
+    context = &local_context;
+  }
+
+  // Map the image, its rows are used in place as the grayscale array
+  if (!map_pnm_image(input_file_name, &image, context) ||
+      image.channels != 1 || image.max_color > 255)
+    exit(1);
+  num_rows = image.num_rows;
+  num_cols = image.num_cols;
+  unsigned char **grayscale = image.rows;
+
+  // Packed output rows, the integral image and the workers come from the
+  // context
+  unsigned char **packed =
+      context_output(context, num_rows, packed_row_bytes(num_cols));
+  struct integral_image *integral_image = context_integral_image(
+      context, num_rows, num_cols, image.max_color, r);
+  struct worker_pool *pool = context_worker_pool(context, num_threads);
+  if (packed == NULL || integral_image == NULL || pool == NULL)
+    exit(1);
+
+  start_time = wall_time_ms();
+
+  compute_integral_image_pooled(grayscale, integral_image, num_cols, num_rows,
+                                pool);
+  INSTRUMENT_BEGIN(probe);
+  if (!sauvola_threshold_with_integral_image_packed_pooled(
+          grayscale, integral_image, packed, num_cols, num_rows, k, r, R, pool,
+          &context->packed_scratch))
+    exit(1);
+  INSTRUMENT_END(probe, STAGE_THRESHOLD,
+                 (long)num_rows * (num_cols + packed_row_bytes(num_cols)),
+                 (long)num_rows * num_cols);
+
+  elapsed_time = wall_time_ms() - start_time;
+
+  if (write_pbm_image(output_file_name, packed[0], num_rows, num_cols) == 0)
+    exit(1);
+
+  unmap_pnm_image(&image);
+  if (context == &local_context)
+    free_sauvola_context(&local_context);
+
+  return elapsed_time;
+}
+
+/**
+ * Reads a PGM image once and binarizes it with every parameter set of params
+ * from a single integral image, see sauvola_threshold_sweep, writing the
+ * result of params[n] to output_file_names[n]. Returns the wall time of the
+ * integral image computation and the thresholding in milliseconds.
+ *
+ * @param context The context whose buffers and workers are reused, or NULL to
+ * allocate them for this call only. All outputs are kept in its output
+ * buffer.
+ */
+double pgm_sauvola_flow_sweep(const char *input_file_name,
+                              const char *const *output_file_names,
+                              const struct sauvola_params *params,
+                              int num_params, int num_threads,
+                              struct sauvola_context *context) {
+  int num_rows, num_cols, n;
+  struct mapped_image image;
+  struct sauvola_context local_context;
+  double start_time, elapsed_time;
+
+  // Use a context of our own if the caller does not reuse one
+  if (context == NULL) {
+    init_sauvola_context(&local_context);
+    context = &local_context;
+  }
+
+  // Map the image, its rows are used in place as the grayscale array
+  if (!map_pnm_image(input_file_name, &image, context) ||
+      image.channels != 1 || image.max_color > 255)
+    exit(1);
+  num_rows = image.num_rows;
+  num_cols = image.num_cols;
+  unsigned char **grayscale = image.rows;
+
+  // The outputs are consecutive images in the context's output buffer, the
+  // integral image is sized for the largest radius
+  unsigned char ***outputs =
+      context_output_images(context, num_params, num_rows, num_cols);
+  struct integral_image *integral_image =
+      context_integral_image(context, num_rows, num_cols, image.max_color,
+                             sweep_max_radius(params, num_params));
+  struct worker_pool *pool = context_worker_pool(context, num_threads);
+  if (outputs == NULL || integral_image == NULL || pool == NULL)
+    exit(1);
+
+  start_time = wall_time_ms();
+
+  compute_integral_image_pooled(grayscale, integral_image, num_cols, num_rows,
+                                pool);
+  INSTRUMENT_BEGIN(probe);
+  if (!sauvola_threshold_sweep_pooled(grayscale, integral_image, outputs,
+                                      num_cols, num_rows, params, num_params,
+                                      pool, &context->sweep_scratch))
+    exit(1);
+  INSTRUMENT_END(probe, STAGE_THRESHOLD,
+                 (long)num_rows * num_cols * (1 + num_params),
+                 (long)num_rows * num_cols * num_params);
+
+  elapsed_time = wall_time_ms() - start_time;
+
+  for (n = 0; n < num_params; n++) {
+    if (write_pgm_image(output_file_names[n], outputs[n][0], num_rows,
+                        num_cols, 255) == 0)
+      exit(1);
+  }
+
+  unmap_pnm_image(&image);
+  if (context == &local_context)
+    free_sauvola_context(&local_context);
+
+  return elapsed_time;
+}
+
+/**
+ * Reads a PGM image, binarizes it with the approximate Sauvola algorithm on
+ * blocks of the largest step that disagrees with the exact output in at most
+ * a fraction max_disagreement of a sample of the pixels, see
+ * choose_decimation, and writes the result. Returns the wall time of choosing
+ * the step and thresholding in milliseconds.
+ *
+ * @param disagreement If not NULL, receives the fraction of pixels that
+ * differ from the exact output, see sauvola_disagreement_rate. Measuring it
+ * runs the exact algorithm as well and is not included in the time.
+ * @param context The context whose buffers are reused, or NULL to allocate
+ * them for this call only.
+ */
+double pgm_sauvola_flow_approximate(const char *input_file_name,
+                                    const char *output_file_name, float k,
+                                    int r, float R, double max_disagreement,
+                                    double *disagreement,
+                                    struct sauvola_context *context) {
+  int num_rows, num_cols;
+  struct mapped_image image;
+  struct sauvola_context local_context;
+  double start_time, elapsed_time;
+  int step;
+
+  // Use a context of our own if the caller does not reuse one
+  if (context == NULL) {
+    init_sauvola_context(&local_context);
+    context = &local_context;
+  }
+
+  // Map the image, its rows are used in place as the grayscale array
+  if (!map_pnm_image(input_file_name, &image, context) ||
+      image.channels != 1 || image.max_color > 255)
+    exit(1);
+  num_rows = image.num_rows;
+  num_cols = image.num_cols;
+  unsigned char **grayscale = image.rows;
+
+  // Take the output array from the context
+  unsigned char **output = context_output(context, num_rows, num_cols);
+  if (output == NULL)
+    exit(1);
+
+  start_time = wall_time_ms();
+
+  step = choose_decimation(grayscale, num_cols, num_rows, k, r, R,
+                           max_disagreement, &context->approximate_scratch);
+  if (step == 0)
+    exit(1);
+
+  INSTRUMENT_BEGIN(probe);
+  if (!sauvola_threshold_approximate_with_scratch(
+          grayscale, output, num_cols, num_rows, k, r, R, step,
+          detect_simd_level(), &context->approximate_scratch))
+    exit(1);
+  INSTRUMENT_END(probe, STAGE_THRESHOLD, 2L * num_rows * num_cols,
+                 (long)num_rows * num_cols);
+
+  elapsed_time = wall_time_ms() - start_time;
+
+  if (disagreement != NULL &&
+      (*disagreement = sauvola_disagreement_rate(grayscale, output, num_cols,
+                                                 num_rows, k, r, R)) < 0)
+    exit(1);
+
+  if (write_pgm_image(output_file_name, output[0], num_rows, num_cols, 255) ==
+      0)
+    exit(1);
+
+  unmap_pnm_image(&image);
+  if (context == &local_context)
+    free_sauvola_context(&local_context);
 
   return elapsed_time;
-}
\ No newline at end of file
+}
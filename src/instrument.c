@@ -0,0 +1,184 @@
+#include "instrument.h"
+
+#if SAUVOLA_INSTRUMENT
+
+#include "tools.h"
+#include <linux/perf_event.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* -------------------------------------------------------------------------- */
+/*                          Hot-Path Instrumentation                          */
+/* -------------------------------------------------------------------------- */
+
+/*
+ * The stage totals are global and updated with atomic additions, so probes
+ * can end on any thread. Hardware counters are opened once per thread, the
+ * first time the thread begins a stage, and closed when it exits. They are
+ * inherited by the threads started afterwards, whose counts are added to
+ * them when they are joined, which covers the thread pool of parallel_for.
+ * The threads of a worker_pool are only joined when the pool is freed, so
+ * the hardware counts of the stages it runs miss the work of its threads.
+ */
+
+enum { COUNTER_CYCLES, COUNTER_INSTRUCTIONS, COUNTER_CACHE_MISSES };
+
+#define NUM_COUNTERS 3
+
+struct stage_totals {
+  unsigned long long calls;
+  unsigned long long wall_ns;
+  unsigned long long bytes;
+  unsigned long long pixels;
+  unsigned long long counters[NUM_COUNTERS];
+  unsigned long long counted_calls; // calls with hardware counters
+};
+
+static struct stage_totals totals[NUM_STAGES];
+
+static const char *const stage_names[NUM_STAGES] = {
+    "header", "read", "gray", "integral", "threshold", "write"};
+
+static pthread_key_t counters_key;
+static pthread_once_t counters_once = PTHREAD_ONCE_INIT;
+
+static void close_counters(void *value) {
+  int *fds = (int *)value;
+
+  for (int c = 0; c < NUM_COUNTERS; c++) {
+    if (fds[c] >= 0)
+      close(fds[c]);
+  }
+  free(fds);
+}
+
+static void create_counters_key(void) {
+  pthread_key_create(&counters_key, close_counters);
+}
+
+static int open_counter(unsigned long long config) {
+  struct perf_event_attr attr;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HARDWARE;
+  attr.config = config;
+  attr.inherit = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+
+  return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/*
+ * Returns the counters of the calling thread, opening them on first use, or
+ * NULL if they are not available.
+ */
+static int *thread_counters(void) {
+  static const unsigned long long configs[NUM_COUNTERS] = {
+      PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+      PERF_COUNT_HW_CACHE_MISSES};
+  int *fds;
+
+  pthread_once(&counters_once, create_counters_key);
+  if ((fds = (int *)pthread_getspecific(counters_key)) == NULL) {
+    if ((fds = (int *)malloc(NUM_COUNTERS * sizeof(int))) == NULL)
+      return NULL;
+    for (int c = 0; c < NUM_COUNTERS; c++) {
+      fds[c] = open_counter(configs[c]);
+    }
+    pthread_setspecific(counters_key, fds);
+  }
+
+  return fds[0] >= 0 && fds[1] >= 0 && fds[2] >= 0 ? fds : NULL;
+}
+
+static int read_counters(unsigned long long *values) {
+  int *fds = thread_counters();
+
+  if (fds == NULL)
+    return 0;
+  for (int c = 0; c < NUM_COUNTERS; c++) {
+    if (read(fds[c], &values[c], sizeof(values[c])) != sizeof(values[c]))
+      return 0;
+  }
+
+  return 1;
+}
+
+/**
+ * Starts a stage on the calling thread.
+ */
+void stage_begin(struct stage_probe *probe) {
+  probe->has_counters = read_counters(probe->start_counters);
+  probe->start_ms = wall_time_ms();
+}
+
+/**
+ * Ends the stage started with probe and adds its time, bytes and pixels and
+ * its hardware counts to the totals of stage.
+ */
+void stage_end(struct stage_probe *probe, enum instrument_stage stage,
+               unsigned long long bytes, unsigned long long pixels) {
+  struct stage_totals *t = &totals[stage];
+  double elapsed_ms = wall_time_ms() - probe->start_ms;
+  unsigned long long values[NUM_COUNTERS];
+
+  __atomic_fetch_add(&t->calls, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&t->wall_ns, (unsigned long long)(elapsed_ms * 1e6),
+                     __ATOMIC_RELAXED);
+  __atomic_fetch_add(&t->bytes, bytes, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&t->pixels, pixels, __ATOMIC_RELAXED);
+
+  if (probe->has_counters && read_counters(values)) {
+    for (int c = 0; c < NUM_COUNTERS; c++) {
+      __atomic_fetch_add(&t->counters[c], values[c] - probe->start_counters[c],
+                         __ATOMIC_RELAXED);
+    }
+    __atomic_fetch_add(&t->counted_calls, 1, __ATOMIC_RELAXED);
+  }
+}
+
+/**
+ * Prints one line per stage that ran: calls, wall time, data moved and
+ * pixels processed with their rates, and the hardware counts if every call
+ * of the stage had them.
+ */
+void instrument_report(FILE *file) {
+  fprintf(file, "%-9s %6s %10s %9s %9s %9s %12s %12s %5s %10s\n", "stage",
+          "calls", "ms", "MB", "MPix", "MB/s", "cycles", "instructions",
+          "IPC", "LLC-miss");
+
+  for (int s = 0; s < NUM_STAGES; s++) {
+    const struct stage_totals *t = &totals[s];
+    double ms = t->wall_ns / 1e6;
+    double mb = t->bytes / 1e6;
+
+    if (t->calls == 0)
+      continue;
+
+    fprintf(file, "%-9s %6llu %10.3f %9.2f %9.2f %9.1f", stage_names[s],
+            t->calls, ms, mb, t->pixels / 1e6, ms > 0 ? mb / (ms / 1000) : 0);
+    if (t->counted_calls == t->calls) {
+      fprintf(file, " %12llu %12llu %5.2f %10llu\n",
+              t->counters[COUNTER_CYCLES], t->counters[COUNTER_INSTRUCTIONS],
+              t->counters[COUNTER_CYCLES]
+                  ? (double)t->counters[COUNTER_INSTRUCTIONS] /
+                        t->counters[COUNTER_CYCLES]
+                  : 0,
+              t->counters[COUNTER_CACHE_MISSES]);
+    } else {
+      fprintf(file, " %12s %12s %5s %10s\n", "n/a", "n/a", "n/a", "n/a");
+    }
+  }
+}
+
+/**
+ * Clears the totals of all stages.
+ */
+void instrument_reset(void) { memset(totals, 0, sizeof(totals)); }
+
+#endif
@@ -0,0 +1,530 @@
+#include "integral.h"
+#include "instrument.h"
+#include "parallel.h"
+#include "sauvola_simd.h"
+#include "tools.h"
+#include <immintrin.h>
+#include <string.h>
+
+/* -------------------------------------------------------------------------- */
+/*                     Parallel Integral Image Construction                   */
+/* -------------------------------------------------------------------------- */
+
+/*
+ * The integral image is built in two passes. The first stores the running
+ * sum of every row on its own, which only depends on that row, so bands of
+ * rows are handled in parallel. The second adds every row to the one below,
+ * top to bottom, which only depends on the same columns of the row above, so
+ * strips of columns are handled in parallel. Additions are taken modulo the
+ * element width like in compute_integral_image, so the result is the same
+ * element for element.
+ */
+
+#define TARGET_AVX2 __attribute__((target("avx2")))
+
+// Rows per task of the row pass
+#define INTEGRAL_BAND_ROWS 16
+
+// Elements per task of the column pass, a few kilobytes of every row
+#define INTEGRAL_STRIP_ELEMENTS 1024
+
+struct integral_job {
+  unsigned char **input;
+  struct integral_image *output;
+  int num_cols;
+  int num_rows;
+  enum simd_level level;
+  long row_elements; // elements of a plane row that hold values
+  int num_strips;    // column strips per plane
+  int num_planes;    // planes summed in the column pass
+  unsigned short **input16; // the samples of a 16-bit image, or NULL
+};
+
+/*
+ * Row pass body for one combination of sample and plane widths, always
+ * inlined with constant widths.
+ */
+static inline __attribute__((always_inline)) void
+row_prefix_with_widths(const void *input, struct integral_image *output,
+                       int i, int num_cols, int sample_bits, int sum_bits,
+                       int sum_squares_bits) {
+  unsigned long long row_sum = 0, row_sum_squares = 0;
+  unsigned long long sample;
+  long index;
+
+  for (int j = 0; j < num_cols; j++) {
+    sample = sample_bits == 16 ? ((const unsigned short *)input)[j]
+                               : ((const unsigned char *)input)[j];
+    row_sum += sample;
+    row_sum_squares += sample * sample;
+    index = INTEGRAL_INDEX(output, i, j);
+    integral_plane_store(output->sum, sum_bits, index, row_sum);
+    integral_plane_store(output->sum_squares, sum_squares_bits, index,
+                         row_sum_squares);
+  }
+}
+
+/*
+ * Inclusive prefix sum of the eight 32-bit lanes of v.
+ */
+TARGET_AVX2 static inline __m256i prefix_sum_epi32(__m256i v) {
+  // Scan within each 128-bit lane, then carry the low lane's total up
+  v = _mm256_add_epi32(v, _mm256_slli_si256(v, 4));
+  v = _mm256_add_epi32(v, _mm256_slli_si256(v, 8));
+  return _mm256_add_epi32(
+      v, _mm256_permute2x128_si256(_mm256_shuffle_epi32(v, 0xFF),
+                                   _mm256_shuffle_epi32(v, 0xFF), 0x08));
+}
+
+/*
+ * Row pass for planar images with two 32-bit planes. Eight pixels are widened
+ * to 32 bits, squared with a multiply-add against themselves and scanned in
+ * registers, and the row total so far is added from the previous group.
+ */
+TARGET_AVX2 static void row_prefix_avx2(const unsigned char *input,
+                                        unsigned int *sums,
+                                        unsigned int *squares, int num_cols) {
+  const __m256i last = _mm256_set1_epi32(7);
+  __m256i sum_carry = _mm256_setzero_si256();
+  __m256i squares_carry = _mm256_setzero_si256();
+  __m256i pixels, pixel_squares;
+  unsigned int row_sum, row_sum_squares;
+  int j;
+
+  for (j = 0; j + 8 <= num_cols; j += 8) {
+    pixels =
+        _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(input + j)));
+    pixel_squares = _mm256_madd_epi16(pixels, pixels);
+
+    sum_carry = _mm256_add_epi32(prefix_sum_epi32(pixels), sum_carry);
+    squares_carry =
+        _mm256_add_epi32(prefix_sum_epi32(pixel_squares), squares_carry);
+    _mm256_storeu_si256((__m256i *)(sums + j), sum_carry);
+    _mm256_storeu_si256((__m256i *)(squares + j), squares_carry);
+
+    sum_carry = _mm256_permutevar8x32_epi32(sum_carry, last);
+    squares_carry = _mm256_permutevar8x32_epi32(squares_carry, last);
+  }
+
+  row_sum = (unsigned int)_mm256_extract_epi32(sum_carry, 0);
+  row_sum_squares = (unsigned int)_mm256_extract_epi32(squares_carry, 0);
+  for (; j < num_cols; j++) {
+    row_sum += input[j];
+    row_sum_squares += (unsigned int)input[j] * input[j];
+    sums[j] = row_sum;
+    squares[j] = row_sum_squares;
+  }
+}
+
+/*
+ * Stores the running sums of row i on their own, without the rows above.
+ */
+static void row_prefix(const unsigned char *input,
+                       struct integral_image *output, int i, int num_cols,
+                       enum simd_level level) {
+  long index = INTEGRAL_INDEX(output, i, 0);
+
+  if (output->sum_bits == 32 && output->sum_squares_bits == 32) {
+    if (level >= SIMD_AVX2 && output->layout == INTEGRAL_PLANAR) {
+      row_prefix_avx2(input, (unsigned int *)output->sum + index,
+                      (unsigned int *)output->sum_squares + index, num_cols);
+    } else {
+      row_prefix_with_widths(input, output, i, num_cols, 8, 32, 32);
+    }
+  } else if (output->sum_bits == 32) {
+    row_prefix_with_widths(input, output, i, num_cols, 8, 32, 64);
+  } else {
+    row_prefix_with_widths(input, output, i, num_cols, 8, 64, 64);
+  }
+}
+
+/*
+ * Same as row_prefix for a row of 16-bit samples.
+ */
+static void row_prefix_16(const unsigned short *input,
+                          struct integral_image *output, int i,
+                          int num_cols) {
+  if (output->sum_bits == 32 && output->sum_squares_bits == 32) {
+    row_prefix_with_widths(input, output, i, num_cols, 16, 32, 32);
+  } else if (output->sum_bits == 32) {
+    row_prefix_with_widths(input, output, i, num_cols, 16, 32, 64);
+  } else {
+    row_prefix_with_widths(input, output, i, num_cols, 16, 64, 64);
+  }
+}
+
+static void job_row_prefix(struct integral_job *job, int i) {
+  if (job->input16 != NULL)
+    row_prefix_16(job->input16[i], job->output, i, job->num_cols);
+  else
+    row_prefix(job->input[i], job->output, i, job->num_cols, job->level);
+}
+
+/*
+ * Adds elements [begin, end) of every row of a plane to the row below, from
+ * the given row to the last one. The loops are over contiguous elements and
+ * are vectorized by the compiler.
+ */
+static void accumulate_columns(void *plane, int bits, long row_stride,
+                               int row_begin, int row_end, long begin,
+                               long end) {
+  for (int i = row_begin; i < row_end; i++) {
+    if (bits == 32) {
+      unsigned int *row = (unsigned int *)plane + i * row_stride;
+      const unsigned int *above = row - row_stride;
+
+      for (long j = begin; j < end; j++) {
+        row[j] += above[j];
+      }
+    } else {
+      unsigned long long *row = (unsigned long long *)plane + i * row_stride;
+      const unsigned long long *above = row - row_stride;
+
+      for (long j = begin; j < end; j++) {
+        row[j] += above[j];
+      }
+    }
+  }
+}
+
+static void integral_row_task(void *context, int task_index,
+                              int worker_index) {
+  struct integral_job *job = (struct integral_job *)context;
+  int row_begin = task_index * INTEGRAL_BAND_ROWS;
+  int row_end = fmin(row_begin + INTEGRAL_BAND_ROWS, job->num_rows);
+
+  for (int i = row_begin; i < row_end; i++) {
+    job_row_prefix(job, i);
+  }
+}
+
+static void integral_column_task(void *context, int task_index,
+                                 int worker_index) {
+  struct integral_job *job = (struct integral_job *)context;
+  struct integral_image *output = job->output;
+  int plane = task_index / job->num_strips;
+  long begin = (long)(task_index % job->num_strips) * INTEGRAL_STRIP_ELEMENTS;
+  long end = fmin(begin + INTEGRAL_STRIP_ELEMENTS, job->row_elements);
+
+  // Row 0 has nothing above it but the zero row
+  if (plane == 0) {
+    accumulate_columns(output->sum, output->sum_bits, output->row_stride, 1,
+                       job->num_rows, begin, end);
+  } else {
+    accumulate_columns(output->sum_squares, output->sum_squares_bits,
+                       output->row_stride, 1, job->num_rows, begin, end);
+  }
+}
+
+/*
+ * Scans every row and adds it to the row above right away, so the image is
+ * only traversed once.
+ */
+static void build_rows_serially(struct integral_job *job) {
+  struct integral_image *output = job->output;
+
+  for (int i = 0; i < job->num_rows; i++) {
+    job_row_prefix(job, i);
+    if (i > 0) {
+      accumulate_columns(output->sum, output->sum_bits, output->row_stride, i,
+                         i + 1, 0, job->row_elements);
+      if (job->num_planes == 2)
+        accumulate_columns(output->sum_squares, output->sum_squares_bits,
+                           output->row_stride, i, i + 1, 0,
+                           job->row_elements);
+    }
+  }
+}
+
+/*
+ * Builds the integral image of the 8-bit input, or of the 16-bit input16 if
+ * it is not NULL, on the threads of pool, or with parallel_for on
+ * num_threads threads if pool is NULL.
+ */
+static void build_integral_image(unsigned char **input,
+                                 unsigned short **input16,
+                                 struct integral_image *output, int num_cols,
+                                 int num_rows, int num_threads,
+                                 struct worker_pool *pool) {
+  struct integral_job job = {input, output, num_cols, num_rows,
+                             detect_simd_level()};
+  int num_bands = (num_rows + INTEGRAL_BAND_ROWS - 1) / INTEGRAL_BAND_ROWS;
+
+  job.input16 = input16;
+
+  // In the interleaved layout both planes share one run of elements per row
+  job.num_planes = output->layout == INTEGRAL_INTERLEAVED ? 1 : 2;
+  job.row_elements = (long)num_cols * output->step;
+  job.num_strips = (job.row_elements + INTEGRAL_STRIP_ELEMENTS - 1) /
+                   INTEGRAL_STRIP_ELEMENTS;
+
+  if (pool != NULL)
+    num_threads = pool->num_workers;
+  else if (num_threads < 1)
+    num_threads = default_thread_count();
+
+  // The serial builder is as fast without the in-register scan
+  if (num_threads == 1 && input16 == NULL &&
+      !(job.level >= SIMD_AVX2 && output->sum_bits == 32 &&
+        output->sum_squares_bits == 32 && output->layout == INTEGRAL_PLANAR)) {
+    compute_integral_image(input, output, num_cols, num_rows);
+    return;
+  }
+
+  if (num_threads == 1) {
+    build_rows_serially(&job);
+    return;
+  }
+
+  if (pool != NULL) {
+    worker_pool_run(pool, num_bands, integral_row_task, &job);
+    worker_pool_run(pool, job.num_planes * job.num_strips,
+                    integral_column_task, &job);
+    return;
+  }
+
+  if (!parallel_for(num_bands, num_threads, integral_row_task, &job) ||
+      !parallel_for(job.num_planes * job.num_strips, num_threads,
+                    integral_column_task, &job))
+    build_rows_serially(&job);
+}
+
+/**
+ * Computes the same integral image as compute_integral_image with several
+ * threads: a row pass over bands of rows, with in-register prefix sums for
+ * 32-bit planar images, followed by a column pass over strips of columns.
+ * With a single thread every row is scanned and added to the row above right
+ * away, so the image is only traversed once, and images without 32-bit planar
+ * planes use compute_integral_image.
+ *
+ * @param num_threads The number of threads to use. Values below 1 select one
+ * thread per online processor.
+ */
+void compute_integral_image_parallel(unsigned char **input,
+                                     struct integral_image *output,
+                                     int num_cols, int num_rows,
+                                     int num_threads) {
+  INSTRUMENT_BEGIN(probe);
+  build_integral_image(input, NULL, output, num_cols, num_rows, num_threads,
+                       NULL);
+  INSTRUMENT_END(probe, STAGE_INTEGRAL,
+                 (long)num_rows * num_cols + output->buffer_size,
+                 (long)num_rows * num_cols);
+}
+
+/**
+ * Same as compute_integral_image_parallel on the threads of a worker pool.
+ */
+void compute_integral_image_pooled(unsigned char **input,
+                                   struct integral_image *output, int num_cols,
+                                   int num_rows, struct worker_pool *pool) {
+  INSTRUMENT_BEGIN(probe);
+  build_integral_image(input, NULL, output, num_cols, num_rows, 0, pool);
+  INSTRUMENT_END(probe, STAGE_INTEGRAL,
+                 (long)num_rows * num_cols + output->buffer_size,
+                 (long)num_rows * num_cols);
+}
+
+/**
+ * Same as compute_integral_image_parallel for an image of 16-bit samples. The
+ * integral image must have been laid out for the max color value of the
+ * image, see choose_integral_widths.
+ */
+void compute_integral_image_16_parallel(unsigned short **input,
+                                        struct integral_image *output,
+                                        int num_cols, int num_rows,
+                                        int num_threads) {
+  INSTRUMENT_BEGIN(probe);
+  build_integral_image(NULL, input, output, num_cols, num_rows, num_threads,
+                       NULL);
+  INSTRUMENT_END(probe, STAGE_INTEGRAL,
+                 2L * num_rows * num_cols + output->buffer_size,
+                 (long)num_rows * num_cols);
+}
+
+/**
+ * Same as compute_integral_image_16_parallel on the threads of a worker pool.
+ */
+void compute_integral_image_16_pooled(unsigned short **input,
+                                      struct integral_image *output,
+                                      int num_cols, int num_rows,
+                                      struct worker_pool *pool) {
+  INSTRUMENT_BEGIN(probe);
+  build_integral_image(NULL, input, output, num_cols, num_rows, 0, pool);
+  INSTRUMENT_END(probe, STAGE_INTEGRAL,
+                 2L * num_rows * num_cols + output->buffer_size,
+                 (long)num_rows * num_cols);
+}
+
+/* -------------------------------------------------------------------------- */
+/*                      Incremental Integral Image Update                     */
+/* -------------------------------------------------------------------------- */
+
+/*
+ * When the pixels of a patch change, every element of the integral image at
+ * or below its first row and at or right of its first column changes by the
+ * sum of the pixel changes above and left of it. The rows of the patch are
+ * updated one after another while the change of every column so far is
+ * accumulated in a delta per column. The rows below the patch all change by
+ * the final deltas, which only leaves an addition per element, and bands of
+ * them are handled in parallel. The old pixels are recovered from the
+ * integral image itself, so no copy of the previous image is needed.
+ */
+
+struct update_job {
+  struct integral_image *output;
+  int num_cols;
+  int row_begin; // first row below the patch
+  int row_end;
+  int col_begin;
+  int col_end;
+  const unsigned long long *sum_deltas;
+  const unsigned long long *square_deltas;
+};
+
+/*
+ * Adds deltas[j - col_begin] to element j of a row of a plane for the
+ * columns of the patch, and the last delta to the columns right of it.
+ * Always inlined, with a constant step for planar images so that the loops
+ * are vectorized.
+ */
+static inline __attribute__((always_inline)) void
+add_column_deltas(void *plane, int bits, long row_index, int step,
+                  int num_cols, int col_begin, int col_end,
+                  const unsigned long long *deltas) {
+  unsigned long long total = deltas[col_end - col_begin - 1];
+  int j;
+
+  if (bits == 32) {
+    unsigned int *row = (unsigned int *)plane + row_index;
+
+    for (j = col_begin; j < col_end; j++) {
+      row[(long)j * step] += (unsigned int)deltas[j - col_begin];
+    }
+    for (; j < num_cols; j++) {
+      row[(long)j * step] += (unsigned int)total;
+    }
+  } else {
+    unsigned long long *row = (unsigned long long *)plane + row_index;
+
+    for (j = col_begin; j < col_end; j++) {
+      row[(long)j * step] += deltas[j - col_begin];
+    }
+    for (; j < num_cols; j++) {
+      row[(long)j * step] += total;
+    }
+  }
+}
+
+static void add_row_deltas(struct integral_image *output, int i, int num_cols,
+                           int col_begin, int col_end,
+                           const unsigned long long *sum_deltas,
+                           const unsigned long long *square_deltas) {
+  long row_index = INTEGRAL_INDEX(output, i, 0);
+
+  if (output->step == 1) {
+    add_column_deltas(output->sum, output->sum_bits, row_index, 1, num_cols,
+                      col_begin, col_end, sum_deltas);
+    add_column_deltas(output->sum_squares, output->sum_squares_bits,
+                      row_index, 1, num_cols, col_begin, col_end,
+                      square_deltas);
+  } else {
+    add_column_deltas(output->sum, output->sum_bits, row_index, output->step,
+                      num_cols, col_begin, col_end, sum_deltas);
+    add_column_deltas(output->sum_squares, output->sum_squares_bits,
+                      row_index, output->step, num_cols, col_begin, col_end,
+                      square_deltas);
+  }
+}
+
+static void update_band_task(void *context, int task_index,
+                             int worker_index) {
+  struct update_job *job = (struct update_job *)context;
+  int row_begin = job->row_begin + task_index * INTEGRAL_BAND_ROWS;
+  int row_end = fmin(row_begin + INTEGRAL_BAND_ROWS, job->row_end);
+
+  for (int i = row_begin; i < row_end; i++) {
+    add_row_deltas(job->output, i, job->num_cols, job->col_begin,
+                   job->col_end, job->sum_deltas, job->square_deltas);
+  }
+}
+
+/*
+ * Updates row i of the patch. On entry the deltas hold the changes of the
+ * rows above, which have already been added to row i - 1, and on return
+ * those of row i as well.
+ */
+static void update_patch_row(const unsigned char *input,
+                             struct integral_image *output, int i,
+                             int num_cols, int col_begin, int col_end,
+                             unsigned long long *sum_deltas,
+                             unsigned long long *square_deltas) {
+  const void *sums = output->sum;
+  const int bits = output->sum_bits;
+  const unsigned long long mask = integral_plane_mask(bits);
+  unsigned long long row_sum = 0, row_squares = 0, previous, current;
+  int old_pixel;
+  long index = INTEGRAL_INDEX(output, i, col_begin - 1);
+  long above = INTEGRAL_INDEX(output, i - 1, col_begin - 1);
+
+  // Old sum of row i alone up to the previous column, left of the patch
+  previous = (integral_plane_load(sums, bits, index) -
+              integral_plane_load(sums, bits, above)) &
+             mask;
+
+  for (int j = col_begin; j < col_end; j++) {
+    index += output->step;
+    above += output->step;
+    current = (integral_plane_load(sums, bits, index) -
+               integral_plane_load(sums, bits, above) +
+               sum_deltas[j - col_begin]) &
+              mask;
+    old_pixel = (int)((current - previous) & mask);
+    previous = current;
+
+    row_sum += input[j] - old_pixel;
+    row_squares += input[j] * input[j] - old_pixel * old_pixel;
+    sum_deltas[j - col_begin] += row_sum;
+    square_deltas[j - col_begin] += row_squares;
+  }
+
+  add_row_deltas(output, i, num_cols, col_begin, col_end, sum_deltas,
+                 square_deltas);
+}
+
+/**
+ * Updates an integral image computed for input after the pixels in rows
+ * [row_begin, row_end) and columns [col_begin, col_end) of input changed, to
+ * the one compute_integral_image would give for the new pixels. Only the
+ * elements at or below row_begin and at or right of col_begin are touched,
+ * with one addition each outside the patch.
+ *
+ * @param deltas Scratch space for 2 * (col_end - col_begin) values.
+ * @param pool The workers that update the rows below the patch.
+ */
+void update_integral_image(unsigned char **input,
+                           struct integral_image *output, int num_cols,
+                           int num_rows, int row_begin, int row_end,
+                           int col_begin, int col_end,
+                           unsigned long long *deltas,
+                           struct worker_pool *pool) {
+  int width = col_end - col_begin;
+  struct update_job job = {output,    num_cols, row_end, num_rows,
+                           col_begin, col_end,  deltas,  deltas + width};
+  int num_bands = (num_rows - row_end + INTEGRAL_BAND_ROWS - 1) /
+                  INTEGRAL_BAND_ROWS;
+  INSTRUMENT_BEGIN(probe);
+
+  memset(deltas, 0, 2 * width * sizeof(*deltas));
+  for (int i = row_begin; i < row_end; i++) {
+    update_patch_row(input[i], output, i, num_cols, col_begin, col_end,
+                     deltas, deltas + width);
+  }
+
+  worker_pool_run(pool, num_bands, update_band_task, &job);
+
+  INSTRUMENT_END(probe, STAGE_INTEGRAL,
+                 (long)(num_rows - row_begin) * (num_cols - col_begin) *
+                     (output->sum_bits + output->sum_squares_bits) / 4,
+                 (long)(row_end - row_begin) * width);
+}
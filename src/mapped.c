@@ -0,0 +1,228 @@
+#include "mapped.h"
+#include "context.h"
+#include "instrument.h"
+#include <ctype.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* -------------------------------------------------------------------------- */
+/*                       Memory-Mapped PGM / PPM Reader                       */
+/* -------------------------------------------------------------------------- */
+
+/*
+ * Skips whitespace and comment lines starting at offset, returning the offset
+ * of the next token.
+ */
+static size_t skip_header_space(const unsigned char *data, size_t length,
+                                size_t offset) {
+  while (offset < length) {
+    if (data[offset] == '#') {
+      while (offset < length && data[offset] != '\n')
+        offset++;
+    } else if (isspace(data[offset])) {
+      offset++;
+    } else {
+      break;
+    }
+  }
+
+  return offset;
+}
+
+/*
+ * Parses a positive decimal number starting at offset. Returns the offset just
+ * past the number, or 0 if there is no valid number.
+ */
+static size_t parse_header_number(const unsigned char *data, size_t length,
+                                  size_t offset, int *value) {
+  long number = 0;
+  size_t start = offset;
+
+  while (offset < length && isdigit(data[offset]) && number <= 0x7FFFFFFF) {
+    number = number * 10 + (data[offset] - '0');
+    offset++;
+  }
+  if (offset == start || number > 0x7FFFFFFF)
+    return 0;
+
+  *value = (int)number;
+  return offset;
+}
+
+/**
+ * Parses the header of a binary PGM or PPM image held in memory, the same
+ * header read_pgm_header and read_ppm_header read from a file. format is '5'
+ * for PGM and '6' for PPM. Returns the length of the header in bytes, or 0 if
+ * the header is not valid or the payload is shorter than the image.
+ */
+int parse_pnm_header(const unsigned char *data, size_t length, char format,
+                     int *num_rows, int *num_cols, int *max_color) {
+  size_t offset;
+  int channels = format == '6' ? 3 : 1;
+  int bytes_per_sample;
+
+  // Check the signature
+  if (length < 2 || data[0] != 'P' || data[1] != format)
+    return 0;
+
+  // Read the dimensions and max color value, skipping any comments
+  offset = skip_header_space(data, length, 2);
+  if ((offset = parse_header_number(data, length, offset, num_cols)) == 0)
+    return 0;
+  offset = skip_header_space(data, length, offset);
+  if ((offset = parse_header_number(data, length, offset, num_rows)) == 0)
+    return 0;
+  offset = skip_header_space(data, length, offset);
+  if ((offset = parse_header_number(data, length, offset, max_color)) == 0)
+    return 0;
+
+  // A single whitespace character separates the header from the pixels
+  if (offset >= length || !isspace(data[offset]))
+    return 0;
+  offset++;
+
+  // Check that the payload holds the whole image
+  bytes_per_sample = *max_color > 255 ? 2 : 1;
+  if (*num_rows <= 0 || *num_cols <= 0 ||
+      (length - offset) / bytes_per_sample / channels / *num_cols <
+          (size_t)*num_rows)
+    return 0;
+
+  return (int)offset;
+}
+
+/*
+ * Reads the whole file into one malloc'd buffer. Used when the file cannot be
+ * memory mapped, e.g. when it is a pipe.
+ */
+static void *read_whole_file(int fd, size_t *length) {
+  size_t capacity = 1 << 20, size = 0;
+  unsigned char *buffer = (unsigned char *)malloc(capacity), *grown;
+  ssize_t count;
+
+  while (buffer != NULL) {
+    if (size == capacity) {
+      capacity *= 2;
+      if ((grown = (unsigned char *)realloc(buffer, capacity)) == NULL)
+        break;
+      buffer = grown;
+    }
+    count = read(fd, buffer + size, capacity - size);
+    if (count == 0) {
+      *length = size;
+      return buffer;
+    }
+    if (count < 0)
+      break;
+    size += count;
+  }
+
+  free(buffer);
+  return NULL;
+}
+
+/**
+ * Opens a binary PGM (P5) or PPM (P6) image and exposes its pixel payload in
+ * place, without copying it. Regular files are memory mapped read-only with a
+ * sequential access hint, anything that cannot be mapped is read into a single
+ * buffer instead. The header is parsed once, straight from memory. For PGM
+ * images image->rows can be passed to the Sauvola kernels as the grayscale
+ * input.
+ *
+ * @param context The context whose row pointers image->rows uses, valid until
+ * the next image is mapped with it, or NULL to allocate them for this image.
+ * @return 1 on success, 0 if the file cannot be opened or is not a valid image.
+ * On success the image must be released with unmap_pnm_image.
+ */
+int map_pnm_image(const char *file_name, struct mapped_image *image,
+                  struct sauvola_context *context) {
+  struct stat status;
+  int fd, header_length, i;
+  size_t row_bytes;
+
+  image->base = NULL;
+  image->rows = NULL;
+  image->is_mapped = 0;
+  image->owns_rows = context == NULL;
+
+  INSTRUMENT_BEGIN(read_probe);
+  if ((fd = open(file_name, O_RDONLY)) < 0) {
+    INSTRUMENT_END(read_probe, STAGE_READ, 0, 0);
+    return 0;
+  }
+
+  // Map regular files, read everything else
+  if (fstat(fd, &status) == 0 && S_ISREG(status.st_mode) &&
+      status.st_size > 0) {
+    image->length = status.st_size;
+    image->base = mmap(NULL, image->length, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (image->base == MAP_FAILED) {
+      image->base = NULL;
+    } else {
+      image->is_mapped = 1;
+      madvise(image->base, image->length, MADV_SEQUENTIAL);
+    }
+  }
+  if (image->base == NULL)
+    image->base = read_whole_file(fd, &image->length);
+  close(fd);
+  INSTRUMENT_END(read_probe, STAGE_READ,
+                 image->base != NULL ? image->length : 0, 0);
+
+  if (image->base == NULL)
+    return 0;
+
+  // Parse the header straight from memory
+  INSTRUMENT_BEGIN(header_probe);
+  image->channels = 1;
+  header_length =
+      parse_pnm_header((const unsigned char *)image->base, image->length, '5',
+                       &image->num_rows, &image->num_cols, &image->max_color);
+  if (header_length == 0) {
+    image->channels = 3;
+    header_length = parse_pnm_header((const unsigned char *)image->base,
+                                     image->length, '6', &image->num_rows,
+                                     &image->num_cols, &image->max_color);
+  }
+  INSTRUMENT_END(header_probe, STAGE_HEADER, header_length, 0);
+  if (header_length == 0) {
+    unmap_pnm_image(image);
+    return 0;
+  }
+
+  // Point the row pointers into the payload
+  image->pixels = (unsigned char *)image->base + header_length;
+  row_bytes = (size_t)image->num_cols * image->channels *
+              (image->max_color > 255 ? 2 : 1);
+  image->rows =
+      context != NULL
+          ? context_row_pointers(context, image->num_rows)
+          : (unsigned char **)malloc(image->num_rows * sizeof(unsigned char *));
+  if (image->rows == NULL) {
+    unmap_pnm_image(image);
+    return 0;
+  }
+  for (i = 0; i < image->num_rows; i++) {
+    image->rows[i] = image->pixels + i * row_bytes;
+  }
+
+  return 1;
+}
+
+/**
+ * Releases an image opened with map_pnm_image.
+ */
+void unmap_pnm_image(struct mapped_image *image) {
+  if (image->is_mapped) {
+    munmap(image->base, image->length);
+  } else {
+    free(image->base);
+  }
+  if (image->owns_rows)
+    free(image->rows);
+  image->base = NULL;
+  image->rows = NULL;
+}
@@ -0,0 +1,433 @@
+#include "parallel.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/* -------------------------------------------------------------------------- */
+/*                         Work-Stealing Thread Pool                          */
+/* -------------------------------------------------------------------------- */
+
+/*
+ * Every worker owns a deque holding a contiguous range [head, tail) of task
+ * indices. The owner pops tasks from the head, so it walks its range in order,
+ * while idle workers steal the upper half of a victim's remaining range from
+ * the tail. Tasks never spawn new tasks, so a worker that finds every deque
+ * empty can retire.
+ */
+struct task_deque {
+  pthread_mutex_t lock;
+  int head;
+  int tail;
+};
+
+struct thread_pool {
+  struct task_deque *deques;
+  int num_workers;
+  parallel_task_fn task;
+  void *context;
+};
+
+struct worker_arg {
+  struct thread_pool *pool;
+  int worker_index;
+  struct pool_state *state; // only for the threads of a worker_pool
+};
+
+/**
+ * Returns the number of online processors, or 1 if it cannot be determined.
+ */
+int default_thread_count(void) {
+  long count = sysconf(_SC_NPROCESSORS_ONLN);
+
+  return count > 0 ? (int)count : 1;
+}
+
+/*
+ * Pops the next task index from the head of the given deque. Returns -1 if the
+ * deque is empty.
+ */
+static int pop_task(struct task_deque *deque) {
+  int task_index = -1;
+
+  pthread_mutex_lock(&deque->lock);
+  if (deque->head < deque->tail) {
+    task_index = deque->head++;
+  }
+  pthread_mutex_unlock(&deque->lock);
+
+  return task_index;
+}
+
+/*
+ * Moves the upper half of the victim's remaining tasks into the thief's deque.
+ * Returns 1 if anything was stolen, otherwise 0.
+ */
+static int steal_tasks(struct task_deque *victim, struct task_deque *thief) {
+  int begin, end, count;
+
+  pthread_mutex_lock(&victim->lock);
+  count = victim->tail - victim->head;
+  if (count <= 0) {
+    pthread_mutex_unlock(&victim->lock);
+    return 0;
+  }
+  count = (count + 1) / 2;
+  end = victim->tail;
+  begin = end - count;
+  victim->tail = begin;
+  pthread_mutex_unlock(&victim->lock);
+
+  pthread_mutex_lock(&thief->lock);
+  thief->head = begin;
+  thief->tail = end;
+  pthread_mutex_unlock(&thief->lock);
+
+  return 1;
+}
+
+static void *worker_main(void *arg) {
+  struct worker_arg *worker = (struct worker_arg *)arg;
+  struct thread_pool *pool = worker->pool;
+  struct task_deque *own = &pool->deques[worker->worker_index];
+  int task_index, victim, attempt;
+
+  for (;;) {
+    // Drain our own deque first
+    while ((task_index = pop_task(own)) >= 0) {
+      pool->task(pool->context, task_index, worker->worker_index);
+    }
+
+    // Look for a victim, starting with our right-hand neighbour
+    for (attempt = 1; attempt < pool->num_workers; attempt++) {
+      victim = (worker->worker_index + attempt) % pool->num_workers;
+      if (steal_tasks(&pool->deques[victim], own))
+        break;
+    }
+
+    // Nothing left anywhere, so we are done
+    if (attempt >= pool->num_workers)
+      break;
+  }
+
+  return NULL;
+}
+
+/**
+ * Runs task(context, i, worker) for every i in [0, num_tasks) on up to
+ * num_threads threads and waits for all of them to finish. The calling thread
+ * takes part as worker 0, so worker indices are in [0, num_threads). Tasks are
+ * dealt out in contiguous ranges and rebalanced by work stealing.
+ *
+ * @param num_tasks The number of tasks to run.
+ * @param num_threads The number of threads to use. Values below 1 select
+ * default_thread_count().
+ * @param task The function executed for every task index.
+ * @param context An opaque pointer passed to every task.
+ * @return 1 on success, 0 if the pool could not be set up.
+ */
+int parallel_for(int num_tasks, int num_threads, parallel_task_fn task,
+                 void *context) {
+  struct thread_pool pool;
+  struct worker_arg *args;
+  pthread_t *threads;
+  int i, started;
+
+  if (num_tasks <= 0)
+    return 1;
+
+  if (num_threads < 1)
+    num_threads = default_thread_count();
+  if (num_threads > num_tasks)
+    num_threads = num_tasks;
+
+  // Nothing to schedule, run everything on the calling thread
+  if (num_threads == 1) {
+    for (i = 0; i < num_tasks; i++) {
+      task(context, i, 0);
+    }
+    return 1;
+  }
+
+  pool.deques =
+      (struct task_deque *)malloc(num_threads * sizeof(struct task_deque));
+  args = (struct worker_arg *)malloc(num_threads * sizeof(struct worker_arg));
+  threads = (pthread_t *)malloc(num_threads * sizeof(pthread_t));
+  if (pool.deques == NULL || args == NULL || threads == NULL) {
+    free(pool.deques);
+    free(args);
+    free(threads);
+    return 0;
+  }
+
+  pool.num_workers = num_threads;
+  pool.task = task;
+  pool.context = context;
+
+  // Deal the tasks out in contiguous, equally sized ranges
+  for (i = 0; i < num_threads; i++) {
+    pthread_mutex_init(&pool.deques[i].lock, NULL);
+    pool.deques[i].head = (int)((long)num_tasks * i / num_threads);
+    pool.deques[i].tail = (int)((long)num_tasks * (i + 1) / num_threads);
+    args[i].pool = &pool;
+    args[i].worker_index = i;
+  }
+
+  // If a thread cannot be started its range is simply stolen by the others
+  started = 1;
+  for (i = 1; i < num_threads; i++) {
+    if (pthread_create(&threads[started], NULL, worker_main, &args[i]) == 0)
+      started++;
+  }
+
+  worker_main(&args[0]);
+
+  for (i = 1; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  for (i = 0; i < num_threads; i++) {
+    pthread_mutex_destroy(&pool.deques[i].lock);
+  }
+  free(pool.deques);
+  free(args);
+  free(threads);
+
+  return 1;
+}
+
+/* -------------------------------------------------------------------------- */
+/*                            Persistent Worker Pool                          */
+/* -------------------------------------------------------------------------- */
+
+/*
+ * The threads of a worker_pool run worker_main on the shared thread_pool for
+ * every job and then sleep until the next one. A job is announced by bumping
+ * the generation; the last thread to finish it wakes the caller.
+ */
+struct pool_state {
+  struct thread_pool pool;
+  struct worker_arg *args;
+  pthread_t *threads;
+  pthread_mutex_t lock;
+  pthread_cond_t wake; // a job was posted or the pool is stopping
+  pthread_cond_t idle; // every thread is done with the current job
+  unsigned long generation;
+  int num_busy; // threads still working on the current job
+  int stop;
+};
+
+static void *pool_thread_main(void *arg) {
+  struct worker_arg *worker = (struct worker_arg *)arg;
+  struct pool_state *state = worker->state;
+  unsigned long generation = 0;
+
+  pthread_mutex_lock(&state->lock);
+  for (;;) {
+    while (!state->stop && state->generation == generation) {
+      pthread_cond_wait(&state->wake, &state->lock);
+    }
+    if (state->stop)
+      break;
+    generation = state->generation;
+    pthread_mutex_unlock(&state->lock);
+
+    worker_main(worker);
+
+    pthread_mutex_lock(&state->lock);
+    if (--state->num_busy == 0)
+      pthread_cond_signal(&state->idle);
+  }
+  pthread_mutex_unlock(&state->lock);
+
+  return NULL;
+}
+
+static void free_pool_state(struct pool_state *state) {
+  if (state == NULL)
+    return;
+  free(state->pool.deques);
+  free(state->args);
+  free(state->threads);
+  free(state);
+}
+
+/*
+ * Stops and joins the first num_started - 1 threads of a pool, then destroys
+ * its locks.
+ */
+static void stop_pool_threads(struct pool_state *state, int num_started) {
+  pthread_mutex_lock(&state->lock);
+  state->stop = 1;
+  pthread_cond_broadcast(&state->wake);
+  pthread_mutex_unlock(&state->lock);
+
+  for (int i = 1; i < num_started; i++) {
+    pthread_join(state->threads[i - 1], NULL);
+  }
+  for (int i = 0; i < state->pool.num_workers; i++) {
+    pthread_mutex_destroy(&state->pool.deques[i].lock);
+  }
+  pthread_mutex_destroy(&state->lock);
+  pthread_cond_destroy(&state->wake);
+  pthread_cond_destroy(&state->idle);
+}
+
+/**
+ * Starts the threads of a pool of num_threads workers, the calling thread
+ * being one of them, and allocates everything worker_pool_run needs, so that
+ * running a job neither allocates nor starts a thread. Threads that cannot be
+ * started are left out, down to no thread at all, in which case jobs run on
+ * the calling thread.
+ *
+ * @param num_threads The number of workers. Values below 1 select
+ * default_thread_count().
+ * @return 1 on success, 0 if the memory cannot be allocated. Either way the
+ * pool must be released with worker_pool_free.
+ */
+int worker_pool_init(struct worker_pool *pool, int num_threads) {
+  struct pool_state *state;
+  int i, started;
+
+  pool->state = NULL;
+  pool->num_workers = 1;
+  pool->num_runs = 0;
+
+  if (num_threads < 1)
+    num_threads = default_thread_count();
+  if (num_threads == 1)
+    return 1;
+
+  state = (struct pool_state *)calloc(1, sizeof(struct pool_state));
+  if (state == NULL)
+    return 0;
+  state->pool.deques =
+      (struct task_deque *)malloc(num_threads * sizeof(struct task_deque));
+  state->args =
+      (struct worker_arg *)malloc(num_threads * sizeof(struct worker_arg));
+  state->threads = (pthread_t *)malloc((num_threads - 1) * sizeof(pthread_t));
+  if (state->pool.deques == NULL || state->args == NULL ||
+      state->threads == NULL) {
+    free_pool_state(state);
+    return 0;
+  }
+
+  pthread_mutex_init(&state->lock, NULL);
+  pthread_cond_init(&state->wake, NULL);
+  pthread_cond_init(&state->idle, NULL);
+  for (i = 0; i < num_threads; i++) {
+    pthread_mutex_init(&state->pool.deques[i].lock, NULL);
+    state->args[i].pool = &state->pool;
+    state->args[i].worker_index = i;
+    state->args[i].state = state;
+  }
+  state->pool.num_workers = num_threads;
+
+  // A thread that cannot be started gives its worker index to the next one
+  started = 1;
+  for (i = 1; i < num_threads; i++) {
+    if (pthread_create(&state->threads[started - 1], NULL, pool_thread_main,
+                       &state->args[started]) == 0)
+      started++;
+  }
+
+  // The workers only ever look at the deques of the threads that run
+  for (i = started; i < num_threads; i++) {
+    pthread_mutex_destroy(&state->pool.deques[i].lock);
+  }
+  state->pool.num_workers = started;
+  if (started == 1) {
+    stop_pool_threads(state, started);
+    free_pool_state(state);
+    return 1;
+  }
+
+  pool->state = state;
+  pool->num_workers = started;
+
+  return 1;
+}
+
+/**
+ * Runs task(context, i, worker) for every i in [0, num_tasks) on the workers
+ * of a pool and waits for all of them to finish, like parallel_for.
+ */
+void worker_pool_run(struct worker_pool *pool, int num_tasks,
+                     parallel_task_fn task, void *context) {
+  struct pool_state *state = pool->state;
+  int num_workers = pool->num_workers;
+
+  if (num_tasks <= 0)
+    return;
+  pool->num_runs++;
+
+  if (state == NULL) {
+    for (int i = 0; i < num_tasks; i++) {
+      task(context, i, 0);
+    }
+    return;
+  }
+
+  // Deal the tasks out like parallel_for; with fewer tasks than workers some
+  // ranges are empty and their owners go straight to stealing
+  state->pool.task = task;
+  state->pool.context = context;
+  for (int i = 0; i < num_workers; i++) {
+    state->pool.deques[i].head = (int)((long)num_tasks * i / num_workers);
+    state->pool.deques[i].tail = (int)((long)num_tasks * (i + 1) / num_workers);
+  }
+
+  pthread_mutex_lock(&state->lock);
+  state->num_busy = num_workers - 1;
+  state->generation++;
+  pthread_cond_broadcast(&state->wake);
+  pthread_mutex_unlock(&state->lock);
+
+  worker_main(&state->args[0]);
+
+  pthread_mutex_lock(&state->lock);
+  while (state->num_busy > 0) {
+    pthread_cond_wait(&state->idle, &state->lock);
+  }
+  pthread_mutex_unlock(&state->lock);
+}
+
+/**
+ * Stops and joins the threads of a pool and frees its memory.
+ */
+void worker_pool_free(struct worker_pool *pool) {
+  if (pool->state != NULL) {
+    stop_pool_threads(pool->state, pool->num_workers);
+    free_pool_state(pool->state);
+  }
+  pool->state = NULL;
+  pool->num_workers = 1;
+}
+
+/**
+ * Runs task(context, i, worker) for every i in [0, num_tasks) on the workers
+ * of pool if it is not NULL, otherwise with parallel_for on num_threads
+ * threads. Lets an engine offer a variant on a caller's pool without
+ * duplicating its scheduling.
+ *
+ * @return 1 on success, 0 if parallel_for could not set up its threads.
+ */
+int run_parallel(struct worker_pool *pool, int num_tasks, int num_threads,
+                 parallel_task_fn task, void *context) {
+  if (pool == NULL)
+    return parallel_for(num_tasks, num_threads, task, context);
+
+  worker_pool_run(pool, num_tasks, task, context);
+  return 1;
+}
+
+/**
+ * Returns the number of worker indices run_parallel can pass to a task for
+ * the same pool and num_threads, which is how many per-worker scratch
+ * buffers an engine needs.
+ */
+int parallel_worker_count(const struct worker_pool *pool, int num_threads) {
+  if (pool != NULL)
+    return pool->num_workers;
+
+  return num_threads < 1 ? default_thread_count() : num_threads;
+}
@@ -0,0 +1,117 @@
+#include "pbm.h"
+#include "instrument.h"
+#include "sauvola_simd.h"
+#include "tools.h"
+#include <immintrin.h>
+#include <string.h>
+
+/* -------------------------------------------------------------------------- */
+/*                          PBM (Portable Bit Map)                            */
+/* -------------------------------------------------------------------------- */
+
+/*
+ * A binary image is stored with one bit per pixel, eight pixels per byte, the
+ * first pixel in the most significant bit. As in the P4 format a set bit is a
+ * black pixel, so a 0 output byte becomes 1 and a 255 output byte becomes 0.
+ * Every row starts on a byte boundary and the unused bits at the end of a row
+ * are zero.
+ */
+
+#define TARGET_AVX2 __attribute__((target("avx2")))
+
+/**
+ * Returns the number of bytes of one packed row of num_cols pixels.
+ */
+int packed_row_bytes(int num_cols) { return (num_cols + 7) / 8; }
+
+/*
+ * Packs 32 pixels per iteration and returns the number of pixels done. The
+ * bytes of every group of eight pixels are reversed, so that movemask puts the
+ * first pixel of the group in the most significant bit of its byte.
+ */
+static TARGET_AVX2 int pack_binary_row_avx2(const unsigned char *row,
+                                            unsigned char *packed,
+                                            int num_cols) {
+  const __m256i reverse = _mm256_setr_epi8(
+      7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2,
+      1, 0, 15, 14, 13, 12, 11, 10, 9, 8);
+  unsigned int bits;
+  int j;
+
+  for (j = 0; j + 32 <= num_cols; j += 32) {
+    __m256i pixels = _mm256_loadu_si256((const __m256i *)(row + j));
+
+    // The high bit is set for white pixels, black ones have to be set instead
+    bits = ~(unsigned int)_mm256_movemask_epi8(
+        _mm256_shuffle_epi8(pixels, reverse));
+    memcpy(packed + j / 8, &bits, sizeof(bits));
+  }
+
+  return j;
+}
+
+/**
+ * Packs a row of num_cols binary pixels, 0 or 255, into packed_row_bytes
+ * bytes. Pixels below 128 are black.
+ */
+void pack_binary_row(const unsigned char *row, unsigned char *packed,
+                     int num_cols) {
+  int j = 0;
+
+  if (detect_simd_level() != SIMD_SCALAR)
+    j = pack_binary_row_avx2(row, packed, num_cols);
+
+  for (; j < num_cols; j += 8) {
+    unsigned char byte = 0;
+
+    for (int b = 0; b < 8 && j + b < num_cols; b++) {
+      if (row[j + b] < 128)
+        byte |= 0x80 >> b;
+    }
+    packed[j / 8] = byte;
+  }
+}
+
+/**
+ * Expands a packed row back into num_cols pixels of 0 (black) or 255.
+ */
+void unpack_binary_row(const unsigned char *packed, unsigned char *row,
+                       int num_cols) {
+  for (int j = 0; j < num_cols; j++) {
+    row[j] = packed[j / 8] & (0x80 >> (j % 8)) ? 0 : 255;
+  }
+}
+
+// Header of a PBM binary image, followed by the width and the height
+#define PBM_HEADER_FORMAT "P4\n# eyetom.com\n%d %d\n"
+
+/**
+ * This function writes the header of a PBM binary image to an already opened
+ * stream, so that the packed rows can follow it.
+ */
+void write_pbm_header(FILE *file, int num_rows, int num_cols) {
+  fprintf(file, PBM_HEADER_FORMAT, num_cols, num_rows);
+}
+
+/**
+ * Writes packed binary image data, num_rows rows of packed_row_bytes(num_cols)
+ * bytes each, to a PBM (P4) image file. Returns 1 on success, 0 if the file
+ * cannot be opened or written.
+ */
+int write_pbm_image(const char *file_name, unsigned char *packed_data,
+                    int num_rows, int num_cols) {
+  size_t size = (size_t)num_rows * packed_row_bytes(num_cols);
+  char header[64];
+  int header_length;
+
+  // Write the header and all rows in one go, without a stdio stream
+  INSTRUMENT_BEGIN(probe);
+  header_length =
+      snprintf(header, sizeof(header), PBM_HEADER_FORMAT, num_cols, num_rows);
+  size_t written =
+      write_image_file(file_name, header, header_length, packed_data, size);
+  INSTRUMENT_END(probe, STAGE_WRITE, written,
+                 written / packed_row_bytes(num_cols) * num_cols);
+
+  return written == size;
+}
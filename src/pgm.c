@@ -1,3 +1,5 @@
+#include "pgm.h"
+#include "instrument.h"
 #include "sauvola.h"
 #include "tools.h"
 #include <ctype.h>
@@ -10,6 +12,38 @@
 /*                           PGM (Portable Gray Map)                          */
 /* -------------------------------------------------------------------------- */
 
+/*
+ * Read header of a PGM binary file from an already opened stream, leaving the
+ * stream positioned at the first pixel. It does not need to seek, so it also
+ * works on pipes. Return 1 if the header is valid, otherwise return 0.
+ */
+int read_pgm_header_stream(FILE *file, int *num_rows, int *num_cols,
+                           int *max_color) {
+  char signature[3]; // PGM signature string "P5"
+  int ok;
+
+  INSTRUMENT_BEGIN(probe);
+
+  // Read the signature and check if it's a valid PGM binary file
+  if (fgets(signature, sizeof(signature), file) == NULL ||
+      signature[0] != 'P' || signature[1] != '5') {
+    INSTRUMENT_END(probe, STAGE_HEADER, 0, 0);
+    return 0;
+  }
+
+  // Skip any comments in the header and read the dimensions and max color value
+  skip_comments(file);
+  ok = fscanf(file, "%d", num_cols) == 1;
+  skip_comments(file);
+  ok = ok && fscanf(file, "%d", num_rows) == 1;
+  skip_comments(file);
+  ok = ok && fscanf(file, "%d", max_color) == 1;
+  fgetc(file);
+  INSTRUMENT_END(probe, STAGE_HEADER, 0, 0);
+
+  return ok && *num_rows > 0 && *num_cols > 0;
+}
+
 /*
  * Read header of a PGM binary file and extract image dimensions and max color
  * value. Return the length of the header in bytes if the file is valid,
@@ -19,7 +53,6 @@ int read_pgm_header(const char *file_name, int *num_rows, int *num_cols,
                     int *max_color) {
   FILE *file_pointer;
   size_t file_length, header_length;
-  char signature[3]; // PGM signature string "P5"
 
   // Try to open the file for binary reading
   if ((file_pointer = fopen(file_name, "rb")) == NULL) {
@@ -31,22 +64,12 @@ int read_pgm_header(const char *file_name, int *num_rows, int *num_cols,
   file_length = ftell(file_pointer);
   fseek(file_pointer, 0, SEEK_SET);
 
-  // Read the signature and check if it's a valid PGM binary file
-  fgets(signature, sizeof(signature), file_pointer);
-  if (signature[0] != 'P' || signature[1] != '5') {
+  // Parse the signature, dimensions and max color value
+  if (!read_pgm_header_stream(file_pointer, num_rows, num_cols, max_color)) {
     fclose(file_pointer);
     return 0;
   }
 
-  // Skip any comments in the header and read the dimensions and max color value
-  skip_comments(file_pointer);
-  fscanf(file_pointer, "%d", num_cols);
-  skip_comments(file_pointer);
-  fscanf(file_pointer, "%d", num_rows);
-  skip_comments(file_pointer);
-  fscanf(file_pointer, "%d", max_color);
-  fgetc(file_pointer);
-
   // Determine the length of the header and close the file
   header_length = ftell(file_pointer);
   fclose(file_pointer);
@@ -80,10 +103,13 @@ int read_pgm_data(unsigned char *image, const char *file_name,
   }
 
   // Seek past the header to the pixel data
+  INSTRUMENT_BEGIN(probe);
   fseek(file, header_length, SEEK_SET);
 
   // Read the pixel data into the buffer
   int rows_read = fread(image, num_cols, num_rows, file);
+  INSTRUMENT_END(probe, STAGE_READ, (long)rows_read * num_cols,
+                 (long)rows_read * num_cols);
 
   // Close the file
   fclose(file);
@@ -97,6 +123,17 @@ int read_pgm_data(unsigned char *image, const char *file_name,
   return 1;
 }
 
+// Header of a PGM binary image, followed by the width, height and max value
+#define PGM_HEADER_FORMAT "P5\n%d %d\n# eyetom.com\n%d\n"
+
+/**
+ * This function writes the header of a PGM binary image to an already opened
+ * stream, so that the pixel data can follow it row by row.
+ */
+void write_pgm_header(FILE *file, int num_rows, int num_cols, int max_val) {
+  fprintf(file, PGM_HEADER_FORMAT, num_cols, num_rows, max_val);
+}
+
 /**
  * This function writes the given image data to a PGM image file with the
  * specified filename. It takes as input the name of the file, a pointer to
@@ -106,27 +143,18 @@ int read_pgm_data(unsigned char *image, const char *file_name,
  */
 int write_pgm_image(const char *file_name, unsigned char *image_data,
                     int num_rows, int num_cols, int max_val) {
-  FILE *file;
-
-  // Attempt to open the file for writing in binary mode
-  if ((file = fopen(file_name, "wb")) == NULL) {
-    return 0;
-  }
-
-  // Write the header information to the file
-  fprintf(file, "P5\n%d %d\n# eyetom.com\n%d\n", num_cols, num_rows, max_val);
-
-  // Write the image data to the file
-  int rows_written = fwrite(image_data, num_cols, num_rows, file);
-
-  // Close the file
-  fclose(file);
-
-  // Check if the number of rows written matches the expected number
-  if (num_rows != rows_written) {
-    return 0;
-  }
-
-  // Return success
-  return 1;
+  size_t size = (size_t)num_rows * num_cols;
+  char header[64];
+  int header_length;
+
+  // Write the header and the image data without a stdio stream
+  INSTRUMENT_BEGIN(probe);
+  header_length = snprintf(header, sizeof(header), PGM_HEADER_FORMAT, num_cols,
+                           num_rows, max_val);
+  size_t written =
+      write_image_file(file_name, header, header_length, image_data, size);
+  INSTRUMENT_END(probe, STAGE_WRITE, written, written);
+
+  // Check if all of the image data was written
+  return written == size;
 }
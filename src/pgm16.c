@@ -0,0 +1,285 @@
+#include "pgm16.h"
+#include "instrument.h"
+#include "integral.h"
+#include "parallel.h"
+#include "sauvola_simd.h"
+#include "tools.h"
+#include <immintrin.h>
+
+/* -------------------------------------------------------------------------- */
+/*                           16-Bit Grayscale Images                          */
+/* -------------------------------------------------------------------------- */
+
+/*
+ * The payload of a 16-bit PGM image holds every sample as two big-endian
+ * bytes. They are swapped with a byte shuffle, 32 or 16 samples per load, and
+ * the integral image of the samples is built with the same two-pass parallel
+ * builder as for 8-bit images. With 16-bit samples the sums of squares of a
+ * window no longer fit 32 bits, so choose_integral_widths picks 64-bit
+ * elements for that plane. The interior of every row is thresholded with the
+ * vectorized kernels of sauvola_simd.c, the borders with the scalar span.
+ */
+
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#define TARGET_AVX512 __attribute__((target("avx512f,avx512bw")))
+
+// Rows per band handed to the thread pool
+#define PGM16_BAND_ROWS 16
+
+/*
+ * Swaps the two bytes of 32 samples per iteration and returns the number of
+ * samples done.
+ */
+static TARGET_AVX512 long swap_samples_avx512(const unsigned char *data,
+                                              unsigned short *samples,
+                                              long num_samples) {
+  const __m512i swap = _mm512_set4_epi32(0x0E0F0C0D, 0x0A0B0809, 0x06070405,
+                                         0x02030001);
+  long i;
+
+  for (i = 0; i + 32 <= num_samples; i += 32) {
+    __m512i bytes = _mm512_loadu_si512((const void *)(data + 2 * i));
+    _mm512_storeu_si512((void *)(samples + i),
+                        _mm512_shuffle_epi8(bytes, swap));
+  }
+
+  return i;
+}
+
+/*
+ * Swaps the two bytes of 16 samples per iteration and returns the number of
+ * samples done.
+ */
+static TARGET_AVX2 long swap_samples_avx2(const unsigned char *data,
+                                          unsigned short *samples,
+                                          long num_samples) {
+  const __m256i swap =
+      _mm256_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14, 1,
+                       0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+  long i;
+
+  for (i = 0; i + 16 <= num_samples; i += 16) {
+    __m256i bytes = _mm256_loadu_si256((const __m256i *)(data + 2 * i));
+    _mm256_storeu_si256((__m256i *)(samples + i),
+                        _mm256_shuffle_epi8(bytes, swap));
+  }
+
+  return i;
+}
+
+/**
+ * Converts num_samples big-endian 16-bit samples, as stored in the payload of
+ * a PGM or PPM image with a max color value above 255, to native unsigned
+ * short values.
+ */
+void load_big_endian_samples(const unsigned char *data,
+                             unsigned short *samples, long num_samples) {
+  enum simd_level level = detect_simd_level();
+  long i = 0;
+
+  if (level == SIMD_AVX512) {
+    i = swap_samples_avx512(data, samples, num_samples);
+  } else if (level == SIMD_AVX2) {
+    i = swap_samples_avx2(data, samples, num_samples);
+  }
+
+  for (; i < num_samples; i++) {
+    samples[i] = (unsigned short)(data[2 * i] << 8 | data[2 * i + 1]);
+  }
+}
+
+/**
+ * Loads the payload of a 16-bit PGM image into native samples and, if
+ * integral_image is not NULL, builds the integral image of the samples with
+ * compute_integral_image_16_pooled. The integral image must have been laid
+ * out for the max color value of the image, see choose_integral_widths.
+ *
+ * @param data The rows of the payload, 2 * num_cols bytes each.
+ * @param grayscale The rows of the 16-bit output.
+ * @param pool The workers building the integral image.
+ */
+void load_pgm16_with_integral_image(unsigned char **data,
+                                    unsigned short **grayscale,
+                                    struct integral_image *integral_image,
+                                    int num_cols, int num_rows,
+                                    struct worker_pool *pool) {
+  INSTRUMENT_BEGIN(probe);
+  for (int i = 0; i < num_rows; i++) {
+    load_big_endian_samples(data[i], grayscale[i], num_cols);
+  }
+  INSTRUMENT_END(probe, STAGE_GRAY, 4L * num_rows * num_cols,
+                 (long)num_rows * num_cols);
+
+  if (integral_image != NULL)
+    compute_integral_image_16_pooled(grayscale, integral_image, num_cols,
+                                     num_rows, pool);
+}
+
+/**
+ * Scales the dynamic range R, given for 8-bit images like everywhere else, to
+ * an image with the given max color value. Sauvola's threshold scales with
+ * the pixels as long as R does, so an image multiplied by max_color / 255 is
+ * binarized the same way with the scaled R.
+ */
+float sauvola_R_for_max_color(float R, int max_color) {
+  return max_color > 255 ? R * max_color / 255.0f : R;
+}
+
+/*
+ * Thresholds the pixels of row i of a 16-bit image in columns
+ * [col_begin, col_end) with the reference formula of
+ * sauvola_threshold_with_integral_image_span. It is always inlined with
+ * constant widths.
+ */
+static inline __attribute__((always_inline)) void
+sauvola_span_16_with_widths(unsigned short **grayscale,
+                            struct integral_image *integral_image,
+                            unsigned char **output, int num_cols,
+                            int num_rows, float k, int r, float R, int i,
+                            int col_begin, int col_end, int sum_bits,
+                            int sum_squares_bits) {
+  int top = fmax(i - r, 0);
+  int bottom = fmin(i + r, num_rows - 1);
+  long top_row = INTEGRAL_INDEX(integral_image, top - 1, 0);
+  long bottom_row = INTEGRAL_INDEX(integral_image, bottom, 0);
+  const void *sums = integral_image->sum;
+  const void *squares = integral_image->sum_squares;
+  long step = integral_image->step;
+  unsigned long long sum, sum_squares;
+  double mean, stdev, threshold, count, reciprocal;
+  int height = bottom - top + 1;
+  double interior_reciprocal = 1.0 / ((double)(2 * r + 1) * height);
+
+  for (int j = col_begin; j < col_end; j++) {
+    int left = j - r > 0 ? j - r : 0;
+    int right = j + r < num_cols - 1 ? j + r : num_cols - 1;
+    long A_index = top_row + (left - 1) * step;
+    long B_index = top_row + right * step;
+    long C_index = bottom_row + (left - 1) * step;
+    long D_index = bottom_row + right * step;
+
+    sum = (integral_plane_load(sums, sum_bits, D_index) -
+           integral_plane_load(sums, sum_bits, B_index) -
+           integral_plane_load(sums, sum_bits, C_index) +
+           integral_plane_load(sums, sum_bits, A_index)) &
+          integral_plane_mask(sum_bits);
+    sum_squares = (integral_plane_load(squares, sum_squares_bits, D_index) -
+                   integral_plane_load(squares, sum_squares_bits, B_index) -
+                   integral_plane_load(squares, sum_squares_bits, C_index) +
+                   integral_plane_load(squares, sum_squares_bits, A_index)) &
+                  integral_plane_mask(sum_squares_bits);
+    count = (double)(right - left + 1) * height;
+    reciprocal = right - left == 2 * r ? interior_reciprocal : 1.0 / count;
+
+    mean = window_quotient(sum, count, reciprocal);
+    stdev = sqrt(window_quotient(sum_squares, count, reciprocal) -
+                 (mean * mean));
+    threshold = mean * (1.0 + k * ((stdev / R) - 1.0));
+
+    output[i][j] = grayscale[i][j] > threshold ? 255 : 0;
+  }
+}
+
+/**
+ * Binarizes the pixels of row i of a 16-bit image whose column lies in
+ * [col_begin, col_end), given the integral image of the whole image. This is
+ * the scalar reference that the vectorized kernels fall back to near the
+ * image border.
+ */
+void sauvola_threshold_16_with_integral_image_span(
+    unsigned short **grayscale, struct integral_image *integral_image,
+    unsigned char **output, int num_cols, int num_rows, float k, int r, float R,
+    int i, int col_begin, int col_end) {
+  if (integral_image->sum_bits == 32 &&
+      integral_image->sum_squares_bits == 32) {
+    sauvola_span_16_with_widths(grayscale, integral_image, output, num_cols,
+                                num_rows, k, r, R, i, col_begin, col_end, 32,
+                                32);
+  } else if (integral_image->sum_bits == 32) {
+    sauvola_span_16_with_widths(grayscale, integral_image, output, num_cols,
+                                num_rows, k, r, R, i, col_begin, col_end, 32,
+                                64);
+  } else {
+    sauvola_span_16_with_widths(grayscale, integral_image, output, num_cols,
+                                num_rows, k, r, R, i, col_begin, col_end, 64,
+                                64);
+  }
+}
+
+/**
+ * Binarizes the rows [row_begin, row_end) of a 16-bit image with the integral
+ * image Sauvola algorithm, given the integral image of the whole image. R is
+ * the dynamic range in the units of the samples, see sauvola_R_for_max_color.
+ */
+void sauvola_threshold_16_with_integral_image_rows(
+    unsigned short **grayscale, struct integral_image *integral_image,
+    unsigned char **output, int num_cols, int num_rows, float k, int r, float R,
+    int row_begin, int row_end) {
+  for (int i = row_begin; i < row_end; i++) {
+    sauvola_threshold_16_with_integral_image_span(grayscale, integral_image,
+                                                  output, num_cols, num_rows, k,
+                                                  r, R, i, 0, num_cols);
+  }
+}
+
+struct sauvola16_job {
+  unsigned short **grayscale;
+  struct integral_image *integral_image;
+  unsigned char **output;
+  int num_cols;
+  int num_rows;
+  float k;
+  int r;
+  float R;
+  enum simd_level level;
+};
+
+static void sauvola16_band_task(void *context, int task_index,
+                                int worker_index) {
+  struct sauvola16_job *job = (struct sauvola16_job *)context;
+  int row_begin = task_index * PGM16_BAND_ROWS;
+  int row_end = fmin(row_begin + PGM16_BAND_ROWS, job->num_rows);
+
+  sauvola_threshold_16_with_integral_image_simd_rows(
+      job->grayscale, job->integral_image, job->output, job->num_cols,
+      job->num_rows, job->k, job->r, job->R, job->level, row_begin, row_end);
+}
+
+/**
+ * Multithreaded version of sauvola_threshold_16_with_integral_image_rows over
+ * the whole image, in bands of rows, with the vectorized kernels of the
+ * running CPU.
+ *
+ * @param num_threads The number of threads to use. Values below 1 select one
+ * thread per online processor.
+ */
+void sauvola_threshold_16_with_integral_image_parallel(
+    unsigned short **grayscale, struct integral_image *integral_image,
+    unsigned char **output, int num_cols, int num_rows, float k, int r, float R,
+    int num_threads) {
+  struct sauvola16_job job = {grayscale, integral_image, output,
+                              num_cols,  num_rows,       k,
+                              r,         R,              detect_simd_level()};
+  int num_bands = (num_rows + PGM16_BAND_ROWS - 1) / PGM16_BAND_ROWS;
+
+  if (!parallel_for(num_bands, num_threads, sauvola16_band_task, &job))
+    sauvola_threshold_16_with_integral_image_simd_rows(
+        grayscale, integral_image, output, num_cols, num_rows, k, r, R,
+        job.level, 0, num_rows);
+}
+
+/**
+ * Same as sauvola_threshold_16_with_integral_image_parallel on the threads of
+ * a worker pool.
+ */
+void sauvola_threshold_16_with_integral_image_pooled(
+    unsigned short **grayscale, struct integral_image *integral_image,
+    unsigned char **output, int num_cols, int num_rows, float k, int r, float R,
+    struct worker_pool *pool) {
+  struct sauvola16_job job = {grayscale, integral_image, output,
+                              num_cols,  num_rows,       k,
+                              r,         R,              detect_simd_level()};
+  int num_bands = (num_rows + PGM16_BAND_ROWS - 1) / PGM16_BAND_ROWS;
+
+  worker_pool_run(pool, num_bands, sauvola16_band_task, &job);
+}
@@ -1,3 +1,10 @@
+#include "context.h"
+#include "instrument.h"
+#include "mapped.h"
+#include "pgm.h"
+#include "pgm16.h"
+#include "ppm.h"
+#include "rgb.h"
 #include "sauvola.h"
 #include "tools.h"
 #include <ctype.h>
@@ -27,6 +34,7 @@ int read_ppm_header(const char *filename, int *num_rows, int *num_cols,
   if ((file = fopen(filename, "rb")) == NULL) {
     return 0; // unable to open file
   }
+  INSTRUMENT_BEGIN(probe);
 
   // get file length and return to beginning of file
   fseek(file, 0, SEEK_END);
@@ -37,6 +45,7 @@ int read_ppm_header(const char *filename, int *num_rows, int *num_cols,
   fgets(signature, sizeof(signature), file);
   if (signature[0] != 'P' || signature[1] != '6') {
     fclose(file);
+    INSTRUMENT_END(probe, STAGE_HEADER, 0, 0);
     return 0; // not a valid PPM file
   }
 
@@ -55,6 +64,7 @@ int read_ppm_header(const char *filename, int *num_rows, int *num_cols,
   // calculate the header length and close the file
   header_length = ftell(file);
   fclose(file);
+  INSTRUMENT_END(probe, STAGE_HEADER, header_length, 0);
 
   // check that the data size in bytes matches the expected size
   if ((*num_rows) * 3 * (*num_cols) != (file_lenght - header_length)) {
@@ -74,28 +84,8 @@ int read_ppm_header(const char *filename, int *num_rows, int *num_cols,
 int write_ppm_data(const char *file_name, unsigned char *red_channel,
                    unsigned char *green_channel, unsigned char *blue_channel,
                    int num_rows, int num_cols, int max_color) {
-  long i, total_pixels; // width times height
-  FILE *file;
-
-  // open file for writing in binary mode
-  if ((file = fopen(file_name, "wb")) == NULL) {
-    return 0; // unable to open file
-  }
-
-  // write the PPM header to the file
-  fprintf(file, "P6\n%d %d\n# eyetom.com\n%d\n", num_cols, num_rows, max_color);
-
-  total_pixels = num_rows * num_cols;
-  for (i = 0; i < total_pixels; i++) {
-    // Write the image data in pixel interleaved format (R, G, B)
-    fputc(red_channel[i], file);
-    fputc(green_channel[i], file);
-    fputc(blue_channel[i], file);
-  }
-
-  // close the file and return success
-  fclose(file);
-  return 1;
+  return write_ppm_image(file_name, red_channel, green_channel, blue_channel,
+                         num_rows, num_cols, max_color);
 }
 
 /**
@@ -109,10 +99,13 @@ int read_ppm_data(unsigned char *red_channel, unsigned char *green_channel,
                   unsigned char *blue_channel, const char *filename,
                   int header_length, int num_rows, int num_cols,
                   int max_color) {
-  long i, total_pixels;
+  long total_pixels = (long)num_rows * num_cols;
+  unsigned char *pixels;
+  size_t count;
   FILE *file;
 
-  // Check if the image has only 1-byte color values
+  // Check if the image has only 1-byte color values, 16-bit images are
+  // binarized from the mapped payload by ppm_sauvola_flow_with_integral_image
   if (max_color > 255) {
     return 0;
   }
@@ -122,20 +115,32 @@ int read_ppm_data(unsigned char *red_channel, unsigned char *green_channel,
     return 0;
   }
 
-  // Seek to the start of the pixel data
+  // Read the whole interleaved payload in one go
+  if ((pixels = (unsigned char *)malloc(3 * total_pixels)) == NULL) {
+    fclose(file);
+    return 0;
+  }
+  INSTRUMENT_BEGIN(probe);
   fseek(file, header_length, SEEK_SET);
+  count = fread(pixels, 3, total_pixels, file);
+  fclose(file);
 
-  // Read the pixel data into the RGB channel arrays
-  total_pixels = num_rows * num_cols;
-  for (i = 0; i < total_pixels; i++) {
-    red_channel[i] = (unsigned char)fgetc(file);
-    green_channel[i] = (unsigned char)fgetc(file);
-    blue_channel[i] = (unsigned char)fgetc(file);
-  }
+  // Split the pixel data into the RGB channel arrays
+  if (count == (size_t)total_pixels)
+    deinterleave_rgb(pixels, red_channel, green_channel, blue_channel,
+                     total_pixels);
+  INSTRUMENT_END(probe, STAGE_READ, 3 * count, count);
 
-  // Close the file and return success
-  fclose(file);
-  return 1;
+  free(pixels);
+  return count == (size_t)total_pixels;
+}
+
+/**
+ * This function writes the header of a PPM binary image to an already opened
+ * stream, so that the pixel data can follow it row by row.
+ */
+void write_ppm_header(FILE *file, int num_rows, int num_cols, int max_color) {
+  fprintf(file, "P6\n%d %d\n# eyetom.com\n%d\n", num_cols, num_rows, max_color);
 }
 
 /**
@@ -148,89 +153,93 @@ int read_ppm_data(unsigned char *red_channel, unsigned char *green_channel,
 int write_ppm_image(const char *file_name, unsigned char *red_channel,
                     unsigned char *green_channel, unsigned char *blue_channel,
                     int num_rows, int num_cols, int max_color) {
-  // Declare variables
-  long total_pixels;
-  int i;
+  // Calculate total number of pixels in image
+  long total_pixels = (long)num_rows * num_cols;
+  unsigned char *pixels;
+  size_t count;
   FILE *file;
 
+  // Merge the channels into one pixel interleaved buffer
+  if ((pixels = (unsigned char *)malloc(3 * total_pixels)) == NULL) {
+    return 0;
+  }
+  INSTRUMENT_BEGIN(probe);
+  interleave_rgb(red_channel, green_channel, blue_channel, pixels,
+                 total_pixels);
+
   // Attempt to open the file in binary mode
   if ((file = fopen(file_name, "wb")) == NULL) {
+    free(pixels);
+    INSTRUMENT_END(probe, STAGE_WRITE, 0, 0);
     return 0;
   }
 
   // Write PPM header to file
-  fprintf(file, "P6\n%d %d\n# eyetom.com\n%d\n", num_cols, num_rows, max_color);
-
-  // Calculate total number of pixels in image
-  total_pixels = num_rows * num_cols;
+  write_ppm_header(file, num_rows, num_cols, max_color);
 
-  // Write the image data in pixel interleaved format
-  for (i = 0; i < total_pixels; i++) {
-    fputc(red_channel[i], file);
-    fputc(green_channel[i], file);
-    fputc(blue_channel[i], file);
-  }
+  // Write the image data with a single call
+  count = fwrite(pixels, 3, total_pixels, file);
 
   // Close the file
-  fclose(file);
+  if (fclose(file) != 0)
+    count = 0;
+  free(pixels);
+  INSTRUMENT_END(probe, STAGE_WRITE, 3 * count, count);
 
-  // Return success
-  return 1;
+  return count == (size_t)total_pixels;
 }
 
 void ppm_sauvola_flow(const char *input_file_name,
-                      const char *output_file_name) {
+                      const char *output_file_name,
+                      struct sauvola_context *context) {
   int num_rows, num_cols;
-  int max_color;
-  int header_length, i, j;
-  clock_t start_time, end_time;
+  struct mapped_image image;
+  struct sauvola_context local_context;
+  double start_time, end_time;
   double elapsed_time;
 
-  // Read header to get dimensions and max color value
-  if ((header_length = read_ppm_header(input_file_name, &num_rows, &num_cols,
-                                       &max_color)) <= 0)
-    exit(1);
-
-  // Allocate memory for grayscale array
-  unsigned char **grayscale = alloc_2D_unsigned_char(num_rows, num_cols);
+  // Use a context of our own if the caller does not reuse one
+  if (context == NULL) {
+    init_sauvola_context(&local_context);
+    context = &local_context;
+  }
 
-  // Allocate memory for RGB arrays
-  unsigned char **red_channel = alloc_2D_unsigned_char(num_rows, num_cols);
-  unsigned char **green_channel = alloc_2D_unsigned_char(num_rows, num_cols);
-  unsigned char **blue_channel = alloc_2D_unsigned_char(num_rows, num_cols);
+  // Map the image to read the interleaved payload in place
+  if (!map_pnm_image(input_file_name, &image, context) || image.channels != 3 ||
+      image.max_color > 255)
+    exit(1);
+  num_rows = image.num_rows;
+  num_cols = image.num_cols;
 
-  // Read RGB data from file
-  if (read_ppm_data(red_channel[0], green_channel[0], blue_channel[0],
-                    input_file_name, header_length, num_rows, num_cols,
-                    max_color) == 0)
+  // Take the grayscale array from the context
+  unsigned char **grayscale = context_grayscale(context, num_rows, num_cols);
+  if (grayscale == NULL)
     exit(1);
 
-  // Compute grayscale values from RGB values
-  unsigned char r, g, b, gray_value;
-  for (i = 0; i < num_rows; ++i) {
-    for (j = 0; j < num_cols; ++j) {
-      r = red_channel[i][j];
-      g = green_channel[i][j];
-      b = blue_channel[i][j];
-      gray_value = (unsigned char)((0.299 * r) + (0.587 * g) + (0.114 * b));
-      grayscale[i][j] = gray_value;
-    }
-  }
+  // Compute grayscale values straight from the interleaved RGB values
+  rgb_to_gray_with_integral_image(image.rows, grayscale, NULL, num_cols,
+                                  num_rows);
+  unmap_pnm_image(&image);
 
-  // Allocate memory for output array
-  unsigned char **output = alloc_2D_unsigned_char(num_rows, num_cols);
+  // Take the output array from the context
+  unsigned char **output = context_output(context, num_rows, num_cols);
+  if (output == NULL)
+    exit(1);
 
   // start timing
-  start_time = clock();
+  start_time = wall_time_ms();
+  INSTRUMENT_BEGIN(probe);
 
   // Sauvola threshold
   sauvola_threshold(grayscale, output, num_cols, num_rows, 0.5, 13, 255);
 
   // end timing
-  end_time = clock();
+  INSTRUMENT_END(probe, STAGE_THRESHOLD, 2L * num_rows * num_cols,
+                 (long)num_rows * num_cols);
+  end_time = wall_time_ms();
 
   // calculate elapsed time in milliseconds
-  elapsed_time = ((double)(end_time - start_time) / CLOCKS_PER_SEC) * 1000.0;
+  elapsed_time = end_time - start_time;
 
   // print elapsed time
   printf("Sauvola Elapsed time: %f ms\n", elapsed_time);
@@ -240,96 +249,111 @@ void ppm_sauvola_flow(const char *input_file_name,
       0)
     exit(1);
 
-  free(red_channel[0]);
-  free(red_channel);
-  free(green_channel[0]);
-  free(green_channel);
-  free(blue_channel[0]);
-  free(blue_channel);
-  free(grayscale[0]);
-  free(grayscale);
-  free(output[0]);
-  free(output);
+  if (context == &local_context)
+    free_sauvola_context(&local_context);
 }
 
+/**
+ * Binarizes a PPM image with the integral image Sauvola algorithm on
+ * num_threads threads. 16-bit images, with a max color value above 255, are
+ * converted to 16-bit grayscale and thresholded natively, see pgm16.h.
+ *
+ * @param num_threads The number of threads to use. Values below 1 select one
+ * thread per online processor.
+ */
 double ppm_sauvola_flow_with_integral_image(const char *input_file_name,
-                                            const char *output_file_name) {
+                                            const char *output_file_name,
+                                            int num_threads,
+                                            struct sauvola_context *context) {
   int num_rows, num_cols;
   int max_color;
-  int header_length, i, j;
-  clock_t start_time, end_time;
+  struct mapped_image image;
+  struct sauvola_context local_context;
+  double start_time, end_time;
   double elapsed_time;
 
-  // Read header to get dimensions and max color value
-  if ((header_length = read_ppm_header(input_file_name, &num_rows, &num_cols,
-                                       &max_color)) <= 0)
-    exit(1);
-
-  // Allocate memory for grayscale array
-  unsigned char **grayscale = alloc_2D_unsigned_char(num_rows, num_cols);
-
-  // Allocate memory for RGB arrays
-  unsigned char **red_channel = alloc_2D_unsigned_char(num_rows, num_cols);
-  unsigned char **green_channel = alloc_2D_unsigned_char(num_rows, num_cols);
-  unsigned char **blue_channel = alloc_2D_unsigned_char(num_rows, num_cols);
-
-  // Read RGB data from file
-  if (read_ppm_data(red_channel[0], green_channel[0], blue_channel[0],
-                    input_file_name, header_length, num_rows, num_cols,
-                    max_color) == 0)
-    exit(1);
-
-  // Compute grayscale values from RGB values
-  unsigned char r, g, b, gray_value;
-  for (i = 0; i < num_rows; ++i) {
-    for (j = 0; j < num_cols; ++j) {
-      r = red_channel[i][j];
-      g = green_channel[i][j];
-      b = blue_channel[i][j];
-      gray_value = (unsigned char)((0.299 * r) + (0.587 * g) + (0.114 * b));
-      grayscale[i][j] = gray_value;
-    }
+  // Use a context of our own if the caller does not reuse one
+  if (context == NULL) {
+    init_sauvola_context(&local_context);
+    context = &local_context;
   }
 
-  // Allocate memory for output array
-  unsigned char **output = alloc_2D_unsigned_char(num_rows, num_cols);
+  // Map the image to read the interleaved payload in place
+  if (!map_pnm_image(input_file_name, &image, context) || image.channels != 3 ||
+      image.max_color > PGM16_MAX_COLOR)
+    exit(1);
+  num_rows = image.num_rows;
+  num_cols = image.num_cols;
+  max_color = image.max_color;
+
+  // Take the grayscale array of the image's sample width from the context
+  unsigned char **grayscale = NULL;
+  unsigned short **grayscale16 = NULL;
+  if (max_color > 255)
+    grayscale16 = context_grayscale16(context, num_rows, num_cols);
+  else
+    grayscale = context_grayscale(context, num_rows, num_cols);
+  if (grayscale == NULL && grayscale16 == NULL)
+    exit(1);
 
-  // Allocate memory for integral image 3D array
-  unsigned long long ***integral_image =
-      alloc_integral_image(num_rows, num_cols);
+  // Take the integral image from the context
+  struct integral_image *integral_image =
+      context_integral_image(context, num_rows, num_cols, max_color, 13);
+  if (integral_image == NULL)
+    exit(1);
 
-  // Calculate integral image
-  compute_integral_image(grayscale, integral_image, num_cols, num_rows);
+  // Take the output array and the workers from the context
+  unsigned char **output = context_output(context, num_rows, num_cols);
+  struct worker_pool *pool = context_worker_pool(context, num_threads);
+  if (output == NULL || pool == NULL)
+    exit(1);
 
-  // start timing
-  start_time = clock();
+  // start timing, the integral image is built with the grayscale image
+  start_time = wall_time_ms();
 
-  // Sauvola threshold
-  sauvola_threshold_with_integral_image(grayscale, integral_image, output,
-                                        num_cols, num_rows, 0.5, 13, 255);
+  if (max_color > 255) {
+    // Compute 16-bit grayscale values and their integral image, and
+    // threshold with R scaled to the max color value
+    rgb16_to_gray16_with_integral_image(image.rows, grayscale16,
+                                        integral_image, num_cols, num_rows,
+                                        pool);
+    unmap_pnm_image(&image);
+
+    INSTRUMENT_BEGIN(probe);
+    sauvola_threshold_16_with_integral_image_pooled(
+        grayscale16, integral_image, output, num_cols, num_rows, 0.5, 13,
+        sauvola_R_for_max_color(255, max_color), pool);
+    INSTRUMENT_END(probe, STAGE_THRESHOLD, 3L * num_rows * num_cols,
+                   (long)num_rows * num_cols);
+  } else {
+    // Compute grayscale values straight from the interleaved RGB values and
+    // accumulate the integral image in the same pass
+    rgb_to_gray_with_integral_image(image.rows, grayscale, integral_image,
+                                    num_cols, num_rows);
+    unmap_pnm_image(&image);
+
+    // Sauvola threshold
+    INSTRUMENT_BEGIN(probe);
+    sauvola_threshold_with_integral_image_pooled(grayscale, integral_image,
+                                                 output, num_cols, num_rows,
+                                                 0.5, 13, 255, pool);
+    INSTRUMENT_END(probe, STAGE_THRESHOLD, 2L * num_rows * num_cols,
+                   (long)num_rows * num_cols);
+  }
 
   // end timing
-  end_time = clock();
+  end_time = wall_time_ms();
 
   // calculate elapsed time in milliseconds
-  elapsed_time = ((double)(end_time - start_time) / CLOCKS_PER_SEC) * 1000.0;
+  elapsed_time = end_time - start_time;
 
   // write pgm file
   if (write_pgm_image(output_file_name, output[0], num_rows, num_cols, 255) ==
       0)
     exit(1);
 
-  free(red_channel[0]);
-  free(red_channel);
-  free(green_channel[0]);
-  free(green_channel);
-  free(blue_channel[0]);
-  free(blue_channel);
-  free(grayscale[0]);
-  free(grayscale);
-  free(output[0]);
-  free(output);
-  free(integral_image[0][0]);
-  free(integral_image[0]);
-  free(integral_image);
-}
\ No newline at end of file
+  if (context == &local_context)
+    free_sauvola_context(&local_context);
+
+  return elapsed_time;
+}
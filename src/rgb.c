@@ -0,0 +1,435 @@
+#include "rgb.h"
+#include "instrument.h"
+#include "integral.h"
+#include "sauvola_simd.h"
+#include "tools.h"
+#include <immintrin.h>
+
+/* -------------------------------------------------------------------------- */
+/*                         RGB Interleaving Kernels                           */
+/* -------------------------------------------------------------------------- */
+
+/*
+ * The vectorized kernels move 16 pixels, 48 interleaved bytes, per 128-bit
+ * lane with byte shuffles. Each of the three 16-byte blocks holds parts of
+ * every channel, so a channel is gathered by shuffling each block with its own
+ * mask and OR-ing the results; mask bytes with the high bit set produce zeros.
+ * An AVX2 register holds two independent groups of 16 pixels, one per lane,
+ * so no shuffle ever has to cross a lane.
+ */
+
+#define TARGET_AVX2 __attribute__((target("avx2")))
+
+// Shuffle index that produces a zero byte
+#define Z -128
+
+/*
+ * deinterleave_masks[c][b] moves the bytes of channel c found in block b of
+ * 48 interleaved bytes to their pixel positions.
+ */
+static const signed char deinterleave_masks[3][3][16] = {
+    {{0, 3, 6, 9, 12, 15, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z},
+     {Z, Z, Z, Z, Z, Z, 2, 5, 8, 11, 14, Z, Z, Z, Z, Z},
+     {Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, 1, 4, 7, 10, 13}},
+    {{1, 4, 7, 10, 13, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z},
+     {Z, Z, Z, Z, Z, 0, 3, 6, 9, 12, 15, Z, Z, Z, Z, Z},
+     {Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, 2, 5, 8, 11, 14}},
+    {{2, 5, 8, 11, 14, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z},
+     {Z, Z, Z, Z, Z, 1, 4, 7, 10, 13, Z, Z, Z, Z, Z, Z},
+     {Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, 0, 3, 6, 9, 12, 15}}};
+
+/*
+ * interleave_masks[b][c] moves the pixels of channel c to their byte positions
+ * in block b of 48 interleaved bytes.
+ */
+static const signed char interleave_masks[3][3][16] = {
+    {{0, Z, Z, 1, Z, Z, 2, Z, Z, 3, Z, Z, 4, Z, Z, 5},
+     {Z, 0, Z, Z, 1, Z, Z, 2, Z, Z, 3, Z, Z, 4, Z, Z},
+     {Z, Z, 0, Z, Z, 1, Z, Z, 2, Z, Z, 3, Z, Z, 4, Z}},
+    {{Z, Z, 6, Z, Z, 7, Z, Z, 8, Z, Z, 9, Z, Z, 10, Z},
+     {5, Z, Z, 6, Z, Z, 7, Z, Z, 8, Z, Z, 9, Z, Z, 10},
+     {Z, 5, Z, Z, 6, Z, Z, 7, Z, Z, 8, Z, Z, 9, Z, Z}},
+    {{Z, 11, Z, Z, 12, Z, Z, 13, Z, Z, 14, Z, Z, 15, Z, Z},
+     {Z, Z, 11, Z, Z, 12, Z, Z, 13, Z, Z, 14, Z, Z, 15, Z},
+     {10, Z, Z, 11, Z, Z, 12, Z, Z, 13, Z, Z, 14, Z, Z, 15}}};
+
+/*
+ * deinterleave16_masks[c][b] moves the samples of channel c found in block b
+ * of 48 bytes, 8 pixels of two big-endian bytes per channel, to their pixel
+ * positions, swapping their bytes on the way.
+ */
+static const signed char deinterleave16_masks[3][3][16] = {
+    {{1, 0, 7, 6, 13, 12, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z},
+     {Z, Z, Z, Z, Z, Z, 3, 2, 9, 8, 15, 14, Z, Z, Z, Z},
+     {Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, 5, 4, 11, 10}},
+    {{3, 2, 9, 8, 15, 14, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z},
+     {Z, Z, Z, Z, Z, Z, 5, 4, 11, 10, Z, Z, Z, Z, Z, Z},
+     {Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, 1, 0, 7, 6, 13, 12}},
+    {{5, 4, 11, 10, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, Z},
+     {Z, Z, Z, Z, 1, 0, 7, 6, 13, 12, Z, Z, Z, Z, Z, Z},
+     {Z, Z, Z, Z, Z, Z, Z, Z, Z, Z, 3, 2, 9, 8, 15, 14}}};
+
+#undef Z
+
+/*
+ * Loads a 16-byte shuffle mask into both lanes.
+ */
+static inline TARGET_AVX2 __m256i load_mask_avx2(const signed char *mask) {
+  return _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)mask));
+}
+
+/*
+ * Loads 16 bytes into the low lane and the 16 bytes at offset 48 into the high
+ * lane.
+ */
+static inline TARGET_AVX2 __m256i load_lanes_avx2(const unsigned char *data) {
+  return _mm256_inserti128_si256(
+      _mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)data)),
+      _mm_loadu_si128((const __m128i *)(data + 48)), 1);
+}
+
+/*
+ * Stores the low lane at data and the high lane at offset 48.
+ */
+static inline TARGET_AVX2 void store_lanes_avx2(unsigned char *data,
+                                                __m256i value) {
+  _mm_storeu_si128((__m128i *)data, _mm256_castsi256_si128(value));
+  _mm_storeu_si128((__m128i *)(data + 48), _mm256_extracti128_si256(value, 1));
+}
+
+/*
+ * Splits 32 pixels per iteration and returns the number of pixels done.
+ */
+static TARGET_AVX2 long deinterleave_rgb_avx2(const unsigned char *rgb,
+                                              unsigned char **channels,
+                                              long num_pixels) {
+  __m256i masks[3][3];
+  long i;
+  int c, b;
+
+  for (c = 0; c < 3; c++)
+    for (b = 0; b < 3; b++)
+      masks[c][b] = load_mask_avx2(deinterleave_masks[c][b]);
+
+  for (i = 0; i + 32 <= num_pixels; i += 32) {
+    const unsigned char *source = rgb + 3 * i;
+    __m256i blocks[3] = {load_lanes_avx2(source),
+                         load_lanes_avx2(source + 16),
+                         load_lanes_avx2(source + 32)};
+
+    for (c = 0; c < 3; c++) {
+      __m256i channel = _mm256_setzero_si256();
+
+      for (b = 0; b < 3; b++)
+        channel = _mm256_or_si256(channel,
+                                  _mm256_shuffle_epi8(blocks[b], masks[c][b]));
+      _mm256_storeu_si256((__m256i *)(channels[c] + i), channel);
+    }
+  }
+
+  return i;
+}
+
+/*
+ * Merges 32 pixels per iteration and returns the number of pixels done.
+ */
+static TARGET_AVX2 long interleave_rgb_avx2(const unsigned char **channels,
+                                            unsigned char *rgb,
+                                            long num_pixels) {
+  __m256i masks[3][3];
+  long i;
+  int c, b;
+
+  for (b = 0; b < 3; b++)
+    for (c = 0; c < 3; c++)
+      masks[b][c] = load_mask_avx2(interleave_masks[b][c]);
+
+  for (i = 0; i + 32 <= num_pixels; i += 32) {
+    unsigned char *target = rgb + 3 * i;
+    __m256i pixels[3];
+
+    for (c = 0; c < 3; c++)
+      pixels[c] = _mm256_loadu_si256((const __m256i *)(channels[c] + i));
+
+    for (b = 0; b < 3; b++) {
+      __m256i block = _mm256_setzero_si256();
+
+      for (c = 0; c < 3; c++)
+        block = _mm256_or_si256(block,
+                                _mm256_shuffle_epi8(pixels[c], masks[b][c]));
+      store_lanes_avx2(target + 16 * b, block);
+    }
+  }
+
+  return i;
+}
+
+/**
+ * Splits num_pixels interleaved (R, G, B) pixels into three planar channels.
+ */
+void deinterleave_rgb(const unsigned char *rgb, unsigned char *red_channel,
+                      unsigned char *green_channel,
+                      unsigned char *blue_channel, long num_pixels) {
+  unsigned char *channels[3] = {red_channel, green_channel, blue_channel};
+  long i = 0;
+
+  if (detect_simd_level() != SIMD_SCALAR)
+    i = deinterleave_rgb_avx2(rgb, channels, num_pixels);
+
+  for (; i < num_pixels; i++) {
+    red_channel[i] = rgb[3 * i];
+    green_channel[i] = rgb[3 * i + 1];
+    blue_channel[i] = rgb[3 * i + 2];
+  }
+}
+
+/**
+ * Merges three planar channels into num_pixels interleaved (R, G, B) pixels.
+ */
+void interleave_rgb(const unsigned char *red_channel,
+                    const unsigned char *green_channel,
+                    const unsigned char *blue_channel, unsigned char *rgb,
+                    long num_pixels) {
+  const unsigned char *channels[3] = {red_channel, green_channel,
+                                      blue_channel};
+  long i = 0;
+
+  if (detect_simd_level() != SIMD_SCALAR)
+    i = interleave_rgb_avx2(channels, rgb, num_pixels);
+
+  for (; i < num_pixels; i++) {
+    rgb[3 * i] = red_channel[i];
+    rgb[3 * i + 1] = green_channel[i];
+    rgb[3 * i + 2] = blue_channel[i];
+  }
+}
+
+/* -------------------------------------------------------------------------- */
+/*                          RGB to Grayscale Kernels                          */
+/* -------------------------------------------------------------------------- */
+
+/*
+ * Luma weights 0.299, 0.587 and 0.114 in 16.16 fixed point. They add up to
+ * exactly 65536, so white stays 255. Like the cast of the double precision
+ * formula the result is truncated, and the two differ by at most one level.
+ */
+#define LUMA_RED_WEIGHT 19595
+#define LUMA_GREEN_WEIGHT 38470
+#define LUMA_BLUE_WEIGHT 7471
+
+/*
+ * Converts 32 pixels per iteration and returns the number of pixels done. The
+ * green weight does not fit a signed 16-bit multiplier, so it is split in
+ * half: the (R, G) and the (G, B) pairs are multiply-added with
+ * (red, green / 2) and (green / 2, blue) and the two partial sums added.
+ */
+static TARGET_AVX2 long rgb_to_gray_avx2(const unsigned char *rgb,
+                                         unsigned char *gray,
+                                         long num_pixels) {
+  __m256i masks[3][3];
+  __m256i red_green_weights = _mm256_set1_epi32(
+      (LUMA_GREEN_WEIGHT / 2) << 16 | LUMA_RED_WEIGHT);
+  __m256i green_blue_weights =
+      _mm256_set1_epi32(LUMA_BLUE_WEIGHT << 16 | LUMA_GREEN_WEIGHT / 2);
+  __m256i zero = _mm256_setzero_si256();
+  long i;
+  int c, b;
+
+  for (c = 0; c < 3; c++)
+    for (b = 0; b < 3; b++)
+      masks[c][b] = load_mask_avx2(deinterleave_masks[c][b]);
+
+  for (i = 0; i + 32 <= num_pixels; i += 32) {
+    const unsigned char *source = rgb + 3 * i;
+    __m256i blocks[3] = {load_lanes_avx2(source),
+                         load_lanes_avx2(source + 16),
+                         load_lanes_avx2(source + 32)};
+    __m256i channels[3], halves[2];
+
+    for (c = 0; c < 3; c++) {
+      channels[c] = _mm256_setzero_si256();
+      for (b = 0; b < 3; b++)
+        channels[c] =
+            _mm256_or_si256(channels[c],
+                            _mm256_shuffle_epi8(blocks[b], masks[c][b]));
+    }
+
+    // Widen to 16 bits, weigh in 32 bits and narrow back, every unpack is
+    // undone by the matching pack
+    for (b = 0; b < 2; b++) {
+      __m256i red = b ? _mm256_unpackhi_epi8(channels[0], zero)
+                      : _mm256_unpacklo_epi8(channels[0], zero);
+      __m256i green = b ? _mm256_unpackhi_epi8(channels[1], zero)
+                        : _mm256_unpacklo_epi8(channels[1], zero);
+      __m256i blue = b ? _mm256_unpackhi_epi8(channels[2], zero)
+                       : _mm256_unpacklo_epi8(channels[2], zero);
+      __m256i low = _mm256_add_epi32(
+          _mm256_madd_epi16(_mm256_unpacklo_epi16(red, green),
+                            red_green_weights),
+          _mm256_madd_epi16(_mm256_unpacklo_epi16(green, blue),
+                            green_blue_weights));
+      __m256i high = _mm256_add_epi32(
+          _mm256_madd_epi16(_mm256_unpackhi_epi16(red, green),
+                            red_green_weights),
+          _mm256_madd_epi16(_mm256_unpackhi_epi16(green, blue),
+                            green_blue_weights));
+
+      halves[b] = _mm256_packs_epi32(_mm256_srli_epi32(low, 16),
+                                     _mm256_srli_epi32(high, 16));
+    }
+    _mm256_storeu_si256((__m256i *)(gray + i),
+                        _mm256_packus_epi16(halves[0], halves[1]));
+  }
+
+  return i;
+}
+
+/**
+ * Converts num_pixels interleaved (R, G, B) pixels to grayscale with the
+ * fixed point luma weights.
+ */
+void rgb_to_gray(const unsigned char *rgb, unsigned char *gray,
+                 long num_pixels) {
+  long i = 0;
+
+  if (detect_simd_level() != SIMD_SCALAR)
+    i = rgb_to_gray_avx2(rgb, gray, num_pixels);
+
+  for (; i < num_pixels; i++) {
+    gray[i] = (LUMA_RED_WEIGHT * rgb[3 * i] +
+               LUMA_GREEN_WEIGHT * rgb[3 * i + 1] +
+               LUMA_BLUE_WEIGHT * rgb[3 * i + 2]) >> 16;
+  }
+}
+
+/**
+ * Converts an interleaved RGB image to grayscale row by row and, if
+ * integral_image is not NULL, adds every grayscale row to the integral image
+ * right after it is produced, while it is still in cache. The planar channels
+ * are never materialized.
+ *
+ * @param rgb The rows of the interleaved RGB image, 3 * num_cols bytes each.
+ * @param grayscale The rows of the grayscale output.
+ * @param integral_image The integral image to fill, or NULL.
+ */
+void rgb_to_gray_with_integral_image(unsigned char **rgb,
+                                     unsigned char **grayscale,
+                                     struct integral_image *integral_image,
+                                     int num_cols, int num_rows) {
+  INSTRUMENT_BEGIN(probe);
+  for (int i = 0; i < num_rows; i++) {
+    rgb_to_gray(rgb[i], grayscale[i], num_cols);
+    if (integral_image != NULL)
+      compute_integral_image_rows(grayscale, integral_image, num_cols, i,
+                                  i + 1);
+  }
+  INSTRUMENT_END(probe, STAGE_GRAY, 4L * num_rows * num_cols,
+                 (long)num_rows * num_cols);
+}
+
+/*
+ * Reads the big-endian 16-bit sample at the given byte offset.
+ */
+static inline unsigned int big_endian_sample(const unsigned char *data,
+                                             long offset) {
+  return (unsigned int)data[offset] << 8 | data[offset + 1];
+}
+
+/*
+ * Converts 16 pixels of 16-bit samples per iteration and returns the number
+ * of pixels done. Every lane takes 8 pixels, 48 bytes, which are split into
+ * native channels by the byte shuffles that also swap the samples, then
+ * weighed in 32 bits and narrowed back.
+ */
+static TARGET_AVX2 long rgb16_to_gray16_avx2(const unsigned char *rgb,
+                                             unsigned short *gray,
+                                             long num_pixels) {
+  const __m256i weights[3] = {_mm256_set1_epi32(LUMA_RED_WEIGHT),
+                              _mm256_set1_epi32(LUMA_GREEN_WEIGHT),
+                              _mm256_set1_epi32(LUMA_BLUE_WEIGHT)};
+  __m256i masks[3][3];
+  __m256i zero = _mm256_setzero_si256();
+  long i;
+  int c, b;
+
+  for (c = 0; c < 3; c++)
+    for (b = 0; b < 3; b++)
+      masks[c][b] = load_mask_avx2(deinterleave16_masks[c][b]);
+
+  for (i = 0; i + 16 <= num_pixels; i += 16) {
+    const unsigned char *source = rgb + 6 * i;
+    __m256i blocks[3] = {load_lanes_avx2(source),
+                         load_lanes_avx2(source + 16),
+                         load_lanes_avx2(source + 32)};
+    __m256i low = zero, high = zero, channel;
+
+    for (c = 0; c < 3; c++) {
+      channel = _mm256_setzero_si256();
+      for (b = 0; b < 3; b++)
+        channel = _mm256_or_si256(channel,
+                                  _mm256_shuffle_epi8(blocks[b], masks[c][b]));
+      low = _mm256_add_epi32(
+          low, _mm256_mullo_epi32(_mm256_unpacklo_epi16(channel, zero),
+                                  weights[c]));
+      high = _mm256_add_epi32(
+          high, _mm256_mullo_epi32(_mm256_unpackhi_epi16(channel, zero),
+                                   weights[c]));
+    }
+
+    // The sums stay below 2^32 and the shifted ones below 2^16, so the
+    // saturating pack is exact and undoes the unpacks lane by lane
+    _mm256_storeu_si256((__m256i *)(gray + i),
+                        _mm256_packus_epi32(_mm256_srli_epi32(low, 16),
+                                            _mm256_srli_epi32(high, 16)));
+  }
+
+  return i;
+}
+
+/**
+ * Converts num_pixels interleaved (R, G, B) pixels with two big-endian bytes
+ * per channel, as stored in a PPM image with a max color value above 255, to
+ * native 16-bit grayscale samples with the luma weights of rgb_to_gray. The
+ * weights add up to 65536, so the weighted sum of a pixel fits 32 bits.
+ */
+void rgb16_to_gray16(const unsigned char *rgb, unsigned short *gray,
+                     long num_pixels) {
+  long i = 0;
+
+  if (detect_simd_level() != SIMD_SCALAR)
+    i = rgb16_to_gray16_avx2(rgb, gray, num_pixels);
+
+  for (; i < num_pixels; i++) {
+    gray[i] = (LUMA_RED_WEIGHT * big_endian_sample(rgb, 6 * i) +
+               LUMA_GREEN_WEIGHT * big_endian_sample(rgb, 6 * i + 2) +
+               LUMA_BLUE_WEIGHT * big_endian_sample(rgb, 6 * i + 4)) >>
+              16;
+  }
+}
+
+/**
+ * Converts a 16-bit interleaved RGB image to 16-bit grayscale and, if
+ * integral_image is not NULL, builds the integral image of the result with
+ * compute_integral_image_16_pooled. The integral image must have been laid
+ * out for the max color value of the image, see choose_integral_widths.
+ *
+ * @param rgb The rows of the interleaved RGB image, 6 * num_cols bytes each.
+ * @param grayscale The rows of the 16-bit grayscale output.
+ * @param pool The workers building the integral image.
+ */
+void rgb16_to_gray16_with_integral_image(unsigned char **rgb,
+                                         unsigned short **grayscale,
+                                         struct integral_image *integral_image,
+                                         int num_cols, int num_rows,
+                                         struct worker_pool *pool) {
+  INSTRUMENT_BEGIN(probe);
+  for (int i = 0; i < num_rows; i++) {
+    rgb16_to_gray16(rgb[i], grayscale[i], num_cols);
+  }
+  INSTRUMENT_END(probe, STAGE_GRAY, 8L * num_rows * num_cols,
+                 (long)num_rows * num_cols);
+
+  if (integral_image != NULL)
+    compute_integral_image_16_pooled(grayscale, integral_image, num_cols,
+                                     num_rows, pool);
+}
@@ -1,3 +1,8 @@
+#include "parallel.h"
+#include "pbm.h"
+#include "sauvola.h"
+#include "sauvola_simd.h"
+#include "stream.h"
 #include "tools.h"
 #include <ctype.h>
 #include <math.h>
@@ -28,11 +33,24 @@
  */
 void sauvola_threshold(unsigned char **grayscale, unsigned char **output,
                        int num_cols, int num_rows, float k, int r, float R) {
+  sauvola_threshold_rows(grayscale, output, num_cols, num_rows, k, r, R, 0,
+                         num_rows);
+}
+
+/**
+ * Applies sauvola_threshold to the output rows in [row_begin, row_end) only.
+ * The local windows still extend over the whole input image, so running this
+ * over disjoint row bands gives exactly the same result as a single call to
+ * sauvola_threshold.
+ */
+void sauvola_threshold_rows(unsigned char **grayscale, unsigned char **output,
+                            int num_cols, int num_rows, float k, int r,
+                            float R, int row_begin, int row_end) {
   unsigned long long sum, sum_squares;
   long count;
   float mean, stdev, threshold;
 
-  for (int i = 0; i < num_rows; i++) {
+  for (int i = row_begin; i < row_end; i++) {
     for (int j = 0; j < num_cols; j++) {
       // Determine the bounds of the local region around the current pixel
       int left = fmax(j - r, 0);
@@ -75,7 +93,7 @@ void sauvola_threshold(unsigned char **grayscale, unsigned char **output,
  *
  * @param grayscale A 2D array of unsigned char representing the input
  * grayscale image.
- * @param integral_image A 3D array representing the integral image.
+ * @param integral_image The integral image of the grayscale image.
  * @param num_cols The number of columns in the input image.
  * @param num_rows The number of rows in the input image.
  * @param k The sensitivity parameter for the algorithm. Values between 0.2 and
@@ -87,58 +105,500 @@ void sauvola_threshold(unsigned char **grayscale, unsigned char **output,
  * @param R The dynamic range of the image. Set to the maximum value of the
  * image data type.
  */
-void sauvola_threshold_with_integral_image(unsigned char **grayscale,
-                                           unsigned long long ***integral_image,
-                                           unsigned char **output, int num_cols,
-                                           int num_rows, float k, int r,
-                                           float R) {
+void sauvola_threshold_with_integral_image(
+    unsigned char **grayscale, struct integral_image *integral_image,
+    unsigned char **output, int num_cols, int num_rows, float k, int r,
+    float R) {
+  sauvola_threshold_with_integral_image_rows(grayscale, integral_image, output,
+                                             num_cols, num_rows, k, r, R, 0,
+                                             num_rows);
+}
+
+/**
+ * Applies sauvola_threshold_with_integral_image to the output rows in
+ * [row_begin, row_end) only. The integral image has to cover the whole image.
+ */
+void sauvola_threshold_with_integral_image_rows(
+    unsigned char **grayscale, struct integral_image *integral_image,
+    unsigned char **output, int num_cols, int num_rows, float k, int r, float R,
+    int row_begin, int row_end) {
+  for (int i = row_begin; i < row_end; i++) {
+    sauvola_threshold_with_integral_image_span(grayscale, integral_image,
+                                               output, num_cols, num_rows, k, r,
+                                               R, i, 0, num_cols);
+  }
+}
+
+/*
+ * Body of sauvola_threshold_with_integral_image_span for one combination of
+ * plane widths. It is always inlined with constant widths, so every
+ * combination gets its own loop without per-pixel width checks.
+ */
+static inline __attribute__((always_inline)) void
+sauvola_span_with_widths(unsigned char **grayscale,
+                         struct integral_image *integral_image,
+                         unsigned char **output, int num_cols, int num_rows,
+                         float k, int r, float R, int i, int col_begin,
+                         int col_end, int sum_bits, int sum_squares_bits) {
   unsigned long long sum, sum_squares;
-  long count;
-  double mean, stdev, threshold;
+  double mean, stdev, threshold, count, reciprocal;
 
-  for (int i = 0; i < num_rows; i++) {
-    for (int j = 0; j < num_cols; j++) {
-      // Determine the bounds of the local region around the current pixel
-      int left = fmax(j - r, 0);
-      int right = fmin(j + r, num_cols - 1);
-      int top = fmax(i - r, 0);
-      int bottom = fmin(i + r, num_rows - 1);
+  // The rows of the local region are the same for the whole span. Row -1 of
+  // the integral image reads as zero.
+  int top = fmax(i - r, 0);
+  int bottom = fmin(i + r, num_rows - 1);
+  int height = bottom - top + 1;
+  long top_row = INTEGRAL_INDEX(integral_image, top - 1, 0);
+  long bottom_row = INTEGRAL_INDEX(integral_image, bottom, 0);
+  const void *sums = integral_image->sum;
+  const void *squares = integral_image->sum_squares;
+  long step = integral_image->step;
 
-      // Calculate integral image values for the local region
-      unsigned long A = (top - 1 < 0 || left - 1 < 0)
-                            ? 0
-                            : integral_image[top - 1][left - 1][0];
-      unsigned long B = top - 1 < 0 ? 0 : integral_image[top - 1][right][0];
-      unsigned long C = left - 1 < 0 ? 0 : integral_image[bottom][left - 1][0];
-      unsigned long D = integral_image[bottom][right][0];
-
-      unsigned long A_sq = (top - 1 < 0 || left - 1 < 0)
-                               ? 0
-                               : integral_image[top - 1][left - 1][1];
-      unsigned long B_sq = top - 1 < 0 ? 0 : integral_image[top - 1][right][1];
-      unsigned long C_sq =
-          left - 1 < 0 ? 0 : integral_image[bottom][left - 1][1];
-      unsigned long D_sq = integral_image[bottom][right][1];
-
-      // Compute the sum and sum of squares for the local region using integral
-      // image values
-      sum = D - B - C + A;
-      sum_squares = D_sq - B_sq - C_sq + A_sq;
-
-      // Compute the mean and standard deviation for the local region
-      count = (right - left + 1) *
-              (bottom - top + 1); // can't be changed, the squar area could be
-                                  // different each loop
-      mean = sum / (double)count;
-      stdev = sqrt((sum_squares / (double)count) - (mean * mean));
+  // Away from the left and right border every window has the same number of
+  // pixels, so its reciprocal is taken once per span and the two divisions by
+  // the count become window_quotient calls, which round the same way.
+  double interior_reciprocal = 1.0 / ((double)(2 * r + 1) * height);
 
-      // Compute the threshold for the current pixel using the mean and standard
-      // deviation
-      threshold = mean * (1.0 + k * ((stdev / R) - 1.0));
+  for (int j = col_begin; j < col_end; j++) {
+    // Determine the bounds of the local region around the current pixel
+    int left = j - r > 0 ? j - r : 0;
+    int right = j + r < num_cols - 1 ? j + r : num_cols - 1;
+    long A_index = top_row + (left - 1) * step;
+    long B_index = top_row + right * step;
+    long C_index = bottom_row + (left - 1) * step;
+    long D_index = bottom_row + right * step;
 
-      // Binarize the current pixel based on whether it is above or below the
-      // threshold
-      output[i][j] = grayscale[i][j] > threshold ? 255 : 0;
+    // Calculate integral image values for the local region. Column -1 of the
+    // integral image reads as zero.
+    unsigned long long A = integral_plane_load(sums, sum_bits, A_index);
+    unsigned long long B = integral_plane_load(sums, sum_bits, B_index);
+    unsigned long long C = integral_plane_load(sums, sum_bits, C_index);
+    unsigned long long D = integral_plane_load(sums, sum_bits, D_index);
+
+    unsigned long long A_sq =
+        integral_plane_load(squares, sum_squares_bits, A_index);
+    unsigned long long B_sq =
+        integral_plane_load(squares, sum_squares_bits, B_index);
+    unsigned long long C_sq =
+        integral_plane_load(squares, sum_squares_bits, C_index);
+    unsigned long long D_sq =
+        integral_plane_load(squares, sum_squares_bits, D_index);
+
+    // Compute the sum and sum of squares for the local region using integral
+    // image values, modulo the width of narrow planes
+    sum = (D - B - C + A) & integral_plane_mask(sum_bits);
+    sum_squares =
+        (D_sq - B_sq - C_sq + A_sq) & integral_plane_mask(sum_squares_bits);
+
+    // Compute the mean and standard deviation for the local region. Only
+    // windows cut by the left or right border need their own reciprocal.
+    count = (double)(right - left + 1) * height;
+    reciprocal = right - left == 2 * r ? interior_reciprocal : 1.0 / count;
+    mean = window_quotient(sum, count, reciprocal);
+    stdev = sqrt(window_quotient(sum_squares, count, reciprocal) -
+                 (mean * mean));
+
+    // Compute the threshold for the current pixel using the mean and standard
+    // deviation
+    threshold = mean * (1.0 + k * ((stdev / R) - 1.0));
+
+    // Binarize the current pixel based on whether it is above or below the
+    // threshold
+    output[i][j] = grayscale[i][j] > threshold ? 255 : 0;
+  }
+}
+
+/**
+ * Applies sauvola_threshold_with_integral_image to the pixels of row i whose
+ * column lies in [col_begin, col_end). This is the scalar reference that the
+ * vectorized kernels fall back to near the image border.
+ */
+void sauvola_threshold_with_integral_image_span(
+    unsigned char **grayscale, struct integral_image *integral_image,
+    unsigned char **output, int num_cols, int num_rows, float k, int r, float R,
+    int i, int col_begin, int col_end) {
+  if (integral_image->sum_bits == 32 &&
+      integral_image->sum_squares_bits == 32) {
+    sauvola_span_with_widths(grayscale, integral_image, output, num_cols,
+                             num_rows, k, r, R, i, col_begin, col_end, 32, 32);
+  } else if (integral_image->sum_bits == 32) {
+    sauvola_span_with_widths(grayscale, integral_image, output, num_cols,
+                             num_rows, k, r, R, i, col_begin, col_end, 32, 64);
+  } else {
+    sauvola_span_with_widths(grayscale, integral_image, output, num_cols,
+                             num_rows, k, r, R, i, col_begin, col_end, 64, 64);
+  }
+}
+
+/* -------------------------------------------------------------------------- */
+/*                     Running-Sum Sauvola (Separable Engine)                 */
+/* -------------------------------------------------------------------------- */
+
+/**
+ * Implements the Sauvola thresholding algorithm with separable running sums
+ * instead of an integral image. A running sum of every column over the
+ * vertical window is updated by one row in and one row out per output row,
+ * and each row's windows are then taken from horizontal prefix sums of those
+ * column sums. Work is O(1) per pixel and the extra memory is a few rows of
+ * accumulators. The window sums are exact integers, so the output is the same
+ * as sauvola_threshold and sauvola_threshold_with_integral_image.
+ */
+void sauvola_threshold_running_sums(unsigned char **grayscale,
+                                    unsigned char **output, int num_cols,
+                                    int num_rows, float k, int r, float R) {
+  sauvola_threshold_running_sums_rows(grayscale, output, num_cols, num_rows, k,
+                                      r, R, 0, num_rows);
+}
+
+/**
+ * Applies sauvola_threshold_running_sums to the output rows in
+ * [row_begin, row_end) only. The column sums are seeded with the window of
+ * row_begin, so disjoint row bands give the same result as a single call.
+ * Falls back to sauvola_threshold_rows if the accumulators cannot be
+ * allocated.
+ */
+void sauvola_threshold_running_sums_rows(unsigned char **grayscale,
+                                         unsigned char **output, int num_cols,
+                                         int num_rows, float k, int r, float R,
+                                         int row_begin, int row_end) {
+  struct column_sums sums;
+  int top, bottom;
+
+  if (row_begin >= row_end)
+    return;
+
+  if (!init_column_sums(&sums, num_cols)) {
+    sauvola_threshold_rows(grayscale, output, num_cols, num_rows, k, r, R,
+                           row_begin, row_end);
+    return;
+  }
+
+  // Seed the column sums with the first window, all but its bottom row
+  top = fmax(row_begin - r, 0);
+  bottom = fmin(row_begin + r, num_rows);
+  for (int x = top; x < bottom; x++) {
+    column_sums_add_row(&sums, grayscale[x]);
+  }
+
+  for (int i = row_begin; i < row_end; i++) {
+    // Slide the vertical window down to the rows [i - r, i + r]
+    if (i - r - 1 >= 0 && i > row_begin)
+      column_sums_remove_row(&sums, grayscale[i - r - 1]);
+    if (i + r < num_rows)
+      column_sums_add_row(&sums, grayscale[i + r]);
+
+    top = fmax(i - r, 0);
+    bottom = fmin(i + r, num_rows - 1);
+    column_sums_threshold_row(&sums, grayscale[i], output[i],
+                              bottom - top + 1, k, r, R);
+  }
+
+  free_column_sums(&sums);
+}
+
+/* -------------------------------------------------------------------------- */
+/*                      Parallel Sauvola (Row-Band Engine)                    */
+/* -------------------------------------------------------------------------- */
+
+/*
+ * Rows per band. Bands are the unit of work handed to the thread pool, so they
+ * are kept small enough for work stealing to even out the load, but large
+ * enough to amortise the scheduling overhead.
+ */
+#define SAUVOLA_BAND_ROWS 16
+
+struct sauvola_band_job {
+  unsigned char **grayscale;
+  struct integral_image *integral_image;
+  unsigned char **output;
+  int num_cols;
+  int num_rows;
+  float k;
+  int r;
+  float R;
+  enum simd_level level;
+};
+
+static void sauvola_band_task(void *context, int task_index,
+                              int worker_index) {
+  struct sauvola_band_job *job = (struct sauvola_band_job *)context;
+  int row_begin = task_index * SAUVOLA_BAND_ROWS;
+  int row_end = fmin(row_begin + SAUVOLA_BAND_ROWS, job->num_rows);
+
+  sauvola_threshold_rows(job->grayscale, job->output, job->num_cols,
+                         job->num_rows, job->k, job->r, job->R, row_begin,
+                         row_end);
+}
+
+static void sauvola_integral_band_task(void *context, int task_index,
+                                       int worker_index) {
+  struct sauvola_band_job *job = (struct sauvola_band_job *)context;
+  int row_begin = task_index * SAUVOLA_BAND_ROWS;
+  int row_end = fmin(row_begin + SAUVOLA_BAND_ROWS, job->num_rows);
+
+  sauvola_threshold_with_integral_image_simd_rows(
+      job->grayscale, job->integral_image, job->output, job->num_cols,
+      job->num_rows, job->k, job->r, job->R, job->level, row_begin, row_end);
+}
+
+/**
+ * Multithreaded version of sauvola_threshold. The output is split into bands
+ * of SAUVOLA_BAND_ROWS rows which are binarized concurrently on a
+ * work-stealing thread pool. Every band runs the serial kernel, so the output
+ * is bit-identical to sauvola_threshold.
+ *
+ * @param num_threads The number of threads to use. Values below 1 select one
+ * thread per online processor.
+ */
+void sauvola_threshold_parallel(unsigned char **grayscale,
+                                unsigned char **output, int num_cols,
+                                int num_rows, float k, int r, float R,
+                                int num_threads) {
+  struct sauvola_band_job job = {grayscale, NULL, output, num_cols,   num_rows,
+                                 k,         r,    R,      SIMD_SCALAR};
+  int num_bands = (num_rows + SAUVOLA_BAND_ROWS - 1) / SAUVOLA_BAND_ROWS;
+
+  if (!parallel_for(num_bands, num_threads, sauvola_band_task, &job))
+    sauvola_threshold(grayscale, output, num_cols, num_rows, k, r, R);
+}
+
+/**
+ * Same as sauvola_threshold_parallel on the threads of a worker pool.
+ */
+void sauvola_threshold_pooled(unsigned char **grayscale,
+                              unsigned char **output, int num_cols,
+                              int num_rows, float k, int r, float R,
+                              struct worker_pool *pool) {
+  struct sauvola_band_job job = {grayscale, NULL, output, num_cols,   num_rows,
+                                 k,         r,    R,      SIMD_SCALAR};
+  int num_bands = (num_rows + SAUVOLA_BAND_ROWS - 1) / SAUVOLA_BAND_ROWS;
+
+  worker_pool_run(pool, num_bands, sauvola_band_task, &job);
+}
+
+/**
+ * Multithreaded version of sauvola_threshold_with_integral_image. The integral
+ * image must be computed beforehand; it is only read by the worker threads.
+ * Each band runs the vectorized kernel, whose output is bit-identical to
+ * sauvola_threshold_with_integral_image.
+ *
+ * @param num_threads The number of threads to use. Values below 1 select one
+ * thread per online processor.
+ */
+void sauvola_threshold_with_integral_image_parallel(
+    unsigned char **grayscale, struct integral_image *integral_image,
+    unsigned char **output, int num_cols, int num_rows, float k, int r, float R,
+    int num_threads) {
+  struct sauvola_band_job job = {
+      grayscale, integral_image, output, num_cols,           num_rows,
+      k,         r,              R,      detect_simd_level()};
+  int num_bands = (num_rows + SAUVOLA_BAND_ROWS - 1) / SAUVOLA_BAND_ROWS;
+
+  if (!parallel_for(num_bands, num_threads, sauvola_integral_band_task, &job))
+    sauvola_threshold_with_integral_image(grayscale, integral_image, output,
+                                          num_cols, num_rows, k, r, R);
+}
+
+/**
+ * Same as sauvola_threshold_with_integral_image_parallel on the threads of a
+ * worker pool.
+ */
+void sauvola_threshold_with_integral_image_pooled(
+    unsigned char **grayscale, struct integral_image *integral_image,
+    unsigned char **output, int num_cols, int num_rows, float k, int r, float R,
+    struct worker_pool *pool) {
+  struct sauvola_band_job job = {
+      grayscale, integral_image, output, num_cols,           num_rows,
+      k,         r,              R,      detect_simd_level()};
+  int num_bands = (num_rows + SAUVOLA_BAND_ROWS - 1) / SAUVOLA_BAND_ROWS;
+
+  worker_pool_run(pool, num_bands, sauvola_integral_band_task, &job);
+}
+
+/* -------------------------------------------------------------------------- */
+/*                       Bit-Packed Output (1 Bit per Pixel)                  */
+/* -------------------------------------------------------------------------- */
+
+/*
+ * The packed kernels threshold SAUVOLA_BAND_ROWS rows at a time into a small
+ * byte buffer that stays in cache and pack each row into its 1-bit-per-pixel
+ * form, see pack_binary_row, right away. The full 8-bit output image is never
+ * materialized.
+ */
+
+struct sauvola_packed_job {
+  unsigned char **grayscale;
+  struct integral_image *integral_image;
+  unsigned char **packed;
+  int num_cols;
+  int num_rows;
+  float k;
+  int r;
+  float R;
+  enum simd_level level;
+  unsigned char *scratch; // one band of band_size bytes per worker
+  size_t band_size;
+};
+
+/*
+ * Bytes of one worker's band, rounded up to whole cache lines so that the
+ * bands of two workers never share one.
+ */
+static size_t packed_band_size(int num_cols) {
+  return ((size_t)SAUVOLA_BAND_ROWS * num_cols + 63) / 64 * 64;
+}
+
+/*
+ * Grows the scratch to at least size bytes. Returns 0 if the memory cannot
+ * be allocated, in which case the old buffer is released.
+ */
+static int reserve_packed_scratch(struct packed_scratch *scratch,
+                                  size_t size) {
+  void *data;
+
+  if (scratch->capacity >= size)
+    return 1;
+
+  free_packed_scratch(scratch);
+  if (posix_memalign(&data, 64, size))
+    return 0;
+  scratch->data = (unsigned char *)data;
+  scratch->capacity = size;
+
+  return 1;
+}
+
+/**
+ * Releases the band buffers of the packed engine.
+ */
+void free_packed_scratch(struct packed_scratch *scratch) {
+  free(scratch->data);
+  scratch->data = NULL;
+  scratch->capacity = 0;
+}
+
+/*
+ * Thresholds the rows [row_begin, row_end), at most SAUVOLA_BAND_ROWS of them,
+ * into a band of byte rows at data and packs them.
+ */
+static void sauvola_packed_band(struct sauvola_packed_job *job,
+                                unsigned char *data, int row_begin,
+                                int row_end) {
+  unsigned char *rows[SAUVOLA_BAND_ROWS];
+
+  for (int i = 0; i < SAUVOLA_BAND_ROWS; i++) {
+    rows[i] = data + (size_t)i * job->num_cols;
+  }
+
+  // The kernels index the output by image row
+  sauvola_threshold_with_integral_image_simd_rows(
+      job->grayscale, job->integral_image, rows - row_begin, job->num_cols,
+      job->num_rows, job->k, job->r, job->R, job->level, row_begin, row_end);
+
+  for (int i = row_begin; i < row_end; i++) {
+    pack_binary_row(rows[i - row_begin], job->packed[i], job->num_cols);
+  }
+}
+
+static void sauvola_packed_band_task(void *context, int task_index,
+                                     int worker_index) {
+  struct sauvola_packed_job *job = (struct sauvola_packed_job *)context;
+  int row_begin = task_index * SAUVOLA_BAND_ROWS;
+  int row_end = fmin(row_begin + SAUVOLA_BAND_ROWS, job->num_rows);
+
+  sauvola_packed_band(job, job->scratch + worker_index * job->band_size,
+                      row_begin, row_end);
+}
+
+/**
+ * Applies sauvola_threshold_with_integral_image to the rows in
+ * [row_begin, row_end) and stores them bit-packed, packed_row_bytes(num_cols)
+ * bytes per row with a set bit for every black pixel, as in a PBM image.
+ *
+ * @param level The instruction set to use, normally detect_simd_level().
+ * @return 1 on success, 0 if the scratch band cannot be allocated.
+ */
+int sauvola_threshold_with_integral_image_packed_rows(
+    unsigned char **grayscale, struct integral_image *integral_image,
+    unsigned char **packed, int num_cols, int num_rows, float k, int r, float R,
+    enum simd_level level, int row_begin, int row_end) {
+  struct sauvola_packed_job job = {
+      grayscale, integral_image, packed, num_cols, num_rows, k, r, R, level};
+  struct packed_scratch scratch = {NULL, 0};
+  int ok = reserve_packed_scratch(&scratch, packed_band_size(num_cols));
+
+  for (int i = row_begin; ok && i < row_end; i += SAUVOLA_BAND_ROWS) {
+    sauvola_packed_band(&job, scratch.data, i,
+                        fmin(i + SAUVOLA_BAND_ROWS, row_end));
+  }
+
+  free_packed_scratch(&scratch);
+  return ok;
+}
+
+/*
+ * Runs the packed engine on the workers of pool, or on num_threads threads if
+ * pool is NULL, with one band of the scratch per worker.
+ */
+static int threshold_packed(struct sauvola_packed_job *job,
+                            struct worker_pool *pool, int num_threads,
+                            struct packed_scratch *scratch) {
+  int num_bands = (job->num_rows + SAUVOLA_BAND_ROWS - 1) / SAUVOLA_BAND_ROWS;
+  int num_workers = parallel_worker_count(pool, num_threads);
+
+  job->level = detect_simd_level();
+  job->band_size = packed_band_size(job->num_cols);
+  if (!reserve_packed_scratch(scratch, num_workers * job->band_size))
+    return 0;
+  job->scratch = scratch->data;
+
+  if (!run_parallel(pool, num_bands, num_threads, sauvola_packed_band_task,
+                    job)) {
+    // Fall back to the calling thread with the first worker's band
+    for (int i = 0; i < num_bands; i++) {
+      sauvola_packed_band_task(job, i, 0);
     }
   }
-}
\ No newline at end of file
+
+  return 1;
+}
+
+/**
+ * Multithreaded, bit-packed version of
+ * sauvola_threshold_with_integral_image, see
+ * sauvola_threshold_with_integral_image_packed_rows. The output takes an eighth
+ * of the memory of the byte output and holds exactly the same pixels.
+ *
+ * @param num_threads The number of threads to use. Values below 1 select one
+ * thread per online processor.
+ * @return 1 on success, 0 if the scratch bands cannot be allocated.
+ */
+int sauvola_threshold_with_integral_image_packed(
+    unsigned char **grayscale, struct integral_image *integral_image,
+    unsigned char **packed, int num_cols, int num_rows, float k, int r, float R,
+    int num_threads) {
+  struct sauvola_packed_job job = {
+      grayscale, integral_image, packed, num_cols, num_rows, k, r, R};
+  struct packed_scratch scratch = {NULL, 0};
+  int ok = threshold_packed(&job, NULL, num_threads, &scratch);
+
+  free_packed_scratch(&scratch);
+  return ok;
+}
+
+/**
+ * Same as sauvola_threshold_with_integral_image_packed on the threads of a
+ * worker pool, with the band buffers kept in scratch. Once scratch has grown
+ * for the widest image and the largest pool, further calls do not allocate.
+ *
+ * @return 1 on success, 0 if the scratch bands cannot be allocated.
+ */
+int sauvola_threshold_with_integral_image_packed_pooled(
+    unsigned char **grayscale, struct integral_image *integral_image,
+    unsigned char **packed, int num_cols, int num_rows, float k, int r, float R,
+    struct worker_pool *pool, struct packed_scratch *scratch) {
+  struct sauvola_packed_job job = {
+      grayscale, integral_image, packed, num_cols, num_rows, k, r, R};
+
+  return threshold_packed(&job, pool, 0, scratch);
+}
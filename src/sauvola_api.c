@@ -0,0 +1,329 @@
+#include "sauvola_api.h"
+#include "integral.h"
+#include "parallel.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* -------------------------------------------------------------------------- */
+/*                            In-Memory Library API                           */
+/* -------------------------------------------------------------------------- */
+
+/*
+ * A processor owns the row pointer arrays, the column deltas and the integral
+ * image. They only grow, so once sauvola_processor_reserve or a first call has
+ * seen the largest image, a call for an image of at most that height and
+ * width does not allocate. Its worker pool is started by
+ * sauvola_processor_init and runs the integral image and the bands of every
+ * call, so calls do not start threads either.
+ */
+
+// Rows per band handed to the thread pool
+#define API_BAND_ROWS 16
+
+struct api_job {
+  struct sauvola_processor *processor;
+  const struct sauvola_roi *rois;
+  int num_rois;
+};
+
+/**
+ * Returns a short description of a status code.
+ */
+const char *sauvola_status_string(enum sauvola_status status) {
+  switch (status) {
+  case SAUVOLA_OK:
+    return "success";
+  case SAUVOLA_ERROR_ARGUMENT:
+    return "invalid argument";
+  case SAUVOLA_ERROR_MEMORY:
+    return "out of memory";
+  }
+
+  return "unknown status";
+}
+
+/**
+ * Sets up a processor for the given parameters and starts its worker threads.
+ * The image buffers are allocated by sauvola_processor_reserve or by the
+ * first call of sauvola_process.
+ *
+ * @return SAUVOLA_OK, SAUVOLA_ERROR_ARGUMENT if r is below 1 or R is not
+ * positive, or SAUVOLA_ERROR_MEMORY if the worker pool cannot be set up.
+ * Either way the processor must be released with sauvola_processor_free.
+ */
+enum sauvola_status
+sauvola_processor_init(struct sauvola_processor *processor,
+                       const struct sauvola_options *options) {
+  memset(processor, 0, sizeof(*processor));
+  if (options == NULL || options->r < 1 || !(options->R > 0))
+    return SAUVOLA_ERROR_ARGUMENT;
+
+  processor->options = *options;
+  if (processor->options.num_threads < 1)
+    processor->options.num_threads = default_thread_count();
+  processor->level = detect_simd_level();
+  init_sauvola_context(&processor->context);
+  if (!worker_pool_init(&processor->pool, processor->options.num_threads))
+    return SAUVOLA_ERROR_MEMORY;
+
+  return SAUVOLA_OK;
+}
+
+/**
+ * Grows the buffers of a processor for images of up to num_rows rows and
+ * num_cols columns, so that later calls for such images do not allocate.
+ *
+ * @return SAUVOLA_OK, SAUVOLA_ERROR_ARGUMENT for sizes below 1 or
+ * SAUVOLA_ERROR_MEMORY.
+ */
+enum sauvola_status
+sauvola_processor_reserve(struct sauvola_processor *processor, int num_rows,
+                          int num_cols) {
+  unsigned char **input_rows, **output_rows;
+  unsigned long long *deltas;
+
+  if (num_rows < 1 || num_cols < 1)
+    return SAUVOLA_ERROR_ARGUMENT;
+
+  if (processor->row_capacity < num_rows) {
+    input_rows = (unsigned char **)malloc(num_rows * sizeof(unsigned char *));
+    output_rows = (unsigned char **)malloc(num_rows * sizeof(unsigned char *));
+    if (input_rows == NULL || output_rows == NULL) {
+      free(input_rows);
+      free(output_rows);
+      return SAUVOLA_ERROR_MEMORY;
+    }
+    free(processor->input_rows);
+    free(processor->output_rows);
+    processor->input_rows = input_rows;
+    processor->output_rows = output_rows;
+    processor->row_capacity = num_rows;
+  }
+
+  if (processor->delta_capacity < 2 * num_cols) {
+    deltas = (unsigned long long *)malloc(2 * num_cols * sizeof(*deltas));
+    if (deltas == NULL)
+      return SAUVOLA_ERROR_MEMORY;
+    free(processor->deltas);
+    processor->deltas = deltas;
+    processor->delta_capacity = 2 * num_cols;
+  }
+
+  if (context_integral_image(&processor->context, num_rows, num_cols, 255,
+                             processor->options.r) == NULL)
+    return SAUVOLA_ERROR_MEMORY;
+
+  return SAUVOLA_OK;
+}
+
+/*
+ * Number of bands of API_BAND_ROWS rows of a region.
+ */
+static inline int roi_bands(const struct sauvola_roi *roi) {
+  return (roi->num_rows + API_BAND_ROWS - 1) / API_BAND_ROWS;
+}
+
+/*
+ * Thresholds one band of one region, the bands of all the regions being
+ * numbered in order.
+ */
+static void api_band_task(void *context, int task_index, int worker_index) {
+  struct api_job *job = (struct api_job *)context;
+  struct sauvola_processor *processor = job->processor;
+  const struct sauvola_roi *roi = job->rois;
+  int row_begin, row_end;
+
+  while (task_index >= roi_bands(roi)) {
+    task_index -= roi_bands(roi);
+    roi++;
+  }
+  row_begin = roi->row + task_index * API_BAND_ROWS;
+  row_end = fmin(row_begin + API_BAND_ROWS, roi->row + roi->num_rows);
+
+  sauvola_threshold_with_integral_image_simd_rect(
+      processor->input_rows, &processor->context.integral_image,
+      processor->output_rows, processor->page_cols, processor->page_rows,
+      processor->options.k, processor->options.r, processor->options.R,
+      processor->level, row_begin, row_end, roi->col,
+      roi->col + roi->num_cols);
+}
+
+/**
+ * Sets the page that the next calls of sauvola_process_rois binarize regions
+ * of and builds its integral image. Row i of the page starts at
+ * pixels + i * stride. The pixels are read again by sauvola_process_rois, so
+ * they must stay valid and unchanged until the page is replaced, except for
+ * regions already binarized in place.
+ *
+ * @return SAUVOLA_OK, SAUVOLA_ERROR_ARGUMENT for a NULL pointer, sizes below 1
+ * or a stride below num_cols, or SAUVOLA_ERROR_MEMORY if the buffers had to
+ * grow and could not. On error the processor has no page.
+ */
+enum sauvola_status sauvola_set_page(struct sauvola_processor *processor,
+                                     const unsigned char *pixels, long stride,
+                                     int num_cols, int num_rows) {
+  enum sauvola_status status;
+
+  if (processor == NULL)
+    return SAUVOLA_ERROR_ARGUMENT;
+  processor->page_cols = processor->page_rows = 0;
+  if (pixels == NULL || stride < num_cols)
+    return SAUVOLA_ERROR_ARGUMENT;
+  if ((status = sauvola_processor_reserve(processor, num_rows, num_cols)) !=
+      SAUVOLA_OK)
+    return status;
+
+  // The kernels only read the input rows
+  for (int i = 0; i < num_rows; i++) {
+    processor->input_rows[i] = (unsigned char *)pixels + i * stride;
+  }
+  compute_integral_image_pooled(processor->input_rows,
+                                &processor->context.integral_image, num_cols,
+                                num_rows, &processor->pool);
+  processor->page_cols = num_cols;
+  processor->page_rows = num_rows;
+
+  return SAUVOLA_OK;
+}
+
+/**
+ * Binarizes regions of the page set with sauvola_set_page. Pixel (i, j) of
+ * the page, 0 for black and 255 for white, is written at
+ * output + i * output_stride + j, so every region lands at its own place in
+ * an output of the size of the page and the rest of the output is left
+ * unchanged. Windows reach past the regions into the page, so a region
+ * gets the same pixels as the whole page binarized with
+ * sauvola_threshold_with_integral_image and then cropped.
+ *
+ * The output may be the page itself, with the same stride, to binarize the
+ * regions in place. Regions must then not overlap, and otherwise they may.
+ *
+ * @return SAUVOLA_OK, or SAUVOLA_ERROR_ARGUMENT if no page is set, for NULL
+ * pointers, a negative number of regions, an empty region or one that does
+ * not fit in the page, or an output stride below the page width. The output
+ * is unchanged on error.
+ */
+enum sauvola_status
+sauvola_process_rois(struct sauvola_processor *processor,
+                     const struct sauvola_roi *rois, int num_rois,
+                     unsigned char *output, long output_stride) {
+  struct api_job job = {processor, rois, num_rois};
+  const struct sauvola_roi *roi;
+  int num_bands = 0;
+
+  if (processor == NULL || processor->page_rows == 0 || output == NULL ||
+      output_stride < processor->page_cols || num_rois < 0 ||
+      (rois == NULL && num_rois > 0))
+    return SAUVOLA_ERROR_ARGUMENT;
+  for (roi = rois; roi < rois + num_rois; roi++) {
+    if (roi->row < 0 || roi->col < 0 || roi->num_rows < 1 ||
+        roi->num_cols < 1 || roi->num_rows > processor->page_rows - roi->row ||
+        roi->num_cols > processor->page_cols - roi->col)
+      return SAUVOLA_ERROR_ARGUMENT;
+    num_bands += roi_bands(roi);
+  }
+
+  // Only the rows of the regions are pointed at
+  for (roi = rois; roi < rois + num_rois; roi++) {
+    for (int i = roi->row; i < roi->row + roi->num_rows; i++) {
+      processor->output_rows[i] = output + i * output_stride;
+    }
+  }
+
+  worker_pool_run(&processor->pool, num_bands, api_band_task, &job);
+
+  return SAUVOLA_OK;
+}
+
+/**
+ * Binarizes a grayscale image held in memory. Row i of the image starts at
+ * pixels + i * stride and row i of the result, 0 for black and 255 for white,
+ * at output + i * output_stride. The output is the same as with
+ * sauvola_threshold_with_integral_image. The input and output must not
+ * overlap. This sets the image as the page of the processor, see
+ * sauvola_set_page.
+ *
+ * @return SAUVOLA_OK, SAUVOLA_ERROR_ARGUMENT for NULL pointers, sizes below 1
+ * or strides below num_cols, or SAUVOLA_ERROR_MEMORY if the buffers had to
+ * grow and could not. The output is unchanged on error.
+ */
+enum sauvola_status sauvola_process(struct sauvola_processor *processor,
+                                    const unsigned char *pixels, long stride,
+                                    int num_cols, int num_rows,
+                                    unsigned char *output, long output_stride) {
+  struct sauvola_roi page = {0, 0, num_rows, num_cols};
+  enum sauvola_status status;
+
+  if (output == NULL || output_stride < num_cols)
+    return SAUVOLA_ERROR_ARGUMENT;
+  if ((status = sauvola_set_page(processor, pixels, stride, num_cols,
+                                 num_rows)) != SAUVOLA_OK)
+    return status;
+
+  return sauvola_process_rois(processor, &page, 1, output, output_stride);
+}
+
+/**
+ * Binarizes the page again after the caller changed the pixels of a patch of
+ * it, in the buffer given to sauvola_set_page. The integral image is updated
+ * from the patch on, with one addition per element below and right of it,
+ * and only the pixels whose window reaches the patch, the patch grown by r
+ * on every side, are thresholded and written to output like with
+ * sauvola_process_rois. The rest of output must hold the previous result,
+ * and output must not be the page.
+ *
+ * @return SAUVOLA_OK, or SAUVOLA_ERROR_ARGUMENT if no page is set, for NULL
+ * pointers, an output stride below the page width or an empty patch or one
+ * that does not fit in the page. Nothing is changed on error.
+ */
+enum sauvola_status
+sauvola_update_page(struct sauvola_processor *processor,
+                    const struct sauvola_roi *patch, unsigned char *output,
+                    long output_stride) {
+  struct sauvola_roi affected;
+  int r;
+
+  if (processor == NULL || processor->page_rows == 0 || patch == NULL ||
+      output == NULL || output_stride < processor->page_cols ||
+      patch->row < 0 || patch->col < 0 || patch->num_rows < 1 ||
+      patch->num_cols < 1 ||
+      patch->num_rows > processor->page_rows - patch->row ||
+      patch->num_cols > processor->page_cols - patch->col)
+    return SAUVOLA_ERROR_ARGUMENT;
+
+  update_integral_image(processor->input_rows,
+                        &processor->context.integral_image,
+                        processor->page_cols, processor->page_rows,
+                        patch->row, patch->row + patch->num_rows, patch->col,
+                        patch->col + patch->num_cols, processor->deltas,
+                        &processor->pool);
+
+  r = processor->options.r;
+  affected.row = fmax(patch->row - r, 0);
+  affected.col = fmax(patch->col - r, 0);
+  affected.num_rows =
+      fmin(patch->row + patch->num_rows + r, processor->page_rows) -
+      affected.row;
+  affected.num_cols =
+      fmin(patch->col + patch->num_cols + r, processor->page_cols) -
+      affected.col;
+
+  return sauvola_process_rois(processor, &affected, 1, output, output_stride);
+}
+
+/**
+ * Stops the worker threads of a processor and frees every buffer.
+ */
+void sauvola_processor_free(struct sauvola_processor *processor) {
+  worker_pool_free(&processor->pool);
+  free_sauvola_context(&processor->context);
+  free(processor->input_rows);
+  free(processor->output_rows);
+  free(processor->deltas);
+  processor->input_rows = NULL;
+  processor->output_rows = NULL;
+  processor->deltas = NULL;
+  processor->row_capacity = 0;
+  processor->delta_capacity = 0;
+  processor->page_cols = processor->page_rows = 0;
+}
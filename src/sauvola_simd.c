@@ -0,0 +1,699 @@
+#include "pgm16.h"
+#include "sauvola.h"
+#include "sauvola_simd.h"
+#include <immintrin.h>
+#include <string.h>
+
+/* -------------------------------------------------------------------------- */
+/*                   Vectorized Sauvola with Integral Image                   */
+/* -------------------------------------------------------------------------- */
+
+/*
+ * Every row is split into the left border, the interior and the right border.
+ * In the interior the whole window lies inside the image horizontally, so the
+ * four integral image corners of neighbouring pixels sit next to each other in
+ * memory and the pixel count only depends on the row. The interior is
+ * processed several pixels at a time with the same sequence of double
+ * precision operations as the scalar reference, the borders go through
+ * sauvola_threshold_with_integral_image_span.
+ *
+ * The integral image rows are contiguous, so the corners are fetched with
+ * plain unaligned loads rather than gathered. With the interleaved layout the
+ * (sum, sum of squares) pairs are split apart in registers, 32-bit elements are
+ * zero-extended to 64-bit lanes and the window sums reduced modulo 2^32. Row -1
+ * of the integral image is a row of zeros, so the top border needs no special
+ * case.
+ *
+ * The AVX2 loops are specialized for every layout. Planar 32-bit planes, the
+ * default for 8-bit pages, take their window sums on eight 32-bit lanes and
+ * are only widened when converted to doubles, and interleaved pairs are split
+ * after the four corners are combined rather than once per corner.
+ */
+
+/*
+ * The two integral image rows bounding the windows of one output row, as
+ * element pointers to column 0 of both planes.
+ */
+struct window_rows {
+  const void *top_sums;
+  const void *top_squares;
+  const void *bottom_sums;
+  const void *bottom_squares;
+  int interleaved;
+  int sum_bits;
+  int sum_squares_bits;
+};
+
+#define TARGET_AVX2 __attribute__((target("avx2,fma")))
+#define TARGET_AVX512                                                          \
+  __attribute__((target("avx512f,avx512dq,avx512bw,avx512vl")))
+
+/**
+ * Returns the widest instruction set the running CPU supports for the
+ * vectorized kernels.
+ */
+enum simd_level detect_simd_level(void) {
+  __builtin_cpu_init();
+
+  if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq") &&
+      __builtin_cpu_supports("avx512bw") && __builtin_cpu_supports("avx512vl"))
+    return SIMD_AVX512;
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+    return SIMD_AVX2;
+
+  return SIMD_SCALAR;
+}
+
+/* --------------------------------- AVX2 ----------------------------------- */
+
+/*
+ * Loads four consecutive elements of one plane starting at the given index,
+ * zero-extended to 64-bit lanes.
+ */
+static inline TARGET_AVX2 __m256i load_plane_avx2(const void *plane, int bits,
+                                                  long index) {
+  const unsigned int *narrow = (const unsigned int *)plane + index;
+
+  if (bits == 32)
+    return _mm256_cvtepu32_epi64(_mm_loadu_si128((const __m128i *)narrow));
+
+  return _mm256_loadu_si256(
+      (const __m256i *)((const unsigned long long *)plane + index));
+}
+
+/*
+ * Four-corner difference D - B - C + A of the 256 bits of integral image
+ * elements starting at element index near and far of the bottom and top row,
+ * lane by lane with the given lane width. Narrow lanes wrap like the plane.
+ */
+static inline TARGET_AVX2 __attribute__((always_inline)) __m256i
+corner_difference_avx2(const void *bottom, const void *top, long near,
+                       long far, int bits) {
+#define LOAD_ELEMENTS(row, index)                                              \
+  _mm256_loadu_si256(                                                          \
+      (const __m256i *)((const char *)(row) + (index) * (bits / 8)))
+  __m256i D = LOAD_ELEMENTS(bottom, far), B = LOAD_ELEMENTS(top, far);
+  __m256i C = LOAD_ELEMENTS(bottom, near), A = LOAD_ELEMENTS(top, near);
+#undef LOAD_ELEMENTS
+
+  if (bits == 32)
+    return _mm256_add_epi32(_mm256_sub_epi32(_mm256_sub_epi32(D, B), C), A);
+
+  return _mm256_add_epi64(_mm256_sub_epi64(_mm256_sub_epi64(D, B), C), A);
+}
+
+/*
+ * Computes the window sums and sums of squares of four neighbouring windows,
+ * whose left and right edges are the columns j - r - 1 and j + r, as 64-bit
+ * lanes. The layout and the element widths are constants after inlining.
+ * With the interleaved layout the corners are differenced as (sum, sum of
+ * squares) pairs and only the result is split apart.
+ */
+static inline TARGET_AVX2 __attribute__((always_inline)) void
+window_sums_avx2(const struct window_rows *rows, int j, int r,
+                 int interleaved, int sum_bits, int sum_squares_bits,
+                 __m256i *sum, __m256i *sum_squares) {
+  long near = j - r - 1, far = j + r;
+  __m256i pairs, first, second, D, B, C, A;
+
+  if (interleaved && sum_bits == 32) {
+    // Every 64-bit lane holds one (sum, sum of squares) pair
+    pairs = corner_difference_avx2(rows->bottom_sums, rows->top_sums,
+                                   2 * near, 2 * far, 32);
+    *sum = _mm256_and_si256(pairs, _mm256_set1_epi64x(0xFFFFFFFFLL));
+    *sum_squares = _mm256_srli_epi64(pairs, 32);
+  } else if (interleaved) {
+    first = corner_difference_avx2(rows->bottom_sums, rows->top_sums,
+                                   2 * near, 2 * far, 64);
+    second = corner_difference_avx2(rows->bottom_sums, rows->top_sums,
+                                    2 * near + 4, 2 * far + 4, 64);
+    *sum = _mm256_permute4x64_epi64(_mm256_unpacklo_epi64(first, second),
+                                    0xD8);
+    *sum_squares = _mm256_permute4x64_epi64(
+        _mm256_unpackhi_epi64(first, second), 0xD8);
+  } else {
+    D = load_plane_avx2(rows->bottom_sums, sum_bits, far);
+    B = load_plane_avx2(rows->top_sums, sum_bits, far);
+    C = load_plane_avx2(rows->bottom_sums, sum_bits, near);
+    A = load_plane_avx2(rows->top_sums, sum_bits, near);
+    *sum = _mm256_and_si256(
+        _mm256_add_epi64(_mm256_sub_epi64(_mm256_sub_epi64(D, B), C), A),
+        _mm256_set1_epi64x(integral_plane_mask(sum_bits)));
+    D = load_plane_avx2(rows->bottom_squares, sum_squares_bits, far);
+    B = load_plane_avx2(rows->top_squares, sum_squares_bits, far);
+    C = load_plane_avx2(rows->bottom_squares, sum_squares_bits, near);
+    A = load_plane_avx2(rows->top_squares, sum_squares_bits, near);
+    *sum_squares = _mm256_and_si256(
+        _mm256_add_epi64(_mm256_sub_epi64(_mm256_sub_epi64(D, B), C), A),
+        _mm256_set1_epi64x(integral_plane_mask(sum_squares_bits)));
+  }
+}
+
+/*
+ * Converts unsigned 64-bit integers below 2^52 to doubles exactly. AVX2 has no
+ * such conversion, so the value is placed in the mantissa of 2^52 and 2^52 is
+ * subtracted again.
+ */
+static inline TARGET_AVX2 __m256d u64_to_double_avx2(__m256i value) {
+  const __m256i magic_bits = _mm256_set1_epi64x(0x4330000000000000LL);
+  const __m256d magic = _mm256_set1_pd(4503599627370496.0);
+
+  return _mm256_sub_pd(
+      _mm256_castsi256_pd(_mm256_or_si256(value, magic_bits)), magic);
+}
+
+/*
+ * Converts unsigned 64-bit integers to doubles with the rounding of a scalar
+ * conversion: the upper and the lower 32 bits are converted exactly and only
+ * their sum is rounded.
+ */
+static inline TARGET_AVX2 __m256d u64_to_double_wide_avx2(__m256i value) {
+  const __m256d two_to_32 = _mm256_set1_pd(4294967296.0);
+  __m256d high = u64_to_double_avx2(_mm256_srli_epi64(value, 32));
+  __m256d low = u64_to_double_avx2(
+      _mm256_and_si256(value, _mm256_set1_epi64x(0xFFFFFFFFLL)));
+
+  return _mm256_add_pd(_mm256_mul_pd(high, two_to_32), low);
+}
+
+/*
+ * Loads four pixels of 8 or 16 bits as doubles.
+ */
+static inline TARGET_AVX2 __m256d load_gray_avx2(const void *grayscale, int j,
+                                                 int sample_bits) {
+  unsigned int pixels;
+
+  if (sample_bits == 16)
+    return _mm256_cvtepi32_pd(_mm_cvtepu16_epi32(_mm_loadl_epi64(
+        (const __m128i *)((const unsigned short *)grayscale + j))));
+
+  memcpy(&pixels, (const unsigned char *)grayscale + j, sizeof(pixels));
+  return _mm256_cvtepi32_pd(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(pixels)));
+}
+
+/*
+ * Vector version of window_quotient: divides the whole numbers in a by count,
+ * rounding like _mm256_div_pd, given its reciprocal.
+ */
+static inline TARGET_AVX2 __m256d window_quotient_avx2(__m256d a,
+                                                       __m256d count,
+                                                       __m256d reciprocal) {
+  __m256d quotient = _mm256_mul_pd(a, reciprocal);
+
+  return _mm256_fmadd_pd(_mm256_fnmadd_pd(quotient, count, a), reciprocal,
+                         quotient);
+}
+
+/*
+ * Byte patterns for every 4-bit compare mask, lowest pixel first
+ */
+static const unsigned int mask_bytes_avx2[16] = {
+    0x00000000, 0x000000FF, 0x0000FF00, 0x0000FFFF, 0x00FF0000, 0x00FF00FF,
+    0x00FFFF00, 0x00FFFFFF, 0xFF000000, 0xFF0000FF, 0xFF00FF00, 0xFF00FFFF,
+    0xFFFF0000, 0xFFFF00FF, 0xFFFFFF00, 0xFFFFFFFF};
+
+/*
+ * Binarizes four pixels from their window sums and sums of squares with the
+ * same sequence of operations as the scalar kernel and stores the four bytes
+ * at output.
+ */
+static inline TARGET_AVX2 __attribute__((always_inline)) void
+threshold_four_avx2(unsigned char *output, __m256d gray, __m256d sum,
+                    __m256d sum_squares, __m256d count, __m256d reciprocal,
+                    __m256d k, __m256d R) {
+  const __m256d one = _mm256_set1_pd(1.0);
+  __m256d mean, variance, stdev, threshold;
+  unsigned int pixels;
+
+  mean = window_quotient_avx2(sum, count, reciprocal);
+  variance = _mm256_sub_pd(window_quotient_avx2(sum_squares, count, reciprocal),
+                           _mm256_mul_pd(mean, mean));
+  stdev = _mm256_sqrt_pd(variance);
+  threshold = _mm256_mul_pd(
+      mean,
+      _mm256_add_pd(
+          one, _mm256_mul_pd(k, _mm256_sub_pd(_mm256_div_pd(stdev, R), one))));
+
+  pixels = mask_bytes_avx2[_mm256_movemask_pd(
+      _mm256_cmp_pd(gray, threshold, _CMP_GT_OQ))];
+  memcpy(output, &pixels, sizeof(pixels));
+}
+
+/*
+ * Converts unsigned 32-bit integers to doubles exactly. AVX2 only converts
+ * signed ones, so the sign bit is flipped first and 2^31 added back.
+ */
+static inline TARGET_AVX2 __m256d u32_to_double_avx2(__m128i value) {
+  const __m128i sign = _mm_set1_epi32((int)0x80000000u);
+  const __m256d two_to_31 = _mm256_set1_pd(2147483648.0);
+
+  return _mm256_add_pd(_mm256_cvtepi32_pd(_mm_xor_si128(value, sign)),
+                       two_to_31);
+}
+
+/*
+ * Thresholds the interior pixels [col_begin, col_end) of one row, eight at a
+ * time, when both planes are planar with 32-bit elements. The window sums are
+ * taken on eight 32-bit lanes, which wrap modulo 2^32 exactly like the
+ * narrow planes, so each corner is a single load without widening. Returns
+ * the first column left over.
+ */
+static inline TARGET_AVX2 __attribute__((always_inline)) int
+sauvola_row_narrow_avx2_with_depth(const void *grayscale,
+                                   unsigned char *output,
+                                   const struct window_rows *rows,
+                                   int col_begin, int col_end, int r,
+                                   double count, double k, double R,
+                                   int sample_bits) {
+  const __m256d count_v = _mm256_set1_pd(count);
+  const __m256d reciprocal_v = _mm256_set1_pd(1.0 / count);
+  const __m256d k_v = _mm256_set1_pd(k);
+  const __m256d R_v = _mm256_set1_pd(R);
+  __m256i sums, squares;
+  int j;
+
+  for (j = col_begin; j + 8 <= col_end; j += 8) {
+    sums = corner_difference_avx2(rows->bottom_sums, rows->top_sums,
+                                  j - r - 1, j + r, 32);
+    squares = corner_difference_avx2(rows->bottom_squares, rows->top_squares,
+                                     j - r - 1, j + r, 32);
+
+    threshold_four_avx2(
+        output + j, load_gray_avx2(grayscale, j, sample_bits),
+        u32_to_double_avx2(_mm256_castsi256_si128(sums)),
+        u32_to_double_avx2(_mm256_castsi256_si128(squares)), count_v,
+        reciprocal_v, k_v, R_v);
+    threshold_four_avx2(
+        output + j + 4, load_gray_avx2(grayscale, j + 4, sample_bits),
+        u32_to_double_avx2(_mm256_extracti128_si256(sums, 1)),
+        u32_to_double_avx2(_mm256_extracti128_si256(squares, 1)), count_v,
+        reciprocal_v, k_v, R_v);
+  }
+
+  return j;
+}
+
+/*
+ * Thresholds the interior pixels [col_begin, col_end) of one row, four at a
+ * time. Always inlined with a constant sample width, layout and element
+ * widths. With 16-bit samples the window sums of squares can reach 2^52, past
+ * the exact range of u64_to_double_avx2.
+ */
+static inline TARGET_AVX2 __attribute__((always_inline)) void
+sauvola_row_avx2_with_layout(const void *grayscale, unsigned char *output,
+                             const struct window_rows *rows, int col_begin,
+                             int col_end, int r, double count, double k,
+                             double R, int sample_bits, int interleaved,
+                             int sum_bits, int sum_squares_bits) {
+  const __m256d count_v = _mm256_set1_pd(count);
+  const __m256d reciprocal_v = _mm256_set1_pd(1.0 / count);
+  const __m256d k_v = _mm256_set1_pd(k);
+  const __m256d R_v = _mm256_set1_pd(R);
+  __m256i window_sums, window_squares;
+  __m256d sum, sum_squares;
+
+  for (int j = col_begin; j + 4 <= col_end; j += 4) {
+    // Window sums are exact in 64-bit integer arithmetic modulo the width
+    window_sums_avx2(rows, j, r, interleaved, sum_bits, sum_squares_bits,
+                     &window_sums, &window_squares);
+    sum = u64_to_double_avx2(window_sums);
+    sum_squares = sample_bits == 16 ? u64_to_double_wide_avx2(window_squares)
+                                    : u64_to_double_avx2(window_squares);
+
+    // Mean, standard deviation, threshold and compare as in the scalar kernel
+    threshold_four_avx2(output + j, load_gray_avx2(grayscale, j, sample_bits),
+                        sum, sum_squares, count_v, reciprocal_v, k_v, R_v);
+  }
+}
+
+/*
+ * Thresholds the interior pixels [col_begin, col_end) of one row with the
+ * loop specialized for the layout of the integral image. Always inlined with
+ * a constant sample width.
+ */
+static inline TARGET_AVX2 __attribute__((always_inline)) void
+sauvola_row_avx2_with_depth(const void *grayscale, unsigned char *output,
+                            const struct window_rows *rows, int col_begin,
+                            int col_end, int r, double count, double k,
+                            double R, int sample_bits) {
+  int sum_bits = rows->sum_bits;
+  int sum_squares_bits = rows->sum_squares_bits;
+  int j;
+
+  if (rows->interleaved) {
+    if (sum_bits == 32) {
+      sauvola_row_avx2_with_layout(grayscale, output, rows, col_begin,
+                                   col_end, r, count, k, R, sample_bits, 1, 32,
+                                   32);
+    } else {
+      sauvola_row_avx2_with_layout(grayscale, output, rows, col_begin,
+                                   col_end, r, count, k, R, sample_bits, 1, 64,
+                                   64);
+    }
+  } else if (sum_bits == 32 && sum_squares_bits == 32) {
+    j = sauvola_row_narrow_avx2_with_depth(grayscale, output, rows, col_begin,
+                                           col_end, r, count, k, R,
+                                           sample_bits);
+    sauvola_row_avx2_with_layout(grayscale, output, rows, j, col_end, r, count,
+                                 k, R, sample_bits, 0, 32, 32);
+  } else if (sum_bits == 32) {
+    sauvola_row_avx2_with_layout(grayscale, output, rows, col_begin, col_end,
+                                 r, count, k, R, sample_bits, 0, 32, 64);
+  } else {
+    sauvola_row_avx2_with_layout(grayscale, output, rows, col_begin, col_end,
+                                 r, count, k, R, sample_bits, 0, 64, 64);
+  }
+}
+
+static TARGET_AVX2 void
+sauvola_row_avx2(const unsigned char *grayscale, unsigned char *output,
+                 const struct window_rows *rows, int col_begin, int col_end,
+                 int r, double count, double k, double R) {
+  sauvola_row_avx2_with_depth(grayscale, output, rows, col_begin, col_end, r,
+                              count, k, R, 8);
+}
+
+static TARGET_AVX2 void
+sauvola_row_16_avx2(const unsigned short *grayscale, unsigned char *output,
+                    const struct window_rows *rows, int col_begin, int col_end,
+                    int r, double count, double k, double R) {
+  sauvola_row_avx2_with_depth(grayscale, output, rows, col_begin, col_end, r,
+                              count, k, R, 16);
+}
+
+/* -------------------------------- AVX-512 --------------------------------- */
+
+/*
+ * Loads the (sum, sum of squares) pairs of eight consecutive pixels and splits
+ * them into a vector of sums and a vector of sums of squares.
+ */
+static inline TARGET_AVX512 void
+load_pairs_avx512(const unsigned long long *pairs, __m512i *sums,
+                  __m512i *squares) {
+  const __m512i even = _mm512_set_epi64(14, 12, 10, 8, 6, 4, 2, 0);
+  const __m512i odd = _mm512_set_epi64(15, 13, 11, 9, 7, 5, 3, 1);
+  __m512i first = _mm512_loadu_si512(pairs);
+  __m512i second = _mm512_loadu_si512(pairs + 8);
+
+  *sums = _mm512_permutex2var_epi64(first, even, second);
+  *squares = _mm512_permutex2var_epi64(first, odd, second);
+}
+
+/*
+ * Loads eight consecutive elements of one plane starting at the given index,
+ * zero-extended to 64-bit lanes.
+ */
+static inline TARGET_AVX512 __m512i load_plane_avx512(const void *plane,
+                                                      int bits, long index) {
+  if (bits == 32)
+    return _mm512_cvtepu32_epi64(_mm256_loadu_si256(
+        (const __m256i *)((const unsigned int *)plane + index)));
+
+  return _mm512_loadu_si512((const unsigned long long *)plane + index);
+}
+
+/*
+ * Loads the sums and sums of squares of eight consecutive integral image
+ * elements starting at column col of the given pair of plane rows.
+ */
+static inline TARGET_AVX512 void
+load_corner_avx512(const void *sums, const void *squares, long col,
+                   const struct window_rows *rows, __m512i *sum,
+                   __m512i *sum_squares) {
+  __m512i pairs;
+
+  if (!rows->interleaved) {
+    *sum = load_plane_avx512(sums, rows->sum_bits, col);
+    *sum_squares = load_plane_avx512(squares, rows->sum_squares_bits, col);
+  } else if (rows->sum_bits == 32) {
+    // Every 64-bit lane holds one (sum, sum of squares) pair
+    pairs = _mm512_loadu_si512((const unsigned int *)sums + 2 * col);
+    *sum = _mm512_and_si512(pairs, _mm512_set1_epi64(0xFFFFFFFFLL));
+    *sum_squares = _mm512_srli_epi64(pairs, 32);
+  } else {
+    load_pairs_avx512((const unsigned long long *)sums + 2 * col, sum,
+                      sum_squares);
+  }
+}
+
+/*
+ * Loads eight pixels of 8 or 16 bits as doubles.
+ */
+static inline TARGET_AVX512 __m512d load_gray_avx512(const void *grayscale,
+                                                     int j, int sample_bits) {
+  if (sample_bits == 16)
+    return _mm512_cvtepi32_pd(_mm256_cvtepu16_epi32(_mm_loadu_si128(
+        (const __m128i *)((const unsigned short *)grayscale + j))));
+
+  return _mm512_cvtepi32_pd(_mm256_cvtepu8_epi32(_mm_loadl_epi64(
+      (const __m128i *)((const unsigned char *)grayscale + j))));
+}
+
+/*
+ * Vector version of window_quotient, see window_quotient_avx2.
+ */
+static inline TARGET_AVX512 __m512d window_quotient_avx512(__m512d a,
+                                                           __m512d count,
+                                                           __m512d reciprocal) {
+  __m512d quotient = _mm512_mul_pd(a, reciprocal);
+
+  return _mm512_fmadd_pd(_mm512_fnmadd_pd(quotient, count, a), reciprocal,
+                         quotient);
+}
+
+/*
+ * Thresholds the interior pixels [col_begin, col_end) of one row, eight at a
+ * time. Always inlined with a constant sample width.
+ */
+static inline TARGET_AVX512 __attribute__((always_inline)) void
+sauvola_row_avx512_with_depth(const void *grayscale, unsigned char *output,
+                              const struct window_rows *rows, int col_begin,
+                              int col_end, int r, double count, double k,
+                              double R, int sample_bits) {
+  const __m512d count_v = _mm512_set1_pd(count);
+  const __m512d reciprocal_v = _mm512_set1_pd(1.0 / count);
+  const __m512d k_v = _mm512_set1_pd(k);
+  const __m512d R_v = _mm512_set1_pd(R);
+  const __m512d one = _mm512_set1_pd(1.0);
+  const __m512i sum_mask =
+      _mm512_set1_epi64(integral_plane_mask(rows->sum_bits));
+  const __m512i sum_squares_mask =
+      _mm512_set1_epi64(integral_plane_mask(rows->sum_squares_bits));
+  __m512i A, B, C, D, A_sq, B_sq, C_sq, D_sq;
+  __m512d sum, sum_squares, mean, variance, stdev, threshold, gray;
+  __mmask8 above;
+  int j;
+
+  for (j = col_begin; j + 8 <= col_end; j += 8) {
+    // Fetch the four corners of eight neighbouring windows
+    load_corner_avx512(rows->bottom_sums, rows->bottom_squares, j + r, rows,
+                       &D, &D_sq);
+    load_corner_avx512(rows->bottom_sums, rows->bottom_squares, j - r - 1, rows,
+                       &C, &C_sq);
+    load_corner_avx512(rows->top_sums, rows->top_squares, j + r, rows, &B,
+                       &B_sq);
+    load_corner_avx512(rows->top_sums, rows->top_squares, j - r - 1, rows, &A,
+                       &A_sq);
+
+    // Window sums are exact in 64-bit integer arithmetic modulo the width
+    sum = _mm512_cvtepu64_pd(_mm512_and_si512(
+        _mm512_add_epi64(_mm512_sub_epi64(_mm512_sub_epi64(D, B), C), A),
+        sum_mask));
+    sum_squares = _mm512_cvtepu64_pd(_mm512_and_si512(
+        _mm512_add_epi64(
+            _mm512_sub_epi64(_mm512_sub_epi64(D_sq, B_sq), C_sq), A_sq),
+        sum_squares_mask));
+
+    // Mean, standard deviation and threshold, as in the scalar kernel
+    mean = window_quotient_avx512(sum, count_v, reciprocal_v);
+    variance = _mm512_sub_pd(
+        window_quotient_avx512(sum_squares, count_v, reciprocal_v),
+        _mm512_mul_pd(mean, mean));
+    stdev = _mm512_sqrt_pd(variance);
+    threshold = _mm512_mul_pd(
+        mean,
+        _mm512_add_pd(one, _mm512_mul_pd(k_v, _mm512_sub_pd(
+                                                   _mm512_div_pd(stdev, R_v),
+                                                   one))));
+
+    // Compare and expand the mask into 0/255 bytes
+    gray = load_gray_avx512(grayscale, j, sample_bits);
+    above = _mm512_cmp_pd_mask(gray, threshold, _CMP_GT_OQ);
+    _mm_storel_epi64((__m128i *)(output + j), _mm_movm_epi8(above));
+  }
+}
+
+static TARGET_AVX512 void
+sauvola_row_avx512(const unsigned char *grayscale, unsigned char *output,
+                   const struct window_rows *rows, int col_begin, int col_end,
+                   int r, double count, double k, double R) {
+  sauvola_row_avx512_with_depth(grayscale, output, rows, col_begin, col_end, r,
+                                count, k, R, 8);
+}
+
+static TARGET_AVX512 void
+sauvola_row_16_avx512(const unsigned short *grayscale, unsigned char *output,
+                      const struct window_rows *rows, int col_begin,
+                      int col_end, int r, double count, double k, double R) {
+  sauvola_row_avx512_with_depth(grayscale, output, rows, col_begin, col_end,
+                                r, count, k, R, 16);
+}
+
+/* -------------------------------- Dispatch -------------------------------- */
+
+/*
+ * Points rows at the integral image rows bounding the windows of output row i
+ * and returns the number of pixels of a window in the interior.
+ */
+static double window_rows_at(struct window_rows *rows,
+                             struct integral_image *integral_image, int i,
+                             int r, int num_rows) {
+  int top = i - r > 0 ? i - r : 0;
+  int bottom = i + r < num_rows - 1 ? i + r : num_rows - 1;
+  long top_row = INTEGRAL_INDEX(integral_image, top - 1, 0);
+  long bottom_row = INTEGRAL_INDEX(integral_image, bottom, 0);
+
+  rows->interleaved = integral_image->layout == INTEGRAL_INTERLEAVED;
+  rows->sum_bits = integral_image->sum_bits;
+  rows->sum_squares_bits = integral_image->sum_squares_bits;
+  rows->top_sums =
+      integral_plane_at(integral_image->sum, rows->sum_bits, top_row);
+  rows->bottom_sums =
+      integral_plane_at(integral_image->sum, rows->sum_bits, bottom_row);
+  rows->top_squares = integral_plane_at(integral_image->sum_squares,
+                                        rows->sum_squares_bits, top_row);
+  rows->bottom_squares = integral_plane_at(integral_image->sum_squares,
+                                           rows->sum_squares_bits, bottom_row);
+
+  return (double)((2 * r + 1) * (bottom - top + 1));
+}
+
+/**
+ * Vectorized version of sauvola_threshold_with_integral_image for the pixels
+ * in rows [row_begin, row_end) and columns [col_begin, col_end). The interior
+ * of each row is processed with the given instruction set, the border columns
+ * and the leftover pixels with the scalar reference.
+ *
+ * @param level The instruction set to use, normally detect_simd_level().
+ */
+void sauvola_threshold_with_integral_image_simd_rect(
+    unsigned char **grayscale, struct integral_image *integral_image,
+    unsigned char **output, int num_cols, int num_rows, float k, int r, float R,
+    enum simd_level level, int row_begin, int row_end, int col_begin,
+    int col_end) {
+  // Columns whose window fits horizontally and has a left neighbour column
+  int interior_begin = r + 1 > col_begin ? r + 1 : col_begin;
+  int interior_end = num_cols - r < col_end ? num_cols - r : col_end;
+  int step = level == SIMD_AVX512 ? 8 : 4;
+
+  if (level == SIMD_SCALAR || interior_end - interior_begin < step) {
+    for (int i = row_begin; i < row_end; i++) {
+      sauvola_threshold_with_integral_image_span(
+          grayscale, integral_image, output, num_cols, num_rows, k, r, R, i,
+          col_begin, col_end);
+    }
+    return;
+  }
+
+  // Last column reached by the vector loop
+  int vector_end =
+      interior_begin + (interior_end - interior_begin) / step * step;
+  struct window_rows rows;
+
+  for (int i = row_begin; i < row_end; i++) {
+    double count = window_rows_at(&rows, integral_image, i, r, num_rows);
+
+    // Left border
+    sauvola_threshold_with_integral_image_span(grayscale, integral_image,
+                                               output, num_cols, num_rows, k, r,
+                                               R, i, col_begin, interior_begin);
+
+    // Interior
+    if (level == SIMD_AVX512) {
+      sauvola_row_avx512(grayscale[i], output[i], &rows, interior_begin,
+                         vector_end, r, count, k, R);
+    } else {
+      sauvola_row_avx2(grayscale[i], output[i], &rows, interior_begin,
+                       vector_end, r, count, k, R);
+    }
+
+    // Leftover interior pixels and the right border
+    sauvola_threshold_with_integral_image_span(grayscale, integral_image,
+                                               output, num_cols, num_rows, k, r,
+                                               R, i, vector_end, col_end);
+  }
+}
+
+/**
+ * Vectorized version of sauvola_threshold_with_integral_image for the rows in
+ * [row_begin, row_end), see sauvola_threshold_with_integral_image_simd_rect.
+ *
+ * @param level The instruction set to use, normally detect_simd_level().
+ */
+void sauvola_threshold_with_integral_image_simd_rows(
+    unsigned char **grayscale, struct integral_image *integral_image,
+    unsigned char **output, int num_cols, int num_rows, float k, int r, float R,
+    enum simd_level level, int row_begin, int row_end) {
+  sauvola_threshold_with_integral_image_simd_rect(
+      grayscale, integral_image, output, num_cols, num_rows, k, r, R, level,
+      row_begin, row_end, 0, num_cols);
+}
+
+/**
+ * Vectorized version of sauvola_threshold_with_integral_image. The instruction
+ * set (AVX-512, AVX2 or scalar) is picked at runtime from the CPU features.
+ */
+void sauvola_threshold_with_integral_image_simd(
+    unsigned char **grayscale, struct integral_image *integral_image,
+    unsigned char **output, int num_cols, int num_rows, float k, int r,
+    float R) {
+  sauvola_threshold_with_integral_image_simd_rows(
+      grayscale, integral_image, output, num_cols, num_rows, k, r, R,
+      detect_simd_level(), 0, num_rows);
+}
+
+/**
+ * Vectorized version of sauvola_threshold_16_with_integral_image_rows, with
+ * the same sequence of double precision operations as the scalar reference,
+ * see sauvola_threshold_with_integral_image_simd_rect.
+ *
+ * @param level The instruction set to use, normally detect_simd_level().
+ */
+void sauvola_threshold_16_with_integral_image_simd_rows(
+    unsigned short **grayscale, struct integral_image *integral_image,
+    unsigned char **output, int num_cols, int num_rows, float k, int r, float R,
+    enum simd_level level, int row_begin, int row_end) {
+  int interior_begin = r + 1;
+  int interior_end = num_cols - r;
+  int step = level == SIMD_AVX512 ? 8 : 4;
+
+  if (level == SIMD_SCALAR || interior_end - interior_begin < step) {
+    sauvola_threshold_16_with_integral_image_rows(grayscale, integral_image,
+                                                  output, num_cols, num_rows,
+                                                  k, r, R, row_begin, row_end);
+    return;
+  }
+
+  // Last column reached by the vector loop
+  int vector_end =
+      interior_begin + (interior_end - interior_begin) / step * step;
+  struct window_rows rows;
+
+  for (int i = row_begin; i < row_end; i++) {
+    double count = window_rows_at(&rows, integral_image, i, r, num_rows);
+
+    sauvola_threshold_16_with_integral_image_span(
+        grayscale, integral_image, output, num_cols, num_rows, k, r, R, i, 0,
+        interior_begin);
+    if (level == SIMD_AVX512) {
+      sauvola_row_16_avx512(grayscale[i], output[i], &rows, interior_begin,
+                            vector_end, r, count, k, R);
+    } else {
+      sauvola_row_16_avx2(grayscale[i], output[i], &rows, interior_begin,
+                          vector_end, r, count, k, R);
+    }
+    sauvola_threshold_16_with_integral_image_span(
+        grayscale, integral_image, output, num_cols, num_rows, k, r, R, i,
+        vector_end, num_cols);
+  }
+}
@@ -0,0 +1,189 @@
+#include "stream.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* -------------------------------------------------------------------------- */
+/*                    Streaming Sliding-Window Sauvola                        */
+/* -------------------------------------------------------------------------- */
+
+/**
+ * Allocates the running column sums for rows of num_cols pixels and clears
+ * them. Returns 1 on success and 0 if the memory cannot be allocated.
+ */
+int init_column_sums(struct column_sums *sums, int num_cols) {
+  sums->num_cols = num_cols;
+  sums->sum =
+      (unsigned long long *)calloc(num_cols, sizeof(unsigned long long));
+  sums->sum_squares =
+      (unsigned long long *)calloc(num_cols, sizeof(unsigned long long));
+  sums->row_sum =
+      (unsigned long long *)malloc((num_cols + 1) * sizeof(unsigned long long));
+  sums->row_sum_squares =
+      (unsigned long long *)malloc((num_cols + 1) * sizeof(unsigned long long));
+
+  if (sums->sum == NULL || sums->sum_squares == NULL || sums->row_sum == NULL ||
+      sums->row_sum_squares == NULL) {
+    free_column_sums(sums);
+    return 0;
+  }
+
+  return 1;
+}
+
+/**
+ * Frees the memory held by running column sums.
+ */
+void free_column_sums(struct column_sums *sums) {
+  free(sums->sum);
+  free(sums->sum_squares);
+  free(sums->row_sum);
+  free(sums->row_sum_squares);
+  sums->sum = sums->sum_squares = sums->row_sum = sums->row_sum_squares = NULL;
+}
+
+/**
+ * Adds a row of pixels to the running column sums.
+ */
+void column_sums_add_row(struct column_sums *sums, const unsigned char *row) {
+  for (int j = 0; j < sums->num_cols; j++) {
+    sums->sum[j] += row[j];
+    sums->sum_squares[j] += (unsigned long long)row[j] * row[j];
+  }
+}
+
+/**
+ * Removes a row of pixels, added earlier, from the running column sums.
+ */
+void column_sums_remove_row(struct column_sums *sums,
+                            const unsigned char *row) {
+  for (int j = 0; j < sums->num_cols; j++) {
+    sums->sum[j] -= row[j];
+    sums->sum_squares[j] -= (unsigned long long)row[j] * row[j];
+  }
+}
+
+/**
+ * Binarizes one row with the Sauvola algorithm, given running column sums over
+ * exactly the rows of its local region. The horizontal window is slid over the
+ * prefix sums of the column sums, so the window sums are the same integers the
+ * integral image kernel computes and the output is identical to it.
+ *
+ * @param grayscale The row of the input image to binarize.
+ * @param output The row of the output image.
+ * @param window_rows The number of rows currently held in the column sums.
+ */
+void column_sums_threshold_row(struct column_sums *sums,
+                               const unsigned char *grayscale,
+                               unsigned char *output, int window_rows, float k,
+                               int r, float R) {
+  unsigned long long sum, sum_squares;
+  long count;
+  double mean, stdev, threshold;
+  int num_cols = sums->num_cols;
+
+  // Horizontal prefix sums of the column sums
+  sums->row_sum[0] = 0;
+  sums->row_sum_squares[0] = 0;
+  for (int j = 0; j < num_cols; j++) {
+    sums->row_sum[j + 1] = sums->row_sum[j] + sums->sum[j];
+    sums->row_sum_squares[j + 1] =
+        sums->row_sum_squares[j] + sums->sum_squares[j];
+  }
+
+  for (int j = 0; j < num_cols; j++) {
+    // Determine the horizontal bounds of the local region
+    int left = fmax(j - r, 0);
+    int right = fmin(j + r, num_cols - 1);
+
+    // Compute the sum and sum of squares for the local region
+    sum = sums->row_sum[right + 1] - sums->row_sum[left];
+    sum_squares =
+        sums->row_sum_squares[right + 1] - sums->row_sum_squares[left];
+
+    // Compute the mean and standard deviation for the local region
+    count = (right - left + 1) * window_rows;
+    mean = sum / (double)count;
+    stdev = sqrt((sum_squares / (double)count) - (mean * mean));
+
+    // Compute the threshold for the current pixel using the mean and standard
+    // deviation
+    threshold = mean * (1.0 + k * ((stdev / R) - 1.0));
+
+    // Binarize the current pixel based on whether it is above or below the
+    // threshold
+    output[j] = grayscale[j] > threshold ? 255 : 0;
+  }
+}
+
+/**
+ * Binarizes a raw 8-bit image read row by row from input and writes the result
+ * row by row to output. Only the 2r+1 input rows of the current window, the
+ * running column sums and one output row are kept in memory, so memory is
+ * bounded by the width and the radius, not the height. Each output row is
+ * written as soon as the last row of its window has been read.
+ *
+ * @param input A stream positioned at the first pixel of the input image.
+ * @param output A stream to write the binarized pixels to.
+ * @return 1 on success, 0 if the memory cannot be allocated or the input ends
+ * early or the output cannot be written.
+ */
+int sauvola_threshold_stream(FILE *input, FILE *output, int num_rows,
+                             int num_cols, float k, int r, float R) {
+  struct column_sums sums;
+  int window_size = 2 * r + 1;
+  int next_row = 0, i, top, bottom;
+  int result = 1;
+
+  // The window never holds more rows than the image
+  if (window_size > num_rows)
+    window_size = num_rows;
+
+  unsigned char *window =
+      (unsigned char *)malloc((size_t)window_size * num_cols);
+  unsigned char *output_row = (unsigned char *)malloc(num_cols);
+
+  if (window == NULL || output_row == NULL ||
+      !init_column_sums(&sums, num_cols)) {
+    free(window);
+    free(output_row);
+    return 0;
+  }
+
+  for (i = 0; i < num_rows && result; i++) {
+    top = fmax(i - r, 0);
+    bottom = fmin(i + r, num_rows - 1);
+
+    // Drop the row that left the window. Its slot is reused just below.
+    if (i - r - 1 >= 0) {
+      column_sums_remove_row(
+          &sums, window + (size_t)((i - r - 1) % window_size) * num_cols);
+    }
+
+    // Read the rows that entered the window
+    for (; next_row <= bottom; next_row++) {
+      unsigned char *row = window + (size_t)(next_row % window_size) * num_cols;
+
+      if (fread(row, 1, num_cols, input) != (size_t)num_cols) {
+        result = 0;
+        break;
+      }
+      column_sums_add_row(&sums, row);
+    }
+    if (!result)
+      break;
+
+    // Row i is final now
+    column_sums_threshold_row(&sums,
+                              window + (size_t)(i % window_size) * num_cols,
+                              output_row, bottom - top + 1, k, r, R);
+    if (fwrite(output_row, 1, num_cols, output) != (size_t)num_cols)
+      result = 0;
+  }
+
+  free(window);
+  free(output_row);
+  free_column_sums(&sums);
+
+  return result;
+}
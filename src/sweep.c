@@ -0,0 +1,384 @@
+#include "sweep.h"
+#include "parallel.h"
+#include "tools.h"
+#include <math.h>
+#include <stdlib.h>
+
+/* -------------------------------------------------------------------------- */
+/*                        Parameter Sweep (One Integral Image)                */
+/* -------------------------------------------------------------------------- */
+
+/*
+ * A sweep thresholds the same image with several (k, r, R) parameter sets
+ * from one integral image. Every output row is produced for all parameter
+ * sets at once: the window mean and standard deviation of the row are
+ * computed once per distinct radius into a row buffer, and every parameter
+ * set with that radius only evaluates its threshold from the buffer. The
+ * integral image rows and the grayscale row are loaded once per row instead
+ * of once per parameter set, and the square root once per radius. The
+ * formulas are those of sauvola_threshold_with_integral_image, so every
+ * output is the same as with a separate call.
+ */
+
+// Rows per band handed to the thread pool
+#define SWEEP_BAND_ROWS 16
+
+/*
+ * Mean and standard deviation rows of one worker, one of each per distinct
+ * radius, and the window sizes of the row being computed.
+ */
+struct sweep_rows {
+  double *mean;
+  double *stdev;
+  double *count;
+};
+
+struct sauvola_sweep_job {
+  unsigned char **grayscale;
+  struct integral_image *integral_image;
+  unsigned char ***outputs;
+  int num_cols;
+  int num_rows;
+  const struct sauvola_params *params;
+  int num_params;
+  int *slots;    // row buffer slot of every parameter set
+  int *radii;    // radius of every slot
+  int num_slots; // distinct radii
+  double *rows;  // the row buffers of every worker, worker_size doubles each
+  size_t worker_size;
+};
+
+/**
+ * Returns the largest radius of a list of parameter sets, which the integral
+ * image of a sweep has to be sized for, see choose_integral_widths.
+ */
+int sweep_max_radius(const struct sauvola_params *params, int num_params) {
+  int max_r = 0;
+
+  for (int n = 0; n < num_params; n++) {
+    if (params[n].r > max_r)
+      max_r = params[n].r;
+  }
+
+  return max_r;
+}
+
+/**
+ * Releases the buffers of a sweep.
+ */
+void free_sweep_scratch(struct sweep_scratch *scratch) {
+  free(scratch->slots);
+  free(scratch->radii);
+  free(scratch->rows);
+  scratch->slots = NULL;
+  scratch->radii = NULL;
+  scratch->rows = NULL;
+  scratch->param_capacity = 0;
+  scratch->row_capacity = 0;
+}
+
+/*
+ * Gives every parameter set the slot of the first one with the same radius,
+ * in slot tables taken from the scratch, and lays out row buffers of the
+ * slots for num_workers workers. Nothing shrinks, so the scratch of a larger
+ * sweep is reused as it is. Returns 0 if the scratch cannot be grown.
+ */
+static int reserve_sweep_scratch(struct sauvola_sweep_job *job,
+                                 struct sweep_scratch *scratch,
+                                 int num_workers) {
+  size_t size;
+  int n, m;
+
+  if (scratch->param_capacity < job->num_params) {
+    free(scratch->slots);
+    free(scratch->radii);
+    scratch->slots = (int *)malloc(job->num_params * sizeof(int));
+    scratch->radii = (int *)malloc(job->num_params * sizeof(int));
+    scratch->param_capacity = 0;
+    if (scratch->slots == NULL || scratch->radii == NULL)
+      return 0;
+    scratch->param_capacity = job->num_params;
+  }
+  job->slots = scratch->slots;
+  job->radii = scratch->radii;
+
+  job->num_slots = 0;
+  for (n = 0; n < job->num_params; n++) {
+    for (m = 0; m < job->num_slots; m++) {
+      if (job->radii[m] == job->params[n].r)
+        break;
+    }
+    if (m == job->num_slots)
+      job->radii[job->num_slots++] = job->params[n].r;
+    job->slots[n] = m;
+  }
+
+  // A mean and a stdev row per slot and a count row, in whole cache lines
+  job->worker_size = ((2 * (size_t)job->num_slots + 1) * job->num_cols + 7) /
+                     8 * 8;
+  size = num_workers * job->worker_size;
+  if (scratch->row_capacity < size) {
+    void *rows;
+
+    free(scratch->rows);
+    scratch->rows = NULL;
+    scratch->row_capacity = 0;
+    if (posix_memalign(&rows, 64, size * sizeof(double)))
+      return 0;
+    scratch->rows = (double *)rows;
+    scratch->row_capacity = size;
+  }
+  job->rows = scratch->rows;
+
+  return 1;
+}
+
+/*
+ * Returns the row buffers of a worker.
+ */
+static struct sweep_rows sweep_worker_rows(const struct sauvola_sweep_job *job,
+                                           int worker_index) {
+  double *base = job->rows + worker_index * job->worker_size;
+  size_t slot_size = (size_t)job->num_slots * job->num_cols;
+  struct sweep_rows rows = {base, base + slot_size, base + 2 * slot_size};
+
+  return rows;
+}
+
+/*
+ * Computes the window mean and standard deviation of the pixels of row i in
+ * columns [col_begin, col_end) for one combination of plane widths and
+ * column step, always inlined with constant ones. In the interior, where the
+ * windows are not clipped horizontally, the loop has no data dependent
+ * bounds and is vectorized by the compiler. The window sizes go through
+ * count, so that the interior divides by them like the reference does
+ * instead of multiplying by a hoisted reciprocal, which rounds differently.
+ */
+static inline __attribute__((always_inline)) void
+window_stats_with_widths(struct integral_image *integral_image, int num_cols,
+                         int num_rows, int r, int i, double *mean,
+                         double *stdev, double *count, int col_begin,
+                         int col_end, int interior, int sum_bits,
+                         int sum_squares_bits, long step) {
+  unsigned long long sum, sum_squares;
+
+  // Row -1 of the integral image reads as zero
+  int top = fmax(i - r, 0);
+  int bottom = fmin(i + r, num_rows - 1);
+  long top_row = INTEGRAL_INDEX(integral_image, top - 1, 0);
+  long bottom_row = INTEGRAL_INDEX(integral_image, bottom, 0);
+  const void *sums = integral_image->sum;
+  const void *squares = integral_image->sum_squares;
+
+  for (int j = col_begin; j < col_end; j++) {
+    int left = interior ? j - r : fmax(j - r, 0);
+    int right = interior ? j + r : fmin(j + r, num_cols - 1);
+    long A_index = top_row + (left - 1) * step;
+    long B_index = top_row + right * step;
+    long C_index = bottom_row + (left - 1) * step;
+    long D_index = bottom_row + right * step;
+
+    sum = (integral_plane_load(sums, sum_bits, D_index) -
+           integral_plane_load(sums, sum_bits, B_index) -
+           integral_plane_load(sums, sum_bits, C_index) +
+           integral_plane_load(sums, sum_bits, A_index)) &
+          integral_plane_mask(sum_bits);
+    sum_squares =
+        (integral_plane_load(squares, sum_squares_bits, D_index) -
+         integral_plane_load(squares, sum_squares_bits, B_index) -
+         integral_plane_load(squares, sum_squares_bits, C_index) +
+         integral_plane_load(squares, sum_squares_bits, A_index)) &
+        integral_plane_mask(sum_squares_bits);
+    count[j] = (right - left + 1) * (bottom - top + 1);
+
+    mean[j] = sum / count[j];
+    stdev[j] = sqrt((sum_squares / count[j]) - (mean[j] * mean[j]));
+  }
+}
+
+/*
+ * Dispatches the borders and the interior of row i to the body for the plane
+ * widths and the layout of the integral image.
+ */
+static inline __attribute__((always_inline)) void
+window_stats_with_layout(struct integral_image *integral_image, int num_cols,
+                         int num_rows, int r, int i, double *mean,
+                         double *stdev, double *count, int sum_bits,
+                         int sum_squares_bits, long step) {
+  // Columns whose window fits horizontally
+  int interior_begin = r < num_cols ? r : num_cols;
+  int interior_end = num_cols - r > interior_begin ? num_cols - r
+                                                   : interior_begin;
+
+  window_stats_with_widths(integral_image, num_cols, num_rows, r, i, mean,
+                           stdev, count, 0, interior_begin, 0, sum_bits,
+                           sum_squares_bits, step);
+  window_stats_with_widths(integral_image, num_cols, num_rows, r, i, mean,
+                           stdev, count, interior_begin, interior_end, 1,
+                           sum_bits, sum_squares_bits, step);
+  window_stats_with_widths(integral_image, num_cols, num_rows, r, i, mean,
+                           stdev, count, interior_end, num_cols, 0, sum_bits,
+                           sum_squares_bits, step);
+}
+
+static void window_stats(struct integral_image *integral_image, int num_cols,
+                         int num_rows, int r, int i, double *mean,
+                         double *stdev, double *count) {
+  if (integral_image->layout == INTEGRAL_INTERLEAVED) {
+    window_stats_with_layout(integral_image, num_cols, num_rows, r, i, mean,
+                             stdev, count, integral_image->sum_bits,
+                             integral_image->sum_squares_bits, 2);
+  } else if (integral_image->sum_bits == 32 &&
+             integral_image->sum_squares_bits == 32) {
+    window_stats_with_layout(integral_image, num_cols, num_rows, r, i, mean,
+                             stdev, count, 32, 32, 1);
+  } else if (integral_image->sum_bits == 32) {
+    window_stats_with_layout(integral_image, num_cols, num_rows, r, i, mean,
+                             stdev, count, 32, 64, 1);
+  } else {
+    window_stats_with_layout(integral_image, num_cols, num_rows, r, i, mean,
+                             stdev, count, 64, 64, 1);
+  }
+}
+
+/*
+ * Thresholds row i for every parameter set.
+ */
+static void sweep_row(struct sauvola_sweep_job *job, struct sweep_rows *rows,
+                      int i) {
+  const unsigned char *gray = job->grayscale[i];
+  int num_cols = job->num_cols;
+
+  for (int s = 0; s < job->num_slots; s++) {
+    window_stats(job->integral_image, num_cols, job->num_rows, job->radii[s],
+                 i, rows->mean + (size_t)s * num_cols,
+                 rows->stdev + (size_t)s * num_cols, rows->count);
+  }
+
+  for (int n = 0; n < job->num_params; n++) {
+    const double *mean = rows->mean + (size_t)job->slots[n] * num_cols;
+    const double *stdev = rows->stdev + (size_t)job->slots[n] * num_cols;
+    unsigned char *output = job->outputs[n][i];
+    float k = job->params[n].k;
+    float R = job->params[n].R;
+
+    for (int j = 0; j < num_cols; j++) {
+      output[j] = gray[j] > mean[j] * (1.0 + k * ((stdev[j] / R) - 1.0)) ? 255
+                                                                          : 0;
+    }
+  }
+}
+
+static void sauvola_sweep_band_task(void *context, int task_index,
+                                    int worker_index) {
+  struct sauvola_sweep_job *job = (struct sauvola_sweep_job *)context;
+  int row_begin = task_index * SWEEP_BAND_ROWS;
+  int row_end = fmin(row_begin + SWEEP_BAND_ROWS, job->num_rows);
+  struct sweep_rows rows = sweep_worker_rows(job, worker_index);
+
+  for (int i = row_begin; i < row_end; i++) {
+    sweep_row(job, &rows, i);
+  }
+}
+
+/**
+ * Binarizes the rows in [row_begin, row_end) once for every parameter set,
+ * into outputs[n] for params[n]. The integral image has to cover the whole
+ * image and be sized for the largest radius, see sweep_max_radius. Every
+ * output is the same as with sauvola_threshold_with_integral_image.
+ *
+ * @return 1 on success, 0 if the row buffers cannot be allocated.
+ */
+int sauvola_threshold_sweep_rows(unsigned char **grayscale,
+                                 struct integral_image *integral_image,
+                                 unsigned char ***outputs, int num_cols,
+                                 int num_rows,
+                                 const struct sauvola_params *params,
+                                 int num_params, int row_begin, int row_end) {
+  struct sauvola_sweep_job job = {grayscale, integral_image, outputs,
+                                  num_cols,  num_rows,       params,
+                                  num_params};
+  struct sweep_scratch scratch = {NULL, NULL, 0, NULL, 0};
+  struct sweep_rows rows;
+  int ok = reserve_sweep_scratch(&job, &scratch, 1);
+
+  if (ok) {
+    rows = sweep_worker_rows(&job, 0);
+    for (int i = row_begin; i < row_end; i++) {
+      sweep_row(&job, &rows, i);
+    }
+  }
+
+  free_sweep_scratch(&scratch);
+  return ok;
+}
+
+/*
+ * Runs a sweep on the workers of pool, or on num_threads threads if pool is
+ * NULL, with the slot tables and row buffers taken from the scratch.
+ */
+static int threshold_sweep(struct sauvola_sweep_job *job,
+                           struct worker_pool *pool, int num_threads,
+                           struct sweep_scratch *scratch) {
+  int num_bands = (job->num_rows + SWEEP_BAND_ROWS - 1) / SWEEP_BAND_ROWS;
+
+  if (!reserve_sweep_scratch(job, scratch,
+                             parallel_worker_count(pool, num_threads)))
+    return 0;
+
+  if (!run_parallel(pool, num_bands, num_threads, sauvola_sweep_band_task,
+                    job)) {
+    // Fall back to the calling thread with the first worker's buffers
+    for (int i = 0; i < num_bands; i++) {
+      sauvola_sweep_band_task(job, i, 0);
+    }
+  }
+
+  return 1;
+}
+
+/**
+ * Multithreaded version of sauvola_threshold_sweep_rows over the whole image.
+ * Bands of rows are handed to a work-stealing thread pool, each worker with
+ * row buffers of its own.
+ *
+ * @param num_threads The number of threads to use. Values below 1 select one
+ * thread per online processor.
+ * @return 1 on success, 0 if the row buffers cannot be allocated.
+ */
+int sauvola_threshold_sweep(unsigned char **grayscale,
+                            struct integral_image *integral_image,
+                            unsigned char ***outputs, int num_cols,
+                            int num_rows, const struct sauvola_params *params,
+                            int num_params, int num_threads) {
+  struct sauvola_sweep_job job = {grayscale, integral_image, outputs,
+                                  num_cols,  num_rows,       params,
+                                  num_params};
+  struct sweep_scratch scratch = {NULL, NULL, 0, NULL, 0};
+  int ok = threshold_sweep(&job, NULL, num_threads, &scratch);
+
+  free_sweep_scratch(&scratch);
+  return ok;
+}
+
+/**
+ * Same as sauvola_threshold_sweep on the threads of a worker pool, with the
+ * slot tables and row buffers kept in scratch. Once scratch has grown for the
+ * longest parameter list, the widest image and the largest pool, further
+ * sweeps do not allocate.
+ *
+ * @return 1 on success, 0 if the scratch cannot be grown.
+ */
+int sauvola_threshold_sweep_pooled(unsigned char **grayscale,
+                                   struct integral_image *integral_image,
+                                   unsigned char ***outputs, int num_cols,
+                                   int num_rows,
+                                   const struct sauvola_params *params,
+                                   int num_params, struct worker_pool *pool,
+                                   struct sweep_scratch *scratch) {
+  struct sauvola_sweep_job job = {grayscale, integral_image, outputs,
+                                  num_cols,  num_rows,       params,
+                                  num_params};
+
+  return threshold_sweep(&job, pool, 0, scratch);
+}
@@ -0,0 +1,258 @@
+#include "synthetic.h"
+#include "parallel.h"
+#include "pgm.h"
+#include "ppm.h"
+#include "rgb.h"
+#include "tools.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* -------------------------------------------------------------------------- */
+/*                        Synthetic Document Generator                        */
+/* -------------------------------------------------------------------------- */
+
+/*
+ * Document-like test images of any size, without media files: lines of text
+ * made of random stroke glyphs on paper, lit by an illumination gradient from
+ * the top left to the bottom right corner, with noise on every pixel. Text
+ * has a fixed size in pixels, like a page scanned at a fixed resolution, so
+ * larger images hold more text rather than larger text.
+ *
+ * Every pixel is a function of the seed and its coordinates only, through a
+ * counter-based hash, so any row can be generated on its own, bands of rows
+ * in parallel and images of 1 GP row by row without holding them in memory,
+ * always with the same result.
+ */
+
+// Text layout in pixels
+#define SYNTHETIC_LINE_PITCH 40
+#define SYNTHETIC_GLYPH_TOP 10
+#define SYNTHETIC_GLYPH_HEIGHT 20
+#define SYNTHETIC_GLYPH_WIDTH 12
+#define SYNTHETIC_GLYPH_PITCH 16
+#define SYNTHETIC_STROKE 3
+
+// Rows per band handed to the thread pool
+#define SYNTHETIC_BAND_ROWS 16
+
+static inline unsigned int mix(unsigned int x) {
+  x ^= x >> 16;
+  x *= 0x7feb352dU;
+  x ^= x >> 15;
+  x *= 0x846ca68bU;
+  x ^= x >> 16;
+  return x;
+}
+
+static inline unsigned int hash3(unsigned int seed, unsigned int a,
+                                 unsigned int b) {
+  return mix(mix(mix(seed) ^ a) + b);
+}
+
+/*
+ * Returns 1 if one of the strokes of a glyph covers pixel (x, y) of its cell.
+ * Bits 0 to 7 of strokes select the left, right and middle stems, the top,
+ * middle and bottom bars and the two diagonals.
+ */
+static int glyph_covers(unsigned int strokes, int x, int y) {
+  const int w = SYNTHETIC_GLYPH_WIDTH, h = SYNTHETIC_GLYPH_HEIGHT;
+  const int s = SYNTHETIC_STROKE;
+
+  return ((strokes & 1) && x < s) || ((strokes & 2) && x >= w - s) ||
+         ((strokes & 4) && x >= (w - s) / 2 && x < (w + s) / 2) ||
+         ((strokes & 8) && y < s) ||
+         ((strokes & 16) && y >= (h - s) / 2 && y < (h + s) / 2) ||
+         ((strokes & 32) && y >= h - s) ||
+         ((strokes & 64) && abs(x * h - y * w) < s * h / 2) ||
+         ((strokes & 128) && abs((w - 1 - x) * h - y * w) < s * h / 2);
+}
+
+/*
+ * Stores 1 in ink[j] where a glyph stroke covers pixel (i, j), 0 elsewhere.
+ * Some lines are left empty between paragraphs and the last line of a
+ * paragraph ends early.
+ */
+static void ink_row(unsigned char *ink, int i, int num_rows, int num_cols,
+                    unsigned int seed) {
+  int margin_rows = num_rows / 16, margin_cols = num_cols / 16;
+  int right = num_cols - margin_cols;
+  int line, y, x0, g;
+  unsigned int line_hash, glyph, strokes;
+
+  memset(ink, 0, num_cols);
+  if (i < margin_rows || i >= num_rows - margin_rows)
+    return;
+
+  line = (i - margin_rows) / SYNTHETIC_LINE_PITCH;
+  y = (i - margin_rows) % SYNTHETIC_LINE_PITCH - SYNTHETIC_GLYPH_TOP;
+  line_hash = hash3(seed, line, 0);
+  if (y < 0 || y >= SYNTHETIC_GLYPH_HEIGHT || line_hash % 8 == 0)
+    return;
+  if (line_hash % 8 == 1)
+    right = margin_cols + (long)(right - margin_cols) *
+                              ((line_hash >> 8) & 0xFF) / 256;
+
+  for (g = 0, x0 = margin_cols; x0 + SYNTHETIC_GLYPH_WIDTH <= right;
+       g++, x0 += SYNTHETIC_GLYPH_PITCH) {
+    glyph = hash3(seed, line, g + 1);
+    // Word spaces
+    if (glyph % 6 == 0)
+      continue;
+    // At least one stroke per glyph
+    strokes = (glyph >> 8) | 1U << ((glyph >> 3) & 7);
+    for (int x = 0; x < SYNTHETIC_GLYPH_WIDTH; x++) {
+      ink[x0 + x] = glyph_covers(strokes, x, y);
+    }
+  }
+}
+
+/*
+ * Illumination of pixel (i, j) as a factor between 0.6 and 1.
+ */
+static inline double illumination(int i, int j, int num_rows, int num_cols) {
+  double u = (double)j / num_cols, v = (double)i / num_rows;
+
+  return 0.6 + 0.4 * (1.0 - u) * (1.0 - 0.5 * v);
+}
+
+/*
+ * Triangular noise between -16 and 15 from two bytes of a hash.
+ */
+static inline int noise(unsigned int bits) {
+  return ((int)(bits & 0xFF) + (int)((bits >> 8) & 0xFF) - 255) >> 4;
+}
+
+static inline unsigned char clamp_pixel(double value) {
+  return value < 0 ? 0 : value > 255 ? 255 : (unsigned char)value;
+}
+
+/**
+ * Generates row i of a synthetic grayscale document of the given size:
+ * paper at 225 and ink at 40 before illumination and noise.
+ */
+void synthetic_document_row(unsigned char *gray, int i, int num_rows,
+                            int num_cols, unsigned int seed) {
+  unsigned int row_key = hash3(seed, 0x5eed, i);
+
+  ink_row(gray, i, num_rows, num_cols, seed);
+  for (int j = 0; j < num_cols; j++) {
+    double base = gray[j] ? 40 : 225;
+
+    gray[j] = clamp_pixel(base * illumination(i, j, num_rows, num_cols) +
+                          noise(mix(row_key + j)));
+  }
+}
+
+/**
+ * Generates row i of a synthetic color document of the given size, with the
+ * layout of synthetic_document_row: dark blue ink on cream paper, with noise
+ * on every channel.
+ */
+void synthetic_document_row_rgb(unsigned char *red, unsigned char *green,
+                                unsigned char *blue, int i, int num_rows,
+                                int num_cols, unsigned int seed) {
+  static const double paper[3] = {240, 230, 205}, ink[3] = {25, 35, 95};
+  unsigned int row_key = hash3(seed, 0x5eed, i);
+
+  ink_row(red, i, num_rows, num_cols, seed);
+  for (int j = 0; j < num_cols; j++) {
+    int c = red[j] != 0;
+    double light = illumination(i, j, num_rows, num_cols);
+    unsigned int bits = mix(row_key + j);
+
+    red[j] = clamp_pixel((c ? ink[0] : paper[0]) * light + noise(bits));
+    green[j] = clamp_pixel((c ? ink[1] : paper[1]) * light + noise(bits >> 8));
+    blue[j] = clamp_pixel((c ? ink[2] : paper[2]) * light + noise(bits >> 16));
+  }
+}
+
+struct synthetic_job {
+  unsigned char **grayscale;
+  int num_rows;
+  int num_cols;
+  unsigned int seed;
+};
+
+static void synthetic_band_task(void *context, int task_index,
+                                int worker_index) {
+  struct synthetic_job *job = (struct synthetic_job *)context;
+  int row_begin = task_index * SYNTHETIC_BAND_ROWS;
+  int row_end = fmin(row_begin + SYNTHETIC_BAND_ROWS, job->num_rows);
+
+  for (int i = row_begin; i < row_end; i++) {
+    synthetic_document_row(job->grayscale[i], i, job->num_rows, job->num_cols,
+                           job->seed);
+  }
+}
+
+/**
+ * Fills an image allocated with alloc_2D_unsigned_char with a synthetic
+ * grayscale document, see synthetic_document_row. The result only depends
+ * on the size and the seed, not on the number of threads.
+ *
+ * @param num_threads The number of threads to use. Values below 1 select one
+ * thread per online processor.
+ */
+void generate_synthetic_document(unsigned char **grayscale, int num_rows,
+                                 int num_cols, unsigned int seed,
+                                 int num_threads) {
+  struct synthetic_job job = {grayscale, num_rows, num_cols, seed};
+  int num_bands = (num_rows + SYNTHETIC_BAND_ROWS - 1) / SYNTHETIC_BAND_ROWS;
+
+  if (num_threads < 1)
+    num_threads = default_thread_count();
+
+  if (num_threads == 1 ||
+      !parallel_for(num_bands, num_threads, synthetic_band_task, &job)) {
+    for (int i = 0; i < num_bands; i++) {
+      synthetic_band_task(&job, i, 0);
+    }
+  }
+}
+
+/**
+ * Writes a synthetic document as a PGM image with one channel or as a PPM
+ * image with three, generating it row by row so that images larger than the
+ * memory can be written.
+ *
+ * @return 1 on success, 0 if the file cannot be written or the row buffers
+ * cannot be allocated.
+ */
+int write_synthetic_document(const char *file_name, int num_rows,
+                             int num_cols, int channels, unsigned int seed) {
+  unsigned char *row = (unsigned char *)malloc((size_t)6 * num_cols);
+  FILE *file;
+  int ok = row != NULL && (channels == 1 || channels == 3);
+
+  if (!ok || (file = fopen(file_name, "wb")) == NULL) {
+    free(row);
+    return 0;
+  }
+
+  if (channels == 1) {
+    write_pgm_header(file, num_rows, num_cols, 255);
+  } else {
+    write_ppm_header(file, num_rows, num_cols, 255);
+  }
+
+  // For PPM images the planes follow the interleaved row in the buffer
+  for (int i = 0; i < num_rows && ok; i++) {
+    if (channels == 1) {
+      synthetic_document_row(row, i, num_rows, num_cols, seed);
+    } else {
+      synthetic_document_row_rgb(row + 3 * num_cols, row + 4 * num_cols,
+                                 row + 5 * num_cols, i, num_rows, num_cols,
+                                 seed);
+      interleave_rgb(row + 3 * num_cols, row + 4 * num_cols,
+                     row + 5 * num_cols, row, num_cols);
+    }
+    ok = fwrite(row, channels, num_cols, file) == (size_t)num_cols;
+  }
+
+  if (fclose(file) != 0)
+    ok = 0;
+  free(row);
+
+  return ok;
+}
@@ -1,67 +1,182 @@
+#include "approximate.h"
+#include "batch.h"
+#include "context.h"
+#include "exact.h"
+#include "flow.h"
+#include "integral.h"
+#include "mapped.h"
+#include "pbm.h"
 #include "pgm.h"
+#include "pgm16.h"
+#include "ppm.h"
+#include "rgb.h"
+#include "sauvola.h"
+#include "sauvola_api.h"
+#include "sauvola_simd.h"
+#include "stream.h"
+#include "sweep.h"
+#include "synthetic.h"
+#include "test.h"
+#include "tiled.h"
 #include "tools.h"
+#include <errno.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <string.h>
+#include <sys/stat.h>
+
+/* -------------------------------------------------------------------------- */
+/*                             Allocation Counting                            */
+/* -------------------------------------------------------------------------- */
+
+/*
+ * Tests that promise no allocations count the real ones. The GNU C library
+ * lets a program replace malloc and its relatives, so the test program
+ * forwards them to the library's own entry points and counts the calls made
+ * while counting is on, including those made by the library itself, such as
+ * the FILE of fopen. Elsewhere nothing is replaced and nothing is counted.
+ */
+static atomic_int counting_allocations;
+static atomic_long num_counted_allocations;
+
+#ifdef __GLIBC__
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *pointer, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void __libc_free(void *pointer);
+
+static void count_allocation(void) {
+  if (atomic_load_explicit(&counting_allocations, memory_order_relaxed))
+    atomic_fetch_add_explicit(&num_counted_allocations, 1,
+                              memory_order_relaxed);
+}
+
+void *malloc(size_t size) {
+  count_allocation();
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+  count_allocation();
+  return __libc_calloc(count, size);
+}
+
+void *realloc(void *pointer, size_t size) {
+  count_allocation();
+  return __libc_realloc(pointer, size);
+}
+
+void free(void *pointer) { __libc_free(pointer); }
+
+int posix_memalign(void **pointer, size_t alignment, size_t size) {
+  void *block;
+
+  if (alignment % sizeof(void *) != 0 || (alignment & (alignment - 1)) != 0)
+    return EINVAL;
+  count_allocation();
+  if ((block = __libc_memalign(alignment, size)) == NULL)
+    return ENOMEM;
+  *pointer = block;
+
+  return 0;
+}
+
+#endif
+
+/*
+ * Starts counting the allocations of every thread from zero.
+ */
+static void start_counting_allocations(void) {
+  atomic_store(&num_counted_allocations, 0);
+  atomic_store(&counting_allocations, 1);
+}
+
+/*
+ * Stops counting and returns the number of allocations since
+ * start_counting_allocations, always 0 where they cannot be counted.
+ */
+static long stop_counting_allocations(void) {
+  atomic_store(&counting_allocations, 0);
+  return atomic_load(&num_counted_allocations);
+}
 
 /* -------------------------------------------------------------------------- */
 /*                              Application Tests                             */
 /* -------------------------------------------------------------------------- */
 
+/*
+ * Allocates the synthetic test page of the given size and fills it in memory
+ * with generate_synthetic_document. The tests that only exercise the engines
+ * start from it; the ones that exercise the file formats, the mapped reader
+ * and the file flows read the same page back from the disk.
+ */
+static unsigned char **generate_test_page(int num_rows, int num_cols) {
+  unsigned char **grayscale = alloc_2D_unsigned_char(num_rows, num_cols);
+
+  if (grayscale == NULL)
+    exit(1);
+  generate_synthetic_document(grayscale, num_rows, num_cols, TEST_PAGE_SEED,
+                              1);
+
+  return grayscale;
+}
+
 /**
  * This function is used to test whether an image is correctly converted into an
  * integral image. An integral image is a representation of an image where each
  * pixel contains the sum of all the pixels above and to the left of it. The
- * function takes the path to the source image as a parameter, reads the header
- * to get the dimensions and max color value, allocates memory for the grayscale
- * and integral image arrays, reads the image data, computes the integral image,
+ * function takes the size of the test page as a parameter, generates the page,
+ * allocates memory for the integral image arrays, computes the integral image,
  * and then loops through the pixels of the image, calculating the integral
  * image values for the local region and comparing them with the grayscale value
  * of the same pixel. If any of the values don't match, the function returns
  * false, indicating that the test has failed. If all the values match, the
  * function returns true, indicating that the test has passed.
  */
-bool test_integral_image(const char *source_image) {
-  int num_rows, num_cols;
-  int max_color;
-  int header_length, i, j;
-  unsigned long long sum;
-
-  // Read header to get dimensions and max color value
-  if ((header_length = read_pgm_header(source_image, &num_rows, &num_cols,
-                                       &max_color)) <= 0)
-    exit(1);
+bool test_integral_image(int num_rows, int num_cols) {
+  int max_color = 255;
+  int i, j, n;
+  unsigned long long sum, sum_squares;
+  bool result = true;
 
   // Allocate memory for grayscale array
-  unsigned char **grayscale = alloc_2D_unsigned_char(num_rows, num_cols);
-
-  // read PGM image data
-  if (read_pgm_data(grayscale[0], source_image, header_length, num_rows,
-                    num_cols, max_color) == 0)
-    ;
+  unsigned char **grayscale = generate_test_page(num_rows, num_cols);
 
-  // Allocate memory for integral image 3D array
-  unsigned long long ***integral_image =
-      alloc_integral_image(num_rows, num_cols);
-
-  // Calculate integral image
-  compute_integral_image(grayscale, integral_image, num_cols, num_rows);
+  // Allocate memory for a 64-bit and a narrow integral image
+  struct integral_image *integral_images[2] = {
+      alloc_integral_image(num_rows, num_cols, INTEGRAL_PLANAR),
+      alloc_narrow_integral_image(num_rows, num_cols, max_color, 0)};
+  if (integral_images[0] == NULL || integral_images[1] == NULL)
+    exit(1);
 
-  for (i = 0; i < num_rows; i++) {
-    for (j = 0; j < num_cols; j++) {
-      // Calculate integral image values for the local region
-      unsigned long A =
-          (i - 1 < 0 || j - 1 < 0) ? 0 : integral_image[i - 1][j - 1][0];
-      unsigned long B = i - 1 < 0 ? 0 : integral_image[i - 1][j][0];
-      unsigned long C = j - 1 < 0 ? 0 : integral_image[i][j - 1][0];
-      unsigned long D = integral_image[i][j][0];
+  for (n = 0; n < 2 && result; n++) {
+    // Calculate integral image
+    compute_integral_image(grayscale, integral_images[n], num_cols, num_rows);
 
-      sum = D - B - C + A;
+    for (i = 0; i < num_rows && result; i++) {
+      for (j = 0; j < num_cols; j++) {
+        // Calculate integral image values for the single pixel region
+        sum = integral_window_sum(integral_images[n], i, j, i, j);
+        sum_squares =
+            integral_window_sum_squares(integral_images[n], i, j, i, j);
 
-      if (sum != grayscale[i][j])
-        return false;
+        if (sum != grayscale[i][j] ||
+            sum_squares != grayscale[i][j] * grayscale[i][j]) {
+          result = false;
+          break;
+        }
+      }
     }
   }
 
-  return true;
+  free(grayscale[0]);
+  free(grayscale);
+  free_integral_image(integral_images[0]);
+  free_integral_image(integral_images[1]);
+
+  return result;
 }
 
 /**
@@ -122,3 +237,1649 @@ bool test_image_unity(const char *image_one, const char *image_two) {
   // If all grayscale values match, return true
   return true;
 }
+
+/**
+ * This function is used to test whether the multithreaded Sauvola engines give
+ * the same output as the serial ones. It generates the test page, binarizes it
+ * with the serial and the parallel version of both the direct and the integral
+ * image algorithm, and compares the outputs pixel by pixel. If any pixel
+ * differs, the function returns false, otherwise it returns true.
+ */
+bool test_parallel_unity(int num_rows, int num_cols, int r, int num_threads) {
+  int i, j;
+  bool result = true;
+
+  // Allocate memory for grayscale and output arrays
+  unsigned char **grayscale = generate_test_page(num_rows, num_cols);
+  unsigned char **serial = alloc_2D_unsigned_char(num_rows, num_cols);
+  unsigned char **parallel = alloc_2D_unsigned_char(num_rows, num_cols);
+
+  // Compare the direct algorithm
+  sauvola_threshold(grayscale, serial, num_cols, num_rows, 0.5, r, 255);
+  sauvola_threshold_parallel(grayscale, parallel, num_cols, num_rows, 0.5, r,
+                             255, num_threads);
+  for (i = 0; i < num_rows && result; i++) {
+    for (j = 0; j < num_cols; j++) {
+      if (serial[i][j] != parallel[i][j]) {
+        result = false;
+        break;
+      }
+    }
+  }
+
+  // Compare the integral image algorithm
+  struct integral_image *integral_image =
+      alloc_integral_image(num_rows, num_cols, INTEGRAL_PLANAR);
+  if (integral_image == NULL)
+    exit(1);
+  compute_integral_image(grayscale, integral_image, num_cols, num_rows);
+  sauvola_threshold_with_integral_image(grayscale, integral_image, serial,
+                                        num_cols, num_rows, 0.5, r, 255);
+  sauvola_threshold_with_integral_image_parallel(grayscale, integral_image,
+                                                 parallel, num_cols, num_rows,
+                                                 0.5, r, 255, num_threads);
+  for (i = 0; i < num_rows && result; i++) {
+    for (j = 0; j < num_cols; j++) {
+      if (serial[i][j] != parallel[i][j]) {
+        result = false;
+        break;
+      }
+    }
+  }
+
+  free(grayscale[0]);
+  free(grayscale);
+  free(serial[0]);
+  free(serial);
+  free(parallel[0]);
+  free(parallel);
+  free_integral_image(integral_image);
+
+  return result;
+}
+
+/*
+ * Binarizes row i with the integral image kernel as it was before the window
+ * count reciprocals were hoisted, dividing by the count for every pixel. The
+ * integral image has to use the 64-bit planar layout.
+ */
+static void threshold_row_by_division(unsigned char **grayscale,
+                                      struct integral_image *integral_image,
+                                      unsigned char *output, int num_cols,
+                                      int num_rows, float k, int r, float R,
+                                      int i) {
+  int top = i - r > 0 ? i - r : 0;
+  int bottom = i + r < num_rows - 1 ? i + r : num_rows - 1;
+  long top_row = INTEGRAL_INDEX(integral_image, top - 1, 0);
+  long bottom_row = INTEGRAL_INDEX(integral_image, bottom, 0);
+  const unsigned long long *sums = integral_image->sum;
+  const unsigned long long *squares = integral_image->sum_squares;
+  long step = integral_image->step;
+
+  for (int j = 0; j < num_cols; j++) {
+    int left = j - r > 0 ? j - r : 0;
+    int right = j + r < num_cols - 1 ? j + r : num_cols - 1;
+    long A = top_row + (left - 1) * step, B = top_row + right * step;
+    long C = bottom_row + (left - 1) * step, D = bottom_row + right * step;
+    unsigned long long sum = sums[D] - sums[B] - sums[C] + sums[A];
+    unsigned long long sum_squares =
+        squares[D] - squares[B] - squares[C] + squares[A];
+    long count = (right - left + 1) * (bottom - top + 1);
+    double mean = sum / (double)count;
+    double stdev = sqrt((sum_squares / (double)count) - (mean * mean));
+    double threshold = mean * (1.0 + k * ((stdev / R) - 1.0));
+
+    output[j] = grayscale[i][j] > threshold ? 255 : 0;
+  }
+}
+
+/**
+ * This function is used to test whether the vectorized integral image kernel
+ * gives the same output as the scalar one. The test page is binarized with
+ * the scalar kernel and then with every instruction set up to the one the CPU
+ * supports on both integral image layouts and on a narrow integral image,
+ * comparing the outputs pixel by pixel. The scalar kernel, which multiplies by
+ * hoisted reciprocals of the window counts, is also compared with a kernel
+ * that divides by the count for every pixel. If any pixel differs, the
+ * function returns false, otherwise it returns true.
+ */
+bool test_simd_unity(int num_rows, int num_cols, int r) {
+  const float ks[2] = {0.5, 0};
+  int max_color = 255;
+  int i, j, level, n, t;
+  bool result = true;
+
+  // Allocate memory for grayscale and output arrays
+  unsigned char **grayscale = generate_test_page(num_rows, num_cols);
+  unsigned char **scalar = alloc_2D_unsigned_char(num_rows, num_cols);
+  unsigned char **vector = alloc_2D_unsigned_char(num_rows, num_cols);
+
+  // Calculate the scalar reference with the 64-bit planar layout
+  struct integral_image *integral_images[3] = {
+      alloc_integral_image(num_rows, num_cols, INTEGRAL_PLANAR),
+      alloc_integral_image(num_rows, num_cols, INTEGRAL_INTERLEAVED),
+      alloc_narrow_integral_image(num_rows, num_cols, max_color, r)};
+  for (n = 0; n < 3; n++) {
+    if (integral_images[n] == NULL)
+      exit(1);
+    compute_integral_image(grayscale, integral_images[n], num_cols, num_rows);
+  }
+
+  // With k = 0 the threshold is the mean itself, so the flat areas of the
+  // page, whose mean equals every pixel, expose any rounding of the mean
+  for (t = 0; t < 2 && result; t++) {
+    sauvola_threshold_with_integral_image(grayscale, integral_images[0], scalar,
+                                          num_cols, num_rows, ks[t], r, 255);
+
+    // The reciprocals must not change a single pixel
+    for (i = 0; i < num_rows && result; i++) {
+      threshold_row_by_division(grayscale, integral_images[0], vector[i],
+                                num_cols, num_rows, ks[t], r, 255, i);
+      result = memcmp(scalar[i], vector[i], num_cols) == 0;
+    }
+
+    // Compare every instruction set on every integral image variant
+    for (level = SIMD_SCALAR; level <= detect_simd_level() && result;
+         level++) {
+      for (n = 0; n < 3 && result; n++) {
+        sauvola_threshold_with_integral_image_simd_rows(
+            grayscale, integral_images[n], vector, num_cols, num_rows, ks[t],
+            r, 255, (enum simd_level)level, 0, num_rows);
+        for (i = 0; i < num_rows && result; i++) {
+          for (j = 0; j < num_cols; j++) {
+            if (scalar[i][j] != vector[i][j]) {
+              result = false;
+              break;
+            }
+          }
+        }
+      }
+    }
+  }
+
+  free(grayscale[0]);
+  free(grayscale);
+  free(scalar[0]);
+  free(scalar);
+  free(vector[0]);
+  free(vector);
+  for (n = 0; n < 3; n++) {
+    free_integral_image(integral_images[n]);
+  }
+
+  return result;
+}
+
+/**
+ * This function is used to test whether the streaming Sauvola engine gives the
+ * same output as the integral image one. The source image is streamed through
+ * sauvola_threshold_stream into a temporary file, which is then compared pixel
+ * by pixel with the output of sauvola_threshold_with_integral_image. If any
+ * pixel differs, the function returns false, otherwise it returns true.
+ */
+bool test_stream_unity(const char *source_image, int r) {
+  int num_rows, num_cols;
+  int max_color;
+  int header_length, i, j;
+  bool result = true;
+  FILE *input, *output;
+
+  // Read header to get dimensions and max color value
+  if ((header_length = read_pgm_header(source_image, &num_rows, &num_cols,
+                                       &max_color)) <= 0)
+    exit(1);
+
+  // Allocate memory for grayscale and output arrays
+  unsigned char **grayscale = alloc_2D_unsigned_char(num_rows, num_cols);
+  unsigned char **reference = alloc_2D_unsigned_char(num_rows, num_cols);
+  unsigned char **streamed = alloc_2D_unsigned_char(num_rows, num_cols);
+
+  // read PGM image data
+  if (read_pgm_data(grayscale[0], source_image, header_length, num_rows,
+                    num_cols, max_color) == 0)
+    exit(1);
+
+  // Calculate the integral image reference
+  struct integral_image *integral_image =
+      alloc_integral_image(num_rows, num_cols, INTEGRAL_PLANAR);
+  if (integral_image == NULL)
+    exit(1);
+  compute_integral_image(grayscale, integral_image, num_cols, num_rows);
+  sauvola_threshold_with_integral_image(grayscale, integral_image, reference,
+                                        num_cols, num_rows, 0.5, r, 255);
+
+  // Stream the image through a temporary file
+  if ((input = fopen(source_image, "rb")) == NULL ||
+      (output = tmpfile()) == NULL)
+    exit(1);
+  fseek(input, header_length, SEEK_SET);
+  if (!sauvola_threshold_stream(input, output, num_rows, num_cols, 0.5, r,
+                                255))
+    result = false;
+  rewind(output);
+  if (fread(streamed[0], num_cols, num_rows, output) != (size_t)num_rows)
+    result = false;
+  fclose(input);
+  fclose(output);
+
+  for (i = 0; i < num_rows && result; i++) {
+    for (j = 0; j < num_cols; j++) {
+      if (reference[i][j] != streamed[i][j]) {
+        result = false;
+        break;
+      }
+    }
+  }
+
+  free(grayscale[0]);
+  free(grayscale);
+  free(reference[0]);
+  free(reference);
+  free(streamed[0]);
+  free(streamed);
+  free_integral_image(integral_image);
+
+  return result;
+}
+
+/**
+ * Checks that the memory-mapped reader exposes the same header and pixels as
+ * read_pgm_header and read_pgm_data.
+ */
+bool test_mapped_unity(const char *source_image) {
+  int num_rows, num_cols;
+  int max_color;
+  int header_length, i, j;
+  bool result = true;
+  struct mapped_image image;
+
+  // Read header to get dimensions and max color value
+  if ((header_length = read_pgm_header(source_image, &num_rows, &num_cols,
+                                       &max_color)) <= 0)
+    exit(1);
+
+  // Allocate memory for grayscale array
+  unsigned char **grayscale = alloc_2D_unsigned_char(num_rows, num_cols);
+
+  // read PGM image data
+  if (read_pgm_data(grayscale[0], source_image, header_length, num_rows,
+                    num_cols, max_color) == 0)
+    exit(1);
+
+  if (!map_pnm_image(source_image, &image, NULL))
+    exit(1);
+
+  if (image.num_rows != num_rows || image.num_cols != num_cols ||
+      image.max_color != max_color || image.channels != 1 ||
+      image.pixels - (unsigned char *)image.base != header_length)
+    result = false;
+
+  for (i = 0; i < num_rows && result; i++) {
+    for (j = 0; j < num_cols; j++) {
+      if (grayscale[i][j] != image.rows[i][j]) {
+        result = false;
+        break;
+      }
+    }
+  }
+
+  unmap_pnm_image(&image);
+  free(grayscale[0]);
+  free(grayscale);
+
+  return result;
+}
+
+/**
+ * Writes an RGB image built from a PGM image with write_ppm_image and checks
+ * that the pixels are interleaved as (R, G, B) and that read_ppm_data splits
+ * them back into the same channels.
+ *
+ * @param temporary_image The name of the PPM file to write.
+ */
+bool test_ppm_unity(const char *source_image, const char *temporary_image) {
+  int num_rows, num_cols;
+  int max_color;
+  int header_length, i, j;
+  bool result = true;
+  struct mapped_image image;
+
+  // Read header to get dimensions and max color value
+  if ((header_length = read_pgm_header(source_image, &num_rows, &num_cols,
+                                       &max_color)) <= 0)
+    exit(1);
+
+  // Allocate memory for the written and the read channels
+  unsigned char **channels[3], **read_channels[3];
+  for (i = 0; i < 3; i++) {
+    channels[i] = alloc_2D_unsigned_char(num_rows, num_cols);
+    read_channels[i] = alloc_2D_unsigned_char(num_rows, num_cols);
+  }
+
+  // Derive three different channels from the grayscale image
+  if (read_pgm_data(channels[0][0], source_image, header_length, num_rows,
+                    num_cols, max_color) == 0)
+    exit(1);
+  for (i = 0; i < num_rows; i++) {
+    for (j = 0; j < num_cols; j++) {
+      channels[1][i][j] = channels[0][i][j] * 7 + j;
+      channels[2][i][j] = 255 - channels[0][i][j];
+    }
+  }
+
+  if (!write_ppm_image(temporary_image, channels[0][0], channels[1][0],
+                       channels[2][0], num_rows, num_cols, 255))
+    exit(1);
+
+  // Check the interleaved payload
+  if (!map_pnm_image(temporary_image, &image, NULL))
+    exit(1);
+  if (image.channels != 3 || image.num_rows != num_rows ||
+      image.num_cols != num_cols)
+    result = false;
+  for (i = 0; i < num_rows && result; i++) {
+    for (j = 0; j < 3 * num_cols; j++) {
+      if (image.rows[i][j] != channels[j % 3][i][j / 3]) {
+        result = false;
+        break;
+      }
+    }
+  }
+  unmap_pnm_image(&image);
+
+  // Check the channels read back
+  if ((header_length = read_ppm_header(temporary_image, &num_rows, &num_cols,
+                                       &max_color)) <= 0 ||
+      !read_ppm_data(read_channels[0][0], read_channels[1][0],
+                     read_channels[2][0], temporary_image, header_length,
+                     num_rows, num_cols, max_color))
+    result = false;
+  for (i = 0; i < num_rows && result; i++) {
+    for (j = 0; j < num_cols; j++) {
+      if (read_channels[0][i][j] != channels[0][i][j] ||
+          read_channels[1][i][j] != channels[1][i][j] ||
+          read_channels[2][i][j] != channels[2][i][j]) {
+        result = false;
+        break;
+      }
+    }
+  }
+
+  for (i = 0; i < 3; i++) {
+    free(channels[i][0]);
+    free(channels[i]);
+    free(read_channels[i][0]);
+    free(read_channels[i]);
+  }
+
+  return result;
+}
+
+/**
+ * Checks the fused RGB to grayscale stage on an RGB image built from the test
+ * page: every gray value must be within one level of the truncated double
+ * precision luma formula, the vectorized conversion must match the scalar
+ * fixed point one, and the integral image filled on the way must match
+ * compute_integral_image.
+ */
+bool test_gray_unity(int num_rows, int num_cols, int r) {
+  int i, j;
+  bool result = true;
+  unsigned char red, green, blue;
+  int expected;
+  double luma;
+
+  // Allocate memory for the source, RGB and grayscale arrays
+  unsigned char **source = generate_test_page(num_rows, num_cols);
+  unsigned char **rgb = alloc_2D_unsigned_char(num_rows, 3 * num_cols);
+  unsigned char **grayscale = alloc_2D_unsigned_char(num_rows, num_cols);
+
+  // Derive three different channels from the grayscale image
+  for (i = 0; i < num_rows; i++) {
+    for (j = 0; j < num_cols; j++) {
+      rgb[i][3 * j] = source[i][j];
+      rgb[i][3 * j + 1] = source[i][j] * 7 + j;
+      rgb[i][3 * j + 2] = 255 - source[i][j] + i;
+    }
+  }
+
+  // Allocate memory for integral images
+  struct integral_image *fused =
+      alloc_narrow_integral_image(num_rows, num_cols, 255, r);
+  struct integral_image *reference =
+      alloc_narrow_integral_image(num_rows, num_cols, 255, r);
+  if (fused == NULL || reference == NULL)
+    exit(1);
+
+  rgb_to_gray_with_integral_image(rgb, grayscale, fused, num_cols, num_rows);
+  compute_integral_image(grayscale, reference, num_cols, num_rows);
+
+  for (i = 0; i < num_rows && result; i++) {
+    for (j = 0; j < num_cols; j++) {
+      red = rgb[i][3 * j];
+      green = rgb[i][3 * j + 1];
+      blue = rgb[i][3 * j + 2];
+      luma = 0.299 * red + 0.587 * green + 0.114 * blue;
+      expected = (19595 * red + 38470 * green + 7471 * blue) >> 16;
+      if (grayscale[i][j] != expected ||
+          abs(grayscale[i][j] - (int)luma) > 1 ||
+          integral_window_sum(fused, 0, 0, i, j) !=
+              integral_window_sum(reference, 0, 0, i, j) ||
+          integral_window_sum_squares(fused, 0, 0, i, j) !=
+              integral_window_sum_squares(reference, 0, 0, i, j)) {
+        result = false;
+        break;
+      }
+    }
+  }
+
+  free(source[0]);
+  free(source);
+  free(rgb[0]);
+  free(rgb);
+  free(grayscale[0]);
+  free(grayscale);
+  free_integral_image(fused);
+  free_integral_image(reference);
+
+  return result;
+}
+
+/**
+ * Runs the batch pipeline over a manifest listing the source image, a missing
+ * image and a copy of the source image with the same base name in another
+ * directory, checks that the missing image and the copy are reported as failed
+ * and the page written for the source image matches the integral image
+ * algorithm.
+ *
+ * @param output_directory The directory for the manifest and the results.
+ */
+bool test_batch_unity(const char *source_image, const char *output_directory,
+                      int r) {
+  int num_rows, num_cols;
+  int max_color;
+  int header_length, i, j;
+  bool result = true;
+  char manifest_name[4096];
+  struct batch_options options = {2, 3, 2, 1, r};
+  struct batch_report report;
+  struct mapped_image page;
+  FILE *manifest;
+
+  // Read header to get dimensions and max color value
+  if ((header_length = read_pgm_header(source_image, &num_rows, &num_cols,
+                                       &max_color)) <= 0)
+    exit(1);
+
+  // Allocate memory for grayscale and output arrays
+  unsigned char **grayscale = alloc_2D_unsigned_char(num_rows, num_cols);
+  unsigned char **reference = alloc_2D_unsigned_char(num_rows, num_cols);
+
+  // read PGM image data
+  if (read_pgm_data(grayscale[0], source_image, header_length, num_rows,
+                    num_cols, max_color) == 0)
+    exit(1);
+
+  // Calculate the integral image reference
+  struct integral_image *integral_image =
+      alloc_integral_image(num_rows, num_cols, INTEGRAL_PLANAR);
+  if (integral_image == NULL)
+    exit(1);
+  compute_integral_image(grayscale, integral_image, num_cols, num_rows);
+  sauvola_threshold_with_integral_image(grayscale, integral_image, reference,
+                                        num_cols, num_rows, 0.5, r, 255);
+
+  // Copy the source image to a subdirectory, under the same base name
+  const char *base = strrchr(source_image, '/');
+  char page_name[4096], copy_name[4096];
+  base = base != NULL ? base + 1 : source_image;
+  snprintf(copy_name, sizeof(copy_name), "%s/copy", output_directory);
+  mkdir(output_directory, 0755);
+  mkdir(copy_name, 0755);
+  snprintf(copy_name, sizeof(copy_name), "%s/copy/%s", output_directory, base);
+  if (!write_pgm_image(copy_name, grayscale[0], num_rows, num_cols,
+                       max_color))
+    exit(1);
+
+  // List the source image, an image that does not exist and the copy, whose
+  // output would overwrite the one of the source image
+  snprintf(manifest_name, sizeof(manifest_name), "%s/manifest.txt",
+           output_directory);
+  if ((manifest = fopen(manifest_name, "w")) == NULL)
+    exit(1);
+  fprintf(manifest, "# batch test\n%s\n%s/missing.pgm\n%s\n", source_image,
+          output_directory, copy_name);
+  fclose(manifest);
+
+  if (!sauvola_batch(manifest_name, output_directory, &options, &report) ||
+      report.num_pages != 3 || report.num_failed != 2)
+    result = false;
+
+  // Check the page written for the source image
+  snprintf(page_name, sizeof(page_name), "%s/%s", output_directory, base);
+  if (!map_pnm_image(page_name, &page, NULL))
+    exit(1);
+  if (page.num_rows != num_rows || page.num_cols != num_cols)
+    result = false;
+  for (i = 0; i < num_rows && result; i++) {
+    for (j = 0; j < num_cols; j++) {
+      if (reference[i][j] != page.rows[i][j]) {
+        result = false;
+        break;
+      }
+    }
+  }
+  unmap_pnm_image(&page);
+
+  free(grayscale[0]);
+  free(grayscale);
+  free(reference[0]);
+  free(reference);
+  free_integral_image(integral_image);
+
+  return result;
+}
+
+/**
+ * Runs the direct, integral image, tiled, PBM and sweep flows several times
+ * with one context and checks that after the first round they make no
+ * allocations at all, counted with malloc itself where the C library allows
+ * it, that a smaller image reuses the buffers and that the outputs match the
+ * flow run without a context.
+ *
+ * @param temporary_image The name of the files to write, "_ctx" is appended
+ * for the run without a context, ".pbm" for the PBM flow and "_sweep" and
+ * the parameter set for the sweep flow.
+ */
+bool test_context_reuse(const char *source_image, const char *temporary_image,
+                        int r) {
+  struct sauvola_context context;
+  struct mapped_image with_context, without_context;
+  char reference_name[4096], packed_name[4096], sweep_names[2][4096];
+  const char *sweep_outputs[] = {sweep_names[0], sweep_names[1]};
+  const struct sauvola_params sweep_params[] = {{0.5, r, 255},
+                                                {0.3, r + 5, 128}};
+  int warm_allocations, i;
+  long allocations;
+  bool result = true;
+
+  snprintf(reference_name, sizeof(reference_name), "%s_ctx", temporary_image);
+  snprintf(packed_name, sizeof(packed_name), "%s.pbm", temporary_image);
+  for (i = 0; i < 2; i++) {
+    snprintf(sweep_names[i], sizeof(sweep_names[i]), "%s_sweep%d",
+             temporary_image, i);
+  }
+  pgm_sauvola_flow_with_integral_image(source_image, reference_name, 0.5, r,
+                                       255, 2, NULL);
+
+  // The first round grows the buffers and starts the workers
+  init_sauvola_context(&context);
+  for (i = 0; i < 4; i++) {
+    if (i == 1) {
+      warm_allocations = context.num_allocations;
+      start_counting_allocations();
+    }
+    pgm_sauvola_flow_with_integral_image(source_image, temporary_image, 0.5,
+                                         r, 255, 2, &context);
+    pgm_sauvola_flow(source_image, temporary_image, 0.5, r, 255, 2, &context);
+    pgm_sauvola_flow_tiled(source_image, temporary_image, 0.5, r, 255, 2,
+                           &context);
+    pgm_sauvola_flow_pbm(source_image, packed_name, 0.5, r, 255, 2, &context);
+    pgm_sauvola_flow_sweep(source_image, sweep_outputs, sweep_params, 2, 2,
+                           &context);
+  }
+  if (context_output(&context, context.output.row_capacity / 2, 1) == NULL)
+    result = false;
+  allocations = stop_counting_allocations();
+  if (allocations != 0 || context.num_allocations != warm_allocations)
+    result = false;
+
+  // The last run with the context was the integral image flow
+  pgm_sauvola_flow_with_integral_image(source_image, temporary_image, 0.5, r,
+                                       255, 2, &context);
+  free_sauvola_context(&context);
+
+  // The first parameter set of the sweep is the one of the reference
+  for (i = 0; i < 2; i++) {
+    if (!map_pnm_image(i == 0 ? temporary_image : sweep_names[0],
+                       &with_context, NULL) ||
+        !map_pnm_image(reference_name, &without_context, NULL))
+      exit(1);
+    if (with_context.length != without_context.length ||
+        memcmp(with_context.base, without_context.base, with_context.length))
+      result = false;
+    unmap_pnm_image(&with_context);
+    unmap_pnm_image(&without_context);
+  }
+  remove(packed_name);
+  remove(sweep_names[0]);
+  remove(sweep_names[1]);
+
+  return result;
+}
+
+/**
+ * Checks that the tiled engine matches the integral image algorithm for the
+ * automatic tile size and for tiles smaller than the radius, tiles that do
+ * not divide the image and single-row and single-column tiles.
+ */
+bool test_tiled_unity(int num_rows, int num_cols, int r) {
+  int i, j, t;
+  bool result = true;
+  const int tile_sizes[][2] = {{0, 0}, {7, 5}, {64, 64}, {1, 333}, {50, 1}};
+
+  // Allocate memory for grayscale and output arrays
+  unsigned char **grayscale = generate_test_page(num_rows, num_cols);
+  unsigned char **reference = alloc_2D_unsigned_char(num_rows, num_cols);
+  unsigned char **tiled = alloc_2D_unsigned_char(num_rows, num_cols);
+
+  // Calculate the integral image reference
+  struct integral_image *integral_image =
+      alloc_integral_image(num_rows, num_cols, INTEGRAL_PLANAR);
+  if (integral_image == NULL)
+    exit(1);
+  compute_integral_image(grayscale, integral_image, num_cols, num_rows);
+  sauvola_threshold_with_integral_image(grayscale, integral_image, reference,
+                                        num_cols, num_rows, 0.5, r, 255);
+
+  for (t = 0; t < 5 && result; t++) {
+    memset(tiled[0], 1, (size_t)num_rows * num_cols);
+    sauvola_threshold_tiled(grayscale, tiled, num_cols, num_rows, 0.5, r, 255,
+                            tile_sizes[t][0], tile_sizes[t][1], 3);
+
+    for (i = 0; i < num_rows && result; i++) {
+      for (j = 0; j < num_cols; j++) {
+        if (reference[i][j] != tiled[i][j]) {
+          result = false;
+          break;
+        }
+      }
+    }
+  }
+
+  free(grayscale[0]);
+  free(grayscale);
+  free(reference[0]);
+  free(reference);
+  free(tiled[0]);
+  free(tiled);
+  free_integral_image(integral_image);
+
+  return result;
+}
+
+/**
+ * Checks that the running-sum engine matches the integral image algorithm,
+ * both over the whole image and over row bands that start and end within r
+ * rows of the image edges.
+ */
+bool test_running_sums_unity(int num_rows, int num_cols, int r) {
+  int i, j, b;
+  bool result = true;
+
+  // Allocate memory for grayscale and output arrays
+  unsigned char **grayscale = generate_test_page(num_rows, num_cols);
+  unsigned char **reference = alloc_2D_unsigned_char(num_rows, num_cols);
+  unsigned char **running = alloc_2D_unsigned_char(num_rows, num_cols);
+
+  // Calculate the integral image reference
+  struct integral_image *integral_image =
+      alloc_integral_image(num_rows, num_cols, INTEGRAL_PLANAR);
+  if (integral_image == NULL)
+    exit(1);
+  compute_integral_image(grayscale, integral_image, num_cols, num_rows);
+  sauvola_threshold_with_integral_image(grayscale, integral_image, reference,
+                                        num_cols, num_rows, 0.5, r, 255);
+
+  // Whole image, then bands with boundaries near both edges
+  int bounds[] = {0, 1, r, num_rows / 2, num_rows - r, num_rows - 1, num_rows};
+  for (i = 1; i < 7; i++) {
+    bounds[i] = fmin(fmax(bounds[i], bounds[i - 1]), num_rows);
+  }
+  for (b = 0; b < 2 && result; b++) {
+    memset(running[0], 1, (size_t)num_rows * num_cols);
+    if (b == 0) {
+      sauvola_threshold_running_sums(grayscale, running, num_cols, num_rows,
+                                     0.5, r, 255);
+    } else {
+      for (i = 0; i + 1 < 7; i++) {
+        sauvola_threshold_running_sums_rows(grayscale, running, num_cols,
+                                            num_rows, 0.5, r, 255, bounds[i],
+                                            bounds[i + 1]);
+      }
+    }
+
+    for (i = 0; i < num_rows && result; i++) {
+      for (j = 0; j < num_cols; j++) {
+        if (reference[i][j] != running[i][j]) {
+          result = false;
+          break;
+        }
+      }
+    }
+  }
+
+  free(grayscale[0]);
+  free(grayscale);
+  free(reference[0]);
+  free(reference);
+  free(running[0]);
+  free(running);
+  free_integral_image(integral_image);
+
+  return result;
+}
+
+/**
+ * Checks that the bit-packed kernel holds the same pixels as the integral
+ * image algorithm and that the PBM image written from it reads back with the
+ * right size and payload.
+ */
+bool test_pbm_unity(const char *source_image, const char *temporary_image,
+                    int r) {
+  int num_rows, num_cols, read_rows, read_cols;
+  int max_color;
+  int header_length, i, j;
+  bool result = true;
+  FILE *file;
+
+  // Read header to get dimensions and max color value
+  if ((header_length = read_pgm_header(source_image, &num_rows, &num_cols,
+                                       &max_color)) <= 0)
+    exit(1);
+  int row_bytes = packed_row_bytes(num_cols);
+
+  // Allocate memory for grayscale, output and packed arrays
+  unsigned char **grayscale = alloc_2D_unsigned_char(num_rows, num_cols);
+  unsigned char **reference = alloc_2D_unsigned_char(num_rows, num_cols);
+  unsigned char **packed = alloc_2D_unsigned_char(num_rows, row_bytes);
+  unsigned char **read_back = alloc_2D_unsigned_char(num_rows, row_bytes);
+  unsigned char *unpacked = (unsigned char *)malloc(num_cols);
+  if (unpacked == NULL)
+    exit(1);
+
+  // read PGM image data
+  if (read_pgm_data(grayscale[0], source_image, header_length, num_rows,
+                    num_cols, max_color) == 0)
+    exit(1);
+
+  // Calculate the integral image reference and the packed output
+  struct integral_image *integral_image =
+      alloc_integral_image(num_rows, num_cols, INTEGRAL_PLANAR);
+  if (integral_image == NULL)
+    exit(1);
+  compute_integral_image(grayscale, integral_image, num_cols, num_rows);
+  sauvola_threshold_with_integral_image(grayscale, integral_image, reference,
+                                        num_cols, num_rows, 0.5, r, 255);
+  if (!sauvola_threshold_with_integral_image_packed(
+          grayscale, integral_image, packed, num_cols, num_rows, 0.5, r, 255,
+          3))
+    exit(1);
+
+  for (i = 0; i < num_rows && result; i++) {
+    unpack_binary_row(packed[i], unpacked, num_cols);
+    if (memcmp(unpacked, reference[i], num_cols))
+      result = false;
+  }
+
+  // Write the PBM image and read it back
+  if (!write_pbm_image(temporary_image, packed[0], num_rows, num_cols) ||
+      (file = fopen(temporary_image, "rb")) == NULL)
+    exit(1);
+  if (fscanf(file, "P4 # eyetom.com %d %d", &read_cols, &read_rows) != 2 ||
+      read_rows != num_rows || read_cols != num_cols || !isspace(fgetc(file)) ||
+      fread(read_back[0], row_bytes, num_rows, file) != (size_t)num_rows ||
+      fgetc(file) != EOF ||
+      memcmp(read_back[0], packed[0], (size_t)num_rows * row_bytes))
+    result = false;
+  fclose(file);
+
+  // A black left half and a white right half that ends mid-byte
+  for (j = 0; j < num_cols; j++) {
+    reference[0][j] = j < num_cols / 2 ? 0 : 255;
+  }
+  pack_binary_row(reference[0], packed[0], num_cols);
+  for (j = 0; j < num_cols && result; j++) {
+    if (!(packed[0][j / 8] & (0x80 >> (j % 8))) != (j >= num_cols / 2))
+      result = false;
+  }
+  if (num_cols % 8 && packed[0][row_bytes - 1] & (0xFF >> (num_cols % 8)))
+    result = false;
+
+  free(grayscale[0]);
+  free(grayscale);
+  free(reference[0]);
+  free(reference);
+  free(packed[0]);
+  free(packed);
+  free(read_back[0]);
+  free(read_back);
+  free(unpacked);
+  free_integral_image(integral_image);
+
+  return result;
+}
+
+/**
+ * Checks the exact integer decision against the floating point reference. The
+ * two may only differ on pixels closer to the threshold than the rounding
+ * error of the reference formula, which is far below 1e-6 * 255 (1 + k
+ * (1 + 255 / R)). The multithreaded version has to give the same output as
+ * the serial one.
+ */
+bool test_exact_unity(int num_rows, int num_cols, int r) {
+  const struct sauvola_rational ks[] = {{1, 2}, {1, 5}, {0, 1}, {1, 1}};
+  const struct sauvola_rational Rs[] = {{255, 1}, {128, 1}, {255, 2}};
+  int max_color = 255;
+  int i, j, a, b, top, bottom, left, right;
+  bool result = true;
+
+  // Allocate memory for grayscale and output arrays
+  unsigned char **grayscale = generate_test_page(num_rows, num_cols);
+  unsigned char **reference = alloc_2D_unsigned_char(num_rows, num_cols);
+  unsigned char **exact = alloc_2D_unsigned_char(num_rows, num_cols);
+  unsigned char **parallel = alloc_2D_unsigned_char(num_rows, num_cols);
+  struct integral_image *integral_image =
+      alloc_narrow_integral_image(num_rows, num_cols, max_color, r);
+  if (integral_image == NULL)
+    exit(1);
+  compute_integral_image(grayscale, integral_image, num_cols, num_rows);
+
+  for (a = 0; a < 4 && result; a++) {
+    for (b = 0; b < 3 && result; b++) {
+      float k = ks[a].num / (float)ks[a].den;
+      float R = Rs[b].num / (float)Rs[b].den;
+      double guard = 1e-6 * 255 * (1.0 + k * (1.0 + 255 / R));
+
+      sauvola_threshold_with_integral_image(grayscale, integral_image,
+                                            reference, num_cols, num_rows, k,
+                                            r, R);
+      if (!sauvola_threshold_exact_rows(grayscale, integral_image, exact,
+                                        num_cols, num_rows, ks[a], r, Rs[b], 0,
+                                        num_rows) ||
+          !sauvola_threshold_exact(grayscale, integral_image, parallel,
+                                   num_cols, num_rows, ks[a], r, Rs[b], 0))
+        exit(1);
+
+      for (i = 0; i < num_rows && result; i++) {
+        top = i - r > 0 ? i - r : 0;
+        bottom = i + r < num_rows - 1 ? i + r : num_rows - 1;
+        for (j = 0; j < num_cols; j++) {
+          left = j - r > 0 ? j - r : 0;
+          right = j + r < num_cols - 1 ? j + r : num_cols - 1;
+          double count = (double)(bottom - top + 1) * (right - left + 1);
+          double mean =
+              integral_window_sum(integral_image, top, left, bottom, right) /
+              count;
+          double variance = integral_window_sum_squares(integral_image, top,
+                                                        left, bottom, right) /
+                                count -
+                            mean * mean;
+          double threshold =
+              mean * (1.0 + k * (sqrt(fmax(variance, 0)) / R - 1.0));
+
+          // Pixels clear of the threshold must agree
+          if (exact[i][j] != parallel[i][j] ||
+              (fabs(grayscale[i][j] - threshold) > guard &&
+               exact[i][j] != reference[i][j])) {
+            result = false;
+            break;
+          }
+        }
+      }
+    }
+  }
+
+  free(grayscale[0]);
+  free(grayscale);
+  free(reference[0]);
+  free(reference);
+  free(exact[0]);
+  free(exact);
+  free(parallel[0]);
+  free(parallel);
+  free_integral_image(integral_image);
+
+  return result;
+}
+
+/**
+ * Checks that the parallel integral image builder stores exactly the same
+ * elements as compute_integral_image, padding included, for the narrow, the
+ * 64-bit planar and the interleaved integral images and several thread counts.
+ */
+bool test_integral_image_unity(int num_rows, int num_cols) {
+  const int thread_counts[] = {1, 2, 3, 8};
+  int max_color = 255;
+  int n, t;
+  bool result = true;
+
+  // Allocate memory for grayscale array
+  unsigned char **grayscale = generate_test_page(num_rows, num_cols);
+
+  // Serial and parallel integral images of every variant
+  struct integral_image *serial[3] = {
+      alloc_narrow_integral_image(num_rows, num_cols, max_color, 13),
+      alloc_integral_image(num_rows, num_cols, INTEGRAL_PLANAR),
+      alloc_integral_image(num_rows, num_cols, INTEGRAL_INTERLEAVED)};
+  struct integral_image *parallel[3] = {
+      alloc_narrow_integral_image(num_rows, num_cols, max_color, 13),
+      alloc_integral_image(num_rows, num_cols, INTEGRAL_PLANAR),
+      alloc_integral_image(num_rows, num_cols, INTEGRAL_INTERLEAVED)};
+
+  for (n = 0; n < 3 && result; n++) {
+    if (serial[n] == NULL || parallel[n] == NULL)
+      exit(1);
+    compute_integral_image(grayscale, serial[n], num_cols, num_rows);
+
+    for (t = 0; t < 4 && result; t++) {
+      compute_integral_image_parallel(grayscale, parallel[n], num_cols,
+                                      num_rows, thread_counts[t]);
+      result = memcmp(serial[n]->buffer, parallel[n]->buffer,
+                      serial[n]->buffer_size) == 0;
+    }
+  }
+
+  free(grayscale[0]);
+  free(grayscale);
+  for (n = 0; n < 3; n++) {
+    free_integral_image(serial[n]);
+    free_integral_image(parallel[n]);
+  }
+
+  return result;
+}
+
+/**
+ * Checks that a sweep gives every parameter set the same output as a separate
+ * run of sauvola_threshold_with_integral_image. The parameter sets share some
+ * radii and differ in others, so both the shared and the separate window
+ * statistics are covered.
+ */
+bool test_sweep_unity(int num_rows, int num_cols) {
+  const struct sauvola_params params[] = {
+      {0.5, 13, 255}, {0.2, 13, 255}, {0.34, 5, 128},
+      {0.5, 40, 255}, {0, 5, 255},    {1, 13, 64},
+      {0.5, 1, 255}};
+  const int num_params = sizeof(params) / sizeof(params[0]);
+  int max_color = 255;
+  int i, j, n;
+  bool result = true;
+
+  // Allocate memory for grayscale, reference and sweep output arrays
+  unsigned char **grayscale = generate_test_page(num_rows, num_cols);
+  unsigned char **reference = alloc_2D_unsigned_char(num_rows, num_cols);
+  unsigned char **outputs[sizeof(params) / sizeof(params[0])];
+  for (n = 0; n < num_params; n++) {
+    outputs[n] = alloc_2D_unsigned_char(num_rows, num_cols);
+  }
+
+  // One integral image for the whole sweep
+  struct integral_image *integral_image = alloc_narrow_integral_image(
+      num_rows, num_cols, max_color, sweep_max_radius(params, num_params));
+  if (integral_image == NULL)
+    exit(1);
+  compute_integral_image(grayscale, integral_image, num_cols, num_rows);
+
+  if (!sauvola_threshold_sweep(grayscale, integral_image, outputs, num_cols,
+                               num_rows, params, num_params, 0))
+    exit(1);
+
+  for (n = 0; n < num_params && result; n++) {
+    sauvola_threshold_with_integral_image(grayscale, integral_image, reference,
+                                          num_cols, num_rows, params[n].k,
+                                          params[n].r, params[n].R);
+    for (i = 0; i < num_rows && result; i++) {
+      for (j = 0; j < num_cols; j++) {
+        if (reference[i][j] != outputs[n][i][j]) {
+          result = false;
+          break;
+        }
+      }
+    }
+  }
+
+  free(grayscale[0]);
+  free(grayscale);
+  free(reference[0]);
+  free(reference);
+  for (n = 0; n < num_params; n++) {
+    free(outputs[n][0]);
+    free(outputs[n]);
+  }
+  free_integral_image(integral_image);
+
+  return result;
+}
+
+/**
+ * Checks the approximate Sauvola algorithm. With a step of 1 it has to give
+ * the same output as the integral image algorithm. The step chosen for a 1%
+ * disagreement on a sample has to decimate, may disagree with the exact
+ * output in at most 2% of the whole page, and every instruction set of the
+ * interpolation has to give the same output as the scalar one.
+ */
+bool test_approximate_unity(int num_rows, int num_cols, int r) {
+  int max_color = 255;
+  const float ks[2] = {0.5, 0};
+  int i, j, t, level, step;
+  bool result = true;
+  struct approximate_scratch scratch = {0};
+
+  // Allocate memory for grayscale, reference and approximate arrays
+  unsigned char **grayscale = generate_test_page(num_rows, num_cols);
+  unsigned char **reference = alloc_2D_unsigned_char(num_rows, num_cols);
+  unsigned char **scalar = alloc_2D_unsigned_char(num_rows, num_cols);
+  unsigned char **approximate = alloc_2D_unsigned_char(num_rows, num_cols);
+
+  // Shade the lower half with a noisy gradient, whose pixels lie close to
+  // their thresholds, so that any change of the interpolation flips some
+  for (i = num_rows / 2; i < num_rows; i++) {
+    for (j = 0; j < num_cols; j++) {
+      grayscale[i][j] = (unsigned char)((i + j) * 192 / (num_rows + num_cols) +
+                                        (i * 7 + j * 13) % 31);
+    }
+  }
+
+  struct integral_image *integral_image =
+      alloc_narrow_integral_image(num_rows, num_cols, max_color, r);
+  if (integral_image == NULL)
+    exit(1);
+  compute_integral_image(grayscale, integral_image, num_cols, num_rows);
+
+  // With k = 0 the threshold is the local mean, which the shaded pixels
+  // straddle
+  for (t = 0; t < 2 && result; t++) {
+    sauvola_threshold_with_integral_image(grayscale, integral_image, reference,
+                                          num_cols, num_rows, ks[t], r, 255);
+
+    for (level = SIMD_SCALAR; level <= detect_simd_level(); level++) {
+      if (!sauvola_threshold_approximate_with_scratch(
+              grayscale, approximate, num_cols, num_rows, ks[t], r, 255, 1,
+              (enum simd_level)level, &scratch))
+        exit(1);
+      for (i = 0; i < num_rows && result; i++) {
+        result = memcmp(reference[i], approximate[i], num_cols) == 0;
+      }
+    }
+
+    step = choose_decimation(grayscale, num_cols, num_rows, ks[t], r, 255,
+                             0.01, &scratch);
+    if (step == 0 ||
+        !sauvola_threshold_approximate_with_scratch(
+            grayscale, scalar, num_cols, num_rows, ks[t], r, 255, step,
+            SIMD_SCALAR, &scratch))
+      exit(1);
+    if (step < 2 || sauvola_disagreement_rate(grayscale, scalar, num_cols,
+                                              num_rows, ks[t], r, 255) > 0.02)
+      result = false;
+
+    for (level = SIMD_AVX2; level <= detect_simd_level(); level++) {
+      memset(approximate[0], 0x5a, (size_t)num_rows * num_cols);
+      if (!sauvola_threshold_approximate_with_scratch(
+              grayscale, approximate, num_cols, num_rows, ks[t], r, 255, step,
+              (enum simd_level)level, &scratch))
+        exit(1);
+      if (memcmp(scalar[0], approximate[0], (size_t)num_rows * num_cols) != 0)
+        result = false;
+    }
+  }
+
+  free(grayscale[0]);
+  free(grayscale);
+  free(reference[0]);
+  free(reference);
+  free(scalar[0]);
+  free(scalar);
+  free(approximate[0]);
+  free(approximate);
+  free_integral_image(integral_image);
+  free_approximate_scratch(&scratch);
+
+  return result;
+}
+
+/**
+ * Checks the synthetic document generator on an image of the given size: the
+ * image must not depend on the number of threads, the PGM and PPM images
+ * written row by row must read back as the generated rows, the tiled engine
+ * must binarize it like the reference and the reference must find text on
+ * it, between 1% and 50% of black pixels.
+ *
+ * @param temporary_image The name of the PGM and then PPM file to write.
+ */
+bool test_synthetic_unity(const char *temporary_image, int num_rows,
+                          int num_cols, int r) {
+  const unsigned int seed = 2024;
+  int read_rows, read_cols, max_color;
+  int header_length, i, j;
+  long black = 0;
+  bool result = true;
+
+  // Allocate memory for the generated images, the read image and the outputs
+  unsigned char **serial = alloc_2D_unsigned_char(num_rows, num_cols);
+  unsigned char **parallel = alloc_2D_unsigned_char(num_rows, num_cols);
+  unsigned char **read = alloc_2D_unsigned_char(num_rows, num_cols);
+  unsigned char **reference = alloc_2D_unsigned_char(num_rows, num_cols);
+  unsigned char **tiled = alloc_2D_unsigned_char(num_rows, num_cols);
+  unsigned char **channels[3], **read_channels[3];
+  for (i = 0; i < 3; i++) {
+    channels[i] = alloc_2D_unsigned_char(num_rows, num_cols);
+    read_channels[i] = alloc_2D_unsigned_char(num_rows, num_cols);
+  }
+
+  generate_synthetic_document(serial, num_rows, num_cols, seed, 1);
+  generate_synthetic_document(parallel, num_rows, num_cols, seed, 0);
+  if (memcmp(serial[0], parallel[0], (size_t)num_rows * num_cols) != 0)
+    result = false;
+
+  // PGM round trip
+  if (!write_synthetic_document(temporary_image, num_rows, num_cols, 1,
+                                seed) ||
+      (header_length = read_pgm_header(temporary_image, &read_rows,
+                                       &read_cols, &max_color)) <= 0 ||
+      read_rows != num_rows || read_cols != num_cols ||
+      !read_pgm_data(read[0], temporary_image, header_length, num_rows,
+                     num_cols, max_color) ||
+      memcmp(serial[0], read[0], (size_t)num_rows * num_cols) != 0)
+    result = false;
+
+  // PPM round trip
+  for (i = 0; i < num_rows; i++) {
+    synthetic_document_row_rgb(channels[0][i], channels[1][i], channels[2][i],
+                               i, num_rows, num_cols, seed);
+  }
+  if (!write_synthetic_document(temporary_image, num_rows, num_cols, 3,
+                                seed) ||
+      (header_length = read_ppm_header(temporary_image, &read_rows,
+                                       &read_cols, &max_color)) <= 0 ||
+      read_rows != num_rows || read_cols != num_cols ||
+      !read_ppm_data(read_channels[0][0], read_channels[1][0],
+                     read_channels[2][0], temporary_image, header_length,
+                     num_rows, num_cols, max_color))
+    result = false;
+  for (i = 0; i < 3 && result; i++) {
+    if (memcmp(channels[i][0], read_channels[i][0],
+               (size_t)num_rows * num_cols) != 0)
+      result = false;
+  }
+
+  // Binarization
+  struct integral_image *integral_image =
+      alloc_narrow_integral_image(num_rows, num_cols, 255, r);
+  if (integral_image == NULL)
+    exit(1);
+  compute_integral_image(serial, integral_image, num_cols, num_rows);
+  sauvola_threshold_with_integral_image(serial, integral_image, reference,
+                                        num_cols, num_rows, 0.5, r, 255);
+  sauvola_threshold_tiled(serial, tiled, num_cols, num_rows, 0.5, r, 255, 0, 0,
+                          0);
+  for (i = 0; i < num_rows; i++) {
+    for (j = 0; j < num_cols; j++) {
+      if (reference[i][j] != tiled[i][j])
+        result = false;
+      black += reference[i][j] == 0;
+    }
+  }
+  if (black < 0.01 * num_rows * num_cols || black > 0.5 * num_rows * num_cols)
+    result = false;
+
+  free(serial[0]);
+  free(serial);
+  free(parallel[0]);
+  free(parallel);
+  free(read[0]);
+  free(read);
+  free(reference[0]);
+  free(reference);
+  free(tiled[0]);
+  free(tiled);
+  for (i = 0; i < 3; i++) {
+    free(channels[i][0]);
+    free(channels[i]);
+    free(read_channels[i][0]);
+    free(read_channels[i]);
+  }
+  free_integral_image(integral_image);
+
+  return result;
+}
+
+/**
+ * Checks the in-memory library API: an image held with padded rows must be
+ * binarized like sauvola_threshold_with_integral_image into padded output
+ * rows without touching the padding, a second call after the first must not
+ * grow any buffer, and invalid parameters, sizes and strides must be reported
+ * as SAUVOLA_ERROR_ARGUMENT.
+ */
+bool test_api_unity(int num_rows, int num_cols, int r) {
+  const struct sauvola_options options = {0.5, r, 255, 3};
+  const struct sauvola_options bad_options = {0.5, 0, 255, 0};
+  struct sauvola_processor processor;
+  int max_color = 255;
+  int i, j, num_allocations, num_workers;
+  unsigned long num_runs;
+  bool result = true;
+
+  // Allocate memory for grayscale and reference arrays and the padded buffers
+  unsigned char **grayscale = generate_test_page(num_rows, num_cols);
+  unsigned char **reference = alloc_2D_unsigned_char(num_rows, num_cols);
+  long stride = num_cols + 13, output_stride = num_cols + 7;
+  unsigned char *pixels = (unsigned char *)malloc(num_rows * stride);
+  unsigned char *output = (unsigned char *)malloc(num_rows * output_stride);
+  if (pixels == NULL || output == NULL)
+    exit(1);
+
+  struct integral_image *integral_image =
+      alloc_narrow_integral_image(num_rows, num_cols, max_color, r);
+  if (integral_image == NULL)
+    exit(1);
+  compute_integral_image(grayscale, integral_image, num_cols, num_rows);
+  sauvola_threshold_with_integral_image(grayscale, integral_image, reference,
+                                        num_cols, num_rows, 0.5, r, 255);
+
+  memset(pixels, 0, num_rows * stride);
+  memset(output, 0x5a, num_rows * output_stride);
+  for (i = 0; i < num_rows; i++) {
+    memcpy(pixels + i * stride, grayscale[i], num_cols);
+  }
+
+  if (sauvola_processor_init(&processor, &bad_options) !=
+      SAUVOLA_ERROR_ARGUMENT)
+    result = false;
+  sauvola_processor_free(&processor);
+  if (sauvola_processor_init(&processor, &options) != SAUVOLA_OK)
+    exit(1);
+
+  // Two calls, the second one must reuse every buffer and the threads of
+  // the pool, which must run all of its work
+  if (processor.pool.num_workers != 3)
+    result = false;
+  if (sauvola_process(&processor, pixels, stride, num_cols, num_rows, output,
+                      output_stride) != SAUVOLA_OK)
+    result = false;
+  num_allocations = processor.context.num_allocations;
+  num_workers = processor.pool.num_workers;
+  num_runs = processor.pool.num_runs;
+  if (sauvola_process(&processor, pixels, stride, num_cols, num_rows, output,
+                      output_stride) != SAUVOLA_OK ||
+      processor.context.num_allocations != num_allocations ||
+      processor.pool.num_workers != num_workers ||
+      num_runs == 0 || processor.pool.num_runs != 2 * num_runs)
+    result = false;
+
+  for (i = 0; i < num_rows && result; i++) {
+    for (j = 0; j < output_stride; j++) {
+      if (output[i * output_stride + j] !=
+          (j < num_cols ? reference[i][j] : 0x5a)) {
+        result = false;
+        break;
+      }
+    }
+  }
+
+  if (sauvola_process(&processor, pixels, num_cols - 1, num_cols, num_rows,
+                      output, output_stride) != SAUVOLA_ERROR_ARGUMENT ||
+      sauvola_process(&processor, pixels, stride, num_cols, 0, output,
+                      output_stride) != SAUVOLA_ERROR_ARGUMENT ||
+      sauvola_process(&processor, NULL, stride, num_cols, num_rows, output,
+                      output_stride) != SAUVOLA_ERROR_ARGUMENT)
+    result = false;
+
+  sauvola_processor_free(&processor);
+  free(grayscale[0]);
+  free(grayscale);
+  free(reference[0]);
+  free(reference);
+  free(pixels);
+  free(output);
+  free_integral_image(integral_image);
+
+  return result;
+}
+
+/**
+ * Checks the regions of interest of the library API on a page held with
+ * padded rows: every region must get the pixels of the whole page binarized
+ * with sauvola_threshold_with_integral_image, both into a separate output
+ * and in place in the page, and the pixels outside the regions must be left
+ * unchanged. Regions outside the page must be rejected.
+ */
+bool test_roi_unity(int num_rows, int num_cols, int r) {
+  const struct sauvola_options options = {0.5, r, 255, 0};
+  struct sauvola_processor processor;
+  int max_color = 255;
+  int i, j, n, inside;
+  bool result = true;
+
+  unsigned char **grayscale = generate_test_page(num_rows, num_cols);
+  unsigned char **reference = alloc_2D_unsigned_char(num_rows, num_cols);
+  long stride = num_cols + 5;
+  unsigned char *page = (unsigned char *)malloc(num_rows * stride);
+  unsigned char *output = (unsigned char *)malloc(num_rows * stride);
+  if (page == NULL || output == NULL)
+    exit(1);
+
+  struct integral_image *integral_image =
+      alloc_narrow_integral_image(num_rows, num_cols, max_color, r);
+  if (integral_image == NULL)
+    exit(1);
+  compute_integral_image(grayscale, integral_image, num_cols, num_rows);
+  sauvola_threshold_with_integral_image(grayscale, integral_image, reference,
+                                        num_cols, num_rows, 0.5, r, 255);
+
+  // Corners, borders, a single pixel and a region inside the page
+  const struct sauvola_roi rois[] = {
+      {0, 0, 20, 30},
+      {num_rows - 7, num_cols - 40, 7, 40},
+      {num_rows / 2, 0, 33, num_cols},
+      {5, num_cols / 3, 1, 1},
+      {num_rows / 4, num_cols / 4, num_rows / 8, num_cols / 5}};
+  const struct sauvola_roi outside = {num_rows - 3, 0, 4, 10};
+  const int num_rois = sizeof(rois) / sizeof(rois[0]);
+
+  for (i = 0; i < num_rows; i++) {
+    memcpy(page + i * stride, grayscale[i], num_cols);
+  }
+  memset(output, 0x5a, num_rows * stride);
+  if (sauvola_processor_init(&processor, &options) != SAUVOLA_OK ||
+      sauvola_set_page(&processor, page, stride, num_cols, num_rows) !=
+          SAUVOLA_OK)
+    exit(1);
+
+  if (sauvola_process_rois(&processor, rois, num_rois, output, stride) !=
+          SAUVOLA_OK ||
+      sauvola_process_rois(&processor, &outside, 1, output, stride) !=
+          SAUVOLA_ERROR_ARGUMENT)
+    result = false;
+
+  // In place, without the overlapping region
+  if (sauvola_process_rois(&processor, rois, num_rois - 1, page, stride) !=
+      SAUVOLA_OK)
+    result = false;
+
+  for (i = 0; i < num_rows && result; i++) {
+    for (j = 0; j < num_cols; j++) {
+      for (n = 0, inside = 0; n < num_rois; n++) {
+        if (i >= rois[n].row && i < rois[n].row + rois[n].num_rows &&
+            j >= rois[n].col && j < rois[n].col + rois[n].num_cols)
+          inside |= n < num_rois - 1 ? 3 : 1;
+      }
+      if (output[i * stride + j] != (inside ? reference[i][j] : 0x5a) ||
+          page[i * stride + j] !=
+              (inside & 2 ? reference[i][j] : grayscale[i][j])) {
+        result = false;
+        break;
+      }
+    }
+  }
+
+  sauvola_processor_free(&processor);
+  free(grayscale[0]);
+  free(grayscale);
+  free(reference[0]);
+  free(reference);
+  free(page);
+  free(output);
+  free_integral_image(integral_image);
+
+  return result;
+}
+
+/**
+ * Checks the incremental update of the library API: after each of several
+ * patches of a page is retouched, sauvola_update_page must leave the same
+ * output as binarizing the retouched page from scratch, and so must a full
+ * pass over its updated integral image after the last one.
+ */
+bool test_update_unity(int num_rows, int num_cols, int r) {
+  const struct sauvola_options options = {0.5, r, 255, 0};
+  struct sauvola_processor processor;
+  int max_color = 255;
+  int i, j, p;
+  bool result = true;
+
+  unsigned char **grayscale = generate_test_page(num_rows, num_cols);
+  unsigned char **reference = alloc_2D_unsigned_char(num_rows, num_cols);
+  unsigned char *output = (unsigned char *)malloc(num_rows * num_cols);
+  if (output == NULL)
+    exit(1);
+
+  struct integral_image *integral_image =
+      alloc_narrow_integral_image(num_rows, num_cols, max_color, r);
+  if (integral_image == NULL)
+    exit(1);
+
+  // An inside patch, one in the top left and one in the bottom right corner
+  const struct sauvola_roi patches[] = {
+      {num_rows / 3, num_cols / 2, 40, 25},
+      {0, 0, 9, 70},
+      {num_rows - 30, num_cols - 3, 30, 3}};
+  const struct sauvola_roi outside = {0, num_cols - 2, 1, 3};
+  const struct sauvola_roi page = {0, 0, num_rows, num_cols};
+
+  if (sauvola_processor_init(&processor, &options) != SAUVOLA_OK ||
+      sauvola_process(&processor, grayscale[0], num_cols, num_cols, num_rows,
+                      output, num_cols) != SAUVOLA_OK)
+    exit(1);
+
+  for (p = 0; p < 4 && result; p++) {
+    if (p < 3) {
+      // Retouch the page behind the processor's back
+      for (i = patches[p].row; i < patches[p].row + patches[p].num_rows; i++) {
+        for (j = patches[p].col; j < patches[p].col + patches[p].num_cols;
+             j++) {
+          grayscale[i][j] = p == 1 ? 0 : 255 - grayscale[i][j];
+        }
+      }
+      if (sauvola_update_page(&processor, &patches[p], output, num_cols) !=
+          SAUVOLA_OK)
+        result = false;
+    } else if (sauvola_process_rois(&processor, &page, 1, output,
+                                    num_cols) != SAUVOLA_OK) {
+      result = false;
+    }
+
+    compute_integral_image(grayscale, integral_image, num_cols, num_rows);
+    sauvola_threshold_with_integral_image(grayscale, integral_image,
+                                          reference, num_cols, num_rows, 0.5,
+                                          r, 255);
+    if (memcmp(output, reference[0], num_rows * num_cols) != 0)
+      result = false;
+  }
+
+  if (sauvola_update_page(&processor, &outside, output, num_cols) !=
+      SAUVOLA_ERROR_ARGUMENT)
+    result = false;
+
+  sauvola_processor_free(&processor);
+  free(grayscale[0]);
+  free(grayscale);
+  free(reference[0]);
+  free(reference);
+  free(output);
+  free_integral_image(integral_image);
+
+  return result;
+}
+
+/*
+ * Reads a binarized PGM image and compares it with the reference.
+ */
+static bool output_matches(const char *file_name, unsigned char **output,
+                           unsigned char **reference, int num_rows,
+                           int num_cols) {
+  int read_rows, read_cols, max_color, header_length;
+
+  return (header_length = read_pgm_header(file_name, &read_rows, &read_cols,
+                                          &max_color)) > 0 &&
+         read_rows == num_rows && read_cols == num_cols &&
+         read_pgm_data(output[0], file_name, header_length, num_rows,
+                       num_cols, max_color) &&
+         memcmp(output[0], reference[0], (size_t)num_rows * num_cols) == 0;
+}
+
+/**
+ * Checks native 16-bit input: an 8-bit image scaled to 16 bits by 257 and
+ * written with big-endian samples, as a PGM and as a gray PPM image, must be
+ * binarized by the integral image flows, with R scaled to the max color
+ * value, exactly like the 8-bit image by sauvola_threshold_with_integral_image.
+ * The PPM flow always uses r = 13, so that part only runs for r = 13.
+ *
+ * On samples with all 16 bits in use, the integral image built on three
+ * threads must equal the one built on one, and the vectorized kernels of
+ * every supported instruction set must agree with the scalar reference.
+ */
+bool test_pgm16_unity(const char *source_image, const char *temporary_image,
+                      const char *temporary_color_image,
+                      const char *temporary_output, int r) {
+  int num_rows, num_cols;
+  int max_color;
+  int header_length, i, j;
+  bool result = true;
+  struct sauvola_context context;
+  FILE *file;
+
+  // Read header to get dimensions and max color value
+  if ((header_length = read_pgm_header(source_image, &num_rows, &num_cols,
+                                       &max_color)) <= 0)
+    exit(1);
+
+  unsigned char **grayscale = alloc_2D_unsigned_char(num_rows, num_cols);
+  unsigned char **reference = alloc_2D_unsigned_char(num_rows, num_cols);
+  unsigned char **output = alloc_2D_unsigned_char(num_rows, num_cols);
+  unsigned char *samples = (unsigned char *)malloc(2 * num_cols);
+  if (samples == NULL)
+    exit(1);
+
+  // read PGM image data
+  if (read_pgm_data(grayscale[0], source_image, header_length, num_rows,
+                    num_cols, max_color) == 0)
+    exit(1);
+
+  struct integral_image *integral_image =
+      alloc_narrow_integral_image(num_rows, num_cols, max_color, r);
+  if (integral_image == NULL)
+    exit(1);
+  compute_integral_image(grayscale, integral_image, num_cols, num_rows);
+  sauvola_threshold_with_integral_image(grayscale, integral_image, reference,
+                                        num_cols, num_rows, 0.5, r, 255);
+
+  // Write the image scaled to 16 bits, most significant byte first
+  if ((file = fopen(temporary_image, "wb")) == NULL)
+    exit(1);
+  fprintf(file, "P5\n%d %d\n%d\n", num_cols, num_rows, PGM16_MAX_COLOR);
+  for (i = 0; i < num_rows; i++) {
+    for (j = 0; j < num_cols; j++) {
+      samples[2 * j] = samples[2 * j + 1] = grayscale[i][j];
+    }
+    fwrite(samples, 2, num_cols, file);
+  }
+  fclose(file);
+
+  pgm_sauvola_flow_with_integral_image(temporary_image, temporary_output, 0.5,
+                                       r, 255, 0, NULL);
+  if (!output_matches(temporary_output, output, reference, num_rows,
+                      num_cols))
+    result = false;
+
+  // The same samples as a PPM image with three equal channels
+  if (r == 13) {
+    if ((file = fopen(temporary_color_image, "wb")) == NULL)
+      exit(1);
+    write_ppm_header(file, num_rows, num_cols, PGM16_MAX_COLOR);
+    for (i = 0; i < num_rows; i++) {
+      for (j = 0; j < 6 * num_cols; j++) {
+        fputc(grayscale[i][j / 6], file);
+      }
+    }
+    fclose(file);
+
+    ppm_sauvola_flow_with_integral_image(temporary_color_image,
+                                         temporary_output, 0, NULL);
+    if (!output_matches(temporary_output, output, reference, num_rows,
+                        num_cols))
+      result = false;
+  }
+
+  // Samples with a low byte of their own, big-endian like a payload
+  unsigned char **payload = alloc_2D_unsigned_char(num_rows, 2 * num_cols);
+  for (i = 0; i < num_rows; i++) {
+    for (j = 0; j < num_cols; j++) {
+      payload[i][2 * j] = grayscale[i][j];
+      payload[i][2 * j + 1] = (unsigned char)(i * 31 + j * 17);
+    }
+  }
+
+  struct integral_image *serial =
+      alloc_narrow_integral_image(num_rows, num_cols, PGM16_MAX_COLOR, r);
+  struct integral_image *parallel =
+      alloc_narrow_integral_image(num_rows, num_cols, PGM16_MAX_COLOR, r);
+  init_sauvola_context(&context);
+  unsigned short **samples16 =
+      context_grayscale16(&context, num_rows, num_cols);
+  if (serial == NULL || parallel == NULL || samples16 == NULL)
+    exit(1);
+  struct worker_pool *pool = context_worker_pool(&context, 1);
+  if (pool == NULL)
+    exit(1);
+  load_pgm16_with_integral_image(payload, samples16, serial, num_cols, num_rows,
+                                 pool);
+  if ((pool = context_worker_pool(&context, 3)) == NULL)
+    exit(1);
+  load_pgm16_with_integral_image(payload, samples16, parallel, num_cols,
+                                 num_rows, pool);
+  if (memcmp(serial->buffer, parallel->buffer, serial->buffer_size) != 0)
+    result = false;
+
+  float R = sauvola_R_for_max_color(255, PGM16_MAX_COLOR);
+  sauvola_threshold_16_with_integral_image_rows(samples16, serial, reference,
+                                                num_cols, num_rows, 0.5, r, R,
+                                                0, num_rows);
+  for (int level = SIMD_AVX2; level <= detect_simd_level(); level++) {
+    memset(output[0], 0x5a, (size_t)num_rows * num_cols);
+    sauvola_threshold_16_with_integral_image_simd_rows(
+        samples16, serial, output, num_cols, num_rows, 0.5, r, R,
+        (enum simd_level)level, 0, num_rows);
+    if (memcmp(output[0], reference[0], (size_t)num_rows * num_cols) != 0)
+      result = false;
+  }
+
+  // Color samples of every value, against the fixed point luma formula
+  unsigned char *rgb16 = (unsigned char *)malloc(6 * num_cols);
+  unsigned short *gray16 =
+      (unsigned short *)malloc(num_cols * sizeof(unsigned short));
+  if (rgb16 == NULL || gray16 == NULL)
+    exit(1);
+  for (j = 0; j < 6 * num_cols; j++) {
+    rgb16[j] = (unsigned char)(j * 37 + j / 7);
+  }
+  rgb16_to_gray16(rgb16, gray16, num_cols);
+  for (j = 0; j < num_cols; j++) {
+    unsigned int red = rgb16[6 * j] << 8 | rgb16[6 * j + 1];
+    unsigned int green = rgb16[6 * j + 2] << 8 | rgb16[6 * j + 3];
+    unsigned int blue = rgb16[6 * j + 4] << 8 | rgb16[6 * j + 5];
+    if (gray16[j] != (19595 * red + 38470 * green + 7471 * blue) >> 16) {
+      result = false;
+      break;
+    }
+  }
+
+  free(rgb16);
+  free(gray16);
+  free_sauvola_context(&context);
+  free_integral_image(serial);
+  free_integral_image(parallel);
+  free(payload[0]);
+  free(payload);
+  free(grayscale[0]);
+  free(grayscale);
+  free(reference[0]);
+  free(reference);
+  free(output[0]);
+  free(output);
+  free(samples);
+  free_integral_image(integral_image);
+
+  return result;
+}
@@ -0,0 +1,274 @@
+#include "tiled.h"
+#include "parallel.h"
+#include "sauvola.h"
+#include "sauvola_simd.h"
+#include "tools.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* -------------------------------------------------------------------------- */
+/*                          Tiled Sauvola Execution                           */
+/* -------------------------------------------------------------------------- */
+
+/*
+ * The output is cut into tiles, each thresholded from an integral image of
+ * only the tile and a halo of r pixels around it, clipped to the image. Every
+ * window of a tile pixel lies inside the halo, and the halo is only clipped
+ * where the image ends, so the window sums, and therefore the output, are the
+ * same as with the integral image of the whole image. Tiles are sized so that
+ * the halo, its integral image and the tile output fit in half of the L2
+ * cache, so the four corner rows of every window are read from cache rather
+ * than streamed from memory 2r rows apart. The tiles are independent and are
+ * spread over a work-stealing thread pool.
+ */
+
+// Cache size assumed when the system does not report one
+#define DEFAULT_L2_CACHE_SIZE (1 << 20)
+
+// Smallest tile side chosen automatically, and the column alignment of tiles
+#define MIN_TILE_SIZE 64
+
+/*
+ * Per-worker scratch: the halo integral image, reused from tile to tile, and
+ * the row pointers of the halo into the input and output images.
+ */
+struct tile_scratch {
+  struct integral_image integral_image;
+  unsigned char **grayscale;
+  unsigned char **output;
+};
+
+struct sauvola_tile_job {
+  unsigned char **grayscale;
+  unsigned char **output;
+  int num_cols;
+  int num_rows;
+  float k;
+  int r;
+  float R;
+  int tile_rows;
+  int tile_cols;
+  int tiles_across;
+  int sum_bits;
+  int sum_squares_bits;
+  enum simd_level level;
+  struct tile_scratch *scratch;
+};
+
+/**
+ * Returns the size of the L2 cache of the running CPU in bytes, or 1 MB if it
+ * cannot be determined.
+ */
+size_t default_l2_cache_size(void) {
+  long size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+
+  return size > 0 ? (size_t)size : DEFAULT_L2_CACHE_SIZE;
+}
+
+/**
+ * Chooses square tiles whose halo working set, the grayscale and output
+ * pixels plus a 32-bit integral image of both planes, fills half of the given
+ * cache. The other half is left for the rows being written and the rest of
+ * the process. Tiles are at least MIN_TILE_SIZE pixels wide, which bounds the
+ * halo overhead for large radii, and their width is a multiple of it so tile
+ * columns start on cache line boundaries.
+ */
+void choose_tile_size(int num_rows, int num_cols, int r, size_t cache_size,
+                      int *tile_rows, int *tile_cols) {
+  // Bytes per halo pixel: grayscale, output, sum and sum of squares
+  const int pixel_bytes = 1 + 1 + 4 + 4;
+  int halo_side = (int)sqrt((double)(cache_size / 2) / pixel_bytes);
+  int tile_side = halo_side - 2 * r;
+
+  if (tile_side < MIN_TILE_SIZE)
+    tile_side = MIN_TILE_SIZE;
+  tile_side = tile_side / MIN_TILE_SIZE * MIN_TILE_SIZE;
+
+  *tile_rows = tile_side < num_rows ? tile_side : num_rows;
+  *tile_cols = tile_side < num_cols ? tile_side : num_cols;
+}
+
+/*
+ * Thresholds one tile: lays the halo out in the worker's scratch, computes
+ * its integral image and runs the vectorized kernel over the tile.
+ */
+static void sauvola_tile_task(void *context, int task_index,
+                              int worker_index) {
+  struct sauvola_tile_job *job = (struct sauvola_tile_job *)context;
+  struct tile_scratch *scratch = &job->scratch[worker_index];
+  int r = job->r;
+
+  // Tile bounds
+  int row_begin = task_index / job->tiles_across * job->tile_rows;
+  int col_begin = task_index % job->tiles_across * job->tile_cols;
+  int row_end = (int)fmin(row_begin + job->tile_rows, job->num_rows);
+  int col_end = (int)fmin(col_begin + job->tile_cols, job->num_cols);
+
+  // Halo bounds, clipped to the image
+  int halo_top = (int)fmax(row_begin - r, 0);
+  int halo_left = (int)fmax(col_begin - r, 0);
+  int halo_rows = (int)fmin(row_end + r, job->num_rows) - halo_top;
+  int halo_cols = (int)fmin(col_end + r, job->num_cols) - halo_left;
+
+  for (int i = 0; i < halo_rows; i++) {
+    scratch->grayscale[i] = job->grayscale[halo_top + i] + halo_left;
+    scratch->output[i] = job->output[halo_top + i] + halo_left;
+  }
+
+  // The scratch buffer was reserved for the largest halo, so this never fails
+  reserve_integral_image(&scratch->integral_image, halo_rows, halo_cols,
+                         INTEGRAL_PLANAR, job->sum_bits,
+                         job->sum_squares_bits);
+  compute_integral_image(scratch->grayscale, &scratch->integral_image,
+                         halo_cols, halo_rows);
+
+  sauvola_threshold_with_integral_image_simd_rect(
+      scratch->grayscale, &scratch->integral_image, scratch->output, halo_cols,
+      halo_rows, job->k, r, job->R, job->level, row_begin - halo_top,
+      row_end - halo_top, col_begin - halo_left, col_end - halo_left);
+}
+
+/**
+ * Releases the per-worker scratch of the tiled engine.
+ */
+void free_tiled_scratch(struct tiled_scratch *scratch) {
+  for (int i = 0; i < scratch->num_workers; i++) {
+    free(scratch->workers[i].integral_image.buffer);
+    free(scratch->workers[i].grayscale);
+    free(scratch->workers[i].output);
+  }
+  free(scratch->workers);
+  scratch->workers = NULL;
+  scratch->num_workers = 0;
+  scratch->row_capacity = 0;
+}
+
+/*
+ * Grows the scratch to num_workers workers whose row pointers and integral
+ * image hold a halo of halo_rows x halo_cols pixels. Nothing shrinks, so the
+ * scratch of a larger image or pool is reused as it is. Returns 0 if the
+ * memory cannot be allocated.
+ */
+static int reserve_tiled_scratch(struct tiled_scratch *scratch,
+                                 int num_workers, int halo_rows, int halo_cols,
+                                 int sum_bits, int sum_squares_bits) {
+  int row_capacity = (int)fmax(halo_rows, scratch->row_capacity);
+  struct tile_scratch *workers;
+
+  if (num_workers > scratch->num_workers) {
+    workers =
+        (struct tile_scratch *)calloc(num_workers, sizeof(struct tile_scratch));
+    if (workers == NULL)
+      return 0;
+    if (scratch->num_workers > 0)
+      memcpy(workers, scratch->workers,
+             scratch->num_workers * sizeof(struct tile_scratch));
+    free(scratch->workers);
+    scratch->workers = workers;
+    scratch->num_workers = num_workers;
+  }
+
+  for (int i = 0; i < scratch->num_workers; i++) {
+    struct tile_scratch *worker = &scratch->workers[i];
+
+    if (worker->grayscale == NULL || worker->output == NULL ||
+        row_capacity > scratch->row_capacity) {
+      free(worker->grayscale);
+      free(worker->output);
+      worker->grayscale =
+          (unsigned char **)malloc(row_capacity * sizeof(unsigned char *));
+      worker->output =
+          (unsigned char **)malloc(row_capacity * sizeof(unsigned char *));
+      if (worker->grayscale == NULL || worker->output == NULL)
+        return 0;
+    }
+    if (!reserve_integral_image(&worker->integral_image, halo_rows, halo_cols,
+                                INTEGRAL_PLANAR, sum_bits, sum_squares_bits))
+      return 0;
+  }
+  scratch->row_capacity = row_capacity;
+
+  return 1;
+}
+
+/*
+ * Runs the tiled engine on the workers of pool, or on num_threads threads if
+ * pool is NULL. If the scratch or the threads cannot be set up, the image is
+ * thresholded serially with the running-sum engine, whose exact window sums
+ * keep the output the same.
+ */
+static void threshold_tiled(unsigned char **grayscale, unsigned char **output,
+                            int num_cols, int num_rows, float k, int r,
+                            float R, int tile_rows, int tile_cols,
+                            struct worker_pool *pool, int num_threads,
+                            struct tiled_scratch *scratch) {
+  struct sauvola_tile_job job = {grayscale, output, num_cols, num_rows, k, r,
+                                 R};
+  int auto_rows, auto_cols, tiles_down, max_halo_rows, max_halo_cols;
+
+  choose_tile_size(num_rows, num_cols, r, default_l2_cache_size(), &auto_rows,
+                   &auto_cols);
+  job.tile_rows = tile_rows > 0 ? (int)fmin(tile_rows, num_rows) : auto_rows;
+  job.tile_cols = tile_cols > 0 ? (int)fmin(tile_cols, num_cols) : auto_cols;
+  job.tiles_across = (num_cols + job.tile_cols - 1) / job.tile_cols;
+  tiles_down = (num_rows + job.tile_rows - 1) / job.tile_rows;
+  job.level = detect_simd_level();
+
+  // Reserve every worker's scratch for the largest halo
+  max_halo_rows = (int)fmin(job.tile_rows + 2 * r, num_rows);
+  max_halo_cols = (int)fmin(job.tile_cols + 2 * r, num_cols);
+  choose_integral_widths(max_halo_rows, max_halo_cols, 255, r, &job.sum_bits,
+                         &job.sum_squares_bits);
+  if (reserve_tiled_scratch(scratch, parallel_worker_count(pool, num_threads),
+                            max_halo_rows, max_halo_cols, job.sum_bits,
+                            job.sum_squares_bits)) {
+    job.scratch = scratch->workers;
+    if (run_parallel(pool, job.tiles_across * tiles_down, num_threads,
+                     sauvola_tile_task, &job))
+      return;
+  }
+
+  sauvola_threshold_running_sums(grayscale, output, num_cols, num_rows, k, r,
+                                 R);
+}
+
+/**
+ * Binarizes an image with the integral image Sauvola algorithm, tile by tile.
+ * Only an integral image of each tile and its halo is built, instead of one
+ * for the whole image. The output is bit-identical to
+ * sauvola_threshold_with_integral_image. If the scratch or the threads cannot
+ * be set up, the image is thresholded serially with the running-sum engine,
+ * whose exact window sums keep the output the same.
+ *
+ * @param tile_rows The tile height, or 0 to choose it from the L2 cache size.
+ * @param tile_cols The tile width, or 0 to choose it from the L2 cache size.
+ * @param num_threads The number of threads to use. Values below 1 select one
+ * thread per online processor.
+ */
+void sauvola_threshold_tiled(unsigned char **grayscale, unsigned char **output,
+                             int num_cols, int num_rows, float k, int r,
+                             float R, int tile_rows, int tile_cols,
+                             int num_threads) {
+  struct tiled_scratch scratch = {NULL, 0, 0};
+
+  threshold_tiled(grayscale, output, num_cols, num_rows, k, r, R, tile_rows,
+                  tile_cols, NULL, num_threads, &scratch);
+  free_tiled_scratch(&scratch);
+}
+
+/**
+ * Same as sauvola_threshold_tiled on the threads of a worker pool, with the
+ * per-worker halo buffers kept in scratch. Once scratch has grown for the
+ * largest tiles and pool, further calls do not allocate.
+ */
+void sauvola_threshold_tiled_pooled(unsigned char **grayscale,
+                                    unsigned char **output, int num_cols,
+                                    int num_rows, float k, int r, float R,
+                                    int tile_rows, int tile_cols,
+                                    struct worker_pool *pool,
+                                    struct tiled_scratch *scratch) {
+  threshold_tiled(grayscale, output, num_cols, num_rows, k, r, R, tile_rows,
+                  tile_cols, pool, 0, scratch);
+}
@@ -1,10 +1,15 @@
 #include "pgm.h"
+#include "tools.h"
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <math.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include <unistd.h>
 
 /* -------------------------------------------------------------------------- */
 /*                                    Tools                                   */
@@ -16,8 +21,9 @@
  * character, and then determines whether that character is the start of a
  * comment. If it is, it reads the entire comment line and recursively calls
  * itself to skip any additional comments.
- * If it is not the start of a comment, it seeks back one character so the next
- * read will start with the correct character.
+ * If it is not the start of a comment, it pushes the character back so the
+ * next read will start with the correct character. Pushing back rather than
+ * seeking keeps it usable on pipes.
  */
 void skip_comments(FILE *file) {
   int ch;         // current character
@@ -34,7 +40,7 @@ void skip_comments(FILE *file) {
     // recursively call itself to skip any additional comments
     skip_comments(file);
   } else {
-    fseek(file, -1, SEEK_CUR); // seek back one character
+    ungetc(ch, file); // push back the character
   }
 }
 
@@ -63,39 +69,220 @@ unsigned char **alloc_2D_unsigned_char(int num_rows, int num_cols) {
   return arr;
 }
 
+/*
+ * Elements of zero padding in front of every integral image row. Rows are
+ * padded to a multiple of this many elements as well, which keeps column 0 of
+ * both planes 64-byte aligned for 32-bit and 64-bit elements alike.
+ */
+#define INTEGRAL_PAD_ELEMENTS 16
+
+/**
+ * Lays out an integral image whose planes have the given element widths in
+ * integral_image->buffer, growing the buffer if it is too small. The buffer
+ * never shrinks, so an integral image reused for images of the same or a
+ * smaller size does not allocate. An interleaved image stores both planes
+ * with the wider of the two widths. integral_image->buffer must be NULL or a
+ * buffer set up by an earlier call.
+ *
+ * @return 1 on success, 0 if the memory cannot be allocated, in which case
+ * the old buffer is released.
+ */
+int reserve_integral_image(struct integral_image *integral_image, int num_rows,
+                           int num_cols, enum integral_layout layout,
+                           int sum_bits, int sum_squares_bits) {
+  long step = layout == INTEGRAL_INTERLEAVED ? 2 : 1;
+  long row_stride, plane_elements;
+  size_t sum_bytes, sum_squares_bytes;
+  void *buffer;
+  int i;
+
+  if (layout == INTEGRAL_INTERLEAVED) {
+    sum_bits = sum_squares_bits = fmax(sum_bits, sum_squares_bits);
+  }
+
+  // Pad every row to a multiple of 64 bytes, zero columns included
+  row_stride = INTEGRAL_PAD_ELEMENTS + num_cols * step;
+  row_stride = (row_stride + INTEGRAL_PAD_ELEMENTS - 1) /
+               INTEGRAL_PAD_ELEMENTS * INTEGRAL_PAD_ELEMENTS;
+  plane_elements = (num_rows + 1) * row_stride;
+  sum_bytes = plane_elements * (sum_bits / 8);
+  sum_squares_bytes = layout == INTEGRAL_INTERLEAVED
+                          ? 0
+                          : plane_elements * (sum_squares_bits / 8);
+
+  // Grow the buffer if needed
+  if (integral_image->buffer == NULL ||
+      integral_image->buffer_size < sum_bytes + sum_squares_bytes) {
+    free(integral_image->buffer);
+    integral_image->buffer = NULL;
+    integral_image->buffer_size = 0;
+    if (posix_memalign(&buffer, 64, sum_bytes + sum_squares_bytes))
+      return 0;
+    integral_image->buffer = buffer;
+    integral_image->buffer_size = sum_bytes + sum_squares_bytes;
+  }
+  buffer = integral_image->buffer;
+
+  integral_image->num_rows = num_rows;
+  integral_image->num_cols = num_cols;
+  integral_image->layout = layout;
+  integral_image->sum_bits = sum_bits;
+  integral_image->sum_squares_bits = sum_squares_bits;
+  integral_image->row_stride = row_stride;
+  integral_image->step = step;
+
+  // Element (0, 0) follows the zero row and the zero padding of its row
+  integral_image->sum = integral_plane_at(
+      buffer, sum_bits, row_stride + INTEGRAL_PAD_ELEMENTS);
+  integral_image->sum_squares =
+      layout == INTEGRAL_INTERLEAVED
+          ? integral_plane_at(integral_image->sum, sum_bits, 1)
+          : integral_plane_at((char *)buffer + sum_bytes, sum_squares_bits,
+                              row_stride + INTEGRAL_PAD_ELEMENTS);
+
+  // Clear the zero row and the padding in front of every row
+  for (int plane = 0; plane < (sum_squares_bytes ? 2 : 1); plane++) {
+    char *base = (char *)buffer + plane * sum_bytes;
+    int bytes = (plane ? sum_squares_bits : sum_bits) / 8;
+
+    memset(base, 0, row_stride * bytes);
+    for (i = 1; i <= num_rows; i++) {
+      memset(base + i * row_stride * bytes, 0, INTEGRAL_PAD_ELEMENTS * bytes);
+    }
+  }
+
+  return 1;
+}
+
+/*
+ * Allocates an integral image whose planes have the given element widths.
+ */
+static struct integral_image *
+alloc_integral_image_with_widths(int num_rows, int num_cols,
+                                 enum integral_layout layout, int sum_bits,
+                                 int sum_squares_bits) {
+  struct integral_image *integral_image =
+      (struct integral_image *)calloc(1, sizeof(struct integral_image));
+
+  if (integral_image == NULL)
+    return NULL;
+
+  if (!reserve_integral_image(integral_image, num_rows, num_cols, layout,
+                              sum_bits, sum_squares_bits)) {
+    free(integral_image);
+    return NULL;
+  }
+
+  return integral_image;
+}
+
 /**
  * Allocates memory for an integral image with two channels (sum and sum of
- * squares).
+ * squares) of 64-bit elements in a single contiguous, 64-byte aligned buffer.
+ * Only the zero padding is initialised, the elements are filled by
+ * compute_integral_image.
  *
  * @param num_rows The number of rows in the integral image.
  * @param num_cols The number of columns in the integral image.
- * @return A 3D array of unsigned long long representing the integral image.
+ * @param layout Whether the two channels are stored as separate planes or
+ * interleaved.
+ * @return The integral image, or NULL if the memory cannot be allocated. Free
+ * it with free_integral_image.
  */
-unsigned long long ***alloc_integral_image(int num_rows, int num_cols) {
-  // Allocate memory for the first dimension
-  unsigned long long ***integral_image =
-      (unsigned long long ***)malloc(num_rows * sizeof(unsigned long long **));
-
-  // Allocate memory for the second dimension
-  integral_image[0] = (unsigned long long **)malloc(
-      num_rows * num_cols * sizeof(unsigned long long *));
-
-  // Allocate memory for the third dimension
-  integral_image[0][0] = (unsigned long long *)malloc(
-      num_rows * num_cols * 2 * sizeof(unsigned long long));
-
-  // Set up the pointers for the second and third dimensions
-  for (int i = 0; i < num_rows; i++) {
-    if (i > 0) {
-      integral_image[i] = integral_image[0] + i * num_cols;
-      integral_image[i][0] = integral_image[0][0] + i * num_cols * 2;
-    }
-    for (int j = 1; j < num_cols; j++) {
-      integral_image[i][j] = integral_image[i][j - 1] + 2;
-    }
+struct integral_image *alloc_integral_image(int num_rows, int num_cols,
+                                            enum integral_layout layout) {
+  return alloc_integral_image_with_widths(num_rows, num_cols, layout, 64, 64);
+}
+
+/**
+ * Chooses the narrowest safe element width for both integral image planes. A
+ * plane can use 32-bit elements if the total over the whole image fits, or if
+ * the total over a single window of radius r fits, in which case the plane is
+ * kept modulo 2^32 and window sums are still exact. Otherwise it falls back to
+ * 64-bit elements.
+ *
+ * @param max_color The maximum pixel value of the image.
+ * @param r The largest window radius the integral image will be used with, or
+ * a negative value if it is not known in advance.
+ */
+void choose_integral_widths(int num_rows, int num_cols, int max_color, int r,
+                            int *sum_bits, int *sum_squares_bits) {
+  unsigned long long num_pixels = (unsigned long long)num_rows * num_cols;
+  unsigned long long window_pixels = num_pixels;
+  unsigned long long max_square = (unsigned long long)max_color * max_color;
+
+  // A window never covers more than the image itself
+  if (r >= 0) {
+    window_pixels = (unsigned long long)fmin(2 * r + 1, num_rows) *
+                    (unsigned long long)fmin(2 * r + 1, num_cols);
   }
 
-  return integral_image;
+  *sum_bits = window_pixels * max_color <= 0xFFFFFFFFULL ? 32 : 64;
+  *sum_squares_bits = window_pixels * max_square <= 0xFFFFFFFFULL ? 32 : 64;
+}
+
+/**
+ * Allocates a planar integral image with the narrowest element widths that
+ * are safe for the given image and window radius, see choose_integral_widths.
+ * With 8-bit pixels and radii up to 128 both planes are 32-bit, which halves
+ * the memory traffic of the four-corner lookups.
+ *
+ * @return The integral image, or NULL if the memory cannot be allocated. Free
+ * it with free_integral_image.
+ */
+struct integral_image *alloc_narrow_integral_image(int num_rows, int num_cols,
+                                                   int max_color, int r) {
+  int sum_bits, sum_squares_bits;
+
+  choose_integral_widths(num_rows, num_cols, max_color, r, &sum_bits,
+                         &sum_squares_bits);
+
+  return alloc_integral_image_with_widths(num_rows, num_cols, INTEGRAL_PLANAR,
+                                          sum_bits, sum_squares_bits);
+}
+
+/**
+ * Frees an integral image allocated with alloc_integral_image.
+ */
+void free_integral_image(struct integral_image *integral_image) {
+  if (integral_image == NULL)
+    return;
+
+  free(integral_image->buffer);
+  free(integral_image);
+}
+
+/*
+ * Body of compute_integral_image for one combination of plane widths. It is
+ * always inlined with constant widths, so every combination gets its own loop
+ * without per-element width checks.
+ */
+static inline __attribute__((always_inline)) void
+compute_integral_image_with_widths(unsigned char **input,
+                                   struct integral_image *output, int num_cols,
+                                   int row_begin, int row_end, int sum_bits,
+                                   int sum_squares_bits) {
+  unsigned long long row_sum, row_sum_squares;
+  long index, above;
+  int i, j;
+
+  for (i = row_begin; i < row_end; i++) {
+    row_sum = 0;
+    row_sum_squares = 0;
+    for (j = 0; j < num_cols; j++) {
+      row_sum += input[i][j];
+      row_sum_squares += (unsigned long long)input[i][j] * input[i][j];
+      index = INTEGRAL_INDEX(output, i, j);
+      above = INTEGRAL_INDEX(output, i - 1, j);
+      integral_plane_store(
+          output->sum, sum_bits, index,
+          row_sum + integral_plane_load(output->sum, sum_bits, above));
+      integral_plane_store(output->sum_squares, sum_squares_bits, index,
+                           row_sum_squares +
+                               integral_plane_load(output->sum_squares,
+                                                   sum_squares_bits, above));
+    }
+  }
 }
 
 /**
@@ -105,38 +292,92 @@ unsigned long long ***alloc_integral_image(int num_rows, int num_cols) {
  * rectangular subset of an image. The value at each pixel in the integral image
  * is the sum of all the pixels above and to the left of it in the original
  * image, inclusive. This function takes the input array, its dimensions, and an
- * output array and computes the integral image in place. The resulting integral
- * image is stored in the output array. The computation is done in
- * O(num_cols*num_cols) time, where num_cols and num_rows are the dimensions of
- * the input array.
+ * output integral image and fills both of its channels. Each row is the running
+ * sum of the input row added to the row above, which the zero row in front of
+ * the image makes uniform for the first row. 32-bit planes wrap around modulo
+ * 2^32. The computation is done in O(num_cols*num_rows) time, where num_cols
+ * and num_rows are the dimensions of the input array.
  */
-void compute_integral_image(unsigned char **input, unsigned long long ***output,
-                            int num_cols, int num_rows) {
-  int i, j;
+void compute_integral_image(unsigned char **input,
+                            struct integral_image *output, int num_cols,
+                            int num_rows) {
+  compute_integral_image_rows(input, output, num_cols, 0, num_rows);
+}
 
-  // Compute the first row of the integral image
-  for (j = 0; j < num_cols; j++) {
-    output[0][j][0] = input[0][j];
-    output[0][j][1] = pow(input[0][j], 2);
-    if (j > 0) {
-      output[0][j][0] += output[0][j - 1][0];
-      output[0][j][1] += output[0][j - 1][1];
-    }
+/**
+ * Computes the rows [row_begin, row_end) of an integral image, see
+ * compute_integral_image. Every row builds on the row above, so the rows
+ * before row_begin must already be computed. This lets a producer fill the
+ * integral image row by row while the input rows are still in cache.
+ */
+void compute_integral_image_rows(unsigned char **input,
+                                 struct integral_image *output, int num_cols,
+                                 int row_begin, int row_end) {
+  if (output->sum_bits == 32 && output->sum_squares_bits == 32) {
+    compute_integral_image_with_widths(input, output, num_cols, row_begin,
+                                       row_end, 32, 32);
+  } else if (output->sum_bits == 32) {
+    compute_integral_image_with_widths(input, output, num_cols, row_begin,
+                                       row_end, 32, 64);
+  } else {
+    compute_integral_image_with_widths(input, output, num_cols, row_begin,
+                                       row_end, 64, 64);
   }
+}
 
-  // Compute the first column of the integral image
-  for (i = 1; i < num_rows; i++) {
-    output[i][0][0] = input[i][0] + output[i - 1][0][0];
-    output[i][0][1] = pow(input[i][0], 2) + output[i - 1][0][1];
-  }
+/**
+ * Returns the current value of a monotonic wall clock in milliseconds. Unlike
+ * clock(), which sums the CPU time of all threads, this measures elapsed real
+ * time and is therefore suitable for timing multithreaded code.
+ */
+double wall_time_ms(void) {
+  struct timespec now;
 
-  // Compute the rest of the integral image
-  for (i = 1; i < num_rows; i++) {
-    for (j = 1; j < num_cols; j++) {
-      output[i][j][0] = input[i][j] + output[i - 1][j][0] +
-                        output[i][j - 1][0] - output[i - 1][j - 1][0];
-      output[i][j][1] = pow(input[i][j], 2) + output[i - 1][j][1] +
-                        output[i][j - 1][1] - output[i - 1][j - 1][1];
-    }
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000.0 + now.tv_nsec / 1000000.0;
+}
+
+/*
+ * Writes length bytes to a file descriptor, retrying after short writes.
+ * Returns the number of bytes written.
+ */
+static size_t write_fully(int fd, const void *data, size_t length) {
+  size_t written = 0;
+  ssize_t count;
+
+  while (written < length) {
+    count = write(fd, (const char *)data + written, length - written);
+    if (count < 0 && errno == EINTR)
+      continue;
+    if (count <= 0)
+      break;
+    written += count;
   }
+
+  return written;
+}
+
+/**
+ * Creates or truncates a file and writes a header and a payload to it with
+ * plain write calls. Unlike a stdio stream this does not allocate, so a flow
+ * writing its output image does not either.
+ *
+ * @return The number of payload bytes written, less than payload_length if
+ * the file cannot be created or written.
+ */
+size_t write_image_file(const char *file_name, const char *header,
+                        size_t header_length, const unsigned char *payload,
+                        size_t payload_length) {
+  size_t written = 0;
+  int fd = open(file_name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+
+  if (fd < 0)
+    return 0;
+
+  if (write_fully(fd, header, header_length) == header_length)
+    written = write_fully(fd, payload, payload_length);
+  if (close(fd) != 0)
+    written = 0;
+
+  return written;
 }